@@ -0,0 +1,218 @@
+/*
+ * cine-bench.c -- time the stages of processing a CINE file
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h> /* getopt() */
+#include <sys/resource.h>
+
+#include "vrptools.h"
+
+/* Each stage runs over (up to -n) frames of the file on its own, so
+ * the times don't mix:
+ *
+ *   open     - vrp_open(), i.e. mapping and checking the headers
+ *   read     - touching every pixel (paging the file in)
+ *   stats    - min/max/mean of each frame's raw samples
+ *   demosaic - vrp_extract_image() to RGB48
+ *   output   - encoding each demosaiced frame as an uncompressed TIFF
+ *              to /dev/null (on -j threads)
+ *
+ * and one line is printed per stage, in fixed columns (so results from
+ * different builds can be diffed): frames, seconds, frames per second,
+ * megabytes per second of raw pixel data, and the process's peak RSS
+ * in megabytes once the stage is done. */
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double peak_rss_mb(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss / 1024.0; /* (kilobytes, on Linux) */
+}
+
+void report(const char *stage, int frames, double seconds, double bytes)
+{
+    if(seconds <= 0)
+        seconds = 1e-9;
+    printf("%-10s %8d %10.4f %10.1f %10.1f %10.1f\n", stage, frames, seconds,
+           frames / seconds, bytes / 1e6 / seconds, peak_rss_mb());
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-j threads] [-n frames] file.cine ...\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    int      i, threads = 0, max_frames = 0;
+    uint16_t *rgb = NULL;
+    size_t   rgbsize = 0;
+    FILE     *devnull;
+
+    while((i = getopt(argc, argv, "j:n:")) != -1)
+    {
+        switch(i)
+        {
+        case 'j': threads = atoi(optarg); break;
+        case 'n': max_frames = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if(!argc)
+    {
+        usage(argv[-optind]);
+        return -1;
+    }
+    if(!(devnull = fopen("/dev/null", "wb")))
+    {
+        perror("/dev/null");
+        return 1;
+    }
+
+    for(i = 0; i < argc; ++i)
+    {
+        VRP_Handle handle;
+        double     t, sink = 0;
+        size_t     size;
+        int        j, frames, done, rows, cols;
+        VRP_Error  err;
+
+        t = now();
+        if(!(handle = vrp_open(argv[i], &err)))
+        {
+            fprintf(stderr, "%s\n", err.message);
+            fprintf(stderr, "Failed to get handle on %s\n", argv[i]);
+            continue;
+        }
+        vrp_print_open_warnings(stderr, handle, &err);
+        t = now() - t;
+
+        frames = handle->header->ImageCount;
+        if(max_frames > 0 && max_frames < frames)
+            frames = max_frames;
+        size = vrp_image_size(handle);
+
+        printf("# %s: %dx%d, %d-bit, %u images\n", argv[i], handle->imageHeader->biWidth,
+               handle->imageHeader->biHeight, handle->imageHeader->biBitCount,
+               handle->header->ImageCount);
+        printf("%-10s %8s %10s %10s %10s %10s\n", "stage", "frames", "seconds",
+               "frames/s", "MB/s", "peakRSS-MB");
+        report("open", 1, t, 0);
+
+        t = now();
+        for(j = 0; j < frames; ++j)
+        {
+            const unsigned char *p = vrp_image_pixels(handle, j);
+            size_t              k;
+
+            if(!p)
+                break;
+            for(k = 0; k < size; k += 4096)
+                sink += p[k];
+        }
+        report("read", j, now() - t, (double)j * size);
+
+        t = now();
+        for(j = 0; j < frames; ++j)
+        {
+            const unsigned char *p = vrp_image_pixels(handle, j);
+            unsigned            lo = ~0u, hi = 0, v;
+            double              sum = 0;
+            size_t              k, n;
+
+            if(!p)
+                break;
+            if(handle->imageHeader->biBitCount == 16)
+            {
+                const uint16_t *s = (const uint16_t *)p;
+
+                for(k = 0, n = size / 2; k < n; ++k)
+                {
+                    v = s[k];
+                    sum += v;
+                    if(v < lo) lo = v;
+                    if(v > hi) hi = v;
+                }
+            }
+            else
+            {
+                for(k = 0, n = size; k < n; ++k)
+                {
+                    v = p[k];
+                    sum += v;
+                    if(v < lo) lo = v;
+                    if(v > hi) hi = v;
+                }
+            }
+            sink += sum / n + lo + hi;
+        }
+        report("stats", j, now() - t, (double)j * size);
+
+        /* demosaic and output are timed separately, but share the loop */
+        {
+            double demosaic = 0, output = 0;
+
+            for(done = 0; done < frames; ++done)
+            {
+                t = now();
+                if(vrp_extract_image(handle, done, &rows, &cols, &rgb, &rgbsize, &err) < 0)
+                    break;
+                demosaic += now() - t;
+
+                t = now();
+                if(vrp_write_tiff(devnull, rgb, rows, cols, handle->imageHeader->biClrImportant,
+                                  VRP_TIFF_NONE, 0, threads) < 0)
+                {
+                    fprintf(stderr, "%s: output failed\n", argv[i]);
+                    break;
+                }
+                fflush(devnull);
+                output += now() - t;
+            }
+            if(done)
+            {
+                report("demosaic", done, demosaic, (double)done * size);
+                report("output", done, output, (double)done * size);
+            }
+            else
+                printf("%-10s (%s)\n", "demosaic", err.message);
+        }
+
+        if(sink < 0) /* (never; keeps the reads from being optimized away) */
+            printf("%g\n", sink);
+
+        free_cine_handle(handle);
+    }
+
+    free(rgb);
+    fclose(devnull);
+    return 0;
+}
@@ -0,0 +1,385 @@
+/*
+ * cine-contact.c -- make a contact sheet of evenly spaced frames of a cine
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h> /* getopt() */
+#include <arpa/inet.h>
+#include <sys/mman.h>
+
+#include "vrptools.h"
+
+/* Only the frames on the sheet are read, and of those, only the 2x2
+ * CFA tiles nearest each tile pixel: each pixel takes its red, green
+ * (the mean of the two) and blue from one tile of the sensor, so a
+ * sheet of 320-pixel-wide tiles from 4K frames touches a fraction of
+ * each frame, and the time taken depends on the size of the sheet, not
+ * of the file.  (Packed files are the exception: their frames are
+ * decoded whole.)  Tiles are rendered in parallel, gamma-encoded (2.2)
+ * for viewing, and labelled with their frame number and time of day. */
+
+#define GAP 4 /* pixels between (and around) tiles */
+
+struct sheet {
+    VRP_Handle    handle;
+    int           *offsets;     /* the frames to show, per tile */
+    int           tiles, columns, tw, th;
+    int           width, height; /* of the whole sheet */
+    uint16_t      *rgb;          /* the sheet: RGB48, big-endian */
+    unsigned char pattern[4];
+    unsigned      maxval;
+    uint16_t      *lut[3];       /* sample to output, white balance included */
+    const VRP_TIME64 *times;     /* per image, if the cine has them */
+    int           failed;
+};
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n tiles] [-c columns] [-w tile-width] [-f first] [-l last] [-j threads]\n"
+            "          file.cine output.{png,tif,ppm}\n"
+            "  (first and last are frame numbers, as the camera counts them)\n", name);
+}
+
+/** labels **/
+
+/* 5x7 glyphs, a row per byte, 0x10 the leftmost column */
+struct glyph {
+    char          c;
+    unsigned char rows[7];
+} font[] = {
+    { '0', { 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e } },
+    { '1', { 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e } },
+    { '2', { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f } },
+    { '3', { 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e } },
+    { '4', { 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 } },
+    { '5', { 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e } },
+    { '6', { 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e } },
+    { '7', { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 } },
+    { '8', { 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e } },
+    { '9', { 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c } },
+    { '-', { 0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00 } },
+    { ':', { 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00 } },
+    { '.', { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c } },
+    { '#', { 0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a } },
+    { '\0', { 0 } }
+};
+
+/* draw_text - white text at x, y (top left) of the sheet, each font
+ * pixel size by size; characters we have no glyph for are blanks */
+void draw_text(struct sheet *s, int x, int y, int size, const char *text)
+{
+    struct glyph *g;
+    int          r, c, i, j;
+
+    for(; *text; ++text, x += 6 * size)
+    {
+        for(g = font; g->c && g->c != *text; ++g)
+            ;
+        if(!g->c)
+            continue;
+        for(r = 0; r < 7; ++r)
+            for(c = 0; c < 5; ++c)
+                if(g->rows[r] & (0x10 >> c))
+                    for(j = 0; j < size; ++j)
+                        for(i = 0; i < size; ++i)
+                        {
+                            uint16_t *p = s->rgb + 3 * ((size_t)(y + r * size + j) * s->width
+                                                        + x + c * size + i);
+
+                            p[0] = p[1] = p[2] = 0xffff;
+                        }
+    }
+}
+
+/* the (absolute) time of image offset: from the cine's Time_only
+ * block if it has one, otherwise worked out from the trigger time and
+ * the frame rate */
+VRP_TIME64 image_time(const struct sheet *s, int offset)
+{
+    VRP_Handle handle = s->handle;
+    VRP_TIME64 t = handle->header->TriggerTime;
+    int64_t    ticks;
+
+    if(s->times)
+        return s->times[offset];
+
+    ticks = ((int64_t)t.Seconds << 32 | t.Fractions);
+    if(handle->setup->FrameRate)
+        ticks += (int64_t)(handle->header->FirstImageNo + offset) * (((int64_t)1 << 32) / handle->setup->FrameRate);
+    t.Seconds = ticks >> 32;
+    t.Fractions = ticks & 0xffffffff;
+    return t;
+}
+
+void label_tile(struct sheet *s, int tile, int x0, int y0)
+{
+    VRP_TIME64 t = image_time(s, s->offsets[tile]);
+    time_t     secs = (time_t)t.Seconds - s->handle->setup->RecordingTimeZone;
+    struct tm  tm;
+    char       line[2][32];
+    int        size = s->tw >= 480 ? 2 : 1, lh = 9 * size, x, y, k;
+    int        usec = (int)(t.Fractions * 1e6 / 4294967296.0 + 0.5);
+
+    snprintf(line[0], sizeof(line[0]), "#%d", s->handle->header->FirstImageNo + s->offsets[tile]);
+    gmtime_r(&secs, &tm);
+    snprintf(line[1], sizeof(line[1]), "%02d:%02d:%02d.%06d", tm.tm_hour, tm.tm_min, tm.tm_sec,
+             usec > 999999 ? 999999 : usec);
+
+    /* darken a band for them to be read against */
+    for(y = s->th - 2 * lh - size; y < s->th; ++y)
+        for(x = 0; x < s->tw; ++x)
+            for(k = 0; k < 3; ++k)
+            {
+                uint16_t *p = s->rgb + 3 * ((size_t)(y0 + y) * s->width + x0 + x) + k;
+
+                if(y >= 0)
+                    *p = htons(ntohs(*p) / 3);
+            }
+
+    for(k = 0; k < 2; ++k)
+        if(s->th >= (2 - k) * lh)
+            draw_text(s, x0 + size, y0 + s->th - (2 - k) * lh, size, line[k]);
+}
+
+/** rendering **/
+
+void render_tile(int tile, void *arg)
+{
+    struct sheet       *s = arg;
+    VRP_Handle         handle = s->handle;
+    int                rows = handle->imageHeader->biHeight, cols = handle->imageHeader->biWidth;
+    int                wide = handle->imageHeader->biBitCount > 8;
+    int                x0 = GAP + (tile % s->columns) * (s->tw + GAP);
+    int                y0 = GAP + (tile / s->columns) * (s->th + GAP);
+    int                tx, ty, k;
+    VRP_PackCursor     *cursor = NULL;
+    const void         *pixels;
+
+    /* (packed files: a cursor per tile, since tiles run in parallel) */
+    if(handle->pack && !(cursor = vrp_pack_cursor_new(handle)))
+    {
+        s->failed = 1;
+        return;
+    }
+    pixels = cursor ? vrp_pack_decode(handle, cursor, s->offsets[tile])
+                    : vrp_image_pixels(handle, s->offsets[tile]);
+
+    for(ty = 0; ty < s->th && pixels; ++ty)
+    {
+        /* the CFA tile under the middle of this pixel, as stored */
+        int      sr = (rows - 1 - (int)((ty + 0.5) * rows / s->th)) & ~1;
+        uint16_t *out = s->rgb + 3 * ((size_t)(y0 + ty) * s->width + x0);
+
+        if(sr > rows - 2) /* (odd heights and widths have a half tile at the end) */
+            sr = (rows - 2) & ~1;
+
+        for(tx = 0; tx < s->tw; ++tx, out += 3)
+        {
+            int      sc = (int)((tx + 0.5) * cols / s->tw) & ~1;
+            unsigned sum[3] = { 0, 0, 0 }, n[3] = { 0, 0, 0 }, v;
+
+            if(sc > cols - 2)
+                sc = (cols - 2) & ~1;
+
+            for(k = 0; k < 4; ++k)
+            {
+                size_t i = (size_t)(sr + (k >> 1)) * cols + sc + (k & 1);
+
+                v = wide ? ((const uint16_t *)pixels)[i] : ((const uint8_t *)pixels)[i];
+                sum[s->pattern[k]] += v;
+                ++n[s->pattern[k]];
+            }
+            for(k = 0; k < 3; ++k)
+            {
+                v = n[k] ? sum[k] / n[k] : sum[1] / n[1];
+                out[k] = htons(s->lut[k][v < s->maxval ? v : s->maxval - 1]);
+            }
+        }
+    }
+    if(pixels)
+        label_tile(s, tile, x0, y0);
+    vrp_pack_cursor_free(cursor);
+}
+
+int write_sheet(struct sheet *s, const char *name, int threads)
+{
+    const char *ext = strrchr(name, '.');
+    FILE       *out;
+    long       ret = 0;
+
+    if(!(out = fopen(name, "wb")))
+    {
+        perror(name);
+        return -1;
+    }
+    if(ext && !strcmp(ext, ".ppm"))
+    {
+        fprintf(out, "P6\n%d %d\n65535\n", s->width, s->height);
+        fwrite(s->rgb, sizeof(uint16_t), 3 * (size_t)s->width * s->height, out);
+    }
+    else if(ext && (!strcmp(ext, ".tif") || !strcmp(ext, ".tiff")))
+        ret = vrp_write_tiff(out, s->rgb, s->height, s->width, 65536, VRP_TIFF_DEFLATE, 6, threads);
+    else
+        ret = vrp_write_png(out, s->rgb, s->height, s->width, 65536, 6, threads);
+
+    if(ret < 0 || ferror(out) | fclose(out))
+    {
+        fprintf(stderr, "%s: write failed\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct sheet     s;
+    VRP_Handle       handle;
+    VRP_Error        err;
+    VRP_TAGGED_BLOCK *block;
+    int              i, k, first, last, count, threads = 0, ret = 0;
+    int              have_first = 0, have_last = 0;
+    unsigned         v;
+
+    memset(&s, 0, sizeof(s));
+    s.tiles = 16;
+    s.tw = 320;
+    first = last = 0;
+    while((i = getopt(argc, argv, "n:c:w:f:l:j:")) != -1)
+    {
+        switch(i)
+        {
+        case 'n': s.tiles = atoi(optarg); break;
+        case 'c': s.columns = atoi(optarg); break;
+        case 'w': s.tw = atoi(optarg); break;
+        case 'f': first = atoi(optarg); have_first = 1; break;
+        case 'l': last = atoi(optarg); have_last = 1; break;
+        case 'j': threads = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(argc - optind != 2 || s.tiles < 1 || s.columns < 0 || s.tw < 16)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if(!(s.handle = handle = vrp_open(argv[optind], &err)))
+    {
+        fprintf(stderr, "%s\n", err.message);
+        fprintf(stderr, "Failed to get handle on %s\n", argv[optind]);
+        return 1;
+    }
+    vrp_print_open_warnings(stderr, handle, &err);
+    if(!handle->imageHeader || !handle->setup || handle->header->Compression == VRP_CC_JPEG
+       || (handle->imageHeader->biBitCount != 8 && handle->imageHeader->biBitCount != 16))
+    {
+        fprintf(stderr, "%s: can't make a contact sheet of this\n", argv[optind]);
+        free_cine_handle(handle);
+        return 1;
+    }
+
+    /* which frames */
+    first = have_first ? first - handle->header->FirstImageNo : 0;
+    last = have_last ? last - handle->header->FirstImageNo : (int)handle->header->ImageCount - 1;
+    if(first < 0 || last >= (int)handle->header->ImageCount || first > last)
+    {
+        fprintf(stderr, "%s: frames %d through %d aren't all there (it has %d through %d)\n", argv[optind],
+                first + handle->header->FirstImageNo, last + handle->header->FirstImageNo,
+                handle->header->FirstImageNo, handle->header->FirstImageNo + handle->header->ImageCount - 1);
+        free_cine_handle(handle);
+        return 1;
+    }
+    count = last - first + 1;
+    if(s.tiles > count)
+        s.tiles = count;
+    if(!(s.offsets = malloc(s.tiles * sizeof(*s.offsets))))
+    {
+        perror("malloc");
+        return 1;
+    }
+    for(i = 0; i < s.tiles; ++i)
+        s.offsets[i] = first + (s.tiles > 1 ? (int)((int64_t)i * (count - 1) / (s.tiles - 1)) : count / 2);
+
+    /* the sheet */
+    if(!s.columns)
+        s.columns = (int)ceil(sqrt(s.tiles));
+    if(s.columns > s.tiles)
+        s.columns = s.tiles;
+    if(s.tw > handle->imageHeader->biWidth / 2)
+        s.tw = handle->imageHeader->biWidth / 2; /* (no bigger than a pixel per CFA tile) */
+    s.th = (int)((double)s.tw * handle->imageHeader->biHeight / handle->imageHeader->biWidth + 0.5);
+    if(s.th < 1)
+        s.th = 1;
+    s.width = GAP + s.columns * (s.tw + GAP);
+    s.height = GAP + (s.tiles + s.columns - 1) / s.columns * (s.th + GAP);
+    if(!(s.rgb = calloc(3 * (size_t)s.width * s.height, sizeof(uint16_t))))
+    {
+        perror("malloc");
+        return 1;
+    }
+    for(i = 0; i < 3 * s.width * s.height; ++i)
+        s.rgb[i] = htons(0x2000); /* a dark gray background */
+
+    /* how to get colours from samples */
+    if(vrp_cfa_pattern(handle, s.pattern) < 0)
+        memset(s.pattern, 1, 4);
+    s.maxval = handle->imageHeader->biClrImportant;
+    if(!s.maxval || s.maxval > (1u << handle->imageHeader->biBitCount))
+        s.maxval = 1u << handle->imageHeader->biBitCount;
+    for(k = 0; k < 3; ++k)
+    {
+        float gain = k == 0 ? handle->setup->WBGain[0].R : k == 2 ? handle->setup->WBGain[0].B : 1;
+
+        if(!(gain > 0))
+            gain = 1;
+        if(!(s.lut[k] = malloc(s.maxval * sizeof(uint16_t))))
+        {
+            perror("malloc");
+            return 1;
+        }
+        for(v = 0; v < s.maxval; ++v)
+        {
+            double x = gain * v / (s.maxval - 1);
+
+            s.lut[k][v] = x >= 1 ? 65535 : (uint16_t)(65535 * pow(x, 1 / 2.2) + 0.5);
+        }
+    }
+    if((block = vrp_find_tagged_block(handle, VRP_TB_Time_only))
+       && block->BlockSize - sizeof(*block) >= handle->header->ImageCount * sizeof(VRP_TIME64))
+        s.times = (const VRP_TIME64 *)block->Data;
+
+    /* we'll only be touching bits of a few images; don't read ahead */
+    if(!handle->pack)
+        madvise(handle->start, handle->st.st_size, MADV_RANDOM);
+
+    vrp_parallel_for(s.tiles, threads, render_tile, &s);
+    if(s.failed)
+    {
+        fprintf(stderr, "%s: out of memory\n", argv[optind]);
+        ret = 1;
+    }
+    else if(write_sheet(&s, argv[optind + 1], threads) < 0)
+        ret = 1;
+
+    for(k = 0; k < 3; ++k)
+        free(s.lut[k]);
+    free(s.rgb);
+    free(s.offsets);
+    free_cine_handle(handle);
+    return ret;
+}
@@ -0,0 +1,152 @@
+/*
+ * cine-encode-bench.c -- compare output encoders on frames from a CINE file
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h> /* getopt() */
+
+#include "vrptools.h"
+
+/* Each frame is demosaiced once (not timed), then handed to every
+ * encoder in turn, writing to /dev/null; we report throughput in
+ * megabytes per second of RGB48 input, and the compression ratio
+ * against that same RGB48 size (i.e. against what PPM writes). */
+
+struct codec {
+    const char *name;
+    int        tiff;         /* nonzero: TIFF with this compression; zero: PNG */
+    int        level;
+    double     seconds;
+    double     in_bytes, out_bytes;
+} codecs[] = {
+    { "tiff",           VRP_TIFF_NONE,    0, 0, 0, 0 },
+    { "tiff-lzw",       VRP_TIFF_LZW,     0, 0, 0, 0 },
+    { "tiff-deflate-1", VRP_TIFF_DEFLATE, 1, 0, 0, 0 },
+    { "tiff-deflate-6", VRP_TIFF_DEFLATE, 6, 0, 0, 0 },
+    { "png-1",          0,                1, 0, 0, 0 },
+    { "png-6",          0,                6, 0, 0, 0 },
+    { NULL, 0, 0, 0, 0, 0 }
+};
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-j threads] [-n frames] file.cine ...\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    int      i, threads = 0, max_frames = 10;
+    uint16_t *rgb = NULL;
+    size_t   rgbsize = 0;
+    FILE     *devnull;
+    struct codec *c;
+
+    while((i = getopt(argc, argv, "j:n:")) != -1)
+    {
+        switch(i)
+        {
+        case 'j': threads = atoi(optarg); break;
+        case 'n': max_frames = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if(!argc)
+    {
+        usage(argv[-optind]);
+        return -1;
+    }
+    if(!(devnull = fopen("/dev/null", "wb")))
+    {
+        perror("/dev/null");
+        return 1;
+    }
+
+    for(i = 0; i < argc; ++i)
+    {
+        VRP_Handle handle;
+        VRP_Error  err;
+        unsigned   j, step;
+
+        if(!(handle = vrp_open(argv[i], &err)))
+        {
+            fprintf(stderr, "%s\n", err.message);
+            fprintf(stderr, "Failed to get handle on %s\n", argv[i]);
+            continue;
+        }
+        vrp_print_open_warnings(stderr, handle, &err);
+
+        /* spread the sample frames over the whole file */
+        step = handle->header->ImageCount / (max_frames > 0 ? max_frames : 1);
+        if(step < 1)
+            step = 1;
+
+        for(j = 0; j < handle->header->ImageCount; j += step)
+        {
+            int       rows, cols, maxval = handle->imageHeader->biClrImportant;
+            VRP_Error err;
+
+            if(vrp_extract_image(handle, j, &rows, &cols, &rgb, &rgbsize, &err) < 0)
+            {
+                fprintf(stderr, "%s\n", err.message);
+                break;
+            }
+
+            for(c = codecs; c->name; ++c)
+            {
+                double t = now();
+                long   n = c->tiff
+                    ? vrp_write_tiff(devnull, rgb, rows, cols, maxval, c->tiff, c->level, threads)
+                    : vrp_write_png(devnull, rgb, rows, cols, maxval, c->level, threads);
+
+                fflush(devnull);
+                c->seconds += now() - t;
+                if(n < 0)
+                {
+                    fprintf(stderr, "%s: encoding failed\n", c->name);
+                    continue;
+                }
+                c->in_bytes += 6.0 * rows * cols;
+                c->out_bytes += n;
+            }
+        }
+
+        free_cine_handle(handle);
+    }
+
+    printf("%-16s %10s %8s\n", "codec", "MB/s", "ratio");
+    for(c = codecs; c->name; ++c)
+        if(c->out_bytes > 0)
+            printf("%-16s %10.1f %8.3f\n", c->name,
+                   c->in_bytes / 1e6 / (c->seconds > 0 ? c->seconds : 1e-9),
+                   c->in_bytes / c->out_bytes);
+
+    free(rgb);
+    fclose(devnull);
+    return 0;
+}
@@ -10,201 +10,884 @@
  * reference.
  */
 
+#define _GNU_SOURCE /* memfd_create() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
-#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <arpa/inet.h> /* ntohs() */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h> /* crc32() */
 
 #include "vrptools.h"
 #include "util.h"
 
-/* extract_image_by_offset - extract the numbered image into a buffer
- *
- * input parameters:
- *   handle - handle to opened VRP Cine file
- *   offset - offset of image we want to extract
- *
- * output parameters:
- *   rows_out - storage location to store number of rows extracted
- *   cols_out -    "        "    "    "     "    "  cols     "
- *   outbuf_out - optional buffer; contract:
- *      if a NULL pointer is passed, it will be allocated;
- *      may be re-used, when doing multiple calls;
- *      Caller's responsibility to free it when done.
- *
- * side effects:
- *   allocates memory for outbuf_out, if null pointer passed
- */
-void extract_image_by_offset(VRP_Handle handle, int offset,
-			     int *rows_out, int *cols_out,
-			     uint16_t **outbuf_out)
+/* Output formats.  Each writer is handed the cine and the offset of
+ * the image to emit, and decides for itself whether it needs the
+ * demosaiced RGB (via vrp_extract_image(), into the stage's own
+ * buffer) or can write the raw data directly.  Monochrome cines skip
+ * the demosaicing, going out as one channel (see gray()).  What it
+ * leaves is the file's contents as a few pieces of memory, in
+ * stage->iov, to go out in one writev(): a header it's formatted and
+ * the pixels as they are, where it can; only the encoders that write
+ * a stream (PNG, TIFF) are given a memfd to write it into (see
+ * stream()). */
+
+struct output_format;
+struct staged_image;
+
+struct extract_options {
+    const char                 *outdir;  /* where to put the images */
+    const struct output_format *format;  /* what to write them as */
+    int                        threads;  /* for encoders that can use them (0: all CPUs) */
+    const char                 *ranges;  /* which frames (see parse_ranges()); NULL for all */
+    int                        manifest; /* keep a manifest, and skip what it says is done */
+    int                        verify;   /* ... checking each output's CRC, not just its size */
+    int                        matrix;   /* for YUV: VRP_YUV_BT709 or VRP_YUV_BT2020 */
+    int                        shard, shards; /* do the shard'th (from 1) of shards parts; 0: all */
+    int                        depth;    /* images to have in flight to the output directory (see lib/outdir.c) */
+    int                        fsync;    /* ... each flushed to disk before it's renamed into place */
+    int                        quiet;    /* no chatter about each image on stderr */
+};
+
+struct output_format {
+    const char *name;        /* as given to -f */
+    const char *suffix;      /* filename extension */
+    int (*write)(const struct extract_options *opts, VRP_Handle handle,
+                 int offset, struct staged_image *stage); /* NULL: see extract_to_npy() */
+    int        compression;  /* encoder-specific, e.g. VRP_TIFF_LZW (or for YUV, VRP_YUV420...) */
+    int        level;        /* zlib level, for encoders that deflate (or bits, for YUV) */
+};
+
+/* An image on its way out, and its buffers: there's one of these for
+ * each image that may be in flight to the output directory (see
+ * lib/outdir.c), and what iov points to stays put until it's written
+ * and image_written() has been called. */
+struct staged_image {
+    struct iovec      iov[2];   /* the file: header and pixels, say */
+    int               iovcnt;
+    char              header[VRP_DNG_HEADER_MAX]; /* room for any header we format */
+    uint16_t          *buf;     /* the image, demosaiced (or copied: see write_dng()) */
+    FILE              *stream;  /* a memfd, for encoders that write a stream */
+    void              *map;     /* ... and what was written to it, mapped */
+    size_t            size;
+    VRP_ManifestEntry e;
+    VRP_Manifest      *manifest;
+    const char        *outdir;
+    int               *failed;  /* set if it doesn't make it */
+};
+
+/* demosaic - vrp_extract_image_mt(), reporting any trouble on stderr
+ * (returns 0 if it worked, -1 if not) */
+int demosaic(const struct extract_options *opts, VRP_Handle handle, int offset,
+             int *rows, int *cols, uint16_t **buf)
 {
-    VRP_ImageOffset     *theImagePointer;
-    VRP_ImageAnnotation *theAnnotation;
-    VRP_ImageData       *theImage;
-    VRP_WORD            *pixelData;
-    int                 i, j, row, col, rows, cols;
-    int                 left, right, top, bottom;
-    int                 bufsiz;
-    uint16_t            *outbuf;
-    float               wb_b, wb_r;
-    struct _ppm_pixel {
-        VRP_WORD r;
-        VRP_WORD g;
-        VRP_WORD b;
-    } pixel;
-
-    if (handle->header->Compression != VRP_CC_UNINT)
-    {
-        fprintf(stderr, "Woah, sorry, don't (yet) know how to handle Compression type %d\n",
-                handle->header->Compression);
-        return;
+    VRP_Error err;
+
+    if (vrp_extract_image_mt(handle, offset, opts->threads, rows, cols, buf, NULL, &err) < 0)
+    {
+        fprintf(stderr, "%s\n", err.message);
+        return -1;
     }
-    if (handle->setup->CFA != VRP_CFA_BAYER)
+    return 0;
+}
+
+/* gray - vrp_extract_gray(), reporting any trouble on stderr; *depth
+ * is set to 8 or 16, the bits per sample of what's in *buf (returns 0
+ * if it worked, -1 if not) */
+int gray(const struct extract_options *opts, VRP_Handle handle, int offset,
+         int *rows, int *cols, int *depth, uint16_t **buf)
+{
+    VRP_Error err;
+    void      *samples = *buf;
+    int       ret;
+
+    ret = vrp_extract_gray(handle, offset, opts->threads, rows, cols, &samples, NULL, &err);
+    *buf = samples;
+    if (ret < 0)
     {
-        fprintf(stderr, "Woah, sorry, don't (yet) know how to handle CFA type %d\n", handle->setup->CFA);
-        return;
+        fprintf(stderr, "%s\n", err.message);
+        return -1;
+    }
+    *depth = handle->imageHeader->biBitCount == 8 ? 8 : 16;
+    return 0;
+}
+
+/* put - add a piece, len bytes at data, to what's to be written for
+ * stage */
+void put(struct staged_image *stage, const void *data, size_t len)
+{
+    stage->iov[stage->iovcnt].iov_base = (void *)data;
+    stage->iov[stage->iovcnt].iov_len = len;
+    stage->iovcnt++;
+}
+
+/* stream - stage's memfd (made the first time, then kept for its
+ * images to come, as a new one would be a new FILE, with its buffer,
+ * every time), emptied, for an encoder to write the image into; NULL
+ * (having said why) if it can't be had */
+FILE *stream(struct staged_image *stage)
+{
+    int fd = -1;
+
+    if (!stage->stream
+        && ((fd = memfd_create("cine-extract", MFD_CLOEXEC)) < 0 || !(stage->stream = fdopen(fd, "w+b"))))
+    {
+        perror("memfd_create");
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    rewind(stage->stream);
+    if (ftruncate(fileno(stage->stream), 0) < 0)
+    {
+        perror("ftruncate");
+        return NULL;
+    }
+    return stage->stream;
+}
+
+/* stream_done - map what's been written into stage->stream, as the
+ * one piece of the file (returns 0, or -1 having said why) */
+int stream_done(struct staged_image *stage)
+{
+    off_t size;
+
+    if (fflush(stage->stream) || (size = lseek(fileno(stage->stream), 0, SEEK_END)) <= 0)
+        return -1;
+    if ((stage->map = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(stage->stream), 0)) == MAP_FAILED)
+    {
+        perror("mmap");
+        stage->map = NULL;
+        return -1;
     }
+    stage->size = size;
+    put(stage, stage->map, size);
+    return 0;
+}
+
+/* write_pgm - binary PGM (P5) of a monochrome image: 8 bits per
+ * sample for 8-bit cines, otherwise 16 */
+int write_pgm(const struct extract_options *opts, VRP_Handle handle,
+              int offset, struct staged_image *stage)
+{
+    unsigned maxval = handle->imageHeader->biClrImportant;
+    int      rows, cols, depth;
+
+    if (gray(opts, handle, offset, &rows, &cols, &depth, &stage->buf) < 0)
+        return -1;
+
+    /* (vrp_extract_gray() has clamped the samples to this) */
+    if (!maxval || maxval > 1u << depth)
+        maxval = 1u << depth;
+
+    put(stage, stage->header, snprintf(stage->header, sizeof(stage->header), "P5\n%d %d\n%u\n",
+                                       cols, rows, maxval - 1));
+    put(stage, stage->buf, (size_t)rows * cols * depth / 8);
+    return 0;
+}
+
+/* write_ppm - 16-bit binary PPM (P6) of the demosaiced image */
+int write_ppm(const struct extract_options *opts, VRP_Handle handle,
+              int offset, struct staged_image *stage)
+{
+    int rows, cols;
+
+    if (demosaic(opts, handle, offset, &rows, &cols, &stage->buf) < 0)
+        return -1;
+
+    put(stage, stage->header, snprintf(stage->header, sizeof(stage->header), "P6\n%d %d\n%d\n",
+                                       cols, rows, handle->imageHeader->biClrImportant));
+    put(stage, stage->buf, (size_t)6 * cols * rows);
+    return 0;
+}
 
-    theImagePointer = handle->firstImageOffset + offset;
-    theAnnotation   = handle->start + *theImagePointer;
-    theImage        = handle->start + *theImagePointer + theAnnotation->AnnotationSize - sizeof(VRP_DWORD);
-    pixelData       = handle->start + *theImagePointer + theAnnotation->AnnotationSize;
+/* write_tiff - 16-bit RGB TIFF of the demosaiced image (or a gray
+ * one, of a monochrome cine) */
+int write_tiff(const struct extract_options *opts, VRP_Handle handle,
+               int offset, struct staged_image *stage)
+{
+    FILE *out;
+    int  rows, cols, depth;
 
-    rows = handle->imageHeader->biHeight;
-    cols = handle->imageHeader->biWidth;
+    if (vrp_is_gray(handle))
+        return gray(opts, handle, offset, &rows, &cols, &depth, &stage->buf) < 0 || !(out = stream(stage))
+            || vrp_write_tiff_gray(out, stage->buf, depth, rows, cols, handle->imageHeader->biClrImportant,
+                                   opts->format->compression, opts->format->level, opts->threads) < 0
+            || stream_done(stage) < 0 ? -1 : 0;
+    if (demosaic(opts, handle, offset, &rows, &cols, &stage->buf) < 0 || !(out = stream(stage)))
+        return -1;
 
-    bufsiz = 3*rows*cols;
+    return vrp_write_tiff(out, stage->buf, rows, cols, handle->imageHeader->biClrImportant,
+                          opts->format->compression, opts->format->level, opts->threads) < 0
+        || stream_done(stage) < 0 ? -1 : 0;
+}
 
-    wb_r = handle->setup->WBGain[0].R;
-    wb_b = handle->setup->WBGain[0].B;
+/* write_png - 16-bit RGB PNG of the demosaiced image (or a gray one,
+ * of a monochrome cine) */
+int write_png(const struct extract_options *opts, VRP_Handle handle,
+              int offset, struct staged_image *stage)
+{
+    FILE *out;
+    int  rows, cols, depth;
 
-    assert(outbuf_out);
+    if (vrp_is_gray(handle))
+        return gray(opts, handle, offset, &rows, &cols, &depth, &stage->buf) < 0 || !(out = stream(stage))
+            || vrp_write_png_gray(out, stage->buf, depth, rows, cols, handle->imageHeader->biClrImportant,
+                                  opts->format->level, opts->threads) < 0
+            || stream_done(stage) < 0 ? -1 : 0;
+    if (demosaic(opts, handle, offset, &rows, &cols, &stage->buf) < 0 || !(out = stream(stage)))
+        return -1;
 
-    outbuf = *outbuf_out;
-    if (!outbuf)
+    return vrp_write_png(out, stage->buf, rows, cols, handle->imageHeader->biClrImportant,
+                         opts->format->level, opts->threads) < 0
+        || stream_done(stage) < 0 ? -1 : 0;
+}
+
+/* write_yuv - planar YUV of the image (see vrp_extract_yuv()), as raw
+ * video frames: cat them together for an encoder's rawvideo input */
+int write_yuv(const struct extract_options *opts, VRP_Handle handle,
+              int offset, struct staged_image *stage)
+{
+    VRP_Error err;
+    void      *yuv = stage->buf;
+    int       rows, cols, ret;
+
+    ret = vrp_extract_yuv(handle, offset, opts->format->compression, opts->format->level, opts->matrix,
+                          opts->threads, &rows, &cols, &yuv, NULL, &err);
+    stage->buf = yuv;
+    if (ret < 0)
     {
-	outbuf=calloc(bufsiz, sizeof(*outbuf));
-	if (!outbuf)
-	{
-	    perror("calloc");
-	    return;
-	}
-	*outbuf_out = outbuf;
+        fprintf(stderr, "%s\n", err.message);
+        return -1;
     }
-    *rows_out = rows;
-    *cols_out = cols;
 
-    /* go through rows backwards, to convert bottom-up format to top-down: */
-    for (i = rows - 1; i >= 0; --i)
+    put(stage, stage->buf, (size_t)rows * cols * (opts->format->compression == VRP_YUV420 ? 3 : 4) / 2
+        * (opts->format->level > 8 ? 2 : 1));
+    return 0;
+}
+
+/* write_dng - raw CFA data as a DNG: its header, then the pixels
+ * straight from the cine's mapping.  (A packed file's are decoded
+ * into this thread's cursor, where the next image would overwrite
+ * them before they're written, so those are copied.) */
+int write_dng(const struct extract_options *opts, VRP_Handle handle,
+              int offset, struct staged_image *stage)
+{
+    VRP_Error  err;
+    const void *pixels;
+    size_t     size = vrp_image_size(handle);
+    long       len;
+
+    (void)opts;
+
+    if ((len = vrp_dng_header(handle, offset, (unsigned char *)stage->header, &pixels, &err)) < 0)
+    {
+        fprintf(stderr, "%s\n", err.message);
+        return -1;
+    }
+    if (handle->pack)
     {
-        row = rows - i - 1;
+        if (!stage->buf && !(stage->buf = malloc(size)))
+        {
+            perror("malloc");
+            return -1;
+        }
+        memcpy(stage->buf, pixels, size);
+        pixels = stage->buf;
+    }
 
-        /* columns go in regular (left-to-right) order: */
-        for (j = 0; j < cols; ++j)
+    put(stage, stage->header, len);
+    put(stage, pixels, size);
+    return 0;
+}
+
+/* The npy formats put all the frames into one .npy file, one after
+ * another at fixed offsets, for NumPy to memory-map: as "npy", the
+ * demosaiced RGB (or gray, for monochrome cines); as "npy-raw", the
+ * samples as stored, only turned the right way up.  Either way they
+ * go in little-endian, so np.memmap() needs no byteswapping. */
+#define NPY_RAW 1
+
+struct npy_job {
+    VRP_Handle                   handle;
+    const struct extract_options *opts;
+    const int                    *offsets; /* the images, in order (NULL: all) */
+    const char                   *path;
+    int                          fd;
+    off_t                        data;     /* where the first frame goes */
+    size_t                       frame;    /* bytes per frame */
+    int                          count, run; /* frames, and how many a worker takes at once */
+    int                          failed;
+};
+
+/* npy_frame - extract the i'th image into its place in the .npy */
+void npy_frame(int i, void *arg)
+{
+    struct npy_job      *job = arg;
+    VRP_Handle          handle = job->handle;
+    VRP_Error           err;
+    VRP_StatsTimer      t;
+    int                 j = job->offsets ? job->offsets[i] : i;
+    int                 rows = handle->imageHeader->biHeight, cols = handle->imageHeader->biWidth, r;
+    int                 wide = handle->imageHeader->biBitCount != 8;
+    const unsigned char *pixels;
+    void                *buf;
+    size_t              rowbytes, k, size = job->frame;
+    off_t               pos = job->data + (off_t)i * job->frame;
+
+    if (!job->opts->quiet)
+        fprintf(stderr, "Extracting image at offset %d into %s\n", j, job->path);
+
+    /* (each frame is exactly job->frame bytes, so the extractors never
+     * have cause to reallocate this) */
+    if (!(buf = vrp_buffer_get(job->frame)))
+    {
+        fprintf(stderr, "%s: out of memory\n", handle->name);
+        job->failed = 1;
+        return;
+    }
+
+    if (job->opts->format->compression == NPY_RAW)
+    {
+        rowbytes = (size_t)cols * (wide ? 2 : 1);
+        if (!(pixels = vrp_image_pixels(handle, j)))
         {
-            col = j;
+            fprintf(stderr, "%s: image at offset %d is missing or truncated\n", handle->name, j);
+            job->failed = 1;
+            vrp_buffer_put(buf);
+            return;
+        }
+        /* (the cine's samples are little-endian already) */
+        for (r = 0; r < rows; ++r)
+            memcpy((char *)buf + (size_t)r * rowbytes, pixels + (size_t)(rows - 1 - r) * rowbytes, rowbytes);
+    }
+    else
+    {
+        uint16_t *rgb = buf;
+        size_t   samples = size / 2;
+        int      gray = vrp_is_gray(handle);
 
-            /* XXX very naive and simple demosaicing right now */
-            /* TODO: find a better algorithm; see http://en.wikipedia.org/wiki/Demosaicing */
+        if ((gray ? vrp_extract_gray(handle, j, 1, &rows, &cols, &buf, &size, &err)
+                  : vrp_extract_image_mt(handle, j, 1, &rows, &cols, &rgb, &samples, &err)) < 0)
+        {
+            fprintf(stderr, "%s\n", err.message);
+            vrp_buffer_put(buf);
+            job->failed = 1;
+            return;
+        }
+        if (wide || !gray)
+            for (k = 0; k < job->frame / 2; ++k)
+                ((uint16_t *)buf)[k] = htole16(ntohs(((uint16_t *)buf)[k]));
+    }
 
-            left   = 2*(col/2);
-            right  = left+1;
-            top    = 2*(row/2);
-            bottom = top + 1;
+    VRP_STATS_START(&t);
+    if (pwrite_all_fd(job->fd, buf, job->frame, pos) < 0)
+    {
+        perror(job->path);
+        job->failed = 1;
+    }
+    VRP_STATS_STOP(&t, VRP_STAGE_WRITE, job->frame);
+    vrp_buffer_put(buf);
+}
 
-            switch((row % 2) << 1 | col % 2)
+/* npy_run - npy_frame() the item'th run of job->run frames, in order:
+ * for packed files, a group's worth, decoded each from the one before
+ * by the same thread's cursor */
+void npy_run(int item, void *arg)
+{
+    struct npy_job *job = arg;
+    int            i;
+
+    for (i = item * job->run; i < (item + 1) * job->run && i < job->count; ++i)
+        npy_frame(i, job);
+}
+
+/*
+ * extract_to_npy - write the images at offsets (count of them; all if
+ * offsets is NULL) into one .npy in opts->outdir, named after the cine
+ *
+ * The file is laid out and allocated first, then the frames written
+ * into their places on several threads (opts->threads), and finally
+ * renamed into place from a temporary name.  There's no manifest:
+ * it's all or nothing.  Returns 0 if it's there, -1 if not (having
+ * said why).
+ */
+int extract_to_npy(VRP_Handle handle, const struct extract_options *opts, const int *offsets, int count)
+{
+    static const char   colours[] = "RGB";
+    struct npy_job      job;
+    unsigned char       header[VRP_NPY_HEADER_MAX], pattern[4];
+    char                path[BUFSIZ], tmp[BUFSIZ + 8];
+    const char          *base, *dot, *descr;
+    size_t              shape[4];
+    int                 rows = handle->imageHeader->biHeight, cols = handle->imageHeader->biWidth;
+    int                 bits = handle->imageHeader->biBitCount, raw = opts->format->compression == NPY_RAW;
+    int                 gray = vrp_is_gray(handle), len;
+
+    if (raw && (handle->header->Compression == VRP_CC_JPEG || (bits != 8 && bits != 16)))
+    {
+        fprintf(stderr, "%s: only 8- and 16-bit uncompressed cines have raw samples to write\n", handle->name);
+        return -1;
+    }
+
+    base = strrchr(handle->name, '/') ? strrchr(handle->name, '/') + 1 : handle->name;
+    dot = strrchr(base, '.');
+    snprintf(path, sizeof(path), "%s/%.*s.npy", opts->outdir, dot && dot > base ? (int)(dot - base) : (int)strlen(base), base);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    /* (count, rows, cols), with 3 samples per pixel for RGB */
+    shape[0] = count;
+    shape[1] = rows;
+    shape[2] = cols;
+    shape[3] = 3;
+    descr = (raw || gray) && bits == 8 ? "|u1" : "<u2";
+    memset(&job, 0, sizeof(job));
+    job.frame = (size_t)rows * cols * (descr[2] == '1' ? 1 : 2) * (raw || gray ? 1 : 3);
+    if ((len = vrp_npy_header(header, sizeof(header), descr, shape, raw || gray ? 3 : 4)) < 0)
+        return -1;
+
+    if (raw && vrp_cfa_pattern(handle, pattern) == 0)
+    {
+        /* as stored, pattern[] starts from the bottom row */
+        int top = rows % 2 ? 0 : 2;
+
+        fprintf(stderr, "NOTICE: raw CFA samples, top row first; the pattern is %c%c%c%c\n",
+                colours[pattern[top]], colours[pattern[top + 1]], colours[pattern[2 - top]], colours[pattern[3 - top]]);
+    }
+
+    if ((job.fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0)
+    {
+        perror(tmp);
+        return -1;
+    }
+    job.handle = handle;
+    job.opts = opts;
+    job.offsets = offsets;
+    job.path = path;
+    job.data = len;
+    job.count = count;
+    job.run = vrp_pack_group_size(handle);
+    if (write(job.fd, header, len) != len
+        || (errno = posix_fallocate(job.fd, 0, job.data + (off_t)count * job.frame)))
+    {
+        perror(tmp);
+        job.failed = 1;
+    }
+
+    if (!job.failed)
+        vrp_parallel_for((count + job.run - 1) / job.run, opts->threads, npy_run, &job);
+
+    if (close(job.fd) < 0 && !job.failed)
+    {
+        perror(tmp);
+        job.failed = 1;
+    }
+    if (job.failed || rename(tmp, path) < 0)
+    {
+        if (!job.failed)
+            perror(path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+struct output_format output_formats[] = {
+    { "ppm",          "ppm",  write_ppm,  0,                0 },
+    { "pgm",          "pgm",  write_pgm,  0,                0 },
+    { "tiff",         "tif",  write_tiff, VRP_TIFF_NONE,    0 },
+    { "tiff-lzw",     "tif",  write_tiff, VRP_TIFF_LZW,     0 },
+    { "tiff-deflate", "tif",  write_tiff, VRP_TIFF_DEFLATE, 6 },
+    { "png",          "png",  write_png,  0,                6 },
+    { "png-fast",     "png",  write_png,  0,                1 },
+    { "dng",          "dng",  write_dng,  0,                0 },
+    { "yuv420p",      "yuv",  write_yuv,  VRP_YUV420,       8 },
+    { "yuv420p10",    "yuv",  write_yuv,  VRP_YUV420,       10 },
+    { "yuv422p",      "yuv",  write_yuv,  VRP_YUV422,       8 },
+    { "yuv422p10",    "yuv",  write_yuv,  VRP_YUV422,       10 },
+    { "npy",          "npy",  NULL,       0,                0 },
+    { "npy-raw",      "npy",  NULL,       NPY_RAW,          0 },
+    { NULL, NULL, NULL, 0, 0 }
+};
+
+/* find_output_format - look up an entry in output_formats by name
+ * (returns NULL if there's no such format) */
+struct output_format *find_output_format(const char *name)
+{
+    struct output_format *format;
+
+    for (format = output_formats; format->name; ++format)
+        if (!strcmp(format->name, name))
+            return format;
+
+    return NULL;
+}
+
+/*
+ * parse_ranges - work out which images a -r option asks for
+ * inputs:
+ *   handle  - VRP cine file handle
+ *   spec    - comma-separated frame numbers and first:last ranges of
+ *             them (inclusive), in Cine reckoning, e.g. "-120:-80,7,300:450"
+ *             (as cine-find-motion prints them)
+ *   offsets - where to put a (malloc()ed) list of their offsets
+ *
+ * return value:
+ *   how many offsets there are, or -1 if spec is bad or asks for frames
+ *   the file doesn't have (having said so on stderr)
+ */
+int parse_ranges(VRP_Handle handle, const char *spec, int **offsets)
+{
+    int        n = 0, size = 0, first, last, i, *list = NULL, *grown;
+    const char *p = spec;
+    char       *end;
+
+    while (*p)
+    {
+        first = last = strtol(p, &end, 10);
+        if (end == p)
+            goto bad;
+        if (*end == ':')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p)
+                goto bad;
+        }
+        if (*end && *end != ',')
+            goto bad;
+        p = *end ? end + 1 : end;
+
+        if (first > last || first < handle->header->FirstImageNo
+            || last >= handle->header->FirstImageNo + (int)handle->header->ImageCount)
+        {
+            fprintf(stderr, "Frames %d through %d aren't all in %s (it has %d through %d)\n", first, last,
+                    handle->name, handle->header->FirstImageNo,
+                    handle->header->FirstImageNo + handle->header->ImageCount - 1);
+            free(list);
+            return -1;
+        }
+        for (i = first; i <= last; ++i)
+        {
+            if (n == size)
             {
-            case 0: /* bottom-left: red */
-                pixel.r = pixelData[row*cols+col]; /* real */
-                pixel.g = pixelData[row*cols+col+1]; /* from the right */
-                pixel.b = pixelData[(row+1)*cols+col+1]; /* from above, right */
-                break;
-            case 1: /* bottom-right: green */
-                pixel.r = pixelData[row*cols+col-1]; /* from the left */
-                pixel.g = pixelData[row*cols+col]; /* real value */
-                pixel.b = pixelData[(row+1)*cols+col]; /* from above */
-                break;
-            case 2: /* top-left: green */
-                pixel.r = pixelData[(row-1)*cols+col]; /* from below */
-                pixel.g = pixelData[row*cols+col]; /* real value */
-                pixel.b = pixelData[row*cols+col+1]; /* from the right */
-                break;
-            case 3: /* top-right: blue */
-                pixel.r = pixelData[(row-1)*cols+col-1]; /* from below, left */
-                pixel.g = pixelData[row*cols+col-1]; /* from the left */
-                pixel.b = pixelData[row*cols+col]; /* real value */
-                break;
+                size = size ? size * 2 : 256;
+                if (!(grown = realloc(list, size * sizeof(*list))))
+                {
+                    perror("realloc");
+                    free(list);
+                    return -1;
+                }
+                list = grown;
             }
+            list[n++] = i - handle->header->FirstImageNo;
+        }
+    }
+
+    *offsets = list;
+    return n;
 
-            /* adjust white balance */
-            pixel.r = wb_r * pixel.r;
-            if (pixel.r >= handle->imageHeader->biClrImportant)
-                pixel.r = handle->imageHeader->biClrImportant - 1;
-            pixel.b = wb_b * pixel.b;
-            if (pixel.b >= handle->imageHeader->biClrImportant)
-                pixel.b = handle->imageHeader->biClrImportant - 1;
-
-            /* prepare to store -- using network byte order (big-endian) */
-            pixel.r = htons(pixel.r);
-            pixel.g = htons(pixel.g);
-            pixel.b = htons(pixel.b);
-
-            outbuf[3*(i*cols+j)+0] = pixel.r;
-            outbuf[3*(i*cols+j)+1] = pixel.g;
-            outbuf[3*(i*cols+j)+2] = pixel.b;
+bad:
+    fprintf(stderr, "Can't make sense of frame ranges \"%s\" (try e.g. -10:20,40)\n", spec);
+    free(list);
+    return -1;
+}
+
+/* The manifest (see lib/manifest.c) makes runs resumable; sharded
+ * runs (--shard i/N) each keep their own, SHARD_MANIFEST, which
+ * cine-merge-manifest puts together. */
+#define SHARD_MANIFEST VRP_MANIFEST_NAME ".shard-%d-of-%d"
+
+/* source_identity - describe handle's recording, for the manifest */
+void source_identity(VRP_Handle handle, char *buf, size_t size)
+{
+    snprintf(buf, size, "%u.%08x/%d/%u/%dx%dx%d", handle->header->TriggerTime.Seconds,
+             handle->header->TriggerTime.Fractions, handle->header->FirstImageNo,
+             handle->header->ImageCount, handle->imageHeader ? handle->imageHeader->biWidth : 0,
+             handle->imageHeader ? handle->imageHeader->biHeight : 0,
+             handle->imageHeader ? handle->imageHeader->biBitCount : 0);
+}
+
+/* already_done - whether the manifest says e's file is done, and it
+ * still looks it */
+int already_done(const VRP_Manifest *m, const struct extract_options *opts,
+                 const VRP_ManifestEntry *e)
+{
+    const VRP_ManifestEntry *found;
+
+    if (!(found = vrp_manifest_find(m, e->file)))
+        return 0;
+    if (found->offset != e->offset || strcmp(found->source, e->source) || strcmp(found->format, e->format))
+        return 0;
+    return vrp_manifest_present(found, opts->outdir, opts->verify);
+}
+
+/* image_written - vrp_outdir_write()'s done(): record the image in the
+ * manifest (in order, as they're called that way), and free its slot */
+void image_written(void *arg, const char *name, int error)
+{
+    struct staged_image *stage = arg;
+    VRP_Error err;
+
+    if (error)
+    {
+        fprintf(stderr, "%s/%s: %s\n", stage->outdir, name, strerror(error));
+        *stage->failed = 1;
+    }
+    else if (stage->manifest->out && vrp_manifest_add(stage->manifest, &stage->e, &err) < 0)
+    {
+        fprintf(stderr, "%s\n", err.message);
+        *stage->failed = 1;
+    }
+    if (stage->map)
+        munmap(stage->map, stage->size);
+    stage->map = NULL;
+}
+
+/*
+ * write_image - write one image (as stage->e.file) into out
+ * inputs:
+ *   handle, offset - which image
+ *   opts           - how
+ *   out            - where
+ *   stage          - a free slot to stage it in, with e filled in but
+ *                    for the size and CRC
+ *
+ * return value:
+ *   0 if it's on its way, -1 on failure (having said why)
+ *
+ * The format's writer leaves the file in pieces, in stage->iov, which
+ * go out in one write, header and all; the CRC (for the manifest) is
+ * taken of them on the way, without reading anything back.
+ */
+int write_image(VRP_Handle handle, int offset, const struct extract_options *opts,
+                VRP_OutDir *out, struct staged_image *stage)
+{
+    VRP_StatsTimer t;
+    size_t         done, len;
+    int            i;
+
+    stage->iovcnt = 0;
+    if (opts->format->write(opts, handle, offset, stage) < 0)
+    {
+        fprintf(stderr, "Failed to write image at offset %d into %s/%s\n", offset, opts->outdir, stage->e.file);
+        if (stage->map)
+            munmap(stage->map, stage->size);
+        stage->map = NULL;
+        return -1;
+    }
+
+    stage->e.bytes = 0;
+    stage->e.crc = crc32(0, NULL, 0);
+    for (i = 0; i < stage->iovcnt; ++i)
+    {
+        stage->e.bytes += stage->iov[i].iov_len;
+        if (!stage->manifest->out)
+            continue;
+        for (done = 0; done < stage->iov[i].iov_len; done += len)
+        {
+            len = stage->iov[i].iov_len - done < 1 << 30 ? stage->iov[i].iov_len - done : 1 << 30;
+            stage->e.crc = crc32(stage->e.crc, (const unsigned char *)stage->iov[i].iov_base + done, len);
         }
     }
+
+    VRP_STATS_START(&t);
+    if (vrp_outdir_write(out, stage->e.file, stage->iov, stage->iovcnt, image_written, stage) < 0)
+    {
+        perror(stage->e.file);
+        if (stage->map)
+            munmap(stage->map, stage->size);
+        stage->map = NULL;
+        return -1;
+    }
+    VRP_STATS_STOP(&t, VRP_STAGE_WRITE, stage->e.bytes);
+    return 0;
 }
 
 /*
- * extract_to_ppm_dir - extract a sequence of PPM images into outdir
+ * extract_to_dir - extract a sequence of images into opts->outdir
  * inputs:
  *   handle - VRP cine file handle
- *   outdir - directory in which to place files (must already exist)
+ *   opts   - where and how to write them, and which (opts->ranges,
+ *            and of those opts->shard's share); the output directory
+ *            must already exist
  *
- * outputs:
- *   none (see side effects)
+ * return value:
+ *   0 if every image asked for is there (written now, or before), -1
+ *   if not, or if the manifest couldn't be kept (having said why)
  *
  * side effects:
- *   creates and/or over-writes files in outdir
+ *   creates and/or over-writes files in outdir (but unless
+ *   opts->manifest is off, leaves alone those its manifest says are
+ *   already done), and appends to the manifest (the shard's own, if
+ *   sharded)
  */
-void extract_to_ppm_dir(VRP_Handle handle, const char *outdir)
+int extract_to_dir(VRP_Handle handle, const struct extract_options *opts)
 {
-    unsigned int j;
-    /* by default, all frames, 1 at a time */
-    /* TODO: make these command-line args */
-    int first = 0, increment = 1;
-    uint16_t *outbuf = NULL;
-    int rows, cols;
+    int i, j, count, first, end, skipped = 0, nstages, next = 0, failed = 0, *offsets = NULL;
+    VRP_Manifest manifest;
+    VRP_ManifestEntry e;
+    VRP_ManifestPlan plan;
+    VRP_OutDir *out;
+    VRP_Error err;
+    struct staged_image *stages;
+    struct extract_options gray_opts;
+    char path[BUFSIZ];
 
-    if (first < 0)
-        first = 0;
+    /* a PPM of a monochrome image would just be three copies of a PGM */
+    if (opts->format->write == write_ppm && vrp_is_gray(handle))
+    {
+        gray_opts = *opts;
+        gray_opts.format = find_output_format("pgm");
+        opts = &gray_opts;
+        if (!opts->quiet)
+            fprintf(stderr, "NOTICE: %s is monochrome, writing PGM rather than PPM\n", handle->name);
+    }
+    /* ... but a PGM of a colour one can't be had at all */
+    if (opts->format->write == write_pgm && !vrp_is_gray(handle))
+    {
+        fprintf(stderr, "%s: not a monochrome cine, so it can't be written as PGM (try ppm)\n", handle->name);
+        return -1;
+    }
+
+    /* by default, all frames */
+    if (opts->ranges)
+    {
+        if ((count = parse_ranges(handle, opts->ranges, &offsets)) < 0)
+            return -1;
+    }
+    else
+        count = handle->header->ImageCount;
+
+    if (!opts->format->write)
+    {
+        if (opts->shards)
+        {
+            fprintf(stderr, "%s: an .npy is written whole, so it can't be sharded\n", handle->name);
+            failed = 1;
+        }
+        else if (extract_to_npy(handle, opts, offsets, count) < 0)
+            failed = 1;
+        free(offsets);
+        return failed ? -1 : 0;
+    }
+
+    /* a shard does its share of the frames asked for, in one run of
+     * them (so each shard reads its own part of the file) */
+    first = 0;
+    end = count;
+    if (opts->shards)
+    {
+        first = (long long)count * (opts->shard - 1) / opts->shards;
+        end = (long long)count * opts->shard / opts->shards;
+    }
+
+    memset(&manifest, 0, sizeof(manifest));
+    if (opts->shards)
+        snprintf(path, sizeof(path), "%s/" SHARD_MANIFEST, opts->outdir, opts->shard, opts->shards);
+    else
+        snprintf(path, sizeof(path), "%s/%s", opts->outdir, VRP_MANIFEST_NAME);
+    if (opts->manifest && vrp_manifest_open(&manifest, path, &err) < 0)
+    {
+        fprintf(stderr, "%s\n", err.message);
+        free(offsets);
+        return -1;
+    }
+    memset(&e, 0, sizeof(e));
+    source_identity(handle, e.source, sizeof(e.source));
+    snprintf(e.format, sizeof(e.format), "%s%s", opts->format->name,
+             opts->format->write == write_yuv && opts->matrix == VRP_YUV_BT2020 ? "-bt2020" : "");
+    if (manifest.out && opts->shards)
+    {
+        memcpy(plan.source, e.source, sizeof(plan.source));
+        memcpy(plan.format, e.format, sizeof(plan.format));
+        plan.shard = opts->shard;
+        plan.shards = opts->shards;
+        plan.assigned = end - first;
+        plan.total = count;
+        if (vrp_manifest_plan(&manifest, &plan, &err) < 0)
+        {
+            fprintf(stderr, "%s\n", err.message);
+            failed = 1;
+        }
+    }
 
-    for (j = first; j < handle->header->ImageCount; j += increment)
+    nstages = opts->depth > 0 ? opts->depth : 1;
+    if (!(out = vrp_outdir_open(opts->outdir, opts->depth, opts->fsync ? VRP_OUTDIR_FSYNC : 0, &err)))
     {
-	char filename[BUFSIZ];
-	FILE *outfile;
+        fprintf(stderr, "%s\n", err.message);
+        vrp_manifest_close(&manifest, NULL);
+        free(offsets);
+        return -1;
+    }
+    if (!(stages = calloc(nstages, sizeof(*stages))))
+    {
+        perror("calloc");
+        vrp_outdir_close(out, NULL);
+        vrp_manifest_close(&manifest, NULL);
+        free(offsets);
+        return -1;
+    }
+    for (i = 0; i < nstages; ++i)
+    {
+        stages[i].manifest = &manifest;
+        stages[i].outdir = opts->outdir;
+        stages[i].failed = &failed;
+    }
 
-	sprintf(filename, "%s/img-%05u.ppm", outdir, j);
-	fprintf(stderr, "Extracting image at offset %d into %s\n", j, filename);
+    for (i = first; i < end; ++i)
+    {
+	struct staged_image *stage;
 
-	if (!(outfile = fopen(filename, "wb")))
+	j = offsets ? offsets[i] : i;
+	snprintf(e.file, sizeof(e.file), "img-%05u.%s", j, opts->format->suffix);
+	e.offset = j;
+
+	if (manifest.out && already_done(&manifest, opts, &e))
 	{
-	    perror(filename);
-	    return;
+	    skipped++;
+	    continue;
 	}
+	if (!opts->quiet)
+	    fprintf(stderr, "Extracting image at offset %d into %s/%s\n", j, opts->outdir, e.file);
 
-	extract_image_by_offset(handle, j, &rows, &cols, &outbuf);
-	fprintf(outfile, "P6\n%d %d\n%d\n", cols, rows, handle->imageHeader->biClrImportant);
-	fwrite(outbuf, sizeof(short), 3*cols*rows, outfile);
-
-	fclose(outfile);
+	/* (the slot's last image, nstages ago, must be out of it) */
+	stage = &stages[next++ % nstages];
+	vrp_outdir_wait(out, nstages - 1);
+	stage->e = e;
+	if (write_image(handle, j, opts, out, stage) < 0)
+	    failed = 1;
+    }
+    if (vrp_outdir_close(out, &err) < 0)
+    {
+	fprintf(stderr, "%s\n", err.message);
+	failed = 1;
+    }
+    for (i = 0; i < nstages; ++i)
+    {
+	if (stages[i].stream)
+	    fclose(stages[i].stream);
+	free(stages[i].buf);
     }
+    free(stages);
+    if (skipped)
+	fprintf(stderr, "Skipped %d image%s already extracted (see %s)\n", skipped,
+		skipped == 1 ? "" : "s", manifest.path);
 
-    if (outbuf)
-	free(outbuf);
+    if (vrp_manifest_close(&manifest, &err) < 0)
+    {
+	fprintf(stderr, "%s\n", err.message);
+	failed = 1;
+    }
+    free(offsets);
+    return failed ? -1 : 0;
 }
 
 /* offset_for_frame_id - return offset for a numbered frame
@@ -239,64 +922,176 @@ int extract_image_by_frame_id(VRP_Handle handle, int frame)
  */
 int main(int argc, char *argv[])
 {
-    int i;
-    const char *outdir = "cine-extract.d";
+    int i, ret = 0;
+    struct extract_options opts = { "cine-extract.d", output_formats, 1, NULL, 1, 0, VRP_YUV_BT709, 0, 0, 4, 0, 0 };
 
     for (i = 1; i < argc; ++i)
     {
         VRP_Handle handle;
+        VRP_Error err;
         int first, trigger, last;
 
         if (!strcmp(argv[i], "-d"))
         {
             i ++;
-            outdir = argv[i];
-            if (!outdir)
+            opts.outdir = argv[i];
+            if (!opts.outdir)
             {
                 fprintf(stderr, "Directory name must follow -d option\n");
                 exit(1);
             }
             continue;
         }
+        if (!strcmp(argv[i], "-f"))
+        {
+            i ++;
+            if (!argv[i] || !(opts.format = find_output_format(argv[i])))
+            {
+                const struct output_format *format;
 
-        fprintf(stderr, "--=> reading %s <=--\n", argv[i]);
-
-        if (!(handle = read_cine(argv[i])))
+                fprintf(stderr, "Format name must follow -f option; one of:");
+                for (format = output_formats; format->name; ++format)
+                    fprintf(stderr, " %s", format->name);
+                fprintf(stderr, "\n");
+                exit(1);
+            }
+            continue;
+        }
+        if (!strncmp(argv[i], "--stats", 7) && (argv[i][7] == '\0' || argv[i][7] == '='))
         {
-            fprintf(stderr, "Failed to get handle on %s\n", argv[i]);
+            if (vrp_stats_option(argv[i][7] ? argv[i] + 8 : NULL) < 0)
+            {
+                fprintf(stderr, "--stats takes a comma-separated list of json, text, faults and cycles\n");
+                exit(1);
+            }
             continue;
         }
-
-        if ((first = handle->header->FirstImageNo) > 0)
+        if (!strncmp(argv[i], "--pool=", 7))
         {
-            fprintf(stderr, "Sorry, trigger frame is not saved in this file (starts with frame %d).\n", first);
+            if (vrp_pool_option(argv[i] + 7) < 0)
+            {
+                fprintf(stderr, "--pool takes megabytes of idle buffers to keep, optionally with \",huge\"\n");
+                exit(1);
+            }
+            continue;
+        }
+        if (!strcmp(argv[i], "-r"))
+        {
+            i ++;
+            if (!(opts.ranges = argv[i]))
+            {
+                fprintf(stderr, "Frame ranges (e.g. -10:20,40) must follow -r option\n");
+                exit(1);
+            }
+            continue;
+        }
+        if (!strcmp(argv[i], "--verify"))
+        {
+            opts.verify = 1;
+            continue;
+        }
+        if (!strcmp(argv[i], "--no-manifest"))
+        {
+            opts.manifest = 0;
+            continue;
+        }
+        if (!strcmp(argv[i], "--shard"))
+        {
+            i ++;
+            if (!argv[i] || sscanf(argv[i], "%d/%d", &opts.shard, &opts.shards) != 2
+                || opts.shards < 1 || opts.shard < 1 || opts.shard > opts.shards)
+            {
+                fprintf(stderr, "Shard (i/N, i from 1 to N) must follow --shard option\n");
+                exit(1);
+            }
+            continue;
+        }
+        if (!strcmp(argv[i], "--io-depth"))
+        {
+            i ++;
+            if (!argv[i])
+            {
+                fprintf(stderr, "Images to have in flight (0 to write each before the next) must follow --io-depth option\n");
+                exit(1);
+            }
+            opts.depth = atoi(argv[i]);
+            continue;
+        }
+        if (!strcmp(argv[i], "--fsync"))
+        {
+            opts.fsync = 1;
+            continue;
+        }
+        if (!strcmp(argv[i], "-q") || !strcmp(argv[i], "--quiet"))
+        {
+            opts.quiet = 1;
+            continue;
+        }
+        if (!strcmp(argv[i], "--bt2020"))
+        {
+            opts.matrix = VRP_YUV_BT2020;
+            continue;
+        }
+        if (!strcmp(argv[i], "-j"))
+        {
+            i ++;
+            if (!argv[i])
+            {
+                fprintf(stderr, "Thread count (0 for one per CPU) must follow -j option\n");
+                exit(1);
+            }
+            opts.threads = atoi(argv[i]);
+            continue;
         }
 
-        /* the offset of the frame we actually want: */
-        trigger = 0;
-
-        last = handle->header->ImageCount + first;
+        if (!opts.quiet)
+            fprintf(stderr, "--=> reading %s <=--\n", argv[i]);
 
-        if (trigger < first)
+        if (!(handle = vrp_open(argv[i], &err)))
         {
-            fprintf(stderr, "NOTICE: trigger frame 0 not in range %d -> %d, setting to %d\n", first, last, first);
-            trigger = first;
+            fprintf(stderr, "%s\n", err.message);
+            fprintf(stderr, "Failed to get handle on %s\n", argv[i]);
+            ret = 1;
+            continue;
         }
-        else if (trigger > last)
+        vrp_print_open_warnings(stderr, handle, &err);
+
+        /* say what we're about to do, unless asked not to */
+        if (!opts.quiet)
         {
-            fprintf(stderr, "NOTICE: trigger frame 0 not in range %d -> %d, setting to %d\n", first, last, last);
-            trigger = last;
-        }
+            if ((first = handle->header->FirstImageNo) > 0)
+            {
+                fprintf(stderr, "Sorry, trigger frame is not saved in this file (starts with frame %d).\n", first);
+            }
+
+            /* the offset of the frame we actually want: */
+            trigger = 0;
 
-        fprintf(stderr, "DEBUG: first = %d, trig = %d, last = %d\n", first, trigger, last);
+            last = handle->header->ImageCount + first;
 
-        fprintf(stderr, "Capturing the %d%s frame (frame #0 out of %d through %d)\n", trigger+1,
-                ordinal_suffix(trigger+1), first, last);
+            if (trigger < first)
+            {
+                fprintf(stderr, "NOTICE: trigger frame 0 not in range %d -> %d, setting to %d\n", first, last, first);
+                trigger = first;
+            }
+            else if (trigger > last)
+            {
+                fprintf(stderr, "NOTICE: trigger frame 0 not in range %d -> %d, setting to %d\n", first, last, last);
+                trigger = last;
+            }
+
+            fprintf(stderr, "DEBUG: first = %d, trig = %d, last = %d\n", first, trigger, last);
+
+            fprintf(stderr, "Capturing the %d%s frame (frame #0 out of %d through %d)\n", trigger+1,
+                    ordinal_suffix(trigger+1), first, last);
+        }
 
-	extract_to_ppm_dir(handle, outdir);
+	if (extract_to_dir(handle, &opts) < 0)
+	    ret = 1;
 
         free_cine_handle(handle);
     }
 
-    return(0);
+    vrp_stats_report(stderr);
+    return(ret);
 }
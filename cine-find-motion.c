@@ -0,0 +1,324 @@
+/*
+ * cine-find-motion.c -- find the parts of a cine where something happens
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h> /* getopt() */
+#include <sys/mman.h>
+
+#include "vrptools.h"
+
+/* Each image gets a "signature": the green samples of -R rows spread
+ * evenly down it (so of a raw file only those rows' pages are ever
+ * read -- a few percent of it).  The activity of an image is the mean
+ * absolute difference (SAD over the count) between its signature and
+ * the one before.  Images are handled in runs, in parallel; the
+ * differences are taken with the compiler's vector extensions, 16
+ * samples at a time.
+ *
+ * Images whose activity is over the threshold are active; active runs
+ * less than -g images apart are joined, then padded by -p images each
+ * side.  The result is printed as frame ranges (as the camera numbers
+ * them) for cine-extract -r, e.g. "-120:-80,300:450"; the exit status is
+ * 1 if nothing was found.  The threshold is -t (in sample values), or
+ * by default -k times the file's noise floor, taken as the activity of
+ * its stillest fifth. */
+
+#define RUN 64 /* images per work item */
+
+typedef uint16_t v16u16 __attribute__((vector_size(32)));
+typedef uint32_t v8u32 __attribute__((vector_size(32)));
+
+struct motion {
+    VRP_Handle    handle;
+    int           first, count;  /* offsets to look at */
+    int           nrows;         /* sampled per image */
+    int           *rows;         /* which (stored) rows */
+    int           greens;        /* samples per row */
+    size_t        sigsize;       /* samples per signature */
+    unsigned char pattern[4];
+    double        *activity;     /* per image; -1 where it can't be had */
+    int           failed;
+};
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-f first] [-l last] [-R rows] [-t threshold | -k factor] [-g gap]\n"
+            "          [-p pad] [-j threads] [-v] file.cine\n"
+            "  (prints active frame ranges for cine-extract -r; -v lists each frame's activity)\n", name);
+}
+
+/* take image offset's signature into sig; returns 0, or -1 if the
+ * image isn't there */
+int signature(struct motion *m, VRP_PackCursor *cursor, int offset, uint16_t *sig)
+{
+    VRP_Handle handle = m->handle;
+    int        cols = handle->imageHeader->biWidth, wide = handle->imageHeader->biBitCount > 8;
+    int        r, x, k, g0;
+    const void *pixels = cursor ? vrp_pack_decode(handle, cursor, offset)
+                                : vrp_image_pixels(handle, offset);
+
+    if(!pixels)
+        return -1;
+
+    for(r = 0; r < m->nrows; ++r)
+    {
+        int row = m->rows[r];
+
+        /* the first green in this row (or just every other sample, for gray) */
+        g0 = m->pattern[(row & 1) * 2] == 1 ? 0 : 1;
+        if(wide)
+        {
+            const uint16_t *p = (const uint16_t *)pixels + (size_t)row * cols;
+
+            for(x = g0, k = 0; k < m->greens; x += 2, ++k)
+                *sig++ = p[x];
+        }
+        else
+        {
+            const uint8_t *p = (const uint8_t *)pixels + (size_t)row * cols;
+
+            for(x = g0, k = 0; k < m->greens; x += 2, ++k)
+                *sig++ = p[x];
+        }
+    }
+    return 0;
+}
+
+/* sad - sum of absolute differences of n samples */
+uint64_t sad(const uint16_t *a, const uint16_t *b, size_t n)
+{
+    uint64_t total = 0;
+    size_t   i = 0, k;
+
+    /* (a block at a time: each 16-bit difference is added into a
+     * 32-bit lane, two to a lane, which can't overflow within a block) */
+    while(n - i >= 16)
+    {
+        v8u32  acc = { 0 };
+        size_t end = n - i > 16 * 4096 ? i + 16 * 4096 : n - (n - i) % 16;
+
+        for(; i < end; i += 16)
+        {
+            v16u16 va, vb, gt, d;
+            v8u32  pairs;
+
+            memcpy(&va, a + i, sizeof(va));
+            memcpy(&vb, b + i, sizeof(vb));
+            gt = (v16u16)(va > vb);
+            d = ((va - vb) & gt) | ((vb - va) & ~gt);
+            pairs = (v8u32)d;
+            acc += (pairs & 0xffff) + (pairs >> 16);
+        }
+        for(k = 0; k < 8; ++k)
+            total += acc[k];
+    }
+    for(; i < n; ++i)
+        total += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    return total;
+}
+
+/* one work item: a run of RUN images, each against the one before */
+void motion_run(int item, void *arg)
+{
+    struct motion  *m = arg;
+    VRP_PackCursor *cursor = NULL;
+    uint16_t       *sig[2];
+    int            i, start = m->first + item * RUN, end = start + RUN, have_prev;
+
+    if(end > m->first + m->count)
+        end = m->first + m->count;
+    sig[0] = malloc(m->sigsize * sizeof(uint16_t));
+    sig[1] = malloc(m->sigsize * sizeof(uint16_t));
+    if(!sig[0] || !sig[1] || (m->handle->pack && !(cursor = vrp_pack_cursor_new(m->handle))))
+    {
+        m->failed = 1;
+        goto done;
+    }
+
+    have_prev = start > 0 && signature(m, cursor, start - 1, sig[1]) == 0;
+    for(i = start; i < end; ++i)
+    {
+        uint16_t *cur = sig[(i - start) & 1], *prev = sig[(i - start + 1) & 1];
+        int      have = signature(m, cursor, i, cur) == 0;
+
+        m->activity[i - m->first] = have && have_prev ? (double)sad(cur, prev, m->sigsize) / m->sigsize : -1;
+        have_prev = have;
+    }
+
+done:
+    vrp_pack_cursor_free(cursor);
+    free(sig[0]);
+    free(sig[1]);
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    struct motion m;
+    VRP_Handle    handle;
+    VRP_Error     err;
+    double        threshold = -1, factor = 3, *sorted;
+    int           i, n, r, first, last, threads = 0, gap = 10, pad = 5, verbose = 0;
+    int           have_first = 0, have_last = 0, found = 0, start, end, prev_start = 0, prev_end = 0;
+
+    memset(&m, 0, sizeof(m));
+    m.nrows = 32;
+    first = last = 0;
+    while((i = getopt(argc, argv, "f:l:R:t:k:g:p:j:v")) != -1)
+    {
+        switch(i)
+        {
+        case 'f': first = atoi(optarg); have_first = 1; break;
+        case 'l': last = atoi(optarg); have_last = 1; break;
+        case 'R': m.nrows = atoi(optarg); break;
+        case 't': threshold = atof(optarg); break;
+        case 'k': factor = atof(optarg); break;
+        case 'g': gap = atoi(optarg); break;
+        case 'p': pad = atoi(optarg); break;
+        case 'j': threads = atoi(optarg); break;
+        case 'v': verbose = 1; break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(argc - optind != 1 || m.nrows < 1 || gap < 0 || pad < 0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if(!(m.handle = handle = vrp_open(argv[optind], &err)))
+    {
+        fprintf(stderr, "%s\n", err.message);
+        fprintf(stderr, "Failed to get handle on %s\n", argv[optind]);
+        return 2;
+    }
+    vrp_print_open_warnings(stderr, handle, &err);
+    if(!handle->imageHeader || handle->header->Compression == VRP_CC_JPEG
+       || (handle->imageHeader->biBitCount != 8 && handle->imageHeader->biBitCount != 16))
+    {
+        fprintf(stderr, "%s: can't look for motion in this\n", argv[optind]);
+        return 2;
+    }
+
+    first = have_first ? first - handle->header->FirstImageNo : 0;
+    last = have_last ? last - handle->header->FirstImageNo : (int)handle->header->ImageCount - 1;
+    if(first < 0 || last >= (int)handle->header->ImageCount || first > last)
+    {
+        fprintf(stderr, "%s: frames %d through %d aren't all there\n", argv[optind],
+                first + handle->header->FirstImageNo, last + handle->header->FirstImageNo);
+        return 2;
+    }
+    m.first = first;
+    m.count = last - first + 1;
+
+    /* which rows: evenly spaced, alternating in parity so both kinds
+     * of Bayer row are sampled */
+    if(m.nrows > handle->imageHeader->biHeight)
+        m.nrows = handle->imageHeader->biHeight;
+    if(vrp_cfa_pattern(handle, m.pattern) < 0)
+        memset(m.pattern, 1, 4);
+    m.greens = handle->imageHeader->biWidth / 2;
+    m.sigsize = (size_t)m.nrows * m.greens;
+    if(!(m.rows = malloc(m.nrows * sizeof(int))) || !(m.activity = malloc(m.count * sizeof(double)))
+       || !(sorted = malloc(m.count * sizeof(double))))
+    {
+        perror("malloc");
+        return 2;
+    }
+    for(r = 0; r < m.nrows; ++r)
+    {
+        m.rows[r] = (int)(((int64_t)r * 2 + 1) * handle->imageHeader->biHeight / (2 * m.nrows));
+        m.rows[r] = (m.rows[r] & ~1) | (r & 1);
+        if(m.rows[r] >= handle->imageHeader->biHeight)
+            m.rows[r] -= 2;
+    }
+    /* we're only touching a few rows of each image; don't read ahead */
+    if(!handle->pack)
+        madvise(handle->start, handle->st.st_size, MADV_RANDOM);
+
+    vrp_parallel_for((m.count + RUN - 1) / RUN, threads, motion_run, &m);
+    if(m.failed)
+    {
+        fprintf(stderr, "%s: out of memory\n", argv[optind]);
+        return 2;
+    }
+
+    /* the threshold, from the stillest fifth unless we were told */
+    for(i = n = 0; i < m.count; ++i)
+        if(m.activity[i] >= 0)
+            sorted[n++] = m.activity[i];
+    if(threshold < 0)
+    {
+        qsort(sorted, n, sizeof(double), compare_doubles);
+        threshold = n ? factor * sorted[n / 5] : 0;
+        if(threshold <= 0)
+            threshold = 0.5; /* (a perfectly still, noiseless source) */
+    }
+    if(verbose)
+    {
+        fprintf(stderr, "# frame activity (threshold %.3f)\n", threshold);
+        for(i = 0; i < m.count; ++i)
+            fprintf(stderr, "%d %.3f%s\n", handle->header->FirstImageNo + m.first + i, m.activity[i],
+                    m.activity[i] > threshold ? " *" : "");
+    }
+
+    /* active runs, joined across small gaps, padded (and joined again,
+     * if the padding makes them meet) */
+    for(i = 0, start = end = -1; i <= m.count; ++i)
+    {
+        int s, e;
+
+        if(i < m.count && !(m.activity[i] > threshold))
+            continue;
+        if(i < m.count && end >= 0 && i - end <= gap + 1)
+        {
+            end = i;
+            continue;
+        }
+        if(end >= 0)
+        {
+            s = start - pad < 0 ? 0 : start - pad;
+            e = end + pad >= m.count ? m.count - 1 : end + pad;
+            if(found && s <= prev_end + 1)
+                prev_end = e;
+            else
+            {
+                if(found++)
+                    printf("%d:%d,", handle->header->FirstImageNo + m.first + prev_start,
+                           handle->header->FirstImageNo + m.first + prev_end);
+                prev_start = s;
+                prev_end = e;
+            }
+        }
+        start = end = i;
+    }
+    if(found)
+        printf("%d:%d\n", handle->header->FirstImageNo + m.first + prev_start,
+               handle->header->FirstImageNo + m.first + prev_end);
+
+    free(sorted);
+    free(m.activity);
+    free(m.rows);
+    free_cine_handle(handle);
+    return found ? 0 : 1;
+}
@@ -0,0 +1,310 @@
+/*
+ * cine-gen.c -- generate synthetic CINE files, for testing and benchmarks
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h> /* getopt() */
+
+#include "vrptools.h"
+
+/* The images are a diagonal gradient that drifts a little each frame,
+ * a bright square moving across it, and a few bits of hashed noise --
+ * enough texture for the encoders and packer to have real work to do,
+ * cheap enough to generate at disk speed, and the same every run for
+ * the same arguments.  With -S, the pixels are left as holes in the
+ * file instead (just the headers, offsets and annotations are
+ * written), so even files of tens of gigabytes are made in moments
+ * and take no disk space; they read as all zeros.
+ *
+ * With -s, signals are recorded too, that many samples per image: 8
+ * binary channels counting up in binary, and 2 bipolar analog ones, a
+ * sine wave with a period of 100 samples and a sawtooth ramp.
+ *
+ * -i and -m set the camera's serial and its master's, -T the trigger
+ * time (seconds since 1970) and -F the first image's number, so the
+ * heads of a session can be made up too (see cine-session). */
+
+struct cfa_name {
+    const char *name;
+    int        cfa;
+} cfa_names[] = {
+    { "bayer",     VRP_CFA_BAYER },
+    { "bayerflip", VRP_CFA_BAYERFLIP },
+    { "gray",      VRP_CFA_NONE },
+    { NULL, 0 }
+};
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-w width] [-h height] [-n frames] [-b bits] [-c bayer|bayerflip|gray]\n"
+            "          [-r fps] [-s samples] [-S] [-i serial] [-m master] [-T trigger] [-F first]\n"
+            "          output.cine\n"
+            "  (-b is the sensor depth, 8 to 16; -s records signals, 1 to 255 samples per image;\n"
+            "   -S leaves the pixels as holes, for a sparse file; -T is in seconds since 1970)\n",
+            name);
+}
+
+/* describe the signals of generate_signals() in SETUP */
+void signals_setup(VRP_SETUP *setup, int samples)
+{
+    int i;
+
+    setup->BinChannels = 8;
+    setup->AnaChannels = 2;
+    setup->SamplesPerImage = samples;
+    setup->AnaOption = 2;
+    setup->AnaGain[0] = 10.0 / 32768; /* volts, on a +/-10V input */
+    setup->AnaGain[1] = 1;
+    for(i = 0; i < 8; ++i)
+        snprintf((char *)setup->BinName[i], sizeof(setup->BinName[i]), "bit%d", i);
+    strcpy((char *)setup->AnaName[0], "sine");
+    strcpy((char *)setup->AnaUnit[0], "V");
+    strcpy((char *)setup->AnaName[1], "ramp");
+}
+
+/* add the BinSig and AnaSig blocks, samples per image; see above */
+int generate_signals(VRP_Writer *w, int frames, int samples)
+{
+    size_t    rows = (size_t)frames * samples, i;
+    uint8_t   *bin = malloc(rows), *ana = malloc(rows * 4);
+    VRP_Error err;
+    int       ret;
+
+    if(!bin || !ana)
+    {
+        perror("malloc");
+        free(bin);
+        free(ana);
+        return -1;
+    }
+    for(i = 0; i < rows; ++i)
+    {
+        int16_t sine = lrint(30000 * sin(2 * M_PI * (i % 100) / 100)), ramp = (i % 65536) - 32768;
+
+        bin[i] = i;
+        ana[4 * i] = sine & 0xff;
+        ana[4 * i + 1] = (uint16_t)sine >> 8;
+        ana[4 * i + 2] = ramp & 0xff;
+        ana[4 * i + 3] = (uint16_t)ramp >> 8;
+    }
+
+    ret = vrp_writer_add_block(w, VRP_TB_BinSig, bin, rows, &err) < 0
+        || vrp_writer_add_block(w, VRP_TB_AnaSig, ana, rows * 4, &err) < 0 ? -1 : 0;
+    if(ret < 0)
+        fprintf(stderr, "%s\n", err.message);
+    free(bin);
+    free(ana);
+    return ret;
+}
+
+/* fill one frame's pixels; gains are per stored CFA position */
+void generate_frame(void *pixels, int width, int height, int bits, int frame,
+                    const int gain[4])
+{
+    uint16_t *p16 = pixels;
+    uint8_t  *p8 = pixels;
+    int      x, y, max = (1 << bits) - 1;
+    int      bx = (frame * 7) % width, by = (frame * 3) % height, side = height / 8 + 1;
+
+    for(y = 0; y < height; ++y)
+    {
+        int in_y = y >= by && y < by + side;
+
+        for(x = 0; x < width; ++x)
+        {
+            uint32_t h = (x * 73856093u) ^ (y * 19349663u) ^ (frame * 83492791u);
+            int      v = ((x + y + frame * 2) * max) / (width + height);
+
+            if(in_y && x >= bx && x < bx + side)
+                v = max - v / 4;
+            v = v * gain[(y & 1) * 2 + (x & 1)] / 256 + ((h >> 13) & 15);
+            if(v > max)
+                v = max;
+
+            if(bits <= 8)
+                *p8++ = v;
+            else
+                *p16++ = v;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    VRP_CINEFILEHEADER   header;
+    VRP_BITMAPINFOHEADER bmi;
+    VRP_SETUP            setup;
+    VRP_Writer           *w;
+    VRP_Error            err;
+    unsigned char        pattern[4];
+    struct cfa_name      *c;
+    const char           *output;
+    void                 *pixels = NULL;
+    int                  i, fd, gain[4];
+    int                  width = 1280, height = 800, frames = 100, bits = 12, fps = 1000, sparse = 0;
+    int                  samples = 0, first = 0;
+    unsigned             serial = 0, master = 0;
+    double               trigger = time(NULL);
+    uint64_t             trigger64;
+    int                  cfa = VRP_CFA_BAYER;
+    VRP_DWORD            exposure;
+
+    while((i = getopt(argc, argv, "w:h:n:b:c:r:s:Si:m:T:F:")) != -1)
+    {
+        switch(i)
+        {
+        case 'w': width = atoi(optarg); break;
+        case 'h': height = atoi(optarg); break;
+        case 'n': frames = atoi(optarg); break;
+        case 'b': bits = atoi(optarg); break;
+        case 'r': fps = atoi(optarg); break;
+        case 's': samples = atoi(optarg); break;
+        case 'S': sparse = 1; break;
+        case 'i': serial = strtoul(optarg, NULL, 0); break;
+        case 'm': master = strtoul(optarg, NULL, 0); break;
+        case 'T': trigger = atof(optarg); break;
+        case 'F': first = atoi(optarg); break;
+        case 'c':
+            for(c = cfa_names; c->name && strcmp(c->name, optarg); ++c)
+                ;
+            if(!c->name)
+            {
+                fprintf(stderr, "%s: unknown CFA pattern %s\n", argv[0], optarg);
+                return -1;
+            }
+            cfa = c->cfa;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(argc - optind != 1 || width < 2 || height < 2 || frames < 1 || bits < 8 || bits > 16 || fps < 1
+       || samples < 0 || samples > 255 || trigger < 0 || trigger >= 4294967296.0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    output = argv[optind];
+
+    memset(&header, 0, sizeof(header));
+    header.Compression = cfa == VRP_CFA_NONE ? VRP_CC_RGB : VRP_CC_UNINT;
+    header.Version = 1;
+    header.TotalImageCount = frames;
+    header.FirstImageNo = header.FirstMovieImage = first;
+    trigger64 = (uint64_t)(trigger * 4294967296.0);
+    header.TriggerTime.Seconds = trigger64 >> 32;
+    header.TriggerTime.Fractions = trigger64 & 0xffffffff;
+
+    memset(&bmi, 0, sizeof(bmi));
+    bmi.biSize = sizeof(bmi);
+    bmi.biWidth = width;
+    bmi.biHeight = height;
+    bmi.biPlanes = 1;
+    bmi.biBitCount = bits <= 8 ? 8 : 16;
+    bmi.biSizeImage = (size_t)width * height * bmi.biBitCount / 8;
+    bmi.biClrImportant = 1 << bits;
+
+    memset(&setup, 0, sizeof(setup));
+    memcpy(&setup.Mark, "ST", 2);
+    setup.Length = sizeof(setup);
+    setup.ImWidth = width;
+    setup.ImHeight = height;
+    setup.FrameRate = fps;
+    setup.Serial = serial;
+    setup.MasterSerial = master;
+    if(serial) /* (one head, saved on its own) */
+    {
+        setup.HeadSerial[0] = serial;
+        setup.HeadSerial[1] = setup.HeadSerial[2] = setup.HeadSerial[3] = 0xffffffff;
+    }
+    setup.ShutterNs = 1000000000 / fps / 2;
+    setup.bEnableColor = cfa != VRP_CFA_NONE;
+    setup.CFA = cfa;
+    setup.RealBPP = bits;
+    setup.WBGain[0].R = setup.WBGain[0].B = 1.0;
+    snprintf((char *)setup.Description, sizeof(setup.Description),
+             "synthetic: cine-gen -w %d -h %d -n %d -b %d", width, height, frames, bits);
+
+    /* R a bit dim and B dimmer, so the planes differ (as stored;
+     * see vrp_cfa_pattern()) */
+    switch(cfa)
+    {
+    case VRP_CFA_BAYER:     memcpy(pattern, "\0\1\1\2", 4); break;
+    case VRP_CFA_BAYERFLIP: memcpy(pattern, "\1\2\0\1", 4); break;
+    default:                memset(pattern, 1, 4); break;
+    }
+    for(i = 0; i < 4; ++i)
+        gain[i] = pattern[i] == 0 ? 200 : pattern[i] == 2 ? 150 : 256;
+
+    if(samples)
+        signals_setup(&setup, samples);
+
+    if(!sparse && !(pixels = malloc(bmi.biSizeImage)))
+    {
+        perror("malloc");
+        return 1;
+    }
+    if((fd = open(output, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0)
+    {
+        perror(output);
+        return 1;
+    }
+    if(!(w = vrp_writer_open(fd, &header, &bmi, &setup, frames,
+                             VRP_WRITER_TIMES | VRP_WRITER_EXPOSURES, &err)))
+    {
+        fprintf(stderr, "%s: %s\n", output, err.message);
+        return 1;
+    }
+    if(samples && generate_signals(w, frames, samples) < 0)
+    {
+        vrp_writer_close(w, NULL);
+        return 1;
+    }
+
+    exposure = (VRP_DWORD)(4294967296.0 * setup.ShutterNs / 1e9);
+    for(i = 0; i < frames; ++i)
+    {
+        VRP_TIME64 t;
+        uint64_t   when = trigger64 + ((int64_t)(first + i) << 32) / fps;
+
+        t.Seconds = when >> 32;
+        t.Fractions = when & 0xffffffff;
+
+        if(pixels)
+            generate_frame(pixels, width, height, bits, i, gain);
+        if(vrp_writer_append(w, NULL, pixels, t, exposure, &err) < 0)
+        {
+            fprintf(stderr, "%s: %s\n", output, err.message);
+            vrp_writer_close(w, NULL);
+            return 1;
+        }
+    }
+
+    if(vrp_writer_close(w, &err) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", output, err.message);
+        return 1;
+    }
+    if(close(fd) < 0)
+    {
+        perror(output);
+        return 1;
+    }
+    free(pixels);
+    return 0;
+}
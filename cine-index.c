@@ -0,0 +1,119 @@
+/*
+ * cine-index.c -- build index sidecars for CINE files
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h> /* getopt_long() */
+
+#include "vrptools.h"
+
+/* The only index so far is the preview pyramid (--pyramid): every
+ * image at 1/4, 1/16 and 1/64 of its width and height, in a sidecar
+ * named after the cine plus ".pyr" (or -o), for viewers to scrub
+ * through; see lib/pyramid.c. */
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s --pyramid [-j threads] [-o output.pyr] file.cine ...\n"
+            "  (-o only with a single file; otherwise each is indexed into file.cine.pyr)\n", name);
+}
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        { "pyramid", no_argument, NULL, 'P' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *output = NULL;
+    int        i, l, pyramid = 0, threads = 0, ret = 0;
+
+    while((i = getopt_long(argc, argv, "j:o:", long_options, NULL)) != -1)
+    {
+        switch(i)
+        {
+        case 'P': pyramid = 1; break;
+        case 'j': threads = atoi(optarg); break;
+        case 'o': output = optarg; break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if(!pyramid || !argc || (output && argc > 1))
+    {
+        usage(argv[-optind]);
+        return -1;
+    }
+
+    for(i = 0; i < argc; ++i)
+    {
+        VRP_Handle              handle;
+        VRP_Pyramid             *p;
+        const VRP_PYRAMIDHEADER *h;
+        VRP_Error               err;
+        char                    *name;
+        double                  t = now();
+
+        if(!(handle = vrp_open(argv[i], &err)))
+        {
+            fprintf(stderr, "%s\n", err.message);
+            fprintf(stderr, "Failed to get handle on %s\n", argv[i]);
+            ret = 1;
+            continue;
+        }
+        vrp_print_open_warnings(stderr, handle, &err);
+        if(output)
+            name = strdup(output);
+        else if((name = malloc(strlen(argv[i]) + 5)))
+            sprintf(name, "%s.pyr", argv[i]);
+        if(!name)
+        {
+            perror("malloc");
+            return 1;
+        }
+
+        if(vrp_pyramid_build(handle, name, threads, &err) < 0
+           || !(p = vrp_pyramid_open(name, handle, &err)))
+        {
+            fprintf(stderr, "%s\n", err.message);
+            ret = 1;
+        }
+        else
+        {
+            h = vrp_pyramid_header(p);
+            printf("%s: %u images in %.2f s;", name, h->ImageCount, now() - t);
+            for(l = 0; l < VRP_PYRAMID_LEVELS; ++l)
+                printf(" %ux%u", h->Level[l].Width, h->Level[l].Height);
+            printf("\n");
+            vrp_pyramid_close(p);
+        }
+
+        free(name);
+        free_cine_handle(handle);
+    }
+
+    return ret;
+}
@@ -11,13 +11,15 @@
  */
 
 #include <stdio.h>
-#include <unistd.h> /* getopt() */
+#include <unistd.h>
+#include <getopt.h> /* getopt_long() */
 
 #include "vrptools.h"
 
 void print_header_info(VRP_Handle handle)
 {
     VRP_CINEFILEHEADER *h;
+    char               when[64];
 
     if(!(h = handle->header))
     {
@@ -39,7 +41,10 @@ void print_header_info(VRP_Handle handle)
     printf("  Offsets:           %d (BITMAPINFOHEADER), %d (SETUP), %d (Image array)\n",
            h->OffImageHeader, h->OffSetup, h->OffImageOffsets);
     if(handle->setup)
-        printf("  Trigger time:      %s\n", vrp_time_iso8601(h->TriggerTime, handle->setup->RecordingTimeZone));
+    {
+        vrp_time_iso8601_s(h->TriggerTime, when, sizeof(when), handle->setup->RecordingTimeZone);
+        printf("  Trigger time:      %s\n", when);
+    }
 }
 
 void print_imageheader_info(VRP_Handle handle)
@@ -267,7 +272,9 @@ void print_summary(VRP_Handle handle)
 
     switch(h->Compression)
     {
-    case 2 /* where's my constant? */: mode = "RAW"; break;
+    case VRP_CC_UNINT: mode = "RAW"; break;
+    case VRP_CC_JPEG:  mode = "JPEG"; break;
+    case VRP_CC_RGB:   mode = "gray"; break;
     default: mode = "[unknown]"; break;
     }
 
@@ -286,19 +293,30 @@ void print_summary(VRP_Handle handle)
 
 void usage(const char *name)
 {
-    fprintf(stderr, "usage: %s [-v]\n", name);
+    fprintf(stderr, "usage: %s [-v] [--stats[=json,faults,cycles]] file.cine ...\n", name);
 }
 
 int main(int argc, char *argv[])
 {
+    static struct option long_options[] = {
+        { "stats", optional_argument, NULL, 'S' },
+        { NULL, 0, NULL, 0 }
+    };
     int i;
     int verbose = 0;
 
-    while((i = getopt(argc, argv, "v")) != -1)
+    while((i = getopt_long(argc, argv, "v", long_options, NULL)) != -1)
     {
         switch(i)
         {
         case 'v': verbose = 1; break;
+        case 'S':
+            if(vrp_stats_option(optarg) < 0)
+            {
+                fprintf(stderr, "--stats takes a comma-separated list of json, text, faults and cycles\n");
+                return -1;
+            }
+            break;
         default:
             usage(argv[0]);
             return -1;
@@ -312,14 +330,17 @@ int main(int argc, char *argv[])
     for(i = 0; i < argc; ++i)
     {
         VRP_Handle handle;
+        VRP_Error  err;
 
         printf("--=> %s <=--\n", argv[i]);
 
-        if(!(handle = read_cine(argv[i])))
+        if(!(handle = vrp_open(argv[i], &err)))
         {
+            fprintf(stderr, "%s\n", err.message);
             fprintf(stderr, "Failed to get handle on %s\n", argv[i]);
             continue;
         }
+        vrp_print_open_warnings(stderr, handle, &err);
 
         if(verbose)
         {
@@ -337,5 +358,6 @@ int main(int argc, char *argv[])
         free_cine_handle(handle);
     }
 
+    vrp_stats_report(stderr);
     return(0);
 }
@@ -0,0 +1,224 @@
+/*
+ * cine-merge-manifest.c -- put together the manifests of a sharded
+ * cine-extract run, and check that between them the shards did it all
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h> /* getopt() */
+
+#include "vrptools.h"
+
+/* Each "cine-extract --shard i/N -d dir" keeps dir's manifest of that
+ * name, with a #plan line for each cine saying how many of its images
+ * were the shard's and how many there were altogether (see
+ * lib/manifest.c).  This reads all N, checks that they're all there
+ * and agree, and that every image planned is in one of them and still
+ * on disk (with -v, with the same CRC); then writes the lot as the
+ * directory's ordinary manifest, so a later unsharded run picks up
+ * where they left off -- which, if anything's missing, is how to fill
+ * the gaps.  It exits 0 only if nothing is. */
+
+#define SHARD_PREFIX VRP_MANIFEST_NAME ".shard-"
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-v] [-n] directory\n"
+            "  (-v checks each image's CRC, not just its size; -n doesn't write the merged\n"
+            "  manifest, just reports)\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    VRP_Manifest      *shards = NULL, merged;
+    VRP_ManifestEntry *all = NULL;
+    VRP_Error         err;
+    const char        *dir;
+    struct dirent     *d;
+    DIR               *dp;
+    char              path[4096];
+    size_t            count = 0, i, k;
+    int               c, s, shard, n, nshards = 0, verify = 0, dry_run = 0, ret = 0;
+
+    while((c = getopt(argc, argv, "vn")) != -1)
+    {
+        switch(c)
+        {
+        case 'v': verify = 1; break;
+        case 'n': dry_run = 1; break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(argc - optind != 1)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    dir = argv[optind];
+
+    /* how many shards: they must all say the same */
+    if(!(dp = opendir(dir)))
+    {
+        perror(dir);
+        return 1;
+    }
+    while((d = readdir(dp)))
+        if(!strncmp(d->d_name, SHARD_PREFIX, strlen(SHARD_PREFIX))
+           && sscanf(d->d_name + strlen(SHARD_PREFIX), "%d-of-%d", &shard, &n) == 2
+           && !strstr(d->d_name, ".tmp"))
+        {
+            if(nshards && n != nshards)
+            {
+                fprintf(stderr, "%s: manifests from runs of %d and %d shards; remove the stale ones\n",
+                        dir, nshards, n);
+                return 1;
+            }
+            nshards = n;
+        }
+    closedir(dp);
+    if(nshards < 1)
+    {
+        fprintf(stderr, "%s: no shard manifests\n", dir);
+        return 1;
+    }
+
+    /* read them all, and the directory's own (older) one, into all */
+    if(!(shards = calloc(nshards + 1, sizeof(*shards))))
+    {
+        perror("calloc");
+        return 1;
+    }
+    for(s = 0; s <= nshards; ++s)
+    {
+        if(s < nshards)
+            snprintf(path, sizeof(path), "%s/%s%d-of-%d", dir, SHARD_PREFIX, s + 1, nshards);
+        else
+            snprintf(path, sizeof(path), "%s/%s", dir, VRP_MANIFEST_NAME);
+        if(vrp_manifest_read(&shards[s], path, &err) < 0)
+        {
+            fprintf(stderr, "%s\n", err.message);
+            return 1;
+        }
+        if(s < nshards && access(path, F_OK) < 0)
+        {
+            fprintf(stderr, "%s: missing (shard %d of %d never ran?)\n", path, s + 1, nshards);
+            ret = 1;
+        }
+        count += shards[s].count;
+    }
+    if(!(all = malloc((count ? count : 1) * sizeof(*all))))
+    {
+        perror("malloc");
+        return 1;
+    }
+    count = 0;
+    for(s = nshards; s >= 0; --s) /* (the shards' lines win) */
+        for(i = 0; i < shards[s].count; ++i)
+        {
+            all[count] = shards[s].entries[i];
+            all[count].line = count;
+            ++count;
+        }
+
+    /* the latest of each, sorted by file, is the merged manifest */
+    memset(&merged, 0, sizeof(merged));
+    merged.entries = all;
+    merged.count = count;
+    vrp_manifest_sort(&merged);
+    snprintf(path, sizeof(path), "%s/%s", dir, VRP_MANIFEST_NAME);
+    if(!dry_run && vrp_manifest_write(&merged, path, &err) < 0)
+    {
+        fprintf(stderr, "%s\n", err.message);
+        return 1;
+    }
+
+    /* every plan: each shard's share of each cine, which between
+     * them must be all of it, and all of it there */
+    for(s = 0; s < nshards; ++s)
+        for(k = 0; k < shards[s].nplans; ++k)
+        {
+            const VRP_ManifestPlan *p = &shards[s].plans[k];
+            int                    t, assigned = 0, seen = 0, done = 0, missing;
+
+            /* each source and format once: at its first appearance */
+            for(t = 0; t < s && !seen; ++t)
+                for(i = 0; i < shards[t].nplans && !seen; ++i)
+                    seen = !strcmp(shards[t].plans[i].source, p->source)
+                        && !strcmp(shards[t].plans[i].format, p->format);
+            for(i = 0; i < k && !seen; ++i)
+                seen = !strcmp(shards[s].plans[i].source, p->source)
+                    && !strcmp(shards[s].plans[i].format, p->format);
+            if(seen)
+                continue;
+
+            for(t = 0; t < nshards; ++t)
+            {
+                const VRP_ManifestPlan *q = NULL;
+                int                    have = 0;
+
+                for(i = 0; i < shards[t].nplans && !q; ++i)
+                    if(!strcmp(shards[t].plans[i].source, p->source) && !strcmp(shards[t].plans[i].format, p->format))
+                        q = &shards[t].plans[i];
+                if(!q)
+                {
+                    printf("%s %s: shard %d of %d didn't get to it\n", p->source, p->format, t + 1, nshards);
+                    ret = 1;
+                    continue;
+                }
+                if(q->total != p->total)
+                {
+                    printf("%s %s: shards %d and %d disagree on how many images there are (%d, %d)\n",
+                           p->source, p->format, s + 1, t + 1, p->total, q->total);
+                    ret = 1;
+                }
+                assigned += q->assigned;
+
+                for(i = 0; i < shards[t].count; ++i)
+                    if(!strcmp(shards[t].entries[i].source, p->source)
+                       && !strcmp(shards[t].entries[i].format, p->format))
+                        ++have;
+                if(have < q->assigned)
+                {
+                    printf("%s %s: shard %d of %d recorded %d of its %d images\n", p->source, p->format,
+                           t + 1, nshards, have, q->assigned);
+                    ret = 1;
+                }
+            }
+            if(assigned != p->total)
+            {
+                printf("%s %s: the shards were given %d images between them, not %d\n",
+                       p->source, p->format, assigned, p->total);
+                ret = 1;
+            }
+
+            for(i = 0; i < merged.count; ++i)
+                if(!strcmp(merged.entries[i].source, p->source) && !strcmp(merged.entries[i].format, p->format)
+                   && vrp_manifest_present(&merged.entries[i], dir, verify))
+                    ++done;
+            missing = p->total - done;
+            printf("%s %s: %d of %d images%s\n", p->source, p->format, done, p->total,
+                   missing > 0 ? "" : ", complete");
+            if(missing > 0)
+                ret = 1;
+        }
+
+    if(ret && !dry_run)
+        printf("(run cine-extract on %s again, unsharded, to fill the gaps)\n", dir);
+    for(s = 0; s <= nshards; ++s)
+        vrp_manifest_close(&shards[s], NULL);
+    free(shards);
+    free(all);
+    return ret;
+}
@@ -0,0 +1,697 @@
+/*
+ * cine-mount.c -- mount a CINE file as a read-only directory of
+ * images, each decoded only when it's read
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#define _GNU_SOURCE /* open_memstream() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h> /* getopt() */
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <linux/fuse.h>
+
+#include "vrptools.h"
+
+/* For tools that only take a directory of images: the cine shows up
+ * as one, img-NNNNN.ppm (or .tif, with -f tiff) per frame, named as
+ * cine-extract names them, with no image written anywhere.  Listing
+ * the directory and stat()ing the files takes only the headers -- the
+ * files' sizes are the same for every frame -- and a frame is decoded
+ * when one of its bytes is first read, into a cache of whole files
+ * bounded by -m megabytes.  When frames are being read in order, the
+ * next -a are decoded ahead by -j background threads.
+ *
+ * Rather than depend on libfuse, this talks the kernel's FUSE protocol
+ * (linux/fuse.h) itself: the handful of operations a read-only
+ * directory needs are simple, a request and a reply each, read from
+ * and written to /dev/fuse by -j threads at once.  It mounts with
+ * mount(2) when run as root, or else through fusermount3 (or
+ * fusermount), as libfuse would; it runs until interrupted or
+ * unmounted (fusermount3 -u), and unmounts on the way out. */
+
+#define ROOT_ID      FUSE_ROOT_ID
+#define ID(offset)   ((offset) + 2)       /* node ids of the frames */
+#define OFFSET(id)   ((int)(id) - 2)
+#define MAX_WRITE    (128 << 10)
+#define BUFFER_SIZE  (MAX_WRITE + 4096)
+
+enum { FORMAT_PPM, FORMAT_TIFF };
+VRP_Handle      handle;
+int             format = FORMAT_PPM, gray, ahead = 8, fuse_fd = -1;
+const char      *suffix = "ppm";
+size_t          file_size;                  /* of every frame's file */
+struct fuse_attr dir_attr, file_attr;        /* file_attr's ino to be filled in */
+VRP_Cache       *cache;                     /* frames' files, by offset */
+int             last = -2;                  /* the frame read most recently */
+pthread_mutex_t last_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-f ppm|tiff] [-m cache-MB] [-a frames-ahead] [-j threads]\n"
+            "          file.cine mountpoint\n"
+            "  (monochrome cines show up as PGM rather than PPM; -j 0, the default, is one\n"
+            "  thread per CPU)\n", name);
+}
+
+/** making the files **/
+
+/* render - the whole image file of frame offset, in a buffer that's
+ * ours to free; returns its size, or 0 on failure */
+size_t render(int offset, char **data)
+{
+    VRP_Error err;
+    void      *pixels = NULL;
+    size_t    pixsize = 0, size = 0;
+    FILE      *out;
+    int       rows, cols, depth = 16, ret, maxval = handle->imageHeader->biClrImportant;
+    char      header[64];
+    int       hlen;
+
+    *data = NULL;
+    if(gray)
+    {
+        ret = vrp_extract_gray(handle, offset, 1, &rows, &cols, &pixels, &pixsize, &err);
+        depth = handle->imageHeader->biBitCount == 8 ? 8 : 16;
+    }
+    else
+        ret = vrp_extract_image(handle, offset, &rows, &cols, (uint16_t **)&pixels, &pixsize, &err);
+    if(ret < 0)
+    {
+        fprintf(stderr, "%s\n", err.message);
+        free(pixels);
+        return 0;
+    }
+
+    if(format == FORMAT_TIFF)
+    {
+        if(!(out = open_memstream(data, &size)))
+            ret = -1;
+        else
+        {
+            ret = gray ? vrp_write_tiff_gray(out, pixels, depth, rows, cols, maxval, VRP_TIFF_NONE, 0, 1)
+                : vrp_write_tiff(out, pixels, rows, cols, maxval, VRP_TIFF_NONE, 0, 1);
+            if(fclose(out))
+                ret = -1;
+        }
+    }
+    else
+    {
+        /* as cine-extract writes them */
+        if(gray)
+            hlen = snprintf(header, sizeof(header), "P5\n%d %d\n%d\n", cols, rows,
+                            (!maxval || maxval > 1 << depth ? 1 << depth : maxval) - 1);
+        else
+            hlen = snprintf(header, sizeof(header), "P6\n%d %d\n%d\n", cols, rows, maxval);
+        size = hlen + (gray ? (size_t)rows * cols * depth / 8 : (size_t)rows * cols * 6);
+        if(!(*data = malloc(size)))
+            ret = -1;
+        else
+        {
+            memcpy(*data, header, hlen);
+            memcpy(*data + hlen, pixels, size - hlen);
+        }
+    }
+    free(pixels);
+
+    if(ret < 0 || size != file_size)
+    {
+        fprintf(stderr, "%s: frame at offset %d came to %zu bytes, not %zu\n",
+                handle->name, offset, ret < 0 ? 0 : size, file_size);
+        free(*data);
+        *data = NULL;
+        return 0;
+    }
+    return size;
+}
+
+/* the size every frame's file comes to: PPM and PGM by arithmetic,
+ * uncompressed TIFF by writing one of a blank image */
+size_t frame_file_size(void)
+{
+    int    rows = abs(handle->imageHeader->biHeight), cols = handle->imageHeader->biWidth;
+    int    maxval = handle->imageHeader->biClrImportant, depth = handle->imageHeader->biBitCount == 8 ? 8 : 16;
+    size_t size = 0;
+    char   header[64], *data = NULL;
+    void   *blank;
+    FILE   *out;
+
+    if(format == FORMAT_PPM)
+    {
+        if(gray)
+            return snprintf(header, sizeof(header), "P5\n%d %d\n%d\n", cols, rows,
+                            (!maxval || maxval > 1 << depth ? 1 << depth : maxval) - 1)
+                + (size_t)rows * cols * depth / 8;
+        return snprintf(header, sizeof(header), "P6\n%d %d\n%d\n", cols, rows, maxval)
+            + (size_t)rows * cols * 6;
+    }
+
+    if(!(blank = calloc((size_t)rows * cols, gray ? 2 : 6)) || !(out = open_memstream(&data, &size)))
+    {
+        free(blank);
+        return 0;
+    }
+    if(((gray ? vrp_write_tiff_gray(out, blank, depth, rows, cols, maxval, VRP_TIFF_NONE, 0, 1)
+         : vrp_write_tiff(out, blank, rows, cols, maxval, VRP_TIFF_NONE, 0, 1)) < 0) | fclose(out))
+        size = 0;
+    free(data);
+    free(blank);
+    return size;
+}
+
+/* produce - make frame *key's file (for the cache)
+ *
+ * returns 0, or -1 if it can't be made. */
+int produce(VRP_CacheEntry *e, void *arg)
+{
+    (void)arg;
+    return (e->size = render(*(const int *)e->key, (char **)&e->data)) ? 0 : -1;
+}
+
+/** prefetching **/
+
+/* note a read of frame offset, and if it follows on from the one
+ * before, have the ones after it made */
+void prefetch_from(int offset)
+{
+    int i, n = 0, keys[VRP_CACHE_AHEAD];
+
+    pthread_mutex_lock(&last_lock);
+    if(offset != last)
+    {
+        if(offset == last + 1)
+        {
+            for(i = offset + 1; i <= offset + ahead && i < (int)handle->header->ImageCount; ++i)
+                keys[n++] = i;
+            vrp_cache_prefetch(cache, keys, n);
+        }
+        last = offset;
+    }
+    pthread_mutex_unlock(&last_lock);
+}
+
+/** the FUSE protocol **/
+
+/* reply - answer request unique with error (a negative errno, or 0)
+ * and len bytes of data */
+void reply(uint64_t unique, int error, const void *data, size_t len)
+{
+    struct fuse_out_header out;
+    struct iovec           iov[2];
+
+    out.len = sizeof(out) + (error ? 0 : len);
+    out.error = error;
+    out.unique = unique;
+    iov[0].iov_base = &out;
+    iov[0].iov_len = sizeof(out);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = error ? 0 : len;
+    /* (ENOENT: the request was interrupted, and no longer wanted) */
+    if(writev(fuse_fd, iov, 2) < 0 && errno != ENOENT)
+        perror("/dev/fuse");
+}
+
+/* the node id of name in the root, or 0 */
+uint64_t lookup(const char *name)
+{
+    char     *end;
+    unsigned long offset;
+
+    if(strncmp(name, "img-", 4) || name[4] < '0' || name[4] > '9')
+        return 0;
+    offset = strtoul(name + 4, &end, 10);
+    if(end - name < 9 || *end != '.' || strcmp(end + 1, suffix) || offset >= handle->header->ImageCount)
+        return 0;
+    /* (only the name cine-extract would give it) */
+    if(end - name > 9 && name[4] == '0')
+        return 0;
+    return ID(offset);
+}
+
+int get_attr(uint64_t id, struct fuse_attr *attr)
+{
+    if(id == ROOT_ID)
+        *attr = dir_attr;
+    else if(id >= ID(0) && id < ID(handle->header->ImageCount))
+    {
+        *attr = file_attr;
+        attr->ino = id;
+    }
+    else
+        return -ENOENT;
+    return 0;
+}
+
+/* list_dir - as many entries as fit in size, from the offset'th ("."
+ * and ".." first) */
+size_t list_dir(uint64_t offset, uint32_t size, char *buf)
+{
+    struct fuse_dirent *d;
+    size_t             len = 0, reclen;
+    uint64_t           count = handle->header->ImageCount + 2;
+    char               name[32];
+
+    for(; offset < count; ++offset)
+    {
+        if(offset < 2)
+            strcpy(name, offset ? ".." : ".");
+        else
+            snprintf(name, sizeof(name), "img-%05u.%s", (unsigned)offset - 2, suffix);
+        reclen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + strlen(name));
+        if(len + reclen > size)
+            break;
+
+        d = (struct fuse_dirent *)(buf + len);
+        memset(d, 0, reclen);
+        d->ino = offset < 2 ? ROOT_ID : ID(offset - 2);
+        d->off = offset + 1;
+        d->namelen = strlen(name);
+        d->type = offset < 2 ? S_IFDIR >> 12 : S_IFREG >> 12;
+        memcpy(d->name, name, d->namelen);
+        len += reclen;
+    }
+    return len;
+}
+
+/* read_file - answer a read of size bytes at pos of a frame's file */
+void read_file(uint64_t unique, uint64_t id, uint64_t pos, uint32_t size)
+{
+    VRP_CacheEntry *e;
+    int            offset = OFFSET(id);
+
+    if(id < ID(0) || id >= ID(handle->header->ImageCount))
+    {
+        reply(unique, -ENOENT, NULL, 0);
+        return;
+    }
+    if(pos >= file_size)
+    {
+        reply(unique, 0, NULL, 0);
+        return;
+    }
+    prefetch_from(offset);
+    if(!(e = vrp_cache_get(cache, &offset, 0, NULL)))
+    {
+        reply(unique, -EIO, NULL, 0);
+        return;
+    }
+    if(size > file_size - pos)
+        size = file_size - pos;
+    reply(unique, 0, (char *)e->data + pos, size);
+    vrp_cache_release(cache, e);
+}
+
+/* serve - answer requests until unmounted */
+void *serve(void *arg)
+{
+    char                   *buf;
+    ssize_t                n;
+    struct fuse_in_header  *in;
+    void                   *body;
+
+    (void)arg;
+    if(!(buf = malloc(BUFFER_SIZE)))
+    {
+        perror("malloc");
+        return NULL;
+    }
+    in = (struct fuse_in_header *)buf;
+    body = buf + sizeof(*in);
+
+    for(;;)
+    {
+        if((n = read(fuse_fd, buf, BUFFER_SIZE)) < 0)
+        {
+            if(errno == EINTR || errno == EAGAIN || errno == ENOENT)
+                continue;
+            if(errno != ENODEV) /* (ENODEV: unmounted) */
+                perror("/dev/fuse");
+            break;
+        }
+        if((size_t)n < sizeof(*in))
+            continue;
+
+        switch(in->opcode)
+        {
+        case FUSE_INIT:
+        {
+            const struct fuse_init_in *init = body;
+            struct fuse_init_out      out;
+
+            memset(&out, 0, sizeof(out));
+            out.major = FUSE_KERNEL_VERSION;
+            out.minor = FUSE_KERNEL_MINOR_VERSION;
+            if(init->major != FUSE_KERNEL_VERSION)
+            {
+                /* the kernel will come back with the version we said */
+                reply(in->unique, 0, &out, 8);
+                break;
+            }
+            out.max_readahead = init->max_readahead;
+            out.flags = init->flags & (FUSE_ASYNC_READ | FUSE_MAX_PAGES);
+            out.max_background = 16;
+            out.congestion_threshold = 12;
+            out.max_write = MAX_WRITE;
+            out.time_gran = 1;
+            out.max_pages = MAX_WRITE / 4096;
+            reply(in->unique, 0, &out, init->minor < 23 ? FUSE_COMPAT_22_INIT_OUT_SIZE : sizeof(out));
+            break;
+        }
+        case FUSE_LOOKUP:
+        {
+            struct fuse_entry_out out;
+
+            memset(&out, 0, sizeof(out));
+            if(in->nodeid != ROOT_ID || !(out.nodeid = lookup(body)))
+            {
+                reply(in->unique, -ENOENT, NULL, 0);
+                break;
+            }
+            out.entry_valid = out.attr_valid = 3600; /* (nothing changes) */
+            get_attr(out.nodeid, &out.attr);
+            reply(in->unique, 0, &out, sizeof(out));
+            break;
+        }
+        case FUSE_GETATTR:
+        {
+            struct fuse_attr_out out;
+            int                  error;
+
+            memset(&out, 0, sizeof(out));
+            out.attr_valid = 3600;
+            error = get_attr(in->nodeid, &out.attr);
+            reply(in->unique, error, &out, sizeof(out));
+            break;
+        }
+        case FUSE_OPEN:
+        case FUSE_OPENDIR:
+        {
+            const struct fuse_open_in *open_in = body;
+            struct fuse_open_out      out;
+
+            memset(&out, 0, sizeof(out));
+            /* the files never change, so their pages can stay cached */
+            out.open_flags = in->opcode == FUSE_OPEN ? FOPEN_KEEP_CACHE : FOPEN_CACHE_DIR;
+            if((open_in->flags & O_ACCMODE) != O_RDONLY)
+                reply(in->unique, -EROFS, NULL, 0);
+            else if((in->opcode == FUSE_OPENDIR) != (in->nodeid == ROOT_ID))
+                reply(in->unique, in->opcode == FUSE_OPEN ? -EISDIR : -ENOTDIR, NULL, 0);
+            else
+                reply(in->unique, 0, &out, sizeof(out));
+            break;
+        }
+        case FUSE_READDIR:
+        {
+            const struct fuse_read_in *read_in = body;
+            char                      *out = malloc(read_in->size);
+
+            if(!out)
+                reply(in->unique, -ENOMEM, NULL, 0);
+            else
+                reply(in->unique, 0, out, list_dir(read_in->offset, read_in->size, out));
+            free(out);
+            break;
+        }
+        case FUSE_READ:
+        {
+            const struct fuse_read_in *read_in = body;
+
+            read_file(in->unique, in->nodeid, read_in->offset, read_in->size);
+            break;
+        }
+        case FUSE_STATFS:
+        {
+            struct fuse_statfs_out out;
+
+            memset(&out, 0, sizeof(out));
+            out.st.bsize = out.st.frsize = 4096;
+            out.st.blocks = (file_size * handle->header->ImageCount + 4095) / 4096;
+            out.st.files = handle->header->ImageCount + 1;
+            out.st.namelen = 255;
+            reply(in->unique, 0, &out, sizeof(out));
+            break;
+        }
+        case FUSE_RELEASE:
+        case FUSE_RELEASEDIR:
+        case FUSE_FLUSH:
+        case FUSE_DESTROY:
+            reply(in->unique, 0, NULL, 0);
+            break;
+        case FUSE_FORGET:
+        case FUSE_BATCH_FORGET:
+        case FUSE_INTERRUPT:
+            break; /* (no reply: nodes are forever, reads are quick) */
+        default:
+            reply(in->unique, -ENOSYS, NULL, 0);
+            break;
+        }
+    }
+
+    free(buf);
+    kill(getpid(), SIGHUP); /* (to have main() clean up) */
+    return NULL;
+}
+
+/** mounting **/
+
+/* run fusermount3 (or, failing that, fusermount) with args; with
+ * commfd >= 0, it's told to send the /dev/fuse descriptor back on it */
+int fusermount(const char *const *args, int commfd)
+{
+    static const char *const programs[] = { "fusermount3", "fusermount" };
+    pid_t                    pid;
+    char                     env[32];
+    const char               *argv[8];
+    int                      i, status;
+
+    if((pid = fork()) < 0)
+        return -1;
+    if(pid == 0)
+    {
+        if(commfd >= 0)
+        {
+            snprintf(env, sizeof(env), "%d", commfd);
+            setenv("_FUSE_COMMFD", env, 1);
+        }
+        for(i = 0; args[i] && i < 6; ++i)
+            argv[i + 1] = args[i];
+        argv[i + 1] = NULL;
+        for(i = 0; i < 2; ++i)
+        {
+            argv[0] = programs[i];
+            execvp(programs[i], (char *const *)argv);
+        }
+        _exit(127);
+    }
+    while(waitpid(pid, &status, 0) < 0)
+        if(errno != EINTR)
+            return -1;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/* mount_fuse - mount our file system on mountpoint; returns the
+ * /dev/fuse descriptor to serve it on, or -1 */
+int mount_fuse(const char *mountpoint, const char *source)
+{
+    char           opts[256], control[CMSG_SPACE(sizeof(int))], byte;
+    const char     *args[6];
+    struct msghdr  msg;
+    struct iovec   iov;
+    struct cmsghdr *cmsg;
+    int            fd, pair[2];
+
+    if(geteuid() == 0)
+    {
+        if((fd = open("/dev/fuse", O_RDWR | O_CLOEXEC)) < 0)
+        {
+            perror("/dev/fuse");
+            return -1;
+        }
+        snprintf(opts, sizeof(opts), "fd=%d,rootmode=40000,user_id=0,group_id=0,default_permissions", fd);
+        if(mount(source, mountpoint, "fuse.cine", MS_RDONLY | MS_NOSUID | MS_NODEV, opts) < 0)
+        {
+            perror(mountpoint);
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    /* as libfuse does it: fusermount opens /dev/fuse, mounts it, and
+     * passes it back to us over a socket */
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+    {
+        perror("socketpair");
+        return -1;
+    }
+    snprintf(opts, sizeof(opts), "ro,nosuid,nodev,default_permissions,subtype=cine,fsname=%s", source);
+    args[0] = "-o";
+    args[1] = opts;
+    args[2] = "--";
+    args[3] = mountpoint;
+    args[4] = NULL;
+    if(fusermount(args, pair[0]) < 0)
+    {
+        fprintf(stderr, "%s: fusermount3 failed\n", mountpoint);
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    close(pair[0]);
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    fd = -1;
+    if(recvmsg(pair[1], &msg, 0) > 0 && (cmsg = CMSG_FIRSTHDR(&msg))
+       && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+    close(pair[1]);
+    if(fd < 0)
+        fprintf(stderr, "%s: fusermount3 didn't pass back /dev/fuse\n", mountpoint);
+    return fd;
+}
+
+void unmount_fuse(const char *mountpoint)
+{
+    const char *args[] = { "-u", "-z", "--", mountpoint, NULL };
+
+    if(geteuid() == 0)
+        umount2(mountpoint, MNT_DETACH);
+    else
+        fusermount(args, -1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct stat st;
+    sigset_t    signals;
+    pthread_t   thread;
+    VRP_Error   err;
+    const char  *mountpoint;
+    long        megabytes = 256;
+    int         i, sig, threads = 0;
+
+    while((i = getopt(argc, argv, "f:m:a:j:")) != -1)
+    {
+        switch(i)
+        {
+        case 'f':
+            if(!strcmp(optarg, "ppm"))
+                format = FORMAT_PPM;
+            else if(!strcmp(optarg, "tiff") || !strcmp(optarg, "tif"))
+                format = FORMAT_TIFF;
+            else
+            {
+                fprintf(stderr, "%s: unknown format \"%s\"\n", argv[0], optarg);
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'm': megabytes = atol(optarg); break;
+        case 'a': ahead = atoi(optarg); break;
+        case 'j': threads = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(argc - optind != 2 || megabytes < 1 || ahead < 0 || ahead > VRP_CACHE_AHEAD || threads < 0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    mountpoint = argv[optind + 1];
+    if(!threads)
+        threads = vrp_default_threads();
+
+    if(!(handle = vrp_open(argv[optind], &err)))
+    {
+        fprintf(stderr, "%s\n", err.message);
+        fprintf(stderr, "Failed to get handle on %s\n", argv[optind]);
+        return 1;
+    }
+    vrp_print_open_warnings(stderr, handle, &err);
+    if(!handle->imageHeader || fstat(handle->fd, &st) < 0)
+    {
+        fprintf(stderr, "%s: no image header\n", argv[optind]);
+        return 1;
+    }
+    gray = vrp_is_gray(handle);
+    suffix = format == FORMAT_TIFF ? "tif" : gray ? "pgm" : "ppm";
+    if(!(file_size = frame_file_size()))
+    {
+        fprintf(stderr, "%s: can't work out the size of its images\n", argv[optind]);
+        return 1;
+    }
+    if(!(cache = vrp_cache_new(sizeof(int), (size_t)megabytes << 20, produce, NULL, NULL)))
+    {
+        perror("vrp_cache_new");
+        return 1;
+    }
+
+    /* everything is as old as the cine, and ours */
+    memset(&dir_attr, 0, sizeof(dir_attr));
+    dir_attr.ino = ROOT_ID;
+    dir_attr.mode = S_IFDIR | 0555;
+    dir_attr.nlink = 2;
+    dir_attr.uid = getuid();
+    dir_attr.gid = getgid();
+    dir_attr.atime = dir_attr.mtime = dir_attr.ctime = st.st_mtime;
+    dir_attr.blksize = 4096;
+    file_attr = dir_attr;
+    file_attr.mode = S_IFREG | 0444;
+    file_attr.nlink = 1;
+    file_attr.size = file_size;
+    file_attr.blocks = (file_size + 511) / 512;
+
+    if((fuse_fd = mount_fuse(mountpoint, argv[optind])) < 0)
+        return 1;
+
+    /* the threads leave the signals to us */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    for(i = 0; i < threads; ++i)
+        if(pthread_create(&thread, NULL, serve, NULL) != 0)
+        {
+            perror("pthread_create");
+            unmount_fuse(mountpoint);
+            return 1;
+        }
+    if(ahead && vrp_cache_start(cache, threads) < 0)
+    {
+        perror("pthread_create");
+        unmount_fuse(mountpoint);
+        return 1;
+    }
+
+    /* until interrupted, or unmounted (see serve()) */
+    sigwait(&signals, &sig);
+    unmount_fuse(mountpoint);
+    return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * cine-pack.c -- losslessly compress a raw CINE file (see lib/pack.c)
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h> /* getopt() */
+
+#include "vrptools.h"
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-g group-size] [-j threads] input.cine output.cinpk\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    VRP_Handle handle;
+    VRP_Error  err;
+    int        i, fd, group_size = 8, threads = 0, ret;
+
+    while((i = getopt(argc, argv, "g:j:")) != -1)
+    {
+        switch(i)
+        {
+        case 'g': group_size = atoi(optarg); break;
+        case 'j': threads = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if(argc - optind != 2)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if(!(handle = vrp_open(argv[optind], &err)))
+    {
+        fprintf(stderr, "%s\n", err.message);
+        fprintf(stderr, "Failed to get handle on %s\n", argv[optind]);
+        return 1;
+    }
+    vrp_print_open_warnings(stderr, handle, &err);
+
+    if((fd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    {
+        perror(argv[optind + 1]);
+        free_cine_handle(handle);
+        return 1;
+    }
+
+    if((ret = vrp_pack_cine(handle, fd, group_size, threads, &err)) < 0)
+        fprintf(stderr, "%s\n", err.message);
+
+    if(close(fd) < 0)
+    {
+        perror(argv[optind + 1]);
+        ret = -1;
+    }
+    free_cine_handle(handle);
+
+    return ret < 0 ? 1 : 0;
+}
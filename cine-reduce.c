@@ -0,0 +1,257 @@
+/*
+ * cine-reduce.c -- reduce a range of frames to one: mean, median,
+ * maximum or minimum of each pixel
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#define _GNU_SOURCE /* memfd_create() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h> /* getopt() */
+#include <sys/mman.h>
+
+#include "vrptools.h"
+
+/* The reduction is done on the raw samples (see lib/reduce.c), so the
+ * result is itself a raw frame: written as a one-frame cine (.cine) or
+ * DNG (.dng) it stays that way; as .ppm, .tif or .png it's demosaiced
+ * first, just as cine-extract would. */
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-o mean|median|max|min] [-f first] [-l last] [-m megabytes]\n"
+            "          [-j threads] file.cine output.{cine,dng,ppm,tif,png}\n"
+            "  (-m bounds the working memory, default 256; medians of long ranges may\n"
+            "   take several passes to stay within it)\n", name);
+}
+
+/* write_cine - write the result as a one-frame cine on fd, with the
+ * source's headers; returns 0 or -1 */
+int write_cine(VRP_Handle handle, int first, const uint16_t *samples, size_t count, int fd)
+{
+    VRP_CINEFILEHEADER header = *handle->header;
+    VRP_Writer         *w;
+    VRP_Error          err;
+    uint8_t            *narrow = NULL;
+    const void         *pixels = samples;
+    size_t             i;
+    int                ret;
+
+    header.FirstImageNo = header.FirstMovieImage = handle->header->FirstImageNo + first;
+    header.TotalImageCount = 1;
+    if(handle->imageHeader->biBitCount == 8)
+    {
+        if(!(narrow = malloc(count)))
+        {
+            perror("malloc");
+            return -1;
+        }
+        for(i = 0; i < count; ++i)
+            narrow[i] = samples[i];
+        pixels = narrow;
+    }
+
+    if(!(w = vrp_writer_open(fd, &header, handle->imageHeader, handle->setup, 1, 0, &err)))
+        ret = -1;
+    else
+        ret = (vrp_writer_append(w, NULL, pixels, header.TriggerTime, 0, &err) < 0)
+            | (vrp_writer_close(w, &err) < 0) ? -1 : 0;
+    if(ret < 0)
+        fprintf(stderr, "%s\n", err.message);
+    free(narrow);
+    return ret;
+}
+
+/* write_image - demosaic the one-frame cine in fd and write it to
+ * name, as its extension says; returns 0 or -1 */
+int write_image(int fd, const char *name, int threads)
+{
+    const char *ext = strrchr(name, '.');
+    VRP_Handle handle;
+    VRP_Error  err;
+    uint16_t   *rgb = NULL;
+    size_t     size = 0;
+    int        rows, cols, outfd, maxval;
+    FILE       *out;
+    long       ret = 0;
+
+    if(!(handle = vrp_open_fd(fd, name, &err)))
+    {
+        fprintf(stderr, "%s\n", err.message);
+        return -1;
+    }
+    maxval = handle->imageHeader->biClrImportant;
+
+    if(ext && !strcmp(ext, ".dng"))
+    {
+        if((outfd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+        {
+            perror(name);
+            ret = -1;
+        }
+        else
+        {
+            if((ret = vrp_write_dng(handle, 0, outfd, &err)) < 0)
+                fprintf(stderr, "%s\n", err.message);
+            if(close(outfd) < 0 && ret == 0)
+            {
+                perror(name);
+                ret = -1;
+            }
+        }
+        free_cine_handle(handle);
+        return ret;
+    }
+
+    if(vrp_extract_image(handle, 0, &rows, &cols, &rgb, &size, &err) < 0)
+    {
+        fprintf(stderr, "%s\n", err.message);
+        free_cine_handle(handle);
+        return -1;
+    }
+    if(!(out = fopen(name, "wb")))
+    {
+        perror(name);
+        ret = -1;
+    }
+    else
+    {
+        if(ext && !strcmp(ext, ".ppm"))
+        {
+            fprintf(out, "P6\n%d %d\n%d\n", cols, rows, maxval);
+            fwrite(rgb, sizeof(uint16_t), 3 * (size_t)cols * rows, out);
+        }
+        else if(ext && (!strcmp(ext, ".tif") || !strcmp(ext, ".tiff")))
+            ret = vrp_write_tiff(out, rgb, rows, cols, maxval, VRP_TIFF_DEFLATE, 6, threads);
+        else
+            ret = vrp_write_png(out, rgb, rows, cols, maxval, 6, threads);
+        if(ret < 0 || ferror(out) | fclose(out))
+        {
+            fprintf(stderr, "%s: write failed\n", name);
+            ret = -1;
+        }
+    }
+
+    free(rgb);
+    free_cine_handle(handle);
+    return ret < 0 ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *ops[] = { "mean", "median", "max", "min" };
+    VRP_Handle        handle;
+    VRP_Error         err;
+    const char        *output, *ext;
+    uint16_t          *samples;
+    size_t            count;
+    long              megabytes = 256;
+    int               i, op = VRP_REDUCE_MEAN, first = 0, last = 0, threads = 0, fd, ret = 0;
+    int               have_first = 0, have_last = 0;
+
+    while((i = getopt(argc, argv, "o:f:l:m:j:")) != -1)
+    {
+        switch(i)
+        {
+        case 'o':
+            for(op = 0; op <= VRP_REDUCE_MIN && strcmp(optarg, ops[op]); ++op)
+                ;
+            if(op > VRP_REDUCE_MIN)
+            {
+                fprintf(stderr, "%s: unknown reduction \"%s\"\n", argv[0], optarg);
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'f': first = atoi(optarg); have_first = 1; break;
+        case 'l': last = atoi(optarg); have_last = 1; break;
+        case 'm': megabytes = atol(optarg); break;
+        case 'j': threads = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(argc - optind != 2 || megabytes < 1)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    output = argv[optind + 1];
+
+    if(!(handle = vrp_open(argv[optind], &err)))
+    {
+        fprintf(stderr, "%s\n", err.message);
+        fprintf(stderr, "Failed to get handle on %s\n", argv[optind]);
+        return 1;
+    }
+    vrp_print_open_warnings(stderr, handle, &err);
+    if(!handle->imageHeader || !handle->setup)
+    {
+        fprintf(stderr, "%s: no image header or setup to describe the result with\n", argv[optind]);
+        return 1;
+    }
+
+    /* -f and -l are as the camera numbers frames */
+    first = have_first ? first - handle->header->FirstImageNo : 0;
+    last = have_last ? last - handle->header->FirstImageNo : (int)handle->header->ImageCount - 1;
+    if(first < 0 || last >= (int)handle->header->ImageCount || first > last)
+    {
+        fprintf(stderr, "%s: frames %d through %d aren't all there\n", argv[optind],
+                first + handle->header->FirstImageNo, last + handle->header->FirstImageNo);
+        return 1;
+    }
+
+    count = (size_t)handle->imageHeader->biWidth * abs(handle->imageHeader->biHeight);
+    if(!(samples = malloc(count * sizeof(*samples))))
+    {
+        perror("malloc");
+        return 1;
+    }
+    if(vrp_reduce(handle, first, last - first + 1, op, (size_t)megabytes << 20, threads, samples, &err) < 0)
+    {
+        fprintf(stderr, "%s\n", err.message);
+        return 1;
+    }
+
+    /* a cine goes straight out; anything else goes through one in memory */
+    ext = strrchr(output, '.');
+    if(ext && !strcmp(ext, ".cine"))
+    {
+        if((fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+        {
+            perror(output);
+            return 1;
+        }
+        if(write_cine(handle, first, samples, count, fd) < 0 || close(fd) < 0)
+        {
+            fprintf(stderr, "%s: write failed\n", output);
+            ret = 1;
+        }
+    }
+    else if((fd = memfd_create("cine-reduce", MFD_CLOEXEC)) < 0)
+    {
+        perror("memfd_create");
+        ret = 1;
+    }
+    else
+    {
+        if(write_cine(handle, first, samples, count, fd) < 0 || write_image(fd, output, threads) < 0)
+            ret = 1;
+        close(fd);
+    }
+
+    free(samples);
+    free_cine_handle(handle);
+    return ret;
+}
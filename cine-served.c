@@ -0,0 +1,847 @@
+/*
+ * cine-served.c -- serve (decoded) frames of CINE files to local clients
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#define _GNU_SOURCE /* memfd_create(), accept4() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h> /* getopt() */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "vrptools.h"
+#include "util.h"
+
+/* A long-running process for tools that fetch the same frames over and
+ * over (e.g. while scrubbing back and forth): files are opened once and
+ * kept open, and the frames asked for are kept, decoded, in an LRU
+ * cache bounded by size (-m megabytes).  Each cached result lives in a
+ * memfd, so it's sent to the client straight from the kernel's pages
+ * (sendfile()); undemosaiced whole frames of unpacked files aren't
+ * cached at all, but sent straight from the file.  After each request
+ * the next -a frames in the direction the client is moving (by
+ * comparing with its previous request) are prefetched into the cache
+ * by -j background threads, so stepping through a file is answered
+ * from memory.
+ *
+ * Clients talk either over a Unix-domain socket (-s; the default), a
+ * line per request:
+ *
+ *   rgb <frame> [roi=x,y,w,h] [scale=n] <file>
+ *   raw <frame> [roi=x,y,w,h] <file>
+ *   info <file>
+ *   stats
+ *
+ * each answered with "OK <length> <width> <height> <format>\n" and
+ * length bytes of data, or "ERR <message>\n"; or over HTTP on
+ * 127.0.0.1 (-p port), with the same requests as
+ *
+ *   GET /rgb?frame=N&roi=x,y,w,h&scale=n&file=/path/to/file.cine
+ *
+ * and the width, height and format in X-Width, X-Height and X-Format
+ * headers.  Frame numbers are as the camera counts them (see cine-info);
+ * the roi is in picture coordinates (from the top left).  Formats are
+ *
+ *   rgb48be - demosaiced, as vrp_extract_image(): top row first,
+ *             big-endian; scale=n averages n by n boxes
+ *   raw8, raw16 - the samples as stored: bottom row first, in this
+ *             machine's byte order
+ *   text    - info and stats, as "name value" lines
+ *
+ * Anyone who can reach the socket can read any file we can, so the
+ * socket is made only for us (mode 0600), and HTTP is only on the
+ * loopback interface. */
+
+enum { KIND_RAW, KIND_RGB };
+
+/* an open file, kept for as long as we run */
+struct cine {
+    char            *path;
+    VRP_Handle      handle;
+    struct cine     *next;
+};
+
+/* what's asked for, which is also what it's cached by (byte by byte,
+ * so cleared before it's filled in) */
+struct key {
+    struct cine *cine;
+    int         kind, offset;
+    int         x, y, w, h, scale;
+};
+
+struct cine     *cines;
+pthread_mutex_t cines_lock = PTHREAD_MUTEX_INITIALIZER;
+int             ahead = 8, verbose = 0;
+VRP_Cache       *cache;
+size_t          cache_limit = 256 << 20;
+volatile sig_atomic_t stopping;
+
+struct conn {
+    int        fd, http, keepalive;
+    FILE       *in;
+    struct key last;   /* the previous frame request, for its direction */
+    int        have_last, direction;
+};
+
+struct args {
+    const char *cmd, *file;
+    int        frame, have_frame;
+    int        x, y, w, h, have_roi;
+    int        scale;
+};
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s socket] [-p port] [-m cache-MB] [-a frames-ahead] [-j threads] [-v]\n"
+            "          [file.cine ...]\n"
+            "  (files named are opened now, rather than when first asked for; the default\n"
+            "  socket is /tmp/cine-served-<uid>.sock)\n", name);
+}
+
+double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/** open files **/
+
+/* cine_get - the open file for path, opening it if need be
+ *
+ * returns NULL (with why in error) if it can't be opened.
+ */
+struct cine *cine_get(const char *path, char error[256])
+{
+    char        real[PATH_MAX];
+    struct cine *c;
+    VRP_Error   err;
+
+    if(!realpath(path, real))
+    {
+        snprintf(error, 256, "%.200s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cines_lock);
+    for(c = cines; c && strcmp(c->path, real); c = c->next)
+        ;
+    if(!c)
+    {
+        VRP_Handle handle = vrp_open(real, &err);
+
+        if(handle && (!handle->imageHeader || !handle->setup))
+        {
+            snprintf(err.message, sizeof(err.message), "%.200s: no image header or setup", real);
+            free_cine_handle(handle);
+            handle = NULL;
+        }
+        if(!handle)
+            snprintf(error, 256, "%s", err.message);
+        else if(!(c = calloc(1, sizeof(*c))) || !(c->path = strdup(real)))
+        {
+            snprintf(error, 256, "%.200s: out of memory", real);
+            free(c);
+            c = NULL;
+            free_cine_handle(handle);
+        }
+        else
+        {
+            c->handle = handle;
+            c->next = cines;
+            cines = c;
+            if(verbose)
+                fprintf(stderr, "opened %s\n", real);
+        }
+    }
+    pthread_mutex_unlock(&cines_lock);
+
+    return c;
+}
+
+/** making what's cached **/
+
+/* crop_scale_rgb - the roi of a whole demosaiced frame (cols wide),
+ * averaged down by scale */
+void crop_scale_rgb(const uint16_t *src, int cols, const struct key *k, uint16_t *dst)
+{
+    int      s = k->scale, ox, oy, i, j, c;
+    uint32_t sum[3];
+
+    for(oy = 0; oy < k->h / s; ++oy)
+        for(ox = 0; ox < k->w / s; ++ox)
+        {
+            sum[0] = sum[1] = sum[2] = 0;
+            for(j = 0; j < s; ++j)
+            {
+                const uint16_t *p = src + 3 * ((size_t)(k->y + oy * s + j) * cols + k->x + ox * s);
+
+                for(i = 0; i < s; ++i, p += 3)
+                    for(c = 0; c < 3; ++c)
+                        sum[c] += ntohs(p[c]);
+            }
+            for(c = 0; c < 3; ++c)
+                *dst++ = htons(sum[c] / (s * s));
+        }
+}
+
+/* produce - make what e's key asks for (for the cache)
+ *
+ * returns 0 on success, -1 (with why in e->error) on failure.
+ */
+int produce(VRP_CacheEntry *e, void *arg)
+{
+    const struct key *k = e->key;
+    VRP_Handle       handle = k->cine->handle;
+    int              rows = handle->imageHeader->biHeight, cols = handle->imageHeader->biWidth;
+    int              ret = 0;
+
+    (void)arg;
+    if(k->kind == KIND_RGB && (k->w != cols || k->h != rows || k->scale != 1))
+    {
+        /* cut from the whole frame, which is then cached too */
+        struct key     whole;
+        VRP_CacheEntry *base;
+
+        memcpy(&whole, k, sizeof(whole)); /* (padding and all) */
+        whole.x = whole.y = 0;
+        whole.w = cols;
+        whole.h = rows;
+        whole.scale = 1;
+        if(!(base = vrp_cache_get(cache, &whole, 0, e->error)))
+            return -1;
+
+        e->width = k->w / k->scale;
+        e->height = k->h / k->scale;
+        if((ret = vrp_cache_alloc(e, (size_t)e->width * e->height * 3 * sizeof(uint16_t))) == 0)
+            crop_scale_rgb(base->data, cols, k, e->data);
+        vrp_cache_release(cache, base);
+        return ret;
+    }
+
+    if(k->kind == KIND_RGB)
+    {
+        uint16_t  *buf;
+        size_t    bufsize;
+        VRP_Error err;
+
+        e->width = cols;
+        e->height = rows;
+        if(vrp_cache_alloc(e, (size_t)rows * cols * 3 * sizeof(uint16_t)) < 0)
+            return -1;
+        buf = e->data;
+        bufsize = e->size;
+
+        /* (demosaiced straight into the memfd) */
+        if((ret = vrp_extract_image(handle, k->offset, &rows, &cols, &buf, &bufsize, &err)) < 0)
+            snprintf(e->error, sizeof(e->error), "%s", err.message);
+        return ret;
+    }
+    else
+    {
+        size_t              bps = handle->imageHeader->biBitCount / 8, rowbytes = k->w * bps;
+        const unsigned char *pixels;
+        int                 r, start = rows - k->y - k->h; /* (stored bottom-up) */
+
+        e->width = k->w;
+        e->height = k->h;
+        if(vrp_cache_alloc(e, rowbytes * k->h) < 0)
+            return -1;
+
+        if(!(pixels = vrp_image_pixels(handle, k->offset)))
+        {
+            snprintf(e->error, sizeof(e->error), "%.200s: image at offset %d is missing or truncated",
+                     handle->name, k->offset);
+            ret = -1;
+        }
+        else
+            for(r = 0; r < k->h; ++r)
+                memcpy((unsigned char *)e->data + r * rowbytes,
+                       pixels + ((size_t)(start + r) * cols + k->x) * bps, rowbytes);
+        return ret;
+    }
+}
+
+/* whole undemosaiced frames of unpacked files are sent from the file */
+int direct(const struct key *k)
+{
+    VRP_Handle handle = k->cine->handle;
+
+    return k->kind == KIND_RAW && !handle->pack && k->x == 0 && k->y == 0
+        && k->w == handle->imageHeader->biWidth && k->h == handle->imageHeader->biHeight;
+}
+
+/** prefetching **/
+
+/* warm - for the prefetch threads: there's nothing to cache for direct
+ * keys, but we can get them read in */
+int warm(const void *key, void *arg)
+{
+    const struct key *k = key;
+    VRP_Handle       handle = k->cine->handle;
+    off_t            off;
+
+    (void)arg;
+    if(!direct(k))
+        return 0;
+    if((off = vrp_image_pixel_offset(handle, k->offset)) > 0)
+        posix_fadvise(handle->fd, off, vrp_image_size(handle), POSIX_FADV_WILLNEED);
+    return 1;
+}
+
+void prefetch_from(struct conn *c, const struct key *k)
+{
+    struct key keys[VRP_CACHE_AHEAD];
+    int        i, n = 0, offset, count = k->cine->handle->header->ImageCount;
+
+    /* the direction we're moving in: the same as last time unless the
+     * frame number says otherwise; forwards, to begin with */
+    if(!c->have_last || c->last.cine != k->cine || c->last.kind != k->kind || c->last.x != k->x
+       || c->last.y != k->y || c->last.w != k->w || c->last.h != k->h || c->last.scale != k->scale)
+        c->direction = 1;
+    else if(k->offset != c->last.offset)
+        c->direction = k->offset > c->last.offset ? 1 : -1;
+    c->last = *k;
+    c->have_last = 1;
+
+    for(i = 1; i <= ahead; ++i)
+    {
+        offset = k->offset + i * c->direction;
+        if(offset < 0 || offset >= count)
+            break;
+        memcpy(&keys[n], k, sizeof(*k));
+        keys[n++].offset = offset;
+    }
+    vrp_cache_prefetch(cache, keys, n);
+}
+
+/** talking to clients **/
+
+int send_all(int fd, const void *buf, size_t len, int flags)
+{
+    const char *p = buf;
+    ssize_t    n;
+
+    while(len)
+    {
+        if((n = send(fd, p, len, flags | MSG_NOSIGNAL)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* respond - send the header for length bytes of format */
+int respond(struct conn *c, int width, int height, const char *format, size_t length)
+{
+    char buf[512];
+    int  n;
+
+    if(c->http)
+        n = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                     "X-Width: %d\r\nX-Height: %d\r\nX-Format: %s\r\n%s\r\n",
+                     strcmp(format, "text") ? "application/octet-stream" : "text/plain", length,
+                     width, height, format, c->keepalive ? "" : "Connection: close\r\n");
+    else
+        n = snprintf(buf, sizeof(buf), "OK %zu %d %d %s\n", length, width, height, format);
+    return send_all(c->fd, buf, n, length ? MSG_MORE : 0);
+}
+
+int respond_error(struct conn *c, int status, const char *message)
+{
+    char buf[512];
+    int  n;
+
+    if(verbose)
+        fprintf(stderr, "error: %s\n", message);
+    if(c->http)
+        n = snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\n"
+                     "Content-Length: %zu\r\n%s\r\n%s\n", status,
+                     status == 400 ? "Bad Request" : status == 404 ? "Not Found" : "Internal Server Error",
+                     strlen(message) + 1, c->keepalive ? "" : "Connection: close\r\n", message);
+    else
+        n = snprintf(buf, sizeof(buf), "ERR %s\n", message);
+    return send_all(c->fd, buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf) - 1, 0);
+}
+
+int respond_text(struct conn *c, const char *text)
+{
+    size_t len = strlen(text);
+
+    if(respond(c, 0, 0, "text", len) < 0)
+        return -1;
+    return send_all(c->fd, text, len, 0);
+}
+
+int serve_frame(struct conn *c, const struct args *a)
+{
+    char           error[256];
+    struct cine    *cine;
+    struct key     k;
+    VRP_CacheEntry *e;
+    VRP_Handle     handle;
+    int            rows, cols, ret;
+    double         t = now_ms();
+
+    if(!a->file || !a->have_frame)
+        return respond_error(c, 400, "a frame and file are needed");
+    if(!(cine = cine_get(a->file, error)))
+        return respond_error(c, 404, error);
+    handle = cine->handle;
+    rows = handle->imageHeader->biHeight;
+    cols = handle->imageHeader->biWidth;
+
+    memset(&k, 0, sizeof(k));
+    k.cine = cine;
+    k.kind = strcmp(a->cmd, "raw") ? KIND_RGB : KIND_RAW;
+    k.offset = a->frame - handle->header->FirstImageNo;
+    k.x = a->have_roi ? a->x : 0;
+    k.y = a->have_roi ? a->y : 0;
+    k.w = a->have_roi ? a->w : cols;
+    k.h = a->have_roi ? a->h : rows;
+    k.scale = a->scale;
+
+    if(k.offset < 0 || k.offset >= (int)handle->header->ImageCount)
+    {
+        snprintf(error, sizeof(error), "%.160s: no frame %d (there are %d to %d)", cine->path, a->frame,
+                 handle->header->FirstImageNo, handle->header->FirstImageNo + handle->header->ImageCount - 1);
+        return respond_error(c, 404, error);
+    }
+    if(k.x < 0 || k.y < 0 || k.w < 1 || k.h < 1 || k.x + k.w > cols || k.y + k.h > rows)
+        return respond_error(c, 400, "roi must be within the frame");
+    if(k.scale < 1 || k.scale > k.w || k.scale > k.h || (k.kind == KIND_RAW && k.scale != 1))
+        return respond_error(c, 400, "bad scale (and raw frames can't be scaled)");
+    if(k.kind == KIND_RAW && handle->header->Compression == VRP_CC_JPEG)
+        return respond_error(c, 400, "JPEG-compressed frames have no raw samples to send");
+
+    if(direct(&k))
+    {
+        size_t size = vrp_image_size(handle);
+        off_t  off = vrp_image_pixel_offset(handle, k.offset);
+        const void *pixels = vrp_image_pixels(handle, k.offset);
+
+        if(!pixels || off <= 0)
+        {
+            snprintf(error, sizeof(error), "%.200s: frame %d is missing or truncated", cine->path, a->frame);
+            return respond_error(c, 404, error);
+        }
+        if(respond(c, cols, rows, handle->imageHeader->biBitCount == 8 ? "raw8" : "raw16", size) < 0)
+            return -1;
+        ret = copy_range_fd(handle->fd, off, c->fd, size, pixels);
+    }
+    else
+    {
+        if(!(e = vrp_cache_get(cache, &k, 0, error)))
+            return respond_error(c, 500, error);
+        ret = respond(c, e->width, e->height,
+                      k.kind == KIND_RGB ? "rgb48be" : handle->imageHeader->biBitCount == 8 ? "raw8" : "raw16",
+                      e->size);
+        if(ret == 0)
+            ret = copy_range_fd(e->fd, 0, c->fd, e->size, e->data);
+        vrp_cache_release(cache, e);
+    }
+
+    if(verbose)
+        fprintf(stderr, "%s %d %s: %.3f ms\n", a->cmd, a->frame, cine->path, now_ms() - t);
+    if(ret == 0 && ahead > 0)
+        prefetch_from(c, &k);
+    return ret;
+}
+
+int serve_info(struct conn *c, const struct args *a)
+{
+    char        error[256], text[PATH_MAX + 512];
+    struct cine *cine;
+    VRP_Handle  handle;
+
+    if(!a->file)
+        return respond_error(c, 400, "a file is needed");
+    if(!(cine = cine_get(a->file, error)))
+        return respond_error(c, 404, error);
+    handle = cine->handle;
+
+    snprintf(text, sizeof(text), "file %s\nwidth %d\nheight %d\nbits %d\nfirst %d\ncount %u\ncfa %u\npacked %d\n",
+             cine->path, handle->imageHeader->biWidth, handle->imageHeader->biHeight,
+             handle->imageHeader->biBitCount, handle->header->FirstImageNo, handle->header->ImageCount,
+             handle->setup->CFA, handle->pack != NULL);
+    return respond_text(c, text);
+}
+
+int serve_stats(struct conn *c)
+{
+    char           text[1024];
+    struct cine    *cine;
+    int            files = 0;
+    VRP_CacheStats stats;
+
+    pthread_mutex_lock(&cines_lock);
+    for(cine = cines; cine; cine = cine->next)
+        ++files;
+    pthread_mutex_unlock(&cines_lock);
+
+    vrp_cache_stats(cache, &stats);
+    snprintf(text, sizeof(text), "files %d\nentries %zu\nbytes %zu\nlimit %zu\nhits %lu\nmisses %lu\n"
+             "waits %lu\nprefetched %lu\nevictions %lu\n", files, stats.entries, stats.bytes, stats.limit,
+             stats.hits, stats.misses, stats.waits, stats.prefetched, stats.evictions);
+
+    return respond_text(c, text);
+}
+
+/* parse_roi - x,y,w,h into a */
+int parse_roi(const char *s, struct args *a)
+{
+    a->have_roi = 1;
+    return sscanf(s, "%d,%d,%d,%d", &a->x, &a->y, &a->w, &a->h) == 4 ? 0 : -1;
+}
+
+/* parse_line - a request of our own protocol, in place:
+ * cmd [frame] [roi=...] [scale=...] [file] */
+int parse_line(char *line, struct args *a)
+{
+    char *p = line, *word;
+
+    a->cmd = strsep(&p, " ");
+    if(p && (!strcmp(a->cmd, "rgb") || !strcmp(a->cmd, "raw")))
+    {
+        word = strsep(&p, " ");
+        a->frame = atoi(word);
+        a->have_frame = 1;
+        while(p && (!strncmp(p, "roi=", 4) || !strncmp(p, "scale=", 6)))
+        {
+            word = strsep(&p, " ");
+            if(*word == 'r' && parse_roi(word + 4, a) < 0)
+                return -1;
+            if(*word == 's')
+                a->scale = atoi(word + 6);
+        }
+    }
+    a->file = p && *p ? p : NULL; /* (the rest of the line, spaces and all) */
+    return 0;
+}
+
+/* url_decode - in place */
+void url_decode(char *s)
+{
+    char *out = s;
+    int  c;
+
+    for(; *s; ++s)
+    {
+        if(*s == '+')
+            *out++ = ' ';
+        else if(*s == '%' && s[1] && s[2] && sscanf(s + 1, "%2x", &c) == 1)
+        {
+            *out++ = c;
+            s += 2;
+        }
+        else
+            *out++ = *s;
+    }
+    *out = '\0';
+}
+
+/* parse_http - "GET /cmd?name=value&... HTTP/1.x", in place */
+int parse_http(char *line, struct args *a, struct conn *c)
+{
+    char *p = line, *target, *version, *query, *param, *value;
+
+    if(strcmp(strsep(&p, " "), "GET") || !(target = strsep(&p, " ")) || !(version = p) || *target != '/')
+        return -1;
+    c->keepalive = !strcmp(version, "HTTP/1.1");
+
+    query = target + 1;
+    a->cmd = strsep(&query, "?");
+    while(query && (param = strsep(&query, "&")))
+    {
+        if(!(value = strchr(param, '=')))
+            continue;
+        *value++ = '\0';
+        url_decode(value);
+        if(!strcmp(param, "file"))
+            a->file = value;
+        else if(!strcmp(param, "frame"))
+        {
+            a->frame = atoi(value);
+            a->have_frame = 1;
+        }
+        else if(!strcmp(param, "roi") && parse_roi(value, a) < 0)
+            return -1;
+        else if(!strcmp(param, "scale"))
+            a->scale = atoi(value);
+    }
+    return 0;
+}
+
+void *serve_conn(void *arg)
+{
+    struct conn *c = arg;
+    char        *line = NULL, *header = NULL;
+    size_t      linesize = 0, headersize = 0;
+    ssize_t     n;
+    struct args a;
+
+    c->keepalive = 1;
+    while(c->keepalive && (n = getline(&line, &linesize, c->in)) > 0)
+    {
+        int bad;
+
+        while(n && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+            line[--n] = '\0';
+        if(!n)
+            continue;
+
+        memset(&a, 0, sizeof(a));
+        a.scale = 1;
+        if(c->http)
+        {
+            bad = parse_http(line, &a, c);
+            /* (the request's headers: all we care about is Connection) */
+            while((n = getline(&header, &headersize, c->in)) > 0 && strcspn(header, "\r\n"))
+                if(!strncasecmp(header, "Connection:", 11))
+                {
+                    if(strcasestr(header, "close"))
+                        c->keepalive = 0;
+                    else if(strcasestr(header, "keep-alive"))
+                        c->keepalive = 1;
+                }
+        }
+        else
+            bad = parse_line(line, &a);
+
+        if(bad)
+            n = respond_error(c, 400, "bad request");
+        else if(!strcmp(a.cmd, "rgb") || !strcmp(a.cmd, "raw"))
+            n = serve_frame(c, &a);
+        else if(!strcmp(a.cmd, "info"))
+            n = serve_info(c, &a);
+        else if(!strcmp(a.cmd, "stats"))
+            n = serve_stats(c);
+        else
+            n = respond_error(c, 404, "unknown request (try rgb, raw, info or stats)");
+        if(n < 0)
+            break;
+    }
+
+    free(line);
+    free(header);
+    fclose(c->in); /* (which closes c->fd) */
+    free(c);
+    return NULL;
+}
+
+/** listening **/
+
+int listen_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    mode_t             mask;
+    int                fd, i;
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    /* a socket left behind by a server that's gone is ours to replace;
+     * one that's still answering isn't */
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        fprintf(stderr, "%s: already being served\n", path);
+        close(fd);
+        return -1;
+    }
+    if(errno == ECONNREFUSED)
+        unlink(path);
+
+    mask = umask(077); /* (so the socket is ours alone) */
+    i = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if(i < 0 || listen(fd, 64) < 0)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int listen_http(int port)
+{
+    struct sockaddr_in addr;
+    int                fd, on = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+       || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0
+       || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0)
+    {
+        fprintf(stderr, "127.0.0.1:%d: %s\n", port, strerror(errno));
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void on_signal(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    char             default_socket[64];
+    const char       *socket_path = NULL;
+    struct pollfd    listeners[2];
+    struct sigaction sa;
+    pthread_t        thread;
+    pthread_attr_t   detached;
+    char             error[256];
+    int              i, nlisteners = 0, port = 0, threads = vrp_default_threads();
+
+    while((i = getopt(argc, argv, "s:p:m:a:j:v")) != -1)
+    {
+        switch(i)
+        {
+        case 's': socket_path = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'm': cache_limit = (size_t)atol(optarg) << 20; break;
+        case 'a': ahead = atoi(optarg); break;
+        case 'j': threads = atoi(optarg); break;
+        case 'v': verbose = 1; break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(ahead < 0 || ahead > VRP_CACHE_AHEAD || threads < 1 || port < 0 || port > 65535)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    if(!socket_path && !port)
+    {
+        snprintf(default_socket, sizeof(default_socket), "/tmp/cine-served-%d.sock", (int)getuid());
+        socket_path = default_socket;
+    }
+    if(!(cache = vrp_cache_new(sizeof(struct key), cache_limit, produce, warm, NULL)))
+    {
+        perror("vrp_cache_new");
+        return 1;
+    }
+
+    for(i = optind; i < argc; ++i)
+        if(!cine_get(argv[i], error))
+            fprintf(stderr, "%s\n", error);
+
+    if(socket_path)
+    {
+        if((listeners[nlisteners].fd = listen_unix(socket_path)) < 0)
+            return 1;
+        listeners[nlisteners++].events = POLLIN;
+        fprintf(stderr, "serving on %s\n", socket_path);
+    }
+    if(port)
+    {
+        if((listeners[nlisteners].fd = listen_http(port)) < 0)
+        {
+            if(socket_path)
+                unlink(socket_path);
+            return 1;
+        }
+        listeners[nlisteners++].events = POLLIN;
+        fprintf(stderr, "serving on http://127.0.0.1:%d/\n", port);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal; /* (no SA_RESTART: poll() should stop) */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_attr_init(&detached);
+    pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+    if(ahead && vrp_cache_start(cache, threads) < 0)
+        perror("can't start prefetching");
+
+    while(!stopping)
+    {
+        if(poll(listeners, nlisteners, -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        for(i = 0; i < nlisteners; ++i)
+        {
+            struct conn *c;
+            int         fd, on = 1;
+
+            if(!(listeners[i].revents & POLLIN)
+               || (fd = accept4(listeners[i].fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+                continue;
+            if(!(c = calloc(1, sizeof(*c))) || !(c->in = fdopen(fd, "r")))
+            {
+                free(c);
+                close(fd);
+                continue;
+            }
+            c->fd = fd;
+            c->http = port && listeners[i].fd == listeners[nlisteners - 1].fd;
+            if(c->http)
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            if(pthread_create(&thread, &detached, serve_conn, c))
+            {
+                fclose(c->in);
+                free(c);
+            }
+        }
+    }
+
+    if(socket_path)
+        unlink(socket_path);
+    return 0;
+}
@@ -0,0 +1,367 @@
+/*
+ * cine-session.c -- extract the cines of a recording session together:
+ * the heads of a multi-head camera, or cameras slaved to a master,
+ * matched up frame by frame
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h> /* getopt() */
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#include "vrptools.h"
+
+/* The cines given are sorted into sessions (see lib/session.c): a
+ * session per take on each rig, its heads matched up by time.  Each
+ * session gets a directory under -d, session-<serial>-<take>, with a
+ * steps.csv saying which frame of each head makes up each step, and
+ * either a directory of images per head (named for its serial), or with
+ * -s one directory of the heads side by side, left to right, master
+ * first.  Images are numbered by step, so img-00042 of every head was
+ * taken at the same moment.  All the heads are worked on at once, step
+ * by step, by -j threads. */
+
+struct format {
+    const char *name, *suffix;
+} formats[] = {
+    { "ppm",  "ppm" },
+    { "png",  "png" },
+    { "tiff", "tif" },
+    { NULL, NULL }
+};
+
+struct job {
+    const struct format *format;
+    char                dir[4096]; /* the session's */
+    int                 maxval;    /* side by side: the largest of the heads' */
+    int                 quiet;
+    int                 failed;
+};
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-l] [-s] [-t seconds] [-f ppm|png|tiff] [-d dir] [-j threads] [-q]\n"
+            "          file.cine...\n"
+            "  (-l lists the sessions and how their heads line up, writing nothing; -s puts the\n"
+            "   heads of each step side by side in one image; -t is how far apart triggers\n"
+            "   may be within a take, default %g)\n", name, VRP_SESSION_TOLERANCE);
+}
+
+/* make_dir - mkdir, unless it's there already; 0, or -1 (having said why) */
+int make_dir(const char *path)
+{
+    if(mkdir(path, 0777) < 0 && errno != EEXIST)
+    {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/* write_image - an RGB48 image to path, by way of a temporary name */
+int write_image(const char *path, const struct format *format, const uint16_t *rgb, int rows, int cols,
+                int maxval)
+{
+    char tmp[4096 + 8];
+    FILE *out;
+    long ret = 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if(!(out = fopen(tmp, "wb")))
+    {
+        perror(tmp);
+        return -1;
+    }
+    if(!strcmp(format->name, "ppm"))
+    {
+        fprintf(out, "P6\n%d %d\n%d\n", cols, rows, maxval);
+        fwrite(rgb, sizeof(uint16_t), 3 * (size_t)rows * cols, out);
+    }
+    else if(!strcmp(format->name, "tiff"))
+        ret = vrp_write_tiff(out, rgb, rows, cols, maxval, VRP_TIFF_DEFLATE, 6, 1);
+    else
+        ret = vrp_write_png(out, rgb, rows, cols, maxval, 6, 1);
+
+    if(ret < 0 || (ferror(out) | fclose(out)) || rename(tmp, path) < 0)
+    {
+        fprintf(stderr, "%s: write failed\n", path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* head_image - (vrp_session_run() callback) one head's image of a step,
+ * into that head's directory */
+void head_image(VRP_Session *s, int step, int head, void *arg)
+{
+    struct job *job = arg;
+    uint16_t   *rgb = NULL;
+    VRP_Error  err;
+    char       path[sizeof(job->dir) + 64];
+    int        rows, cols;
+
+    snprintf(path, sizeof(path), "%s/%s/img-%05d.%s", job->dir, s->label[head], step, job->format->suffix);
+    if(vrp_session_extract(s, step, head, &rows, &cols, &rgb, NULL, &err) < 0)
+    {
+        fprintf(stderr, "%s\n", err.message);
+        job->failed = 1;
+        return;
+    }
+    if(write_image(path, job->format, rgb, rows, cols, s->head[head]->imageHeader->biClrImportant) < 0)
+        job->failed = 1;
+    else if(!job->quiet)
+        fprintf(stderr, "wrote %s\n", path);
+    free(rgb);
+}
+
+/* side_image - (vrp_session_run() callback) a step's images from all
+ * the heads, side by side, top-aligned on black, each scaled to the
+ * largest maxval among them */
+void side_image(VRP_Session *s, int step, int head, void *arg)
+{
+    struct job *job = arg;
+    uint16_t   *rgb[VRP_SESSION_HEADS], *out = NULL;
+    int        rows[VRP_SESSION_HEADS], cols[VRP_SESSION_HEADS], height = 0, width = 0, x, r, i;
+    VRP_Error  err;
+    char       path[sizeof(job->dir) + 64];
+
+    (void)head;
+    memset(rgb, 0, sizeof(rgb));
+    for(i = 0; i < s->nheads; ++i)
+    {
+        if(vrp_session_extract(s, step, i, &rows[i], &cols[i], &rgb[i], NULL, &err) < 0)
+        {
+            fprintf(stderr, "%s\n", err.message);
+            job->failed = 1;
+            goto done;
+        }
+        width += cols[i];
+        if(rows[i] > height)
+            height = rows[i];
+    }
+    if(!(out = calloc((size_t)height * width * 3, sizeof(*out))))
+    {
+        perror("calloc");
+        job->failed = 1;
+        goto done;
+    }
+
+    for(i = x = 0; i < s->nheads; x += cols[i++])
+    {
+        int maxval = s->head[i]->imageHeader->biClrImportant;
+
+        for(r = 0; r < rows[i]; ++r)
+        {
+            uint16_t       *dst = out + ((size_t)r * width + x) * 3;
+            const uint16_t *src = rgb[i] + (size_t)r * cols[i] * 3;
+            int            k;
+
+            if(maxval == job->maxval)
+                memcpy(dst, src, (size_t)cols[i] * 3 * sizeof(*dst));
+            else /* (big-endian) */
+                for(k = 0; k < cols[i] * 3; ++k)
+                    dst[k] = htons((uint32_t)ntohs(src[k]) * job->maxval / maxval);
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/img-%05d.%s", job->dir, step, job->format->suffix);
+    if(write_image(path, job->format, out, height, width, job->maxval) < 0)
+        job->failed = 1;
+    else if(!job->quiet)
+        fprintf(stderr, "wrote %s\n", path);
+
+done:
+    for(i = 0; i < s->nheads; ++i)
+        free(rgb[i]);
+    free(out);
+}
+
+/* seconds from a to b */
+double seconds(VRP_TIME64 a, VRP_TIME64 b)
+{
+    return ((int64_t)b.Seconds - a.Seconds) + ((double)b.Fractions - a.Fractions) / 4294967296.0;
+}
+
+/* list_session - describe a session, and its heads */
+void list_session(const VRP_Session *s)
+{
+    char when[64];
+    int  h;
+
+    vrp_time_iso8601_s(s->trigger, when, sizeof(when), s->head[0]->setup->RecordingTimeZone);
+    printf("session-%u-%d: %s, %d head%s, %d step%s of %.6g ms, skew at most %.3g us\n",
+           s->serial, s->take, when,
+           s->nheads, s->nheads == 1 ? "" : "s", s->steps, s->steps == 1 ? "" : "s",
+           s->interval * 1e3, s->skew * 1e6);
+    for(h = 0; h < s->nheads; ++h)
+    {
+        VRP_Handle handle = s->head[h];
+
+        printf("  %-12s %s: %u images at %u fps, %+.6f s after, %dx%d%s%s", s->label[h], handle->name,
+               handle->header->ImageCount, handle->setup->FrameRate,
+               seconds(s->trigger, handle->header->TriggerTime),
+               handle->imageHeader->biWidth, abs(handle->imageHeader->biHeight),
+               handle->setup->MasterSerial ? ", slave" : "", h == s->reference ? ", reference" : "");
+        if(handle->setup->MCCnt > 0)
+            printf(", one of %d partitions", handle->setup->MCCnt);
+        if(s->steps)
+            printf(", frames %d to %d",
+                   handle->header->FirstImageNo + s->offsets[h],
+                   handle->header->FirstImageNo + s->offsets[(size_t)(s->steps - 1) * s->nheads + h]);
+        printf("\n");
+    }
+}
+
+/* write_steps - steps.csv: for each step, the reference head's time
+ * from the trigger, and each head's frame number */
+int write_steps(const VRP_Session *s, const char *dir)
+{
+    char path[4096 + 16];
+    FILE *out;
+    int  step, h;
+
+    snprintf(path, sizeof(path), "%s/steps.csv", dir);
+    if(!(out = fopen(path, "w")))
+    {
+        perror(path);
+        return -1;
+    }
+    fprintf(out, "step,time");
+    for(h = 0; h < s->nheads; ++h)
+        fprintf(out, ",%s", s->label[h]);
+    fprintf(out, "\n");
+    for(step = 0; step < s->steps; ++step)
+    {
+        fprintf(out, "%d,%.9f", step, seconds(s->trigger, vrp_session_time(s, step, s->reference)));
+        for(h = 0; h < s->nheads; ++h)
+            fprintf(out, ",%d", s->head[h]->header->FirstImageNo + s->offsets[(size_t)step * s->nheads + h]);
+        fprintf(out, "\n");
+    }
+    if(ferror(out) | fclose(out))
+    {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    VRP_Handle    *handles;
+    VRP_Session   *sessions;
+    VRP_Error     err;
+    struct job    job;
+    const char    *outdir = "cine-session.d";
+    double        tolerance = 0;
+    int           i, h, c, count, nsessions, list = 0, side = 0, threads = 0, ret = 0;
+
+    memset(&job, 0, sizeof(job));
+    job.format = formats;
+    while((c = getopt(argc, argv, "lst:f:d:j:q")) != -1)
+    {
+        switch(c)
+        {
+        case 'l': list = 1; break;
+        case 's': side = 1; break;
+        case 't': tolerance = atof(optarg); break;
+        case 'd': outdir = optarg; break;
+        case 'j': threads = atoi(optarg); break;
+        case 'q': job.quiet = 1; break;
+        case 'f':
+            for(job.format = formats; job.format->name && strcmp(job.format->name, optarg); ++job.format)
+                ;
+            if(!job.format->name)
+            {
+                fprintf(stderr, "%s: unknown format %s\n", argv[0], optarg);
+                return -1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(optind >= argc)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    count = argc - optind;
+    if(!(handles = calloc(count, sizeof(*handles))))
+    {
+        perror("calloc");
+        return 1;
+    }
+    for(i = 0; i < count; ++i)
+        if(!(handles[i] = vrp_open(argv[optind + i], &err)))
+        {
+            fprintf(stderr, "%s\n", err.message);
+            return 1;
+        }
+    if((nsessions = vrp_session_group(handles, count, tolerance, &sessions, &err)) < 0)
+    {
+        fprintf(stderr, "%s\n", err.message);
+        return 1;
+    }
+
+    if(!list && make_dir(outdir) < 0)
+        return 1;
+    for(i = 0; i < nsessions; ++i)
+    {
+        VRP_Session *s = &sessions[i];
+
+        if(list)
+        {
+            list_session(s);
+            continue;
+        }
+        if(!s->steps)
+        {
+            fprintf(stderr, "session-%u-%d: no frames in common; skipped\n", s->serial, s->take);
+            ret = 1;
+            continue;
+        }
+
+        snprintf(job.dir, sizeof(job.dir), "%s/session-%u-%d", outdir, s->serial, s->take);
+        if(make_dir(job.dir) < 0 || write_steps(s, job.dir) < 0)
+            return 1;
+        job.maxval = 0;
+        for(h = 0; h < s->nheads; ++h)
+        {
+            char path[sizeof(job.dir) + 32];
+
+            snprintf(path, sizeof(path), "%s/%s", job.dir, s->label[h]);
+            if(!side && make_dir(path) < 0)
+                return 1;
+            if((int)s->head[h]->imageHeader->biClrImportant > job.maxval)
+                job.maxval = s->head[h]->imageHeader->biClrImportant;
+        }
+        if(!job.quiet)
+            fprintf(stderr, "%s: %d heads, %d steps\n", job.dir, s->nheads, s->steps);
+
+        job.failed = 0;
+        vrp_session_run(s, threads, side, side ? side_image : head_image, &job);
+        if(job.failed)
+            ret = 1;
+    }
+
+    vrp_session_free(sessions, nsessions);
+    for(i = 0; i < count; ++i)
+        free_cine_handle(handles[i]);
+    free(handles);
+    return ret;
+}
@@ -0,0 +1,408 @@
+/*
+ * cine-signals.c -- export the binary and analog signals recorded
+ * with a cine, a row per sample, alongside the time it was taken
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h> /* getopt() */
+#include <sys/stat.h>
+
+#include "vrptools.h"
+
+/* The columns are the frame's number (as the camera counts them), the
+ * sample's number within the frame, its time in seconds from the
+ * trigger, and then each binary channel (0 or 1) and each analog one
+ * (multiplied by its AnaGain, i.e. in measurement units).  They're
+ * filled BATCH_ROWS rows at a time, and each batch written in one go:
+ *
+ *   .csv (or - for stdout): comma-separated text, with a header line
+ *   .arrow or .feather:     an Arrow IPC file, a record batch per batch
+ *   anything else:          a directory of raw little-endian column
+ *                           files, <column>.<type>, and columns.txt
+ *                           saying what each holds in NumPy's terms */
+
+#define BATCH_ROWS 65536
+
+struct column {
+    char       name[16];
+    int        type;     /* VRP_ARROW_* */
+    void       *data;    /* this batch's rows */
+    int        decimals; /* to print, for floats */
+    int        channel;  /* for signals */
+    float      gain;
+    FILE       *raw;
+};
+
+static const struct {
+    const char *ext, *dtype;
+    int        size;
+} types[] = {
+    [VRP_ARROW_INT32] =   { "i32", "<i4", 4 },
+    [VRP_ARROW_UINT8] =   { "u8",  "|u1", 1 },
+    [VRP_ARROW_FLOAT32] = { "f32", "<f4", 4 },
+    [VRP_ARROW_FLOAT64] = { "f64", "<f8", 8 },
+};
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-f first] [-l last] file.cine {output.csv|-|output.arrow|directory}\n",
+            name);
+}
+
+/* name a column, from the cine's name for it if it has one, using
+ * only characters safe in a CSV header or a file name */
+void name_column(struct column *c, const VRP_CHAR *name, size_t size, const char *fallback, int channel)
+{
+    size_t i;
+
+    if(name && name[0])
+    {
+        for(i = 0; i < size && name[i] && i < sizeof(c->name) - 1; ++i)
+            c->name[i] = isalnum((unsigned char)name[i]) ? name[i] : '_';
+        c->name[i] = '\0';
+    }
+    else
+        snprintf(c->name, sizeof(c->name), "%s%d", fallback, channel);
+}
+
+/* seconds from the trigger to each image, first through last */
+double *image_times(VRP_Handle handle, int first, int last)
+{
+    VRP_TAGGED_BLOCK *block = vrp_find_tagged_block(handle, VRP_TB_Time_only);
+    const VRP_TIME64 *times = NULL;
+    VRP_TIME64       trigger = handle->header->TriggerTime;
+    double           *t;
+    int              i;
+
+    if(!(t = malloc((last - first + 1) * sizeof(*t))))
+        return NULL;
+    if(block && block->BlockSize - sizeof(*block) >= handle->header->ImageCount * sizeof(*times))
+        times = (const VRP_TIME64 *)block->Data;
+
+    for(i = first; i <= last; ++i)
+        if(times)
+            t[i - first] = ((int64_t)times[i].Seconds - trigger.Seconds)
+                + ((double)times[i].Fractions - trigger.Fractions) / 4294967296.0;
+        else
+            t[i - first] = (double)(handle->header->FirstImageNo + i) / (handle->setup->FrameRate ? handle->setup->FrameRate : 1);
+    return t;
+}
+
+/* put_fixed - put v at p with the given decimals, rounded; returns
+ * the end.  (Much quicker than printf, which matters at millions of
+ * values.) */
+char *put_fixed(char *p, double v, int decimals)
+{
+    static const double scale[] = { 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+    char                digits[32];
+    uint64_t            n;
+    int                 len = 0;
+
+    if(v < 0)
+    {
+        *p++ = '-';
+        v = -v;
+    }
+    n = (uint64_t)(v * scale[decimals] + 0.5);
+    do
+    {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    } while(n || len <= decimals);
+
+    while(len > decimals)
+        *p++ = digits[--len];
+    if(decimals)
+    {
+        *p++ = '.';
+        while(len)
+            *p++ = digits[--len];
+    }
+    return p;
+}
+
+char *put_int(char *p, long v)
+{
+    return put_fixed(p, v, 0);
+}
+
+/* write_csv - one batch of rows as text; returns 0 or -1 */
+int write_csv(FILE *out, struct column *columns, int ncolumns, size_t rows, char *buf)
+{
+    size_t i;
+    int    c;
+    char   *p = buf;
+
+    for(i = 0; i < rows; ++i)
+    {
+        for(c = 0; c < ncolumns; ++c)
+        {
+            const struct column *col = &columns[c];
+
+            switch(col->type)
+            {
+            case VRP_ARROW_INT32:   p = put_int(p, ((int32_t *)col->data)[i]); break;
+            case VRP_ARROW_UINT8:   p = put_int(p, ((uint8_t *)col->data)[i]); break;
+            case VRP_ARROW_FLOAT32: p = put_fixed(p, ((float *)col->data)[i], col->decimals); break;
+            case VRP_ARROW_FLOAT64: p = put_fixed(p, ((double *)col->data)[i], col->decimals); break;
+            }
+            *p++ = c == ncolumns - 1 ? '\n' : ',';
+        }
+    }
+    return fwrite(buf, p - buf, 1, out) == 1 ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    VRP_Handle      handle;
+    VRP_Error       err;
+    VRP_Signals     sig;
+    VRP_ArrowWriter *arrow = NULL;
+    struct column   *columns, *col;
+    const char      *output, *ext;
+    const void      **data;
+    const char      **names;
+    int             *coltypes;
+    double          *times;
+    char            *text = NULL, path[4096];
+    FILE            *out = NULL;
+    size_t          row, end, rows, i, line;
+    int             c, ncolumns, first = 0, last = 0, have_first = 0, have_last = 0, ret = 0;
+    enum { CSV, ARROW, RAW } format;
+
+    while((c = getopt(argc, argv, "f:l:")) != -1)
+    {
+        switch(c)
+        {
+        case 'f': first = atoi(optarg); have_first = 1; break;
+        case 'l': last = atoi(optarg); have_last = 1; break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(argc - optind != 2)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    output = argv[optind + 1];
+    ext = strrchr(output, '.');
+    if(!strcmp(output, "-") || (ext && !strcmp(ext, ".csv")))
+        format = CSV;
+    else if(ext && (!strcmp(ext, ".arrow") || !strcmp(ext, ".feather")))
+        format = ARROW;
+    else
+        format = RAW;
+
+    if(!(handle = vrp_open(argv[optind], &err)))
+    {
+        fprintf(stderr, "%s\n", err.message);
+        return 1;
+    }
+    if(vrp_signals_open(handle, &sig, &err) < 0)
+    {
+        fprintf(stderr, "%s\n", err.message);
+        return 1;
+    }
+    if(!sig.rows)
+    {
+        fprintf(stderr, "%s: no signals were recorded\n", argv[optind]);
+        return 1;
+    }
+
+    /* -f and -l are as the camera numbers frames */
+    first = have_first ? first - handle->header->FirstImageNo : 0;
+    last = have_last ? last - handle->header->FirstImageNo : sig.images - 1;
+    if(first < 0 || last >= sig.images || first > last)
+    {
+        fprintf(stderr, "%s: frames %d through %d aren't all there\n", argv[optind],
+                first + handle->header->FirstImageNo, last + handle->header->FirstImageNo);
+        return 1;
+    }
+
+    ncolumns = 3 + sig.bin_channels + sig.ana_channels;
+    columns = calloc(ncolumns, sizeof(*columns));
+    data = calloc(ncolumns, sizeof(*data));
+    names = calloc(ncolumns, sizeof(*names));
+    coltypes = calloc(ncolumns, sizeof(*coltypes));
+    times = image_times(handle, first, last);
+    if(!columns || !data || !names || !coltypes || !times)
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    strcpy(columns[0].name, "frame");
+    columns[0].type = VRP_ARROW_INT32;
+    strcpy(columns[1].name, "sample");
+    columns[1].type = VRP_ARROW_UINT8;
+    strcpy(columns[2].name, "time");
+    columns[2].type = VRP_ARROW_FLOAT64;
+    columns[2].decimals = 9;
+    for(c = 0; c < sig.bin_channels; ++c)
+    {
+        col = &columns[3 + c];
+        name_column(col, c < 8 ? handle->setup->BinName[c] : NULL, sizeof(handle->setup->BinName[0]), "bin", c);
+        col->type = VRP_ARROW_UINT8;
+        col->channel = c;
+    }
+    for(c = 0; c < sig.ana_channels; ++c)
+    {
+        col = &columns[3 + sig.bin_channels + c];
+        name_column(col, c < 8 ? handle->setup->AnaName[c] : NULL, sizeof(handle->setup->AnaName[0]), "ana", c);
+        col->type = VRP_ARROW_FLOAT32;
+        col->channel = c;
+        col->gain = c < 8 && handle->setup->AnaGain[c] ? handle->setup->AnaGain[c] : 1;
+        /* enough decimals to tell one step of the converter from the next */
+        col->decimals = ceil(-log10(fabs(col->gain))) + 1;
+        col->decimals = col->decimals < 0 ? 0 : col->decimals > 9 ? 9 : col->decimals;
+    }
+    for(c = 0; c < ncolumns; ++c)
+    {
+        if(!(columns[c].data = malloc(BATCH_ROWS * types[columns[c].type].size)))
+        {
+            perror("malloc");
+            return 1;
+        }
+        data[c] = columns[c].data;
+        names[c] = columns[c].name;
+        coltypes[c] = columns[c].type;
+    }
+
+    /* open the output(s) */
+    if(format == RAW)
+    {
+        if(mkdir(output, 0777) < 0 && errno != EEXIST)
+        {
+            perror(output);
+            return 1;
+        }
+        snprintf(path, sizeof(path), "%s/columns.txt", output);
+        if(!(out = fopen(path, "w")))
+        {
+            perror(path);
+            return 1;
+        }
+        for(c = 0; c < ncolumns; ++c)
+        {
+            col = &columns[c];
+            fprintf(out, "%s.%s %s %s\n", col->name, types[col->type].ext, types[col->type].dtype, col->name);
+            snprintf(path, sizeof(path), "%s/%s.%s", output, col->name, types[col->type].ext);
+            if(!(col->raw = fopen(path, "wb")))
+            {
+                perror(path);
+                return 1;
+            }
+        }
+        if(ferror(out) | fclose(out))
+        {
+            fprintf(stderr, "%s/columns.txt: write failed\n", output);
+            return 1;
+        }
+        out = NULL;
+    }
+    else if(!strcmp(output, "-"))
+        out = stdout;
+    else if(!(out = fopen(output, "wb")))
+    {
+        perror(output);
+        return 1;
+    }
+
+    if(format == ARROW && !(arrow = vrp_arrow_open(out, ncolumns, names, coltypes)))
+    {
+        fprintf(stderr, "%s: write failed\n", output);
+        return 1;
+    }
+    if(format == CSV)
+    {
+        /* a line is at most a few numbers of up to ~21 characters each */
+        line = 12 + 1 + 4 + 1 + 22 + 2 * sig.bin_channels + 23 * sig.ana_channels;
+        if(!(text = malloc(BATCH_ROWS * line)))
+        {
+            perror("malloc");
+            return 1;
+        }
+        for(c = 0; c < ncolumns; ++c)
+            fprintf(out, "%s%c", columns[c].name, c == ncolumns - 1 ? '\n' : ',');
+    }
+
+    /* the rows, a batch at a time */
+    end = (size_t)(last + 1) * sig.samples;
+    for(row = (size_t)first * sig.samples; row < end && !ret; row += rows)
+    {
+        rows = end - row < BATCH_ROWS ? end - row : BATCH_ROWS;
+
+        for(i = 0; i < rows; ++i)
+        {
+            size_t image = (row + i) / sig.samples;
+            int    sample = (row + i) % sig.samples;
+
+            ((int32_t *)columns[0].data)[i] = handle->header->FirstImageNo + image;
+            ((uint8_t *)columns[1].data)[i] = sample;
+            ((double *)columns[2].data)[i] = times[image - first]
+                + (double)sample / sig.samples / (handle->setup->FrameRate ? handle->setup->FrameRate : 1);
+        }
+        for(c = 0; c < sig.bin_channels; ++c)
+            vrp_signals_binary(&sig, c, row, rows, columns[3 + c].data);
+        for(c = 0; c < sig.ana_channels; ++c)
+        {
+            col = &columns[3 + sig.bin_channels + c];
+            vrp_signals_analog(&sig, c, row, rows, col->gain, col->data);
+        }
+
+        switch(format)
+        {
+        case CSV:
+            if(write_csv(out, columns, ncolumns, rows, text) < 0)
+                ret = 1;
+            break;
+        case ARROW:
+            if(vrp_arrow_write(arrow, rows, data) < 0)
+                ret = 1;
+            break;
+        case RAW:
+            for(c = 0; c < ncolumns; ++c)
+                if(fwrite(columns[c].data, types[columns[c].type].size, rows, columns[c].raw) != rows)
+                    ret = 1;
+            break;
+        }
+    }
+
+    if(arrow && vrp_arrow_close(arrow) < 0)
+        ret = 1;
+    if(out && (ferror(out) | fclose(out)))
+        ret = 1;
+    for(c = 0; c < ncolumns; ++c)
+    {
+        if(columns[c].raw && (ferror(columns[c].raw) | fclose(columns[c].raw)))
+            ret = 1;
+        free(columns[c].data);
+    }
+    if(ret)
+        fprintf(stderr, "%s: write failed\n", output);
+
+    free(text);
+    free(times);
+    free(columns);
+    free(data);
+    free(names);
+    free(coltypes);
+    free_cine_handle(handle);
+    return ret;
+}
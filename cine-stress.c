@@ -0,0 +1,259 @@
+/*
+ * cine-stress.c -- hammer the library from many threads at once, and
+ * check that every image comes out as it does from one
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h> /* getopt() */
+
+#include "vrptools.h"
+
+/* First each file is opened once, and a checksum taken of every image
+ * (up to -n of them), raw and demosaiced, on this thread alone.  Then
+ * -j threads each make -i random requests: mostly an image's raw
+ * pixels (vrp_image_pixels()) or its demosaicing (vrp_extract_image())
+ * from the handles opened at the start, which all threads share; and
+ * one time in -o, a handle of its own, opened, used and closed again.
+ * Any image whose checksum differs from the one taken at the start, or
+ * that can't be had at all, is reported; the exit status is 1 if there
+ * were any.
+ *
+ * Packed files are the interesting case: images are decoded a group at
+ * a time, from one to the next, into per-thread state. */
+
+struct file {
+    const char *path;
+    VRP_Handle handle;    /* shared by all the threads */
+    int        frames;
+    uint64_t   *raw, *rgb; /* checksums, per image */
+};
+
+struct files {
+    struct file     *file;
+    int             count;
+    int             iterations, open_every;
+    pthread_mutex_t lock;
+    unsigned        seeds;     /* (one per thread) */
+    unsigned long   requests, opens, failures;
+};
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-j threads] [-i requests-per-thread] [-o open-every] [-n frames]\n"
+            "          file.cine ...\n", name);
+}
+
+/* FNV-1a, 64-bit */
+uint64_t checksum(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t            h = 14695981039346656037ull;
+
+    while(len--)
+        h = (h ^ *p++) * 1099511628211ull;
+    return h;
+}
+
+/* check - compare image offset of f, got through handle, against its
+ * checksums; returns 0 if it matches */
+int check(struct file *f, VRP_Handle handle, int offset, int demosaic, uint16_t **buf, size_t *bufsize)
+{
+    const void *pixels;
+    VRP_Error  err;
+    int        rows, cols;
+
+    if(!demosaic)
+    {
+        if(!(pixels = vrp_image_pixels(handle, offset)))
+        {
+            fprintf(stderr, "%s: image at offset %d is missing\n", f->path, offset);
+            return -1;
+        }
+        if(checksum(pixels, vrp_image_size(handle)) != f->raw[offset])
+        {
+            fprintf(stderr, "%s: raw image at offset %d differs\n", f->path, offset);
+            return -1;
+        }
+        return 0;
+    }
+
+    if(vrp_extract_image(handle, offset, &rows, &cols, buf, bufsize, &err) < 0)
+    {
+        fprintf(stderr, "%s\n", err.message);
+        return -1;
+    }
+    if(checksum(*buf, (size_t)rows * cols * 3 * sizeof(uint16_t)) != f->rgb[offset])
+    {
+        fprintf(stderr, "%s: demosaiced image at offset %d differs\n", f->path, offset);
+        return -1;
+    }
+    return 0;
+}
+
+void *worker(void *arg)
+{
+    struct files  *files = arg;
+    unsigned      seed;
+    uint16_t      *buf = NULL;
+    size_t        bufsize = 0;
+    unsigned long opens = 0, failures = 0;
+    int           i;
+
+    pthread_mutex_lock(&files->lock);
+    seed = ++files->seeds;
+    pthread_mutex_unlock(&files->lock);
+
+    for(i = 0; i < files->iterations; ++i)
+    {
+        struct file *f = &files->file[rand_r(&seed) % files->count];
+        int         offset = rand_r(&seed) % f->frames, demosaic = rand_r(&seed) & 1;
+
+        if(files->open_every > 0 && rand_r(&seed) % files->open_every == 0)
+        {
+            VRP_Error  err;
+            VRP_Handle handle = vrp_open(f->path, &err);
+
+            ++opens;
+            if(!handle)
+            {
+                fprintf(stderr, "%s\n", err.message);
+                ++failures;
+                continue;
+            }
+            failures += check(f, handle, offset, demosaic, &buf, &bufsize) < 0;
+            free_cine_handle(handle);
+        }
+        else
+            failures += check(f, f->handle, offset, demosaic, &buf, &bufsize) < 0;
+    }
+    free(buf);
+
+    pthread_mutex_lock(&files->lock);
+    files->requests += files->iterations;
+    files->opens += opens;
+    files->failures += failures;
+    pthread_mutex_unlock(&files->lock);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct files files;
+    pthread_t    *tids;
+    uint16_t     *buf = NULL;
+    size_t       bufsize = 0;
+    int          i, j, threads = 16, max_frames = 0, started;
+
+    memset(&files, 0, sizeof(files));
+    files.iterations = 200;
+    files.open_every = 8;
+    while((i = getopt(argc, argv, "j:i:o:n:")) != -1)
+    {
+        switch(i)
+        {
+        case 'j': threads = atoi(optarg); break;
+        case 'i': files.iterations = atoi(optarg); break;
+        case 'o': files.open_every = atoi(optarg); break;
+        case 'n': max_frames = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if(!argc || threads < 1 || files.iterations < 1 || files.open_every < 0)
+    {
+        usage(argv[-optind]);
+        return -1;
+    }
+    if(!(files.file = calloc(argc, sizeof(*files.file))) || !(tids = calloc(threads, sizeof(*tids))))
+    {
+        perror("calloc");
+        return 1;
+    }
+    pthread_mutex_init(&files.lock, NULL);
+
+    /* the answers, one thread, one image at a time */
+    for(i = 0; i < argc; ++i)
+    {
+        struct file *f = &files.file[files.count];
+        VRP_Error   err;
+
+        f->path = argv[i];
+        if(!(f->handle = vrp_open(f->path, &err)))
+        {
+            fprintf(stderr, "%s\n", err.message);
+            return 1;
+        }
+        if(!f->handle->imageHeader || !f->handle->setup || !f->handle->header->ImageCount)
+        {
+            fprintf(stderr, "%s: no images\n", f->path);
+            return 1;
+        }
+        f->frames = f->handle->header->ImageCount;
+        if(max_frames > 0 && max_frames < f->frames)
+            f->frames = max_frames;
+        if(!(f->raw = calloc(f->frames, sizeof(*f->raw))) || !(f->rgb = calloc(f->frames, sizeof(*f->rgb))))
+        {
+            perror("calloc");
+            return 1;
+        }
+        for(j = 0; j < f->frames; ++j)
+        {
+            const void *pixels = vrp_image_pixels(f->handle, j);
+            int        rows, cols;
+
+            if(!pixels)
+            {
+                fprintf(stderr, "%s: image at offset %d is missing\n", f->path, j);
+                return 1;
+            }
+            f->raw[j] = checksum(pixels, vrp_image_size(f->handle));
+            if(vrp_extract_image(f->handle, j, &rows, &cols, &buf, &bufsize, &err) < 0)
+            {
+                fprintf(stderr, "%s\n", err.message);
+                return 1;
+            }
+            f->rgb[j] = checksum(buf, (size_t)rows * cols * 3 * sizeof(uint16_t));
+        }
+        ++files.count;
+    }
+    free(buf);
+
+    for(started = 0; started < threads; ++started)
+        if(pthread_create(&tids[started], NULL, worker, &files))
+        {
+            perror("pthread_create");
+            break;
+        }
+    for(i = 0; i < started; ++i)
+        pthread_join(tids[i], NULL);
+
+    printf("%d files, %d threads: %lu requests, %lu opens, %lu failures\n",
+           files.count, started, files.requests, files.opens, files.failures);
+
+    for(i = 0; i < files.count; ++i)
+    {
+        free_cine_handle(files.file[i].handle);
+        free(files.file[i].raw);
+        free(files.file[i].rgb);
+    }
+    free(files.file);
+    free(tids);
+    return files.failures || started < threads ? 1 : 0;
+}
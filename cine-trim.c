@@ -0,0 +1,122 @@
+/*
+ * cine-trim.c -- keep only some of the images of a CINE file
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h> /* getopt() */
+
+#include "vrptools.h"
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-f first] [-l last] [-s images-per-file] input.cine output.cine\n"
+            "  (first and last are frame numbers, as the camera counts them; with -s,\n"
+            "  output files are named like output-000.cine, output-001.cine, ...)\n", name);
+}
+
+/* trim_to - write count images from offset first into a file named name */
+int trim_to(VRP_Handle handle, int first, int count, const char *name)
+{
+    VRP_Error err;
+    int       fd, ret;
+
+    if((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    {
+        perror(name);
+        return -1;
+    }
+
+    fprintf(stderr, "Writing %d images (frames %d through %d) into %s\n", count,
+            handle->header->FirstImageNo + first, handle->header->FirstImageNo + first + count - 1, name);
+    if((ret = vrp_trim_cine(handle, first, count, fd, &err)) < 0)
+        fprintf(stderr, "%s\n", err.message);
+
+    if(close(fd) < 0)
+    {
+        perror(name);
+        ret = -1;
+    }
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    VRP_Handle handle;
+    VRP_Error  err;
+    const char *input, *output;
+    int        i, first, last, split = 0, ret = 0;
+    int        have_first = 0, have_last = 0;
+
+    first = last = 0;
+    while((i = getopt(argc, argv, "f:l:s:")) != -1)
+    {
+        switch(i)
+        {
+        case 'f': first = atoi(optarg); have_first = 1; break;
+        case 'l': last = atoi(optarg); have_last = 1; break;
+        case 's': split = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if(argc - optind != 2)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    input = argv[optind];
+    output = argv[optind + 1];
+
+    if(!(handle = vrp_open(input, &err)))
+    {
+        fprintf(stderr, "%s\n", err.message);
+        fprintf(stderr, "Failed to get handle on %s\n", input);
+        return 1;
+    }
+    vrp_print_open_warnings(stderr, handle, &err);
+
+    /* from frame numbers to offsets */
+    first = have_first ? first - handle->header->FirstImageNo : 0;
+    last = have_last ? last - handle->header->FirstImageNo : (int)handle->header->ImageCount - 1;
+    if(first < 0 || last >= (int)handle->header->ImageCount || last < first)
+    {
+        fprintf(stderr, "%s: frames must be within %d through %d\n", input,
+                handle->header->FirstImageNo,
+                handle->header->FirstImageNo + handle->header->ImageCount - 1);
+        free_cine_handle(handle);
+        return 1;
+    }
+
+    if(split <= 0)
+        ret = trim_to(handle, first, last - first + 1, output);
+    else
+    {
+        const char *dot = strrchr(output, '.');
+        int        stem = dot && !strchr(dot, '/') ? dot - output : (int)strlen(output);
+        int        piece;
+
+        for(piece = 0, i = first; i <= last && !ret; ++piece, i += split)
+        {
+            char name[BUFSIZ];
+
+            snprintf(name, sizeof(name), "%.*s-%03d%s", stem, output, piece, output + stem);
+            ret = trim_to(handle, i, last - i + 1 < split ? last - i + 1 : split, name);
+        }
+    }
+
+    free_cine_handle(handle);
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * cine-unpack.c -- restore the original CINE file from a packed one
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h> /* getopt() */
+
+#include "vrptools.h"
+
+struct unpack_job {
+    VRP_Handle handle;
+    int        outfd, group_size, failed;
+};
+
+/* unpack_group - decode one group of images (each group on its own
+ * thread, with its own cursor) and put each back where it was in the
+ * original file */
+void unpack_group(int group, void *arg)
+{
+    struct unpack_job *job = arg;
+    VRP_Handle        handle = job->handle;
+    VRP_PackCursor    *cursor;
+    size_t            size = vrp_image_size(handle);
+    unsigned          j;
+
+    if(!(cursor = vrp_pack_cursor_new(handle)))
+    {
+        job->failed = 1;
+        return;
+    }
+
+    for(j = group * job->group_size;
+        j < handle->header->ImageCount && j < (unsigned)(group + 1) * job->group_size; ++j)
+    {
+        VRP_ImageAnnotation *ann = vrp_image_annotation(handle, j);
+        const void          *pixels = vrp_pack_decode(handle, cursor, j);
+        off_t               pos = handle->firstImageOffset[j];
+
+        if(!pixels)
+            continue; /* missing in the original, too */
+
+        if(ann && pwrite(job->outfd, ann, ann->AnnotationSize, pos) != (ssize_t)ann->AnnotationSize)
+            job->failed = 1;
+        pos += ann ? ann->AnnotationSize : 0;
+        if(pwrite(job->outfd, pixels, size, pos) != (ssize_t)size)
+            job->failed = 1;
+    }
+
+    vrp_pack_cursor_free(cursor);
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-j threads] input.cinpk output.cine\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    VRP_Handle        handle;
+    VRP_Error         err;
+    struct unpack_job job;
+    int               i, threads = 0, ngroups;
+    size_t            prefix, trailer_size;
+    const void        *trailer;
+
+    while((i = getopt(argc, argv, "j:")) != -1)
+    {
+        switch(i)
+        {
+        case 'j': threads = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if(argc - optind != 2)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if(!(handle = vrp_open(argv[optind], &err)))
+    {
+        fprintf(stderr, "%s\n", err.message);
+        fprintf(stderr, "Failed to get handle on %s\n", argv[optind]);
+        return 1;
+    }
+    vrp_print_open_warnings(stderr, handle, &err);
+    if(!handle->pack || !handle->firstImageOffset)
+    {
+        fprintf(stderr, "%s: not a packed cine\n", argv[optind]);
+        free_cine_handle(handle);
+        return 1;
+    }
+
+    if((job.outfd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    {
+        perror(argv[optind + 1]);
+        free_cine_handle(handle);
+        return 1;
+    }
+
+    /* headers and trailer first, and the full size (so gaps stay sparse) */
+    prefix = handle->end - handle->start;
+    trailer = vrp_pack_trailer(handle, &trailer_size);
+    if(pwrite(job.outfd, handle->start, prefix, 0) != (ssize_t)prefix
+       || ftruncate(job.outfd, vrp_pack_original_size(handle)) < 0
+       || pwrite(job.outfd, trailer, trailer_size,
+                 vrp_pack_original_size(handle) - trailer_size) != (ssize_t)trailer_size)
+    {
+        perror(argv[optind + 1]);
+        free_cine_handle(handle);
+        return 1;
+    }
+
+    job.handle = handle;
+    job.group_size = vrp_pack_group_size(handle);
+    job.failed = 0;
+    ngroups = (handle->header->ImageCount + job.group_size - 1) / job.group_size;
+
+    vrp_parallel_for(ngroups, threads, unpack_group, &job);
+
+    if(job.failed)
+        fprintf(stderr, "%s: failed to write some images\n", argv[optind + 1]);
+    if(close(job.outfd) < 0)
+    {
+        perror(argv[optind + 1]);
+        job.failed = 1;
+    }
+    free_cine_handle(handle);
+
+    return job.failed ? 1 : 0;
+}
@@ -0,0 +1,404 @@
+/*
+ * arrow.c -- a minimal writer of Apache Arrow IPC files ("Feather
+ * v2"): fixed-width numeric columns, no nulls, record batches
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "vrptools.h"
+
+/*
+ * An Arrow file is "ARROW1" and two NULs, then a stream of messages -- the
+ * schema, then a record batch per vrp_arrow_write() -- an end-of-stream
+ * marker, and a footer repeating the schema and saying where each
+ * batch is, followed by the footer's length and "ARROW1" again.
+ *
+ * Each message is 0xFFFFFFFF, a 32-bit length, that many bytes of
+ * flatbuffer metadata (Message.fbs), and then the message body: for
+ * a record batch, each column's data buffer in turn.  Since we never
+ * have nulls, every column's validity buffer is empty.
+ *
+ * Flatbuffers are normally built back to front with a library; the
+ * few tables we need are simple enough to lay out front to back
+ * instead, parents before children, so every offset points forward:
+ *
+ *   table:  int32 offset back to its vtable, then its fields
+ *   vtable: uint16 vtable size, table size, then each field's offset
+ *           within the table (0: absent, i.e. default)
+ *   vector: uint32 count, then the elements (offsets, for tables)
+ *   string: uint32 length, the bytes, a NUL
+ *
+ * Each message body, and each buffer in it, starts ARROW_ALIGN-aligned.
+ */
+
+#define ARROW_ALIGN   64
+#define ARROW_V5      4  /* MetadataVersion */
+#define ARROW_SCHEMA  1  /* MessageHeader union types */
+#define ARROW_BATCH   3
+#define ARROW_INT     2  /* Type union types */
+#define ARROW_FLOAT   3
+
+struct fb {
+    unsigned char *buf;
+    size_t        len, cap;
+    int           failed;
+};
+
+struct arrow_block {
+    int64_t offset;
+    int32_t meta;
+    int64_t body;
+};
+
+struct _VRP_ArrowWriter {
+    FILE               *out;
+    int64_t            pos;      /* bytes written so far */
+    int                ncolumns;
+    char               **names;
+    int                *types;
+    struct arrow_block *blocks;  /* one per record batch */
+    int                nblocks;
+    int                failed;
+};
+
+/** flatbuffer building **/
+
+/* fb_alloc - reserve size zeroed bytes at the next multiple of align;
+ * returns where */
+static size_t fb_alloc(struct fb *b, size_t size, size_t align)
+{
+    size_t pos = (b->len + align - 1) / align * align;
+
+    if(pos + size > b->cap)
+    {
+        size_t        cap = (pos + size) * 2 + 256;
+        unsigned char *p = realloc(b->buf, cap);
+
+        if(!p)
+        {
+            b->failed = 1;
+            return 0;
+        }
+        memset(p + b->cap, 0, cap - b->cap);
+        b->buf = p;
+        b->cap = cap;
+    }
+    b->len = pos + size;
+    return pos;
+}
+
+static void fb_put(struct fb *b, size_t pos, uint64_t v, int size)
+{
+    int i;
+
+    if(b->failed)
+        return;
+    for(i = 0; i < size; ++i)
+        b->buf[pos + i] = v >> (8 * i);
+}
+
+/* fb_ref - point the offset at pos to target (which comes after it) */
+static void fb_ref(struct fb *b, size_t pos, size_t target)
+{
+    fb_put(b, pos, target - pos, 4);
+}
+
+/* fb_table - lay out a table of nfields fields, size[i] bytes each (0
+ * for absent ones), filling in where each goes in at[]; returns where
+ * the table starts */
+static size_t fb_table(struct fb *b, int nfields, const int *size, size_t *at)
+{
+    size_t vt = fb_alloc(b, 4 + 2 * nfields, 2), t = fb_alloc(b, 4, 4);
+    int    i;
+
+    for(i = 0; i < nfields; ++i)
+        at[i] = size[i] ? fb_alloc(b, size[i], size[i]) : 0;
+
+    fb_put(b, t, t - vt, 4);
+    fb_put(b, vt, 4 + 2 * nfields, 2);
+    fb_put(b, vt + 2, b->len - t, 2);
+    for(i = 0; i < nfields; ++i)
+        fb_put(b, vt + 4 + 2 * i, at[i] ? at[i] - t : 0, 2);
+    return t;
+}
+
+/* fb_vector - lay out count elements of size bytes, aligned to align,
+ * after their count; returns where the count is (what's referred to),
+ * and the first element's position in *elements */
+static size_t fb_vector(struct fb *b, size_t count, int size, int align, size_t *elements)
+{
+    size_t pos;
+
+    /* the elements are aligned, with the count just before them */
+    while((b->len + 4) % align)
+        fb_alloc(b, 1, 1);
+    pos = fb_alloc(b, 4, 4);
+    fb_put(b, pos, count, 4);
+    *elements = fb_alloc(b, count * size, 1);
+    return pos;
+}
+
+static size_t fb_string(struct fb *b, const char *s)
+{
+    size_t len = strlen(s), pos = fb_alloc(b, 4 + len + 1, 4);
+
+    fb_put(b, pos, len, 4);
+    if(!b->failed)
+        memcpy(b->buf + pos + 4, s, len);
+    return pos;
+}
+
+/* the Schema table: a Field per column */
+static size_t fb_schema(struct fb *b, const VRP_ArrowWriter *w)
+{
+    static const int schema_fields[] = { 0, 4 };             /* endianness (Little: default), fields */
+    static const int field_fields[] = { 4, 1, 1, 4, 0, 4 };  /* name, nullable, type_type, type, dictionary, children */
+    static const int int_fields[] = { 4, 1 };                /* bitWidth, is_signed */
+    static const int float_fields[] = { 2 };                 /* precision */
+    size_t           at[6], schema, fields, elements, field, type, none;
+    int              i, t;
+
+    schema = fb_table(b, 2, schema_fields, at);
+    fields = fb_vector(b, w->ncolumns, 4, 4, &elements);
+    fb_ref(b, at[1], fields);
+
+    for(i = 0; i < w->ncolumns; ++i)
+    {
+        size_t name_at, type_type_at, type_at, children_at;
+
+        field = fb_table(b, 6, field_fields, at);
+        fb_ref(b, elements + 4 * i, field);
+        name_at = at[0];
+        type_type_at = at[2];
+        type_at = at[3];
+        children_at = at[5];
+
+        fb_ref(b, name_at, fb_string(b, w->names[i]));
+        t = w->types[i];
+        if(t == VRP_ARROW_FLOAT32 || t == VRP_ARROW_FLOAT64)
+        {
+            fb_put(b, type_type_at, ARROW_FLOAT, 1);
+            type = fb_table(b, 1, float_fields, at);
+            fb_put(b, at[0], t == VRP_ARROW_FLOAT32 ? 1 : 2, 2); /* SINGLE, DOUBLE */
+        }
+        else
+        {
+            fb_put(b, type_type_at, ARROW_INT, 1);
+            type = fb_table(b, 2, int_fields, at);
+            fb_put(b, at[0], t == VRP_ARROW_UINT8 ? 8 : 32, 4);
+            fb_put(b, at[1], t == VRP_ARROW_INT32, 1);
+        }
+        fb_ref(b, type_at, type);
+        fb_ref(b, children_at, fb_vector(b, 0, 4, 4, &none));
+    }
+    return schema;
+}
+
+/** writing **/
+
+static int column_size(int type)
+{
+    return type == VRP_ARROW_UINT8 ? 1 : type == VRP_ARROW_FLOAT64 ? 8 : 4;
+}
+
+static int put(VRP_ArrowWriter *w, const void *data, size_t len)
+{
+    static const unsigned char zeros[ARROW_ALIGN];
+    size_t                     pad = (ARROW_ALIGN - len % ARROW_ALIGN) % ARROW_ALIGN;
+
+    if(w->failed || (len && fwrite(data, len, 1, w->out) != 1)
+       || (pad && fwrite(zeros, pad, 1, w->out) != 1))
+        return w->failed = -1;
+    w->pos += len + pad;
+    return 0;
+}
+
+/* put_message - write a message's prefix and metadata (the flatbuffer
+ * in b), padded so the body that follows starts aligned; returns the
+ * length it took, for the footer's Block */
+static int32_t put_message(VRP_ArrowWriter *w, struct fb *b)
+{
+    unsigned char prefix[8];
+    size_t        len = (w->pos + 8 + b->len + ARROW_ALIGN - 1) / ARROW_ALIGN * ARROW_ALIGN - w->pos - 8;
+    int           i;
+
+    fb_alloc(b, len - b->len, 1);  /* (padding, zeroed) */
+    if(w->failed || b->failed)
+        return w->failed = -1;
+    memset(prefix, 0xff, 4);
+    for(i = 0; i < 4; ++i)
+        prefix[4 + i] = len >> (8 * i);
+    if(fwrite(prefix, 8, 1, w->out) != 1 || fwrite(b->buf, len, 1, w->out) != 1)
+        return w->failed = -1;
+    w->pos += 8 + len;
+    return 8 + len;
+}
+
+/* vrp_arrow_open - start an Arrow IPC file
+ *
+ * inputs:
+ *   out      - where to write it
+ *   ncolumns - how many columns
+ *   names    - their names
+ *   types    - their types: VRP_ARROW_INT32, _UINT8, _FLOAT32 or _FLOAT64
+ *
+ * return value:
+ *   the writer, or NULL on failure
+ */
+VRP_ArrowWriter *vrp_arrow_open(FILE *out, int ncolumns, const char *const *names, const int *types)
+{
+    static const int message_fields[] = { 2, 1, 4, 8 }; /* version, header_type, header, bodyLength */
+    VRP_ArrowWriter  *w;
+    struct fb        b;
+    size_t           at[4], root;
+    int              i;
+
+    if(!(w = calloc(1, sizeof(*w))) || !(w->names = calloc(ncolumns, sizeof(*w->names)))
+       || !(w->types = malloc(ncolumns * sizeof(*w->types))))
+    {
+        if(w)
+            free(w->names);
+        free(w);
+        return NULL;
+    }
+    w->out = out;
+    w->ncolumns = ncolumns;
+    for(i = 0; i < ncolumns; ++i)
+    {
+        w->types[i] = types[i];
+        if(!(w->names[i] = strdup(names[i])))
+            w->failed = -1;
+    }
+
+    memset(&b, 0, sizeof(b));
+    root = fb_alloc(&b, 4, 4);
+    fb_ref(&b, root, fb_table(&b, 4, message_fields, at));
+    fb_put(&b, at[0], ARROW_V5, 2);
+    fb_put(&b, at[1], ARROW_SCHEMA, 1);
+    fb_ref(&b, at[2], fb_schema(&b, w));
+
+    if(fwrite("ARROW1\0\0", 8, 1, w->out) != 1)
+        w->failed = -1;
+    w->pos = 8;
+    if(put_message(w, &b) < 0)
+        w->failed = -1;
+    free(b.buf);
+    if(w->failed)
+    {
+        vrp_arrow_close(w);
+        return NULL;
+    }
+    return w;
+}
+
+/* vrp_arrow_write - write rows rows of each column (columns[i] in the
+ * type given for it to vrp_arrow_open(), host byte order being
+ * little-endian) as a record batch; returns 0, or -1 on failure */
+int vrp_arrow_write(VRP_ArrowWriter *w, size_t rows, const void *const *columns)
+{
+    static const int   message_fields[] = { 2, 1, 4, 8 };  /* version, header_type, header, bodyLength */
+    static const int   batch_fields[] = { 8, 4, 4 };       /* length, nodes, buffers */
+    struct arrow_block *blocks, *block;
+    struct fb          b;
+    size_t             at[4], body_at, nodes, buffers, n, off = 0;
+    int                i;
+
+    if(w->failed)
+        return -1;
+    if(!(blocks = realloc(w->blocks, (w->nblocks + 1) * sizeof(*blocks))))
+        return w->failed = -1;
+    w->blocks = blocks;
+    block = &blocks[w->nblocks++];
+    block->offset = w->pos;
+
+    memset(&b, 0, sizeof(b));
+    n = fb_alloc(&b, 4, 4);
+    fb_ref(&b, n, fb_table(&b, 4, message_fields, at));
+    fb_put(&b, at[0], ARROW_V5, 2);
+    fb_put(&b, at[1], ARROW_BATCH, 1);
+    body_at = at[3];
+    n = at[2];
+    fb_ref(&b, n, fb_table(&b, 3, batch_fields, at));
+    fb_put(&b, at[0], rows, 8);
+
+    /* a FieldNode {length, null_count} per column, and two Buffers
+     * {offset, length} -- validity (empty), data -- into the body */
+    fb_ref(&b, at[1], fb_vector(&b, w->ncolumns, 16, 8, &nodes));
+    fb_ref(&b, at[2], fb_vector(&b, 2 * w->ncolumns, 16, 8, &buffers));
+    for(i = 0; i < w->ncolumns; ++i)
+    {
+        size_t len = rows * column_size(w->types[i]);
+
+        fb_put(&b, nodes + 16 * i, rows, 8);
+        fb_put(&b, buffers + 32 * i, off, 8);
+        fb_put(&b, buffers + 32 * i + 16, off, 8);
+        fb_put(&b, buffers + 32 * i + 24, len, 8);
+        off += (len + ARROW_ALIGN - 1) / ARROW_ALIGN * ARROW_ALIGN;
+    }
+    fb_put(&b, body_at, off, 8);
+    block->body = off;
+
+    if((block->meta = put_message(w, &b)) < 0)
+        w->failed = -1;
+    for(i = 0; i < w->ncolumns && !w->failed; ++i)
+        put(w, columns[i], rows * column_size(w->types[i]));
+    free(b.buf);
+    return w->failed ? -1 : 0;
+}
+
+/* vrp_arrow_close - finish the file with its footer, and free the
+ * writer; returns 0, or -1 on failure (now or earlier) */
+int vrp_arrow_close(VRP_ArrowWriter *w)
+{
+    static const int     footer_fields[] = { 2, 4, 4, 4 }; /* version, schema, dictionaries, recordBatches */
+    static const uint8_t eos[8] = { 0xff, 0xff, 0xff, 0xff, 0, 0, 0, 0 };
+    struct fb            b;
+    size_t               at[4], root, blocks, unused;
+    unsigned char        tail[10];
+    int                  i, ret;
+
+    memset(&b, 0, sizeof(b));
+    if(!w->failed && w->out)
+    {
+        root = fb_alloc(&b, 4, 4);
+        fb_ref(&b, root, fb_table(&b, 4, footer_fields, at));
+        fb_put(&b, at[0], ARROW_V5, 2);
+        fb_ref(&b, at[2], fb_vector(&b, 0, 24, 8, &unused));
+        fb_ref(&b, at[3], fb_vector(&b, w->nblocks, 24, 8, &blocks));
+        for(i = 0; i < w->nblocks; ++i)
+        {
+            fb_put(&b, blocks + 24 * i, w->blocks[i].offset, 8);
+            fb_put(&b, blocks + 24 * i + 8, w->blocks[i].meta, 4);
+            fb_put(&b, blocks + 24 * i + 16, w->blocks[i].body, 8);
+        }
+        fb_ref(&b, at[1], fb_schema(&b, w));
+
+        for(i = 0; i < 4; ++i)
+            tail[i] = b.len >> (8 * i);
+        memcpy(tail + 4, "ARROW1", 6);
+        if(b.failed || fwrite(eos, 8, 1, w->out) != 1 || fwrite(b.buf, b.len, 1, w->out) != 1
+           || fwrite(tail, 10, 1, w->out) != 1)
+            w->failed = -1;
+    }
+
+    ret = w->failed ? -1 : 0;
+    free(b.buf);
+    for(i = 0; i < w->ncolumns; ++i)
+        free(w->names[i]);
+    free(w->names);
+    free(w->types);
+    free(w->blocks);
+    free(w);
+    return ret;
+}
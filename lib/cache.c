@@ -0,0 +1,376 @@
+/*
+ * cache.c -- an LRU cache of things made from frames, bounded by size,
+ * with background threads to make them ahead of being asked
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#define _GNU_SOURCE /* memfd_create() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "vrptools.h"
+
+/* For the daemons (cine-served, cine-mount), which are asked for the
+ * same frames over and over: what's asked for is named by a key of the
+ * caller's (a fixed-size struct, compared byte by byte), and made by
+ * the caller's produce() the first time, outside the lock, so several
+ * can be made at once; anyone else asking for one that's being made
+ * waits for it rather than making it again.  Entries are kept, most
+ * recently used first, until their bytes come to more than the limit,
+ * and then the oldest nobody's using are freed.  Entries that fail
+ * aren't kept, so they're tried again next time.
+ *
+ * vrp_cache_prefetch() replaces the list of keys for the prefetch
+ * threads to make next -- the caller has moved on, so the old list is
+ * of no more use -- and they get and release each in turn, so it's
+ * there when it's asked for. */
+
+#define BUCKETS 4096
+
+enum { PENDING, READY, FAILED };
+
+struct _VRP_Cache {
+    pthread_mutex_t lock;
+    pthread_cond_t  done;      /* broadcast as entries leave PENDING */
+    size_t          key_size;
+    VRP_CacheEntry  *bucket[BUCKETS];
+    VRP_CacheEntry  *newest, *oldest;
+    VRP_CacheStats  stats;     /* (bytes and limit, too) */
+    int             (*produce)(VRP_CacheEntry *e, void *arg);
+    int             (*warm)(const void *key, void *arg);
+    void            *arg;
+
+    /* what the prefetch threads are to make next */
+    pthread_mutex_t ahead_lock;
+    pthread_cond_t  more;
+    char            *queue;    /* VRP_CACHE_AHEAD keys */
+    int             next, count;
+};
+
+/** the table and the list (all with c->lock held) **/
+
+static unsigned key_hash(const VRP_Cache *c, const void *key)
+{
+    const unsigned char *p = key;
+    uint32_t            h = 2166136261u; /* (FNV-1a) */
+    size_t              i;
+
+    for(i = 0; i < c->key_size; ++i)
+        h = (h ^ p[i]) * 16777619u;
+    return (h ^ (h >> 17)) % BUCKETS;
+}
+
+static void lru_unlink(VRP_Cache *c, VRP_CacheEntry *e)
+{
+    if(e->older)
+        e->older->newer = e->newer;
+    else
+        c->oldest = e->newer;
+    if(e->newer)
+        e->newer->older = e->older;
+    else
+        c->newest = e->older;
+    e->older = e->newer = NULL;
+}
+
+static void lru_push(VRP_Cache *c, VRP_CacheEntry *e)
+{
+    e->older = c->newest;
+    e->newer = NULL;
+    if(c->newest)
+        c->newest->newer = e;
+    else
+        c->oldest = e;
+    c->newest = e;
+}
+
+/* take e out of the table (it's freed once nobody's using it) */
+static void cache_remove(VRP_Cache *c, VRP_CacheEntry *e)
+{
+    VRP_CacheEntry **p;
+
+    for(p = &c->bucket[key_hash(c, e->key)]; *p != e; p = &(*p)->chain)
+        ;
+    *p = e->chain;
+    lru_unlink(c, e);
+    if(e->state == READY)
+        c->stats.bytes -= e->size;
+    --c->stats.entries;
+    e->cached = 0;
+}
+
+static void entry_free(VRP_CacheEntry *e)
+{
+    if(e->fd >= 0)
+    {
+        if(e->data)
+            munmap(e->data, e->size);
+        close(e->fd);
+    }
+    else
+        free(e->data);
+    free(e);
+}
+
+/* evict the least recently used entries nobody's using, until we're
+ * within the limit */
+static void cache_evict(VRP_Cache *c)
+{
+    VRP_CacheEntry *e, *newer;
+
+    for(e = c->oldest; e && c->stats.bytes > c->stats.limit; e = newer)
+    {
+        newer = e->newer;
+        if(e->refs || e->state != READY)
+            continue;
+        cache_remove(c, e);
+        entry_free(e);
+        ++c->stats.evictions;
+    }
+}
+
+/** making and finding entries **/
+
+/* vrp_cache_new - a cache of keys key_size bytes long, holding up to
+ * limit bytes of entries
+ *
+ * inputs:
+ *   produce - fills in an entry for e->key: its data and size (with
+ *             vrp_cache_alloc(), or malloc()ed memory with e->fd left
+ *             at -1), and whatever else of it the caller uses; returns
+ *             0, or -1 with why in e->error.  Called without the
+ *             cache's lock, so it may itself vrp_cache_get() others.
+ *   warm    - if not NULL, called by the prefetch threads first: a
+ *             nonzero return means the key's been dealt with some
+ *             other way (e.g. the file's pages read in), and not to
+ *             be made
+ *   arg     - for produce() and warm()
+ *
+ * return value: the cache, or NULL (with errno set) if out of memory.
+ */
+VRP_Cache *vrp_cache_new(size_t key_size, size_t limit,
+                         int (*produce)(VRP_CacheEntry *e, void *arg),
+                         int (*warm)(const void *key, void *arg), void *arg)
+{
+    VRP_Cache *c;
+
+    if(!(c = calloc(1, sizeof(*c))) || !(c->queue = malloc(VRP_CACHE_AHEAD * key_size)))
+    {
+        free(c);
+        return NULL;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->done, NULL);
+    pthread_mutex_init(&c->ahead_lock, NULL);
+    pthread_cond_init(&c->more, NULL);
+    c->key_size = key_size;
+    c->stats.limit = limit;
+    c->produce = produce;
+    c->warm = warm;
+    c->arg = arg;
+    return c;
+}
+
+/* vrp_cache_alloc - give e size bytes to fill, in a (mapped) memfd, so
+ * that it can be sent on with sendfile() or the like
+ *
+ * return value: 0, or -1 (with why in e->error).
+ */
+int vrp_cache_alloc(VRP_CacheEntry *e, size_t size)
+{
+    void *data;
+
+    if((e->fd = memfd_create("vrp-cache", MFD_CLOEXEC)) < 0 || ftruncate(e->fd, size) < 0
+       || (data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, e->fd, 0)) == MAP_FAILED)
+    {
+        snprintf(e->error, sizeof(e->error), "can't allocate %zu bytes: %s", size, strerror(errno));
+        return -1;
+    }
+    e->data = data;
+    e->size = size;
+    return 0;
+}
+
+/* vrp_cache_get - the (READY) entry for key, making it if need be; if
+ * someone else is already making it, wait for them
+ *
+ * inputs:
+ *   prefetching - nonzero from the prefetch threads, which counts it
+ *                 as prefetched rather than as a hit or a miss
+ *   error       - if not NULL, why, should it fail
+ *
+ * return value: the entry, to be given back with vrp_cache_release(),
+ * or NULL if it can't be made.
+ */
+VRP_CacheEntry *vrp_cache_get(VRP_Cache *c, const void *key, int prefetching, char error[256])
+{
+    VRP_CacheEntry *e;
+    unsigned       h = key_hash(c, key);
+    int            ret;
+
+    pthread_mutex_lock(&c->lock);
+    for(e = c->bucket[h]; e && memcmp(e->key, key, c->key_size); e = e->chain)
+        ;
+    if(e)
+    {
+        ++e->refs;
+        lru_unlink(c, e);
+        lru_push(c, e);
+        if(e->state == PENDING)
+            ++c->stats.waits;
+        else if(!prefetching)
+            ++c->stats.hits;
+        while(e->state == PENDING)
+            pthread_cond_wait(&c->done, &c->lock);
+        pthread_mutex_unlock(&c->lock);
+    }
+    else
+    {
+        /* (the key's copy just after the entry) */
+        if(!(e = calloc(1, sizeof(*e) + c->key_size)))
+        {
+            pthread_mutex_unlock(&c->lock);
+            if(error)
+                snprintf(error, 256, "out of memory");
+            return NULL;
+        }
+        memcpy(e + 1, key, c->key_size);
+        e->key = e + 1;
+        e->fd = -1;
+        e->state = PENDING;
+        e->refs = e->cached = 1;
+        e->chain = c->bucket[h];
+        c->bucket[h] = e;
+        lru_push(c, e);
+        ++c->stats.entries;
+        if(prefetching)
+            ++c->stats.prefetched;
+        else
+            ++c->stats.misses;
+        pthread_mutex_unlock(&c->lock);
+
+        ret = c->produce(e, c->arg);
+
+        pthread_mutex_lock(&c->lock);
+        if(ret < 0)
+        {
+            e->state = FAILED; /* (and not to be found again) */
+            cache_remove(c, e);
+        }
+        else
+        {
+            e->state = READY;
+            c->stats.bytes += e->size;
+            cache_evict(c);
+        }
+        pthread_cond_broadcast(&c->done);
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    if(e->state == FAILED)
+    {
+        if(error)
+            snprintf(error, 256, "%s", e->error);
+        vrp_cache_release(c, e);
+        return NULL;
+    }
+    return e;
+}
+
+void vrp_cache_release(VRP_Cache *c, VRP_CacheEntry *e)
+{
+    pthread_mutex_lock(&c->lock);
+    if(--e->refs == 0)
+    {
+        if(!e->cached)
+            entry_free(e);
+        else
+            cache_evict(c);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void vrp_cache_stats(VRP_Cache *c, VRP_CacheStats *stats)
+{
+    pthread_mutex_lock(&c->lock);
+    *stats = c->stats;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/** prefetching **/
+
+/* vrp_cache_prefetch - have the prefetch threads make count keys (up
+ * to VRP_CACHE_AHEAD), in order, instead of whatever they were to make
+ * next */
+void vrp_cache_prefetch(VRP_Cache *c, const void *keys, int count)
+{
+    if(count > VRP_CACHE_AHEAD)
+        count = VRP_CACHE_AHEAD;
+    pthread_mutex_lock(&c->ahead_lock);
+    memcpy(c->queue, keys, count * c->key_size);
+    c->next = 0;
+    c->count = count;
+    pthread_cond_broadcast(&c->more);
+    pthread_mutex_unlock(&c->ahead_lock);
+}
+
+static void *prefetcher(void *arg)
+{
+    VRP_Cache      *c = arg;
+    VRP_CacheEntry *e;
+    char           *key;
+
+    if(!(key = malloc(c->key_size)))
+        return NULL;
+    for(;;)
+    {
+        pthread_mutex_lock(&c->ahead_lock);
+        while(c->next >= c->count)
+            pthread_cond_wait(&c->more, &c->ahead_lock);
+        memcpy(key, c->queue + c->next++ * c->key_size, c->key_size);
+        pthread_mutex_unlock(&c->ahead_lock);
+
+        if(c->warm && c->warm(key, c->arg))
+            continue;
+        if((e = vrp_cache_get(c, key, 1, NULL)))
+            vrp_cache_release(c, e);
+    }
+    return NULL;
+}
+
+/* vrp_cache_start - start threads (detached) prefetching for c, which
+ * run for as long as the process does
+ *
+ * return value: 0, or -1 (with errno set) if they couldn't all be
+ * started.
+ */
+int vrp_cache_start(VRP_Cache *c, int threads)
+{
+    pthread_attr_t detached;
+    pthread_t      thread;
+    int            i, ret = 0;
+
+    pthread_attr_init(&detached);
+    pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+    for(i = 0; i < threads && ret == 0; ++i)
+        if((ret = pthread_create(&thread, &detached, prefetcher, c)))
+        {
+            errno = ret;
+            ret = -1;
+        }
+    pthread_attr_destroy(&detached);
+    return ret;
+}
@@ -0,0 +1,833 @@
+/*
+ * extract.c -- turn the raw pixel data of a CINE image into RGB (or,
+ * for monochrome cines, gray; or planar YUV, for video encoders)
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2011, 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h> /* for htons() */
+
+#include "vrptools.h"
+#include "util.h"
+
+typedef uint16_t v16u16 __attribute__((vector_size(32)));
+typedef uint8_t v32u8 __attribute__((vector_size(32)));
+typedef uint16_t v8u16 __attribute__((vector_size(16)));
+typedef float v8f32 __attribute__((vector_size(32)));
+typedef int32_t v8i32 __attribute__((vector_size(32)));
+
+/* output_buffer - a new buffer for one of the vrp_extract_*() calls'
+ * results: 64-byte aligned, but still the caller's to free(), and left
+ * untouched (unlike calloc()'s) so that its pages belong to whichever
+ * thread first writes them */
+static void *output_buffer(size_t bytes)
+{
+    void *p;
+
+    return posix_memalign(&p, 64, bytes) ? NULL : p;
+}
+
+/* decode_jpeg - decode the CC_JPEG image at offset into a pool buffer,
+ * with its samples scaled to the cine's range (0 to biClrImportant - 1,
+ * as an uncompressed image's would be); returns NULL on failure */
+static uint16_t *decode_jpeg(VRP_Handle handle, int offset, int threads, VRP_JpegInfo *info, VRP_Error *err)
+{
+    const void *data;
+    size_t     size, i, count;
+    uint16_t   *decoded;
+    unsigned   top, maxval = handle->imageHeader->biClrImportant;
+
+    if (!(data = vrp_image_pixels(handle, offset)) || !(size = vrp_image_stored_size(handle, offset)))
+    {
+        vrp_set_error(err, VRP_E_RANGE, "%s: image at offset %d is missing or truncated",
+                      handle->name, offset);
+        return NULL;
+    }
+    if (vrp_jpeg_info(data, size, info, err) < 0)
+        return NULL;
+
+    count = (size_t)info->width * info->height * info->components;
+    if (!(decoded = vrp_buffer_get(count * sizeof(*decoded))))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", handle->name);
+        return NULL;
+    }
+    if (vrp_jpeg_decode(data, size, decoded, threads, err) < 0)
+    {
+        vrp_buffer_put(decoded);
+        return NULL;
+    }
+
+    top = (1u << info->precision) - 1;
+    if (maxval > 1 && maxval - 1 != top)
+        for (i = 0; i < count; ++i)
+            decoded[i] = ((uint64_t)decoded[i] * (maxval - 1) + top / 2) / top;
+    return decoded;
+}
+
+/* samples16 - the image at offset as 16-bit samples in stored order
+ * (rows bottom-up): straight from the file where it holds them that
+ * way, otherwise decoded or widened into *decoded (a pool buffer, the
+ * caller's to vrp_buffer_put()).  JPEG images decode to what an
+ * uncompressed one would have held -- CFA or gray samples, or, for
+ * three-component sequential JPEGs, RGB, in which case *rgb is set.
+ * Returns NULL on failure. */
+static const uint16_t *samples16(VRP_Handle handle, int offset, int threads,
+                                 uint16_t **decoded, int *rgb, VRP_Error *err)
+{
+    const void   *pixels;
+    int          rows = handle->imageHeader->biHeight, cols = handle->imageHeader->biWidth;
+    size_t       n;
+    VRP_JpegInfo info;
+
+    *decoded = NULL;
+    *rgb = 0;
+    if (handle->header->Compression == VRP_CC_JPEG)
+    {
+        if (!(*decoded = decode_jpeg(handle, offset, threads, &info, err)))
+            return NULL;
+        *rgb = info.components == 3 && !info.lossless;
+        if (*rgb ? info.width != cols || info.height != rows
+                 : (size_t)info.width * info.height * info.components != (size_t)rows * cols)
+        {
+            vrp_set_error(err, VRP_E_FORMAT, "%s: image at offset %d decodes to %dx%dx%d, not %dx%d",
+                          handle->name, offset, info.width, info.height, info.components, cols, rows);
+            return NULL;
+        }
+        return *decoded;
+    }
+    if (handle->header->Compression != VRP_CC_UNINT && !vrp_is_gray(handle))
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "Woah, sorry, don't (yet) know how to handle Compression type %d",
+                      handle->header->Compression);
+        return NULL;
+    }
+    if (handle->imageHeader->biBitCount != 8 && handle->imageHeader->biBitCount != 16)
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: can't handle %d-bit (packed?) pixels",
+                      handle->name, handle->imageHeader->biBitCount);
+        return NULL;
+    }
+    if (!(pixels = vrp_image_pixels(handle, offset)))
+    {
+        vrp_set_error(err, VRP_E_RANGE, "%s: image at offset %d is missing or truncated",
+                      handle->name, offset);
+        return NULL;
+    }
+    if (handle->imageHeader->biBitCount == 16)
+        return pixels;
+
+    n = (size_t)rows * cols;
+    if (!(*decoded = vrp_buffer_get(n * sizeof(**decoded))))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", handle->name);
+        return NULL;
+    }
+    while (n--)
+        (*decoded)[n] = ((const uint8_t *)pixels)[n];
+    return *decoded;
+}
+
+/* the work of vrp_extract_image(), below */
+static int extract_image(VRP_Handle handle, int offset, int threads,
+			 int *rows_out, int *cols_out,
+			 uint16_t **outbuf_out, size_t *bufsize, VRP_Error *err)
+{
+    const VRP_WORD      *pixelData;
+    int                 i, j, k, row, col, rows, cols, rgb, gray, ret = -1;
+    size_t              bufsiz;
+    uint16_t            *outbuf, *decoded = NULL;
+    float               wb_b, wb_r;
+    struct _ppm_pixel {
+        VRP_WORD r;
+        VRP_WORD g;
+        VRP_WORD b;
+    } pixel;
+
+    rows = handle->imageHeader->biHeight;
+    cols = handle->imageHeader->biWidth;
+
+    if (!(pixelData = samples16(handle, offset, threads, &decoded, &rgb, err)))
+        goto done;
+    gray = !rgb && vrp_is_gray(handle);
+    if (!rgb && !gray && handle->setup->CFA != VRP_CFA_BAYER)
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "Woah, sorry, don't (yet) know how to handle CFA type %d",
+                      handle->setup->CFA);
+        goto done;
+    }
+
+    rows = handle->imageHeader->biHeight;
+    cols = handle->imageHeader->biWidth;
+
+    bufsiz = 3*(size_t)rows*cols;
+
+    wb_r = handle->setup->WBGain[0].R;
+    wb_b = handle->setup->WBGain[0].B;
+
+    assert(outbuf_out);
+
+    /* (without bufsize, we have to trust that a buffer we're given
+     * is big enough) */
+    outbuf = *outbuf_out;
+    if (!outbuf || (bufsize && *bufsize < bufsiz))
+    {
+	free(outbuf);
+	*outbuf_out = NULL;
+	outbuf = output_buffer(bufsiz * sizeof(*outbuf));
+	if (!outbuf)
+	{
+	    vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", handle->name);
+	    goto done;
+	}
+	*outbuf_out = outbuf;
+	if (bufsize)
+	    *bufsize = bufsiz;
+    }
+    *rows_out = rows;
+    *cols_out = cols;
+
+    /* already RGB: just turn it the right way up */
+    if (rgb)
+    {
+        for (i = rows - 1; i >= 0; --i)
+            for (j = 0; j < cols; ++j)
+                for (k = 0; k < 3; ++k)
+                    outbuf[3*(i*cols+j)+k] = htons(pixelData[3*((rows-i-1)*cols+j)+k]);
+        ret = 0;
+        goto done;
+    }
+
+    /* gray: the same sample in all three (but see vrp_extract_gray()) */
+    if (gray)
+    {
+        for (i = rows - 1; i >= 0; --i)
+            for (j = 0; j < cols; ++j)
+                outbuf[3*(i*cols+j)+0] = outbuf[3*(i*cols+j)+1] = outbuf[3*(i*cols+j)+2]
+                    = htons(pixelData[(rows-i-1)*cols+j]);
+        ret = 0;
+        goto done;
+    }
+
+    /* go through rows backwards, to convert bottom-up format to top-down: */
+    for (i = rows - 1; i >= 0; --i)
+    {
+        row = rows - i - 1;
+
+        /* columns go in regular (left-to-right) order: */
+        for (j = 0; j < cols; ++j)
+        {
+            col = j;
+
+            /* XXX very naive and simple demosaicing right now */
+            /* TODO: find a better algorithm; see http://en.wikipedia.org/wiki/Demosaicing */
+
+            switch((row % 2) << 1 | col % 2)
+            {
+            case 0: /* bottom-left: red */
+                pixel.r = pixelData[row*cols+col]; /* real */
+                pixel.g = pixelData[row*cols+col+1]; /* from the right */
+                pixel.b = pixelData[(row+1)*cols+col+1]; /* from above, right */
+                break;
+            case 1: /* bottom-right: green */
+                pixel.r = pixelData[row*cols+col-1]; /* from the left */
+                pixel.g = pixelData[row*cols+col]; /* real value */
+                pixel.b = pixelData[(row+1)*cols+col]; /* from above */
+                break;
+            case 2: /* top-left: green */
+                pixel.r = pixelData[(row-1)*cols+col]; /* from below */
+                pixel.g = pixelData[row*cols+col]; /* real value */
+                pixel.b = pixelData[row*cols+col+1]; /* from the right */
+                break;
+            case 3: /* top-right: blue */
+                pixel.r = pixelData[(row-1)*cols+col-1]; /* from below, left */
+                pixel.g = pixelData[row*cols+col-1]; /* from the left */
+                pixel.b = pixelData[row*cols+col]; /* real value */
+                break;
+            }
+
+            /* adjust white balance */
+            pixel.r = wb_r * pixel.r;
+            if (pixel.r >= handle->imageHeader->biClrImportant)
+                pixel.r = handle->imageHeader->biClrImportant - 1;
+            pixel.b = wb_b * pixel.b;
+            if (pixel.b >= handle->imageHeader->biClrImportant)
+                pixel.b = handle->imageHeader->biClrImportant - 1;
+
+            /* prepare to store -- using network byte order (big-endian) */
+            pixel.r = htons(pixel.r);
+            pixel.g = htons(pixel.g);
+            pixel.b = htons(pixel.b);
+
+            outbuf[3*(i*cols+j)+0] = pixel.r;
+            outbuf[3*(i*cols+j)+1] = pixel.g;
+            outbuf[3*(i*cols+j)+2] = pixel.b;
+        }
+    }
+    ret = 0;
+
+done:
+    vrp_buffer_put(decoded);
+    return ret;
+}
+
+/* vrp_extract_image - demosaic the image at offset into RGB48 (gray
+ * images are copied into all three channels)
+ *
+ * inputs:
+ *   handle  - handle to opened VRP Cine file
+ *   offset  - offset of image we want to extract
+ *   buf     - where the result goes: *buf is (re)allocated as needed,
+ *             and is the caller's to free when done
+ *   bufsize - how many samples *buf has room for (updated if it's
+ *             reallocated)
+ *   err     - where to say what went wrong (may be NULL)
+ *
+ * outputs:
+ *   rows_out, cols_out - dimensions of the extracted image
+ *   *buf - rows*cols*3 big-endian samples, top row first
+ *
+ * return value:
+ *   0 on success, -1 on failure
+ *
+ * Uses nothing but the handle and the caller's buffer (packed files
+ * decode into a cursor of the calling thread's), so is safe to call
+ * from several threads at once, with separate buffers.
+ */
+int vrp_extract_image(VRP_Handle handle, int offset, int *rows_out, int *cols_out,
+                      uint16_t **buf, size_t *bufsize, VRP_Error *err)
+{
+    return vrp_extract_image_mt(handle, offset, 1, rows_out, cols_out, buf, bufsize, err);
+}
+
+/* vrp_extract_image_mt - vrp_extract_image(), but spreading the work
+ * over threads (0: one per CPU) where it can be split: so far, that's
+ * the restart intervals of CC_JPEG images */
+int vrp_extract_image_mt(VRP_Handle handle, int offset, int threads, int *rows_out, int *cols_out,
+                         uint16_t **buf, size_t *bufsize, VRP_Error *err)
+{
+    VRP_StatsTimer t;
+    int            ret;
+
+    VRP_STATS_START(&t);
+    ret = extract_image(handle, offset, threads, rows_out, cols_out, buf, bufsize, err);
+    VRP_STATS_STOP(&t, VRP_STAGE_DEMOSAIC, vrp_image_size(handle));
+    return ret;
+}
+
+/* gray_row16 - copy n 16-bit samples, clamped to top and swapped to
+ * big-endian, 16 at a time */
+static void gray_row16(uint16_t *out, const uint16_t *in, size_t n, uint16_t top)
+{
+    v16u16 limit = (v16u16){} + top;
+    size_t i, v = n & ~(size_t)15;
+
+    for (i = 0; i < v; i += 16)
+    {
+        v16u16 s, over;
+
+        memcpy(&s, in + i, sizeof(s));
+        over = (v16u16)(s > limit);
+        s = (s & ~over) | (limit & over);
+        s = s << 8 | s >> 8;
+        memcpy(out + i, &s, sizeof(s));
+    }
+    for (; i < n; ++i)
+        out[i] = htons(in[i] > top ? top : in[i]);
+}
+
+/* gray_row8 - the same for 8-bit samples (only clamping if there's
+ * anything to clamp; otherwise it's just a memcpy()) */
+static void gray_row8(uint8_t *out, const uint8_t *in, size_t n, uint8_t top)
+{
+    v32u8  limit = (v32u8){} + top;
+    size_t i, v = n & ~(size_t)31;
+
+    if (top == 0xff)
+    {
+        memcpy(out, in, n);
+        return;
+    }
+    for (i = 0; i < v; i += 32)
+    {
+        v32u8 s, over;
+
+        memcpy(&s, in + i, sizeof(s));
+        over = (v32u8)(s > limit);
+        s = (s & ~over) | (limit & over);
+        memcpy(out + i, &s, sizeof(s));
+    }
+    for (; i < n; ++i)
+        out[i] = in[i] > top ? top : in[i];
+}
+
+/* vrp_extract_gray - copy a monochrome image (see vrp_is_gray()) out
+ * as it is: turned the right way up, in big-endian order, and clamped
+ * to the cine's range -- with no demosaicing, nor tripling of its size
+ *
+ * inputs:
+ *   handle  - handle to opened VRP Cine file
+ *   offset  - offset of image we want to extract
+ *   threads - for decoding CC_JPEG images (0: one per CPU)
+ *   buf     - where the result goes: *buf is (re)allocated as needed,
+ *             and is the caller's to free when done
+ *   bufsize - how many bytes *buf has room for (updated if it's
+ *             reallocated)
+ *   err     - where to say what went wrong (may be NULL)
+ *
+ * outputs:
+ *   rows_out, cols_out - dimensions of the extracted image
+ *   *buf - rows*cols samples, top row first: bytes for 8-bit cines,
+ *          otherwise big-endian 16-bit words; none over maxval - 1
+ *          (maxval being biClrImportant, or the full range if that's
+ *          unset), so fit to go straight into a PGM
+ *
+ * return value:
+ *   0 on success, -1 on failure
+ */
+int vrp_extract_gray(VRP_Handle handle, int offset, int threads, int *rows_out, int *cols_out,
+                     void **buf, size_t *bufsize, VRP_Error *err)
+{
+    const void     *pixels;
+    uint16_t       *decoded = NULL;
+    unsigned       maxval = handle->imageHeader ? handle->imageHeader->biClrImportant : 0;
+    unsigned       top;
+    int            rows, cols, narrow, i, j, ret = -1;
+    size_t         bytes, rowbytes;
+    unsigned char  *out;
+    VRP_JpegInfo   info;
+    VRP_StatsTimer t;
+
+    if (!vrp_is_gray(handle))
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: not a monochrome cine", handle->name);
+        return -1;
+    }
+
+    VRP_STATS_START(&t);
+    rows = handle->imageHeader->biHeight;
+    cols = handle->imageHeader->biWidth;
+    narrow = handle->imageHeader->biBitCount == 8;
+    top = narrow ? 0xff : 0xffff;
+    if (maxval && maxval - 1 < top)
+        top = maxval - 1;
+
+    if (handle->header->Compression == VRP_CC_JPEG)
+    {
+        if (!(decoded = decode_jpeg(handle, offset, threads, &info, err)))
+            goto done;
+        if (info.components != 1 || info.width != cols || info.height != rows)
+        {
+            vrp_set_error(err, VRP_E_FORMAT, "%s: image at offset %d decodes to %dx%dx%d, not %dx%d",
+                          handle->name, offset, info.width, info.height, info.components, cols, rows);
+            goto done;
+        }
+        pixels = decoded;
+    }
+    else if (!narrow && handle->imageHeader->biBitCount != 16)
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: can't handle %d-bit (packed?) pixels",
+                      handle->name, handle->imageHeader->biBitCount);
+        goto done;
+    }
+    else if (!(pixels = vrp_image_pixels(handle, offset)))
+    {
+        vrp_set_error(err, VRP_E_RANGE, "%s: image at offset %d is missing or truncated",
+                      handle->name, offset);
+        goto done;
+    }
+
+    rowbytes = (size_t)cols * (narrow ? 1 : 2);
+    bytes = rowbytes * rows;
+    assert(buf);
+    out = *buf;
+    if (!out || (bufsize && *bufsize < bytes))
+    {
+        free(out);
+        if (!(*buf = out = output_buffer(bytes)))
+        {
+            vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", handle->name);
+            goto done;
+        }
+        if (bufsize)
+            *bufsize = bytes;
+    }
+    *rows_out = rows;
+    *cols_out = cols;
+
+    /* the stored rows go bottom-up */
+    for (i = 0; i < rows; ++i)
+    {
+        unsigned char *dst = out + (size_t)(rows - 1 - i) * rowbytes;
+
+        if (!decoded && narrow)
+            gray_row8(dst, (const uint8_t *)pixels + (size_t)i * cols, cols, top);
+        else if (!narrow)
+            gray_row16((uint16_t *)dst, (const uint16_t *)pixels + (size_t)i * cols, cols, top);
+        else /* an 8-bit cine's JPEG, decoded to 16 bits */
+            for (j = 0; j < cols; ++j)
+                dst[j] = decoded[(size_t)i * cols + j] > top ? top : decoded[(size_t)i * cols + j];
+    }
+    ret = 0;
+
+done:
+    vrp_buffer_put(decoded);
+    VRP_STATS_STOP(&t, VRP_STAGE_DEMOSAIC, vrp_image_size(handle));
+    return ret;
+}
+
+
+/** YUV: demosaicing, white balance and colour conversion in one pass **/
+
+/* The demosaicing above gives each pixel of a stored 2x2 quad that
+ * quad's red and blue, and the green from its own row -- so a quad
+ * comes down to four numbers, and its Y, U and V can be worked out
+ * straight from them, eight quads at a time, without ever building
+ * the RGB image.  The results are what a video encoder would get by
+ * converting that RGB itself (e.g. ffmpeg from our PPMs): no transfer
+ * curve, limited ("TV") range, chroma averaged over each 2x2 (4:2:0)
+ * or 2x1 (4:2:2) block. */
+
+#define YUV_BAND 16 /* quads (pairs of rows) down per work item */
+
+#define YUV_BAYER 0
+#define YUV_GRAY  1
+#define YUV_RGB   2
+
+struct yuv_job {
+    const uint16_t *pixels;       /* as from samples16() */
+    int            kind;          /* YUV_BAYER, YUV_GRAY or YUV_RGB */
+    int            rows, cols, chroma, bits;
+    int            r, b, g0, g1;  /* where red, blue and the lower and upper
+                                   * rows' greens are in a quad (as indexes
+                                   * into vrp_cfa_pattern()'s pattern) */
+    float          wb_r, wb_b, top;
+    float          ky[3], ku[3], kv[3], yoff, coff; /* per R, G and B */
+    unsigned char  *y, *u, *v;    /* the planes */
+};
+
+/* yuv_put - store sample i of a plane: a byte, or for more than 8
+ * bits a little-endian word (as in ffmpeg's yuv420p10le and kin) */
+static inline void yuv_put(unsigned char *plane, size_t i, int bits, int value)
+{
+    if (bits == 8)
+        plane[i] = value;
+    else
+    {
+        plane[2*i] = value & 0xff;
+        plane[2*i+1] = value >> 8;
+    }
+}
+
+/* yuv_store - store n samples at sample i of a plane, as yuv_put() */
+static inline void yuv_store(unsigned char *plane, size_t i, int bits, const uint16_t *samples, int n)
+{
+    int k;
+
+    if (bits == 8)
+        for (k = 0; k < n; ++k)
+            plane[i+k] = samples[k];
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    else
+        memcpy(plane + 2*i, samples, n * sizeof(*samples));
+#else
+    else
+        for (k = 0; k < n; ++k)
+            yuv_put(plane, i+k, bits, samples[k]);
+#endif
+}
+
+/* yuv_bayer_band - convert one band of quads of a CFA image */
+static void yuv_bayer_band(int band, void *arg)
+{
+    const struct yuv_job *job = arg;
+    const v16u16         deal = { 0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15 };
+    const v16u16         twice = { 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7 };
+    const v8f32          top = (v8f32){} + job->top;
+    int                  q, q1 = (band + 1) * YUV_BAND, k, i, n;
+    int                  quads = job->cols / 2, cw = job->cols / 2, bits = job->bits;
+
+    if (q1 > job->rows / 2)
+        q1 = job->rows / 2;
+
+    for (q = band * YUV_BAND; q < q1; ++q)
+    {
+        const uint16_t *stored = job->pixels + (size_t)2 * q * job->cols;
+        int            out[2];
+
+        /* its lower and upper stored rows, top-down */
+        out[0] = job->rows - 1 - 2 * q;
+        out[1] = out[0] - 1;
+
+        for (k = 0; k < quads; k += 8)
+        {
+            v16u16 in[2], ys[2];
+            v8u16  half, us[2], vs[2];
+            v8f32  s[4], r, b, g, y, u, v;
+            v8i32  over;
+
+            /* eight quads: each row dealt into evens and odds */
+            n = quads - k < 8 ? quads - k : 8;
+            if (n < 8)
+                memset(in, 0, sizeof(in));
+            for (i = 0; i < 2; ++i)
+            {
+                memcpy(&in[i], stored + (size_t)i * job->cols + 2 * k, 2 * n * sizeof(uint16_t));
+                in[i] = __builtin_shuffle(in[i], deal);
+                memcpy(&half, &in[i], sizeof(half));
+                s[2*i] = __builtin_convertvector(half, v8f32);
+                memcpy(&half, (char *)&in[i] + sizeof(half), sizeof(half));
+                s[2*i+1] = __builtin_convertvector(half, v8f32);
+            }
+
+            /* white balance, clamped as extract_image() does */
+            r = s[job->r] * job->wb_r;
+            over = r > top;
+            r = (v8f32)(((v8i32)r & ~over) | ((v8i32)top & over));
+            b = s[job->b] * job->wb_b;
+            over = b > top;
+            b = (v8f32)(((v8i32)b & ~over) | ((v8i32)top & over));
+
+            for (i = 0; i < 2; ++i)
+            {
+                g = s[i ? job->g1 : job->g0];
+                y = job->yoff + job->ky[0] * r + job->ky[1] * g + job->ky[2] * b;
+                half = __builtin_convertvector(__builtin_convertvector(y, v8i32), v8u16);
+                memcpy(&ys[i], &half, sizeof(half));
+                ys[i] = __builtin_shuffle(ys[i], twice);  /* (a quad's two pixels in a row match) */
+                if (job->chroma == 420)
+                {
+                    if (i)
+                        continue;
+                    g = (s[job->g0] + s[job->g1]) * 0.5f;
+                }
+                u = job->coff + job->ku[0] * r + job->ku[1] * g + job->ku[2] * b;
+                v = job->coff + job->kv[0] * r + job->kv[1] * g + job->kv[2] * b;
+                us[i] = __builtin_convertvector(__builtin_convertvector(u, v8i32), v8u16);
+                vs[i] = __builtin_convertvector(__builtin_convertvector(v, v8i32), v8u16);
+            }
+
+            for (i = 0; i < 2; ++i)
+            {
+                size_t c = (size_t)(job->chroma == 420 ? job->rows / 2 - 1 - q : out[i]) * cw + k;
+
+                yuv_store(job->y, (size_t)out[i] * job->cols + 2 * k, bits, (const uint16_t *)&ys[i], 2 * n);
+                if (job->chroma == 420 && i)
+                    continue;
+                yuv_store(job->u, c, bits, (const uint16_t *)&us[i], n);
+                yuv_store(job->v, c, bits, (const uint16_t *)&vs[i], n);
+            }
+        }
+    }
+}
+
+/* yuv_pixels_band - the same for gray or RGB images, which have a
+ * colour for every pixel already (and so no white balance to apply) */
+static void yuv_pixels_band(int band, void *arg)
+{
+    const struct yuv_job *job = arg;
+    int                  q, q1 = (band + 1) * YUV_BAND, k, i, j, c;
+    int                  cw = job->cols / 2, bits = job->bits;
+    float                px[4][3], sum[2][3], y;
+
+    if (q1 > job->rows / 2)
+        q1 = job->rows / 2;
+
+    for (q = band * YUV_BAND; q < q1; ++q)
+        for (k = 0; k < cw; ++k)
+        {
+            /* the quad's four pixels, lower row first */
+            for (i = 0; i < 4; ++i)
+            {
+                size_t at = (size_t)(2 * q + i / 2) * job->cols + 2 * k + i % 2;
+
+                for (c = 0; c < 3; ++c)
+                    px[i][c] = job->kind == YUV_GRAY ? job->pixels[at] : job->pixels[3 * at + c];
+            }
+
+            for (i = 0; i < 2; ++i)
+            {
+                int out = job->rows - 1 - 2 * q - i;
+
+                for (c = 0; c < 3; ++c)
+                    sum[i][c] = (px[2*i][c] + px[2*i+1][c]) * 0.5f;
+                for (j = 0; j < 2; ++j)
+                {
+                    y = job->yoff;
+                    for (c = 0; c < 3; ++c)
+                        y += job->ky[c] * px[2*i+j][c];
+                    yuv_put(job->y, (size_t)out * job->cols + 2 * k + j, bits, y);
+                }
+            }
+
+            for (i = 0; i < (job->chroma == 420 ? 1 : 2); ++i)
+            {
+                size_t at = (size_t)(job->chroma == 420 ? job->rows / 2 - 1 - q : job->rows - 1 - 2 * q - i) * cw + k;
+                float  u = job->coff, v = job->coff;
+
+                for (c = 0; c < 3; ++c)
+                {
+                    float m = job->chroma == 420 ? (sum[0][c] + sum[1][c]) * 0.5f : sum[i][c];
+
+                    u += job->ku[c] * m;
+                    v += job->kv[c] * m;
+                }
+                yuv_put(job->u, at, bits, u);
+                yuv_put(job->v, at, bits, v);
+            }
+        }
+}
+
+/* vrp_extract_yuv - the image at offset as planar YUV, for feeding
+ * straight to a video encoder
+ *
+ * inputs:
+ *   handle  - handle to opened VRP Cine file
+ *   offset  - offset of image we want to extract
+ *   chroma  - VRP_YUV420 or VRP_YUV422 (subsampling)
+ *   bits    - 8 or 10 per sample
+ *   matrix  - VRP_YUV_BT709 or VRP_YUV_BT2020 (colour matrix)
+ *   threads - how many threads to convert with (0: one per CPU)
+ *   buf     - where the result goes: *buf is (re)allocated as needed,
+ *             and is the caller's to free when done
+ *   bufsize - how many bytes *buf has room for (updated if it's
+ *             reallocated)
+ *   err     - where to say what went wrong (may be NULL)
+ *
+ * outputs:
+ *   rows_out, cols_out - dimensions of the extracted image
+ *   *buf - the Y plane (rows*cols), then U and V (cols/2 wide, and
+ *          rows/2 (4:2:0) or rows (4:2:2) high), top row first; each
+ *          sample a byte for 8 bits, else a little-endian word -- as
+ *          ffmpeg's yuv420p, yuv420p10le, yuv422p and yuv422p10le
+ *
+ * return value:
+ *   0 on success, -1 on failure
+ *
+ * CFA images are demosaiced and white balanced as vrp_extract_image()
+ * does, in the same pass; both dimensions must be even.
+ */
+int vrp_extract_yuv(VRP_Handle handle, int offset, int chroma, int bits, int matrix, int threads,
+                    int *rows_out, int *cols_out, void **buf, size_t *bufsize, VRP_Error *err)
+{
+    struct yuv_job job;
+    unsigned char  pattern[4], *out;
+    uint16_t       *decoded = NULL;
+    unsigned       maxval = handle->imageHeader->biClrImportant;
+    int            rgb, i, ret = -1;
+    size_t         plane, cplane, bytes;
+    double         kr, kb, kg, ys, cs;
+    VRP_StatsTimer t;
+
+    if ((chroma != VRP_YUV420 && chroma != VRP_YUV422) || (bits != 8 && bits != 10)
+        || (matrix != VRP_YUV_BT709 && matrix != VRP_YUV_BT2020))
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "YUV %d, %d bits, BT.%d isn't something we can write",
+                      chroma, bits, matrix);
+        return -1;
+    }
+
+    VRP_STATS_START(&t);
+    memset(&job, 0, sizeof(job));
+    job.rows = handle->imageHeader->biHeight;
+    job.cols = handle->imageHeader->biWidth;
+    job.chroma = chroma;
+    job.bits = bits;
+    if (job.rows <= 0 || job.cols <= 0 || job.rows % 2 || job.cols % 2)
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: %dx%d images can't be subsampled to YUV (need even sizes)",
+                      handle->name, job.cols, job.rows);
+        goto done;
+    }
+
+    if (!(job.pixels = samples16(handle, offset, threads, &decoded, &rgb, err)))
+        goto done;
+    if (rgb)
+        job.kind = YUV_RGB;
+    else if (vrp_is_gray(handle))
+        job.kind = YUV_GRAY;
+    else
+    {
+        /* red and blue, with a green in each row */
+        job.kind = YUV_BAYER;
+        job.r = job.b = job.g0 = job.g1 = -1;
+        if (vrp_cfa_pattern(handle, pattern) == 0)
+            for (i = 0; i < 4; ++i)
+                switch (pattern[i])
+                {
+                case 0: job.r = i; break;
+                case 2: job.b = i; break;
+                default: *(i < 2 ? &job.g0 : &job.g1) = i; break;
+                }
+        if (job.r < 0 || job.b < 0 || job.g0 < 0 || job.g1 < 0)
+        {
+            vrp_set_error(err, VRP_E_UNSUPPORTED, "Woah, sorry, don't (yet) know how to handle CFA type %d",
+                          handle->setup->CFA);
+            goto done;
+        }
+        job.wb_r = handle->setup->WBGain[0].R;
+        job.wb_b = handle->setup->WBGain[0].B;
+    }
+
+    /* Y = Kr R + Kg G + Kb B, U and V the scaled differences from it
+     * of B and R, all mapped from 0..top onto the limited range */
+    kr = matrix == VRP_YUV_BT709 ? 0.2126 : 0.2627;
+    kb = matrix == VRP_YUV_BT709 ? 0.0722 : 0.0593;
+    kg = 1 - kr - kb;
+    job.top = maxval > 1 && maxval <= 65536 ? maxval - 1 : 65535;
+    ys = (219 << (bits - 8)) / job.top;
+    cs = (224 << (bits - 8)) / job.top;
+    job.ky[0] = kr * ys;
+    job.ky[1] = kg * ys;
+    job.ky[2] = kb * ys;
+    job.ku[0] = -kr / (2 * (1 - kb)) * cs;
+    job.ku[1] = -kg / (2 * (1 - kb)) * cs;
+    job.ku[2] = 0.5 * cs;
+    job.kv[0] = 0.5 * cs;
+    job.kv[1] = -kg / (2 * (1 - kr)) * cs;
+    job.kv[2] = -kb / (2 * (1 - kr)) * cs;
+    job.yoff = (16 << (bits - 8)) + 0.5f;  /* (+ 0.5: round, not truncate) */
+    job.coff = (128 << (bits - 8)) + 0.5f;
+
+    plane = (size_t)job.rows * job.cols;
+    cplane = plane / (chroma == VRP_YUV420 ? 4 : 2);
+    bytes = (plane + 2 * cplane) * (bits == 8 ? 1 : 2);
+    assert(buf);
+    out = *buf;
+    if (!out || (bufsize && *bufsize < bytes))
+    {
+        free(out);
+        if (!(*buf = out = output_buffer(bytes)))
+        {
+            vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", handle->name);
+            goto done;
+        }
+        if (bufsize)
+            *bufsize = bytes;
+    }
+    job.y = out;
+    job.u = out + plane * (bits == 8 ? 1 : 2);
+    job.v = job.u + cplane * (bits == 8 ? 1 : 2);
+    *rows_out = job.rows;
+    *cols_out = job.cols;
+
+    vrp_parallel_for((job.rows / 2 + YUV_BAND - 1) / YUV_BAND, threads,
+                     job.kind == YUV_BAYER ? yuv_bayer_band : yuv_pixels_band, &job);
+    ret = 0;
+
+done:
+    vrp_buffer_put(decoded);
+    VRP_STATS_STOP(&t, VRP_STAGE_DEMOSAIC, vrp_image_size(handle));
+    return ret;
+}
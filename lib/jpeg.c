@@ -0,0 +1,692 @@
+/*
+ * jpeg.c -- a JPEG decoder for the images of CC_JPEG cines: baseline
+ * and extended (8- and 12-bit) sequential Huffman, and lossless
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "vrptools.h"
+#include "util.h"
+
+/*
+ * Only what's needed for a single image in a single scan: SOF0, SOF1
+ * and SOF3 (lossless), one SOS holding every component, Huffman
+ * coding.  Progressive, arithmetic-coded, hierarchical and multi-scan
+ * images are refused.
+ *
+ * Restart intervals are independent by design (predictors reset at
+ * each one), so the entropy-coded data is first cut at its RSTn
+ * markers, and the intervals are decoded on separate threads, each
+ * into its own part of the component planes.  Without restart markers
+ * an image is decoded on one thread.
+ *
+ * Sequential images are decoded a block at a time (dequantized, then a
+ * separable floating-point IDCT) into per-component planes, which are
+ * then upsampled (by replication) and, for three components that
+ * aren't marked as RGB, converted from YCbCr.  Lossless images are
+ * predicted straight into the output.
+ */
+
+#define JPEG_FAST_BITS 9
+
+struct jpeg_huffman {
+    int      present;
+    uint8_t  values[256];
+    int32_t  maxcode[18];   /* largest code of each length (-1 if none) */
+    int32_t  delta[17];     /* code minus index into values, for each length */
+    uint16_t fast[1 << JPEG_FAST_BITS]; /* length << 8 | value, for short codes (0: longer) */
+};
+
+struct jpeg_component {
+    int      id, h, v, tq;  /* from the frame header */
+    int      td, ta;        /* from the scan header: DC (or lossless) and AC tables */
+    int      bw, bh;        /* blocks across and down the plane */
+    uint16_t *plane;        /* sequential: bw * 8 by bh * 8 samples */
+};
+
+struct jpeg_interval {
+    const unsigned char *start, *end;
+};
+
+struct jpeg {
+    int                   lossless, precision, width, height, ncomp;
+    struct jpeg_component comp[4];
+    uint16_t              qt[4][64];  /* (in zigzag order) */
+    struct jpeg_huffman   dc[4], ac[4];
+    int                   restart;    /* MCUs per restart interval (0: none) */
+    int                   nscan, scan[4]; /* the scan's components (indices into comp) */
+    int                   ss, pt;     /* lossless predictor, point transform */
+    int                   hmax, vmax, mcux, mcuy;
+    int                   rgb;        /* three components that are RGB already */
+    struct jpeg_interval  *intervals;
+    int                   nintervals;
+    uint16_t              *out;       /* lossless: width * height * ncomp */
+    int                   failed;
+};
+
+struct jpeg_bits {
+    const unsigned char *p, *end;
+    uint64_t            acc;         /* n bits, right-aligned */
+    int                 n;
+};
+
+static const unsigned char zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static float idct_table[8][8]; /* [x][u]: C(u)/2 * cos((2x+1)u pi/16) */
+
+static void idct_init(void)
+{
+    int x, u;
+
+    for(x = 0; x < 8; ++x)
+        for(u = 0; u < 8; ++u)
+            idct_table[x][u] = (u ? 0.5 : 0.5 / sqrt(2.0)) * cos((2 * x + 1) * u * M_PI / 16);
+}
+
+static unsigned get16(const unsigned char *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+/* build the decoding tables from a DHT's 16 counts and its values */
+static int huffman_build(struct jpeg_huffman *h, const unsigned char *counts, const unsigned char *values, int nvalues)
+{
+    int code = 0, k = 0, len, i, j;
+
+    memset(h, 0, sizeof(*h));
+    memcpy(h->values, values, nvalues);
+    for(len = 1; len <= 16; ++len)
+    {
+        h->delta[len] = code - k;
+        for(i = 0; i < counts[len - 1]; ++i, ++k, ++code)
+            if(len <= JPEG_FAST_BITS)
+                for(j = 0; j < 1 << (JPEG_FAST_BITS - len); ++j)
+                    h->fast[(code << (JPEG_FAST_BITS - len)) | j] = len << 8 | values[k];
+        h->maxcode[len] = counts[len - 1] ? code - 1 : -1;
+        if(code > 1 << len)
+            return -1;
+        code <<= 1;
+    }
+    h->maxcode[17] = 0x7fffffff;
+    h->present = 1;
+    return 0;
+}
+
+/* top up b's accumulator (past the end of the data, or at a marker,
+ * with zeros: only corrupt data gets that far) */
+static void bits_fill(struct jpeg_bits *b)
+{
+    while(b->n <= 56)
+    {
+        unsigned c = 0;
+
+        if(b->p < b->end)
+        {
+            c = *b->p++;
+            if(c == 0xff)
+            {
+                if(b->p < b->end && *b->p == 0)
+                    b->p++;
+                else
+                {
+                    b->p = b->end;
+                    c = 0;
+                }
+            }
+        }
+        b->acc = b->acc << 8 | c;
+        b->n += 8;
+    }
+}
+
+static unsigned bits_get(struct jpeg_bits *b, int k)
+{
+    unsigned v;
+
+    if(b->n < k)
+        bits_fill(b);
+    v = (b->acc >> (b->n - k)) & ((1u << k) - 1);
+    b->n -= k;
+    return v;
+}
+
+/* the next Huffman-coded value (-1 for a code that isn't in h) */
+static int huffman_decode(struct jpeg_bits *b, const struct jpeg_huffman *h)
+{
+    unsigned code, entry;
+    int      len;
+
+    if(b->n < 16)
+        bits_fill(b);
+    if((entry = h->fast[(b->acc >> (b->n - JPEG_FAST_BITS)) & ((1 << JPEG_FAST_BITS) - 1)]))
+    {
+        b->n -= entry >> 8;
+        return entry & 0xff;
+    }
+    for(len = JPEG_FAST_BITS + 1; len <= 16; ++len)
+    {
+        code = (b->acc >> (b->n - len)) & ((1u << len) - 1);
+        if((int32_t)code <= h->maxcode[len])
+        {
+            b->n -= len;
+            return h->values[code - h->delta[len]];
+        }
+    }
+    return -1;
+}
+
+/* s more bits, as the signed value they stand for */
+static int receive_extend(struct jpeg_bits *b, int s)
+{
+    int v;
+
+    if(!s)
+        return 0;
+    v = bits_get(b, s);
+    return v < 1 << (s - 1) ? v - (1 << s) + 1 : v;
+}
+
+/* decode, dequantize and inverse-transform one block into plane at
+ * (bx, by); returns 0, or -1 for corrupt data */
+static int decode_block(struct jpeg *j, struct jpeg_bits *b, struct jpeg_component *c,
+                        int *pred, int bx, int by)
+{
+    const uint16_t *q = j->qt[c->tq];
+    float          coef[64], tmp[64], sum;
+    int            k, t, r, s, x, y, u, dc_only = 1;
+    int            shift = 1 << (j->precision - 1), top = (1 << j->precision) - 1;
+    uint16_t       *out = c->plane + (size_t)by * 8 * c->bw * 8 + bx * 8;
+
+    memset(coef, 0, sizeof(coef));
+    if((t = huffman_decode(b, &j->dc[c->td])) < 0 || t > 15)
+        return -1;
+    *pred += receive_extend(b, t);
+    coef[0] = (float)*pred * q[0];
+    for(k = 1; k < 64; )
+    {
+        if((t = huffman_decode(b, &j->ac[c->ta])) < 0)
+            return -1;
+        r = t >> 4;
+        s = t & 15;
+        if(!s)
+        {
+            if(r != 15)
+                break;
+            k += 16;
+            continue;
+        }
+        if((k += r) > 63)
+            return -1;
+        coef[zigzag[k]] = (float)receive_extend(b, s) * q[k];
+        dc_only = 0;
+        k++;
+    }
+
+    if(dc_only)
+    {
+        int v = (int)lrintf(coef[0] / 8) + shift;
+
+        v = v < 0 ? 0 : v > top ? top : v;
+        for(y = 0; y < 8; ++y)
+            for(x = 0; x < 8; ++x)
+                out[(size_t)y * c->bw * 8 + x] = v;
+        return 0;
+    }
+
+    /* rows, then columns */
+    for(y = 0; y < 8; ++y)
+        for(x = 0; x < 8; ++x)
+        {
+            for(u = 0, sum = 0; u < 8; ++u)
+                sum += idct_table[x][u] * coef[y * 8 + u];
+            tmp[y * 8 + x] = sum;
+        }
+    for(x = 0; x < 8; ++x)
+        for(y = 0; y < 8; ++y)
+        {
+            int v;
+
+            for(u = 0, sum = 0; u < 8; ++u)
+                sum += idct_table[y][u] * tmp[u * 8 + x];
+            v = (int)lrintf(sum) + shift;
+            out[(size_t)y * c->bw * 8 + x] = v < 0 ? 0 : v > top ? top : v;
+        }
+    return 0;
+}
+
+/* one restart interval of a sequential image */
+static void decode_sequential(int item, void *arg)
+{
+    struct jpeg      *j = arg;
+    struct jpeg_bits b;
+    int              pred[4] = { 0, 0, 0, 0 };
+    int              total = j->mcux * j->mcuy, m, end, i, h, v;
+
+    b.p = j->intervals[item].start;
+    b.end = j->intervals[item].end;
+    b.acc = 0;
+    b.n = 0;
+
+    m = j->restart ? item * j->restart : 0;
+    end = j->restart && m + j->restart < total ? m + j->restart : total;
+    for(; m < end; ++m)
+    {
+        int mx = m % j->mcux, my = m / j->mcux;
+
+        for(i = 0; i < j->nscan; ++i)
+        {
+            struct jpeg_component *c = &j->comp[j->scan[i]];
+
+            /* (a scan of one component has a block per MCU) */
+            if(j->nscan == 1)
+            {
+                if(decode_block(j, &b, c, &pred[i], mx, my) < 0)
+                    goto corrupt;
+                continue;
+            }
+            for(v = 0; v < c->v; ++v)
+                for(h = 0; h < c->h; ++h)
+                    if(decode_block(j, &b, c, &pred[i], mx * c->h + h, my * c->v + v) < 0)
+                        goto corrupt;
+        }
+    }
+    return;
+
+corrupt:
+    j->failed = 1;
+}
+
+/* one restart interval of a lossless image (whole rows; see jpeg_parse()) */
+static void decode_lossless(int item, void *arg)
+{
+    struct jpeg      *j = arg;
+    struct jpeg_bits b;
+    int              rows = j->restart ? j->restart / j->width : j->height;
+    int              y0 = item * rows, y, x, i, t, diff, pred, n = j->ncomp;
+    int              initial = 1 << (j->precision - j->pt - 1);
+
+    b.p = j->intervals[item].start;
+    b.end = j->intervals[item].end;
+    b.acc = 0;
+    b.n = 0;
+
+    for(y = y0; y < y0 + rows && y < j->height; ++y)
+    {
+        uint16_t *row = j->out + (size_t)y * j->width * n, *above = row - (size_t)j->width * n;
+
+        for(x = 0; x < j->width; ++x)
+            for(i = 0; i < j->nscan; ++i)
+            {
+                int c = j->scan[i], ra, rb, rc;
+
+                if((t = huffman_decode(&b, &j->dc[j->comp[c].td])) < 0 || t > 16)
+                {
+                    j->failed = 1;
+                    return;
+                }
+                diff = t == 16 ? 32768 : receive_extend(&b, t);
+
+                /* the first row of an interval is predicted from the left;
+                 * the first column, from above */
+                if(y == y0)
+                    pred = x ? row[(x - 1) * n + c] : initial;
+                else if(!x)
+                    pred = above[c];
+                else
+                {
+                    ra = row[(x - 1) * n + c];
+                    rb = above[x * n + c];
+                    rc = above[(x - 1) * n + c];
+                    switch(j->ss)
+                    {
+                    case 1:  pred = ra; break;
+                    case 2:  pred = rb; break;
+                    case 3:  pred = rc; break;
+                    case 4:  pred = ra + rb - rc; break;
+                    case 5:  pred = ra + ((rb - rc) >> 1); break;
+                    case 6:  pred = rb + ((ra - rc) >> 1); break;
+                    default: pred = (ra + rb) >> 1; break;
+                    }
+                }
+                row[x * n + c] = (pred + diff) & 0xffff;
+            }
+    }
+}
+
+/* jpeg_parse - read the headers, up to and including the (only) scan's,
+ * and cut the scan into restart intervals */
+static int jpeg_parse(struct jpeg *j, const unsigned char *data, size_t len, const char *name, VRP_Error *err)
+{
+    const unsigned char *p = data, *end = data + len, *scan;
+    int                 i, k, n, marker, seg, adobe = -1;
+
+    memset(j, 0, sizeof(*j));
+    if(len < 4 || p[0] != 0xff || p[1] != 0xd8)
+        goto corrupt;
+    p += 2;
+
+    for(;;)
+    {
+        /* (markers may be padded with any number of 0xff) */
+        while(p < end && *p == 0xff)
+            p++;
+        if(p + 3 > end)
+            goto corrupt;
+        marker = *p++;
+        seg = get16(p);
+        if(seg < 2 || p + seg > end)
+            goto corrupt;
+
+        switch(marker)
+        {
+        case 0xc0: case 0xc1: case 0xc3: /* SOF: baseline, extended, lossless */
+            if(j->ncomp || seg < 8)
+                goto corrupt;
+            j->lossless = marker == 0xc3;
+            j->precision = p[2];
+            j->height = get16(p + 3);
+            j->width = get16(p + 5);
+            j->ncomp = p[7];
+            if(j->ncomp < 1 || j->ncomp > 4 || seg < 8 + 3 * j->ncomp)
+                goto corrupt;
+            if(j->lossless ? j->precision < 2 || j->precision > 16
+                           : j->precision != 8 && j->precision != 12)
+            {
+                vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: %d-bit %s JPEG isn't supported", name,
+                              j->precision, j->lossless ? "lossless" : "sequential");
+                return -1;
+            }
+            if(!j->width || !j->height)
+            {
+                vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: JPEG with its height after the scan (DNL)", name);
+                return -1;
+            }
+            for(i = 0; i < j->ncomp; ++i)
+            {
+                j->comp[i].id = p[8 + 3 * i];
+                j->comp[i].h = p[9 + 3 * i] >> 4;
+                j->comp[i].v = p[9 + 3 * i] & 15;
+                j->comp[i].tq = p[10 + 3 * i] & 3;
+                if(j->comp[i].h < 1 || j->comp[i].h > 4 || j->comp[i].v < 1 || j->comp[i].v > 4
+                   || (j->lossless && (j->comp[i].h != 1 || j->comp[i].v != 1)))
+                    goto corrupt;
+            }
+            break;
+
+        case 0xc4: /* DHT */
+            for(k = 2; k < seg; k += 17 + n)
+            {
+                int tc = p[k] >> 4, th = p[k] & 15;
+
+                if(k + 17 > seg || tc > 1 || th > 3)
+                    goto corrupt;
+                for(i = n = 0; i < 16; ++i)
+                    n += p[k + 1 + i];
+                if(n > 256 || k + 17 + n > seg
+                   || huffman_build(tc ? &j->ac[th] : &j->dc[th], p + k + 1, p + k + 17, n) < 0)
+                    goto corrupt;
+            }
+            break;
+
+        case 0xdb: /* DQT */
+            for(k = 2; k < seg; k += 1 + 64 * (n + 1))
+            {
+                int tq = p[k] & 15;
+
+                n = p[k] >> 4;
+                if(tq > 3 || n > 1 || k + 1 + 64 * (n + 1) > seg)
+                    goto corrupt;
+                for(i = 0; i < 64; ++i)
+                    j->qt[tq][i] = n ? get16(p + k + 1 + 2 * i) : p[k + 1 + i];
+            }
+            break;
+
+        case 0xdd: /* DRI */
+            if(seg < 4)
+                goto corrupt;
+            j->restart = get16(p + 2);
+            break;
+
+        case 0xee: /* APP14: Adobe's says whether three components are RGB */
+            if(seg >= 14 && !memcmp(p + 2, "Adobe", 5))
+                adobe = p[13];
+            break;
+
+        case 0xda: /* SOS */
+            if(!j->ncomp || seg < 6 + 2 * p[2] || p[2] < 1 || p[2] > 4)
+                goto corrupt;
+            j->nscan = p[2];
+            if(j->nscan != j->ncomp)
+            {
+                vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: JPEG in more than one scan isn't supported", name);
+                return -1;
+            }
+            for(i = 0; i < j->nscan; ++i)
+            {
+                for(k = 0; k < j->ncomp && j->comp[k].id != p[3 + 2 * i]; ++k)
+                    ;
+                if(k == j->ncomp)
+                    goto corrupt;
+                j->scan[i] = k;
+                j->comp[k].td = p[4 + 2 * i] >> 4 & 3;
+                j->comp[k].ta = p[4 + 2 * i] & 3;
+                if(!j->dc[j->comp[k].td].present || (!j->lossless && !j->ac[j->comp[k].ta].present))
+                    goto corrupt;
+            }
+            j->ss = p[3 + 2 * j->nscan];
+            j->pt = p[5 + 2 * j->nscan] & 15;
+            if(j->lossless && (j->ss < 1 || j->ss > 7 || j->pt >= j->precision))
+                goto corrupt;
+            p += seg;
+            goto scan;
+
+        case 0xc2: case 0xc5: case 0xc6: case 0xc7: case 0xc9: case 0xca: case 0xcb:
+        case 0xcd: case 0xce: case 0xcf:
+            vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: JPEG process SOF%d isn't supported", name, marker - 0xc0);
+            return -1;
+
+        case 0xd9: /* EOI, before any scan */
+            goto corrupt;
+
+        default:   /* APPn, COM, ...: nothing we need */
+            break;
+        }
+        p += seg;
+    }
+
+scan:
+    j->rgb = j->ncomp == 3 && (adobe == 0 || (adobe < 0 && j->comp[0].id == 'R'
+                                              && j->comp[1].id == 'G' && j->comp[2].id == 'B'));
+    for(i = 0; i < j->ncomp; ++i)
+    {
+        if(j->comp[i].h > j->hmax)
+            j->hmax = j->comp[i].h;
+        if(j->comp[i].v > j->vmax)
+            j->vmax = j->comp[i].v;
+    }
+    if(j->lossless)
+    {
+        j->mcux = j->width;
+        j->mcuy = j->height;
+        if(j->restart % j->width)
+        {
+            vrp_set_error(err, VRP_E_FORMAT, "%s: lossless JPEG restart interval isn't whole rows", name);
+            return -1;
+        }
+    }
+    else if(j->nscan == 1)
+    {
+        /* (a lone component's blocks are its MCUs, however it's sampled) */
+        j->mcux = ((j->width * j->comp[0].h + j->hmax - 1) / j->hmax + 7) / 8;
+        j->mcuy = ((j->height * j->comp[0].v + j->vmax - 1) / j->vmax + 7) / 8;
+        j->comp[0].bw = j->mcux;
+        j->comp[0].bh = j->mcuy;
+    }
+    else
+    {
+        j->mcux = (j->width + 8 * j->hmax - 1) / (8 * j->hmax);
+        j->mcuy = (j->height + 8 * j->vmax - 1) / (8 * j->vmax);
+        for(i = 0; i < j->ncomp; ++i)
+        {
+            j->comp[i].bw = j->mcux * j->comp[i].h;
+            j->comp[i].bh = j->mcuy * j->comp[i].v;
+        }
+    }
+
+    /* cut the entropy-coded data at its restart markers */
+    n = j->restart ? ((int64_t)j->mcux * j->mcuy + j->restart - 1) / j->restart : 1;
+    if(!(j->intervals = vrp_buffer_get(n * sizeof(*j->intervals))))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", name);
+        return -1;
+    }
+    for(scan = p, k = 0; ; )
+    {
+        while(p < end && (*p != 0xff || p + 1 >= end || p[1] == 0 || p[1] == 0xff))
+            p++;
+        if(k < n)
+            j->intervals[k++] = (struct jpeg_interval){ scan, p };
+        if(p >= end || p[1] < 0xd0 || p[1] > 0xd7)
+            break; /* (EOI, whatever follows the scan, or the end of the data) */
+        scan = p += 2;
+    }
+    if(k < n)
+    {
+        vrp_set_error(err, VRP_E_FORMAT, "%s: JPEG has %d restart intervals; expected %d", name, k, n);
+        return -1;
+    }
+    j->nintervals = n;
+    return 0;
+
+corrupt:
+    vrp_set_error(err, VRP_E_FORMAT, "%s: corrupt or truncated JPEG", name);
+    return -1;
+}
+
+/* vrp_jpeg_info - what a JPEG image decodes to
+ *
+ * inputs:
+ *   data, len - the JPEG (from SOI to EOI)
+ *   info      - where to put its dimensions, components and precision
+ *   err       - where to say what went wrong
+ *
+ * return value:
+ *   0 if it's an image vrp_jpeg_decode() can decode, -1 if not
+ */
+int vrp_jpeg_info(const void *data, size_t len, VRP_JpegInfo *info, VRP_Error *err)
+{
+    struct jpeg j;
+    int         ret;
+
+    if((ret = jpeg_parse(&j, data, len, "JPEG", err)) == 0)
+    {
+        info->width = j.width;
+        info->height = j.height;
+        info->components = j.ncomp;
+        info->precision = j.precision;
+        info->lossless = j.lossless;
+    }
+    vrp_buffer_put(j.intervals);
+    return ret;
+}
+
+/* vrp_jpeg_decode - decode a JPEG image
+ *
+ * inputs:
+ *   data, len - the JPEG
+ *   out       - room for width * height * components samples (see
+ *               vrp_jpeg_info()); they're written interleaved, top row
+ *               first, at the image's own precision -- three-component
+ *               sequential images as RGB
+ *   threads   - how many to spread restart intervals over (0: one per CPU)
+ *   err       - where to say what went wrong
+ *
+ * return value:
+ *   0 on success, -1 on failure
+ *
+ * Safe to call from several threads at once.
+ */
+int vrp_jpeg_decode(const void *data, size_t len, uint16_t *out, int threads, VRP_Error *err)
+{
+    static pthread_once_t idct_once = PTHREAD_ONCE_INIT;
+    struct jpeg           j;
+    int                   i, x, y, ret = -1;
+
+    if(jpeg_parse(&j, data, len, "JPEG", err) < 0)
+        goto done;
+
+    if(j.lossless)
+    {
+        j.out = out;
+        vrp_parallel_for(j.nintervals, threads, decode_lossless, &j);
+        if(!j.failed && j.pt)
+            for(i = 0; i < j.width * j.height * j.ncomp; ++i)
+                out[i] <<= j.pt;
+    }
+    else
+    {
+        pthread_once(&idct_once, idct_init);
+        for(i = 0; i < j.ncomp; ++i)
+            if(!(j.comp[i].plane = vrp_buffer_get((size_t)j.comp[i].bw * j.comp[i].bh * 64 * sizeof(uint16_t))))
+            {
+                vrp_set_error(err, VRP_E_NOMEM, "JPEG: out of memory");
+                goto done;
+            }
+        vrp_parallel_for(j.nintervals, threads, decode_sequential, &j);
+
+        /* upsample, interleave and (if need be) convert to RGB */
+        for(y = 0; !j.failed && y < j.height; ++y)
+            for(x = 0; x < j.width; ++x)
+            {
+                uint16_t *o = out + ((size_t)y * j.width + x) * j.ncomp;
+
+                for(i = 0; i < j.ncomp; ++i)
+                {
+                    const struct jpeg_component *c = &j.comp[i];
+
+                    o[i] = c->plane[(size_t)(y * c->v / j.vmax) * c->bw * 8 + x * c->h / j.hmax];
+                }
+                if(j.ncomp == 3 && !j.rgb)
+                {
+                    float yy = o[0], cb = o[1] - (1 << (j.precision - 1)), cr = o[2] - (1 << (j.precision - 1));
+                    float rgb[3] = { yy + 1.402f * cr, yy - 0.344136f * cb - 0.714136f * cr, yy + 1.772f * cb };
+                    int   top = (1 << j.precision) - 1;
+
+                    for(i = 0; i < 3; ++i)
+                    {
+                        int v = (int)lrintf(rgb[i]);
+
+                        o[i] = v < 0 ? 0 : v > top ? top : v;
+                    }
+                }
+            }
+    }
+    if(j.failed)
+        vrp_set_error(err, VRP_E_FORMAT, "JPEG: corrupt entropy-coded data");
+    else
+        ret = 0;
+
+done:
+    for(i = 0; i < 4; ++i)
+        vrp_buffer_put(j.comp[i].plane);
+    vrp_buffer_put(j.intervals);
+    return ret;
+}
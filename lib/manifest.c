@@ -0,0 +1,316 @@
+/*
+ * manifest.c -- cine-extract's manifests: what it's written, and (for
+ * sharded runs) what it was meant to
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h> /* crc32() */
+
+#include "vrptools.h"
+#include "util.h"
+
+/* A manifest (VRP_MANIFEST_NAME, in an output directory) makes runs
+ * resumable: a line is appended for each image once it's safely in
+ * place (written to a temporary name, then renamed), saying
+ *
+ *   file offset source format bytes crc32
+ *
+ * where source identifies the recording (trigger time, first image
+ * number, count and geometry -- so a copy, or a packed version, of the
+ * same cine counts as the same source).  A later run skips any image
+ * whose latest line matches its source and format and whose file is
+ * still there at that size (or, with --verify, that CRC); everything
+ * else is extracted again.  Each run starts by rewriting the manifest
+ * with just the latest line for each file.
+ *
+ * Runs split over several processes (cine-extract --shard) each keep
+ * their own manifest, with a line for each source saying what share of
+ * it they were given,
+ *
+ *   #plan source format shard/shards assigned total
+ *
+ * so that cine-merge-manifest can tell whether, between them, they've
+ * done everything.  (Beginning with '#', it's a comment to anything
+ * that doesn't know about it.) */
+
+static int compare_files(const void *a, const void *b)
+{
+    return strcmp(((const VRP_ManifestEntry *)a)->file, ((const VRP_ManifestEntry *)b)->file);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const VRP_ManifestEntry *x = a, *y = b;
+    int                     c = strcmp(x->file, y->file);
+
+    return c ? c : x->line < y->line ? -1 : x->line > y->line;
+}
+
+/* grow - make room for one more of size bytes in *array; returns 0,
+ * or -1 (with err filled in) */
+static int grow(void *array, size_t count, size_t *allocated, size_t size, VRP_Error *err)
+{
+    void *grown;
+
+    if(count < *allocated)
+        return 0;
+    *allocated = *allocated ? *allocated * 2 : 1024;
+    if(!(grown = realloc(*(void **)array, *allocated * size)))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "out of memory reading manifest");
+        return -1;
+    }
+    *(void **)array = grown;
+    return 0;
+}
+
+/* add_plan - record p, replacing any plan for the same source and format */
+static int add_plan(VRP_Manifest *m, const VRP_ManifestPlan *p, size_t *allocated, VRP_Error *err)
+{
+    size_t i;
+
+    for(i = 0; i < m->nplans; ++i)
+        if(!strcmp(m->plans[i].source, p->source) && !strcmp(m->plans[i].format, p->format))
+        {
+            m->plans[i] = *p;
+            return 0;
+        }
+    if(grow(&m->plans, m->nplans, allocated, sizeof(*p), err) < 0)
+        return -1;
+    m->plans[m->nplans++] = *p;
+    return 0;
+}
+
+/* vrp_manifest_read - read the manifest at path, if there is one
+ *
+ * inputs:
+ *   m    - filled in: entries (the latest for each file, sorted by
+ *          file) and plans; to be freed with vrp_manifest_close()
+ *   path - where it is
+ *   err  - where to say what went wrong (may be NULL)
+ *
+ * return value:
+ *   0 (with nothing in m if there's no such file), or -1 if something
+ *   failed (with err filled in)
+ */
+int vrp_manifest_read(VRP_Manifest *m, const char *path, VRP_Error *err)
+{
+    VRP_ManifestEntry e;
+    VRP_ManifestPlan  p;
+    char              line[512];
+    size_t            size = 0, plans = 0;
+    int               failed;
+    FILE              *in;
+
+    memset(m, 0, sizeof(*m));
+    snprintf(m->path, sizeof(m->path), "%s", path);
+
+    if((in = fopen(m->path, "r")))
+    {
+        for(e.line = 0; fgets(line, sizeof(line), in); ++e.line)
+        {
+            if(!strncmp(line, "#plan ", 6)
+               && sscanf(line + 6, "%95s %31s %d/%d %d %d", p.source, p.format, &p.shard, &p.shards,
+                         &p.assigned, &p.total) == 6)
+            {
+                if(add_plan(m, &p, &plans, err) < 0)
+                    break;
+                continue;
+            }
+            if(line[0] == '#'
+               || sscanf(line, "%63s %d %95s %31s %lld %lx", e.file, &e.offset, e.source,
+                         e.format, &e.bytes, &e.crc) != 6)
+                continue;
+            if(grow(&m->entries, m->count, &size, sizeof(e), err) < 0)
+                break;
+            m->entries[m->count++] = e;
+        }
+        if(ferror(in))
+            vrp_set_error(err, VRP_E_SYSTEM, "%s", m->path);
+        failed = !feof(in) || ferror(in);
+        fclose(in);
+        if(failed)
+        {
+            vrp_manifest_close(m, NULL);
+            return -1;
+        }
+    }
+    else if(errno != ENOENT)
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "%s", path);
+        return -1;
+    }
+
+    vrp_manifest_sort(m);
+    return 0;
+}
+
+/* vrp_manifest_sort - sort m's entries by file, keeping only the last
+ * (by line) for each */
+void vrp_manifest_sort(VRP_Manifest *m)
+{
+    size_t i, n;
+
+    if(m->count)
+        qsort(m->entries, m->count, sizeof(*m->entries), compare_entries);
+    for(i = n = 0; i < m->count; ++i)
+    {
+        if(n && !strcmp(m->entries[n - 1].file, m->entries[i].file))
+            --n;
+        m->entries[n++] = m->entries[i];
+    }
+    m->count = n;
+}
+
+/* vrp_manifest_write - (re)write m's entries and plans to path, by way
+ * of a temporary file; returns 0, or -1 (with err filled in) */
+int vrp_manifest_write(const VRP_Manifest *m, const char *path, VRP_Error *err)
+{
+    char   tmp[sizeof(m->path) + 8];
+    size_t i;
+    FILE   *out;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if(!(out = fopen(tmp, "w")))
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "%s", tmp);
+        return -1;
+    }
+    fprintf(out, "# cine-extract manifest: file offset source format bytes crc32\n");
+    for(i = 0; i < m->nplans; ++i)
+        fprintf(out, "#plan %s %s %d/%d %d %d\n", m->plans[i].source, m->plans[i].format,
+                m->plans[i].shard, m->plans[i].shards, m->plans[i].assigned, m->plans[i].total);
+    for(i = 0; i < m->count; ++i)
+        fprintf(out, "%s %d %s %s %lld %08lx\n", m->entries[i].file, m->entries[i].offset,
+                m->entries[i].source, m->entries[i].format, m->entries[i].bytes, m->entries[i].crc);
+    if((ferror(out) | fclose(out)) || rename(tmp, path) < 0)
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "%s", path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* vrp_manifest_open - read the manifest at path (if there is one),
+ * rewrite it with the latest line for each file, and open it for
+ * vrp_manifest_add() and vrp_manifest_plan(); returns 0, or -1 if
+ * something failed (with err filled in) */
+int vrp_manifest_open(VRP_Manifest *m, const char *path, VRP_Error *err)
+{
+    if(vrp_manifest_read(m, path, err) < 0)
+        return -1;
+    if(vrp_manifest_write(m, m->path, err) < 0)
+    {
+        vrp_manifest_close(m, NULL);
+        return -1;
+    }
+    if(!(m->out = fopen(m->path, "a")))
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "%s", m->path);
+        vrp_manifest_close(m, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+/* vrp_manifest_close - close m's file, if it's open, and free what's
+ * in it; returns 0, or -1 if the file couldn't be closed (with err
+ * filled in) */
+int vrp_manifest_close(VRP_Manifest *m, VRP_Error *err)
+{
+    int ret = 0;
+
+    if(m->out && fclose(m->out))
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "%s", m->path);
+        ret = -1;
+    }
+    free(m->entries);
+    free(m->plans);
+    memset(m, 0, sizeof(*m));
+    return ret;
+}
+
+/* vrp_manifest_add - record a finished image (flushed at once, so the
+ * line survives whatever happens to us next); returns 0, or -1 (with
+ * err filled in) */
+int vrp_manifest_add(VRP_Manifest *m, const VRP_ManifestEntry *e, VRP_Error *err)
+{
+    fprintf(m->out, "%s %d %s %s %lld %08lx\n", e->file, e->offset, e->source, e->format, e->bytes, e->crc);
+    if(fflush(m->out))
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "%s", m->path);
+        return -1;
+    }
+    return 0;
+}
+
+/* vrp_manifest_plan - record what share of a source this run is doing;
+ * returns 0, or -1 (with err filled in) */
+int vrp_manifest_plan(VRP_Manifest *m, const VRP_ManifestPlan *p, VRP_Error *err)
+{
+    fprintf(m->out, "#plan %s %s %d/%d %d %d\n", p->source, p->format, p->shard, p->shards,
+            p->assigned, p->total);
+    if(fflush(m->out))
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "%s", m->path);
+        return -1;
+    }
+    return 0;
+}
+
+/* vrp_manifest_find - the entry for file, or NULL */
+const VRP_ManifestEntry *vrp_manifest_find(const VRP_Manifest *m, const char *file)
+{
+    VRP_ManifestEntry key;
+
+    snprintf(key.file, sizeof(key.file), "%s", file);
+    return m->count ? bsearch(&key, m->entries, m->count, sizeof(key), compare_files) : NULL;
+}
+
+/* vrp_file_crc - CRC-32 of a whole file (returns 0 if it worked, -1 if not) */
+int vrp_file_crc(const char *path, unsigned long *crc)
+{
+    unsigned char buf[65536];
+    ssize_t       n;
+    int           fd;
+
+    if((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    *crc = crc32(0, NULL, 0);
+    while((n = read(fd, buf, sizeof(buf))) > 0)
+        *crc = crc32(*crc, buf, n);
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+/* vrp_manifest_present - whether e's file (in dir) is still as the
+ * entry says: there, at that size, and if verify, with that CRC */
+int vrp_manifest_present(const VRP_ManifestEntry *e, const char *dir, int verify)
+{
+    char          path[4096];
+    struct stat   st;
+    unsigned long crc;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, e->file);
+    if(stat(path, &st) < 0 || st.st_size != e->bytes)
+        return 0;
+    if(verify && (vrp_file_crc(path, &crc) < 0 || crc != e->crc))
+        return 0;
+    return 1;
+}
@@ -0,0 +1,64 @@
+/*
+ * npy.c -- headers for NumPy's .npy array files
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "vrptools.h"
+
+/* An .npy file (format version 1.0) is a magic string, a version, a
+ * little-endian 16-bit length, and then that many bytes of Python
+ * dict literal describing the array -- padded with spaces and ended
+ * with a newline so the data that follows starts on a 64-byte
+ * boundary.  The data is the array, C order, with nothing after it:
+ * so once the header is written, frame i of a (frames, ...) array is
+ * at a fixed offset, and the whole file can be np.memmap()ed (or
+ * np.load(mmap_mode='r')ed) as it stands. */
+
+#define NPY_ALIGN 64
+
+/* vrp_npy_header - build the header of an .npy file
+ *
+ * inputs:
+ *   buf   - where to put it
+ *   size  - how much room buf has (VRP_NPY_HEADER_MAX is always enough)
+ *   descr - the dtype, as NumPy spells it: e.g. "|u1", "<u2"
+ *   shape - ndim dimensions, outermost first
+ *
+ * return value:
+ *   length of the header (where the data starts), or -1 if it
+ *   doesn't fit
+ */
+int vrp_npy_header(unsigned char *buf, size_t size, const char *descr, const size_t *shape, int ndim)
+{
+    char dict[VRP_NPY_HEADER_MAX];
+    int  n, i, len;
+
+    n = snprintf(dict, sizeof(dict), "{'descr': '%s', 'fortran_order': False, 'shape': (", descr);
+    for(i = 0; i < ndim && n < (int)sizeof(dict); ++i)
+        n += snprintf(dict + n, sizeof(dict) - n, ndim == 1 ? "%zu," : i ? ", %zu" : "%zu", shape[i]);
+    if(n < (int)sizeof(dict))
+        n += snprintf(dict + n, sizeof(dict) - n, "), }");
+
+    /* magic, version and length, then the dict, padding and newline */
+    len = (10 + n + 1 + NPY_ALIGN - 1) / NPY_ALIGN * NPY_ALIGN;
+    if(n >= (int)sizeof(dict) || (size_t)len > size)
+        return -1;
+
+    memcpy(buf, "\x93NUMPY\x01\x00", 8);
+    buf[8] = (len - 10) & 0xff;
+    buf[9] = (len - 10) >> 8;
+    memcpy(buf + 10, dict, n);
+    memset(buf + 10 + n, ' ', len - 10 - n - 1);
+    buf[len - 1] = '\n';
+    return len;
+}
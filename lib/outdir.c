@@ -0,0 +1,539 @@
+/*
+ * outdir.c -- whole files written into a directory, several at once
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+#include "vrptools.h"
+#include "util.h"
+
+/* Each file is written as name.tmp, then renamed into place, so a
+ * reader (or a later, resuming, run) never sees half of one.  Where
+ * the kernel has io_uring, that's one linked chain per file -- openat
+ * (relative to the directory's descriptor, into a slot of the ring's
+ * own file table), one writev of all its pieces, fsync if asked,
+ * close, renameat -- submitted with a single system call and left to
+ * run while the caller gets on with the next; up to depth files are in
+ * flight at once.  Otherwise (or with depth 0), the same calls are
+ * made one by one, there and then.
+ *
+ * Whichever way, each file's done() is called in the order the files
+ * were given, once it's in place (or has failed): so a caller can
+ * record finished files in order, and reuse a file's buffers once
+ * they're done with.  A file whose chain fails is written again the
+ * plain way, which either works -- in which case the ring is given up
+ * on, as evidently not up to it (e.g. a kernel older than 5.15, which
+ * can't open into the file table) -- or says what the real trouble
+ * is. */
+
+#define OUTDIR_MAX_IOV 4
+#define OUTDIR_STEPS   5 /* openat, writev, fsync, close, renameat */
+
+struct outdir_job {
+    char         name[256], tmp[264];
+    struct iovec iov[OUTDIR_MAX_IOV];
+    int          iovcnt;
+    size_t       bytes;
+    int          pending;  /* completions still to come */
+    int          error;    /* errno of the first failure */
+    void         (*done)(void *arg, const char *name, int error);
+    void         *arg;
+};
+
+struct _VRP_OutDir {
+    char              path[4096];
+    int               dirfd, flags, depth, failed;
+    unsigned          nfailed;
+    char              first_failed[256]; /* the first file that did, */
+    int               first_error;       /* and why */
+    struct outdir_job *jobs;  /* in flight: head <= seq < tail, at seq % depth */
+    unsigned          head, tail;
+
+    /* the ring, if we have one (ring >= 0) */
+    int                 ring;
+    void                *sq_map, *cq_map;
+    size_t              sq_map_size, cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t              sqes_size;
+    unsigned            *sq_tail, *sq_mask, *sq_array;
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+/* write_file - the plain way: returns 0, or an errno */
+static int write_file(int dirfd, const char *name, const char *tmp, const struct iovec *iov,
+                      int iovcnt, int flags)
+{
+    struct iovec v[OUTDIR_MAX_IOV];
+    ssize_t      n;
+    int          fd, i = 0, error = 0;
+
+    memcpy(v, iov, iovcnt * sizeof(*v));
+    if((fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0)
+        return errno;
+    while(!error && i < iovcnt)
+    {
+        if((n = writev(fd, v + i, iovcnt - i)) < 0)
+        {
+            if(errno != EINTR)
+                error = errno;
+            continue;
+        }
+        for(; i < iovcnt && (size_t)n >= v[i].iov_len; ++i)
+            n -= v[i].iov_len;
+        if(i < iovcnt)
+        {
+            if(!n && !v[i].iov_len)
+                continue;
+            v[i].iov_base = (char *)v[i].iov_base + n;
+            v[i].iov_len -= n;
+        }
+    }
+    if(!error && (flags & VRP_OUTDIR_FSYNC) && fsync(fd) < 0)
+        error = errno;
+    if(close(fd) < 0 && !error)
+        error = errno;
+    if(!error && renameat(dirfd, tmp, dirfd, name) < 0)
+        error = errno;
+    if(error)
+        unlinkat(dirfd, tmp, 0);
+    return error;
+}
+
+#ifdef __NR_io_uring_setup
+
+/* ring_setup - make d a ring for depth files' worth of chains, with a
+ * file table of depth slots; returns 0, or -1 if the kernel won't (in
+ * which case we do without) */
+static int ring_setup(VRP_OutDir *d)
+{
+    static const int       ops[] = { IORING_OP_OPENAT, IORING_OP_WRITEV, IORING_OP_FSYNC,
+                                     IORING_OP_CLOSE, IORING_OP_RENAMEAT };
+    struct io_uring_params p;
+    struct {
+        struct io_uring_probe    probe;
+        struct io_uring_probe_op room[256];
+    } probe;
+    int                    *slots, i, ret;
+
+    memset(&p, 0, sizeof(p));
+    if((d->ring = syscall(__NR_io_uring_setup, d->depth * OUTDIR_STEPS, &p)) < 0)
+        return -1;
+
+    memset(&probe, 0, sizeof(probe));
+    if(syscall(__NR_io_uring_register, d->ring, IORING_REGISTER_PROBE, &probe, 256) < 0)
+        return -1;
+    for(i = 0; i < (int)(sizeof(ops) / sizeof(*ops)); ++i)
+        if(ops[i] > probe.probe.last_op || !(probe.probe.ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            return -1;
+
+    /* an empty file table, for the files being written */
+    if(!(slots = malloc(d->depth * sizeof(*slots))))
+        return -1;
+    for(i = 0; i < d->depth; ++i)
+        slots[i] = -1;
+    ret = syscall(__NR_io_uring_register, d->ring, IORING_REGISTER_FILES, slots, d->depth);
+    free(slots);
+    if(ret < 0)
+        return -1;
+
+    d->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    d->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(d->cq_map_size > d->sq_map_size)
+            d->sq_map_size = d->cq_map_size;
+        d->cq_map_size = 0;
+    }
+    d->sq_map = mmap(NULL, d->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     d->ring, IORING_OFF_SQ_RING);
+    if(d->sq_map == MAP_FAILED)
+        return -1;
+    if(!d->cq_map_size)
+        d->cq_map = d->sq_map;
+    else if((d->cq_map = mmap(NULL, d->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              d->ring, IORING_OFF_CQ_RING)) == MAP_FAILED)
+        return -1;
+    d->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if((d->sqes = mmap(NULL, d->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       d->ring, IORING_OFF_SQES)) == MAP_FAILED)
+        return -1;
+
+    d->sq_tail = (unsigned *)((char *)d->sq_map + p.sq_off.tail);
+    d->sq_mask = (unsigned *)((char *)d->sq_map + p.sq_off.ring_mask);
+    d->sq_array = (unsigned *)((char *)d->sq_map + p.sq_off.array);
+    d->cq_head = (unsigned *)((char *)d->cq_map + p.cq_off.head);
+    d->cq_tail = (unsigned *)((char *)d->cq_map + p.cq_off.tail);
+    d->cq_mask = (unsigned *)((char *)d->cq_map + p.cq_off.ring_mask);
+    d->cqes = (struct io_uring_cqe *)((char *)d->cq_map + p.cq_off.cqes);
+    return 0;
+}
+
+static void ring_close(VRP_OutDir *d)
+{
+    if(d->sqes && d->sqes != MAP_FAILED)
+        munmap(d->sqes, d->sqes_size);
+    if(d->cq_map && d->cq_map != MAP_FAILED && d->cq_map != d->sq_map)
+        munmap(d->cq_map, d->cq_map_size);
+    if(d->sq_map && d->sq_map != MAP_FAILED)
+        munmap(d->sq_map, d->sq_map_size);
+    if(d->ring >= 0)
+        close(d->ring); /* (and with it, anything left in its file table) */
+    d->ring = -1;
+    d->sqes = NULL;
+    d->sq_map = d->cq_map = NULL;
+}
+
+/* ring_sqe - the next submission entry, cleared, for step of the job
+ * in slot */
+static struct io_uring_sqe *ring_sqe(VRP_OutDir *d, unsigned *tail, int slot, int step, int opcode)
+{
+    unsigned            i = *tail & *d->sq_mask;
+    struct io_uring_sqe *sqe = &d->sqes[i];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = (uint64_t)slot * OUTDIR_STEPS + step;
+    d->sq_array[i] = i;
+    ++*tail;
+    return sqe;
+}
+
+/* ring_submit - queue the chain for the job in slot, and submit it;
+ * returns 0, or -1 if the ring's broken */
+static int ring_submit(VRP_OutDir *d, int slot)
+{
+    struct outdir_job   *job = &d->jobs[slot];
+    struct io_uring_sqe *sqe;
+    unsigned            tail = *d->sq_tail, n;
+    int                 ret;
+
+    sqe = ring_sqe(d, &tail, slot, 0, IORING_OP_OPENAT);
+    sqe->fd = d->dirfd;
+    sqe->addr = (uintptr_t)job->tmp;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC; /* (a slot's never inherited anyway) */
+    sqe->len = 0666;
+    sqe->file_index = slot + 1;
+
+    sqe = ring_sqe(d, &tail, slot, 1, IORING_OP_WRITEV);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->fd = slot;
+    sqe->addr = (uintptr_t)job->iov;
+    sqe->len = job->iovcnt;
+
+    if(d->flags & VRP_OUTDIR_FSYNC)
+    {
+        sqe = ring_sqe(d, &tail, slot, 2, IORING_OP_FSYNC);
+        sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->fd = slot;
+    }
+
+    sqe = ring_sqe(d, &tail, slot, 3, IORING_OP_CLOSE);
+    sqe->file_index = slot + 1;
+
+    sqe = ring_sqe(d, &tail, slot, 4, IORING_OP_RENAMEAT);
+    sqe->flags = 0; /* (the end of the chain) */
+    sqe->fd = d->dirfd;
+    sqe->addr = (uintptr_t)job->tmp;
+    sqe->len = d->dirfd;
+    sqe->addr2 = (uintptr_t)job->name;
+
+    n = tail - *d->sq_tail;
+    job->pending = n;
+    __atomic_store_n(d->sq_tail, tail, __ATOMIC_RELEASE);
+    while(n)
+    {
+        if((ret = syscall(__NR_io_uring_enter, d->ring, n, 0, 0, NULL, 0)) < 0)
+        {
+            if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            return -1;
+        }
+        n -= ret;
+    }
+    return 0;
+}
+
+/* ring_reap - take in whatever's completed (waiting for at least one
+ * thing if wait); returns 0, or -1 if the ring's broken */
+static int ring_reap(VRP_OutDir *d, int wait)
+{
+    unsigned head, tail;
+
+    if(wait && syscall(__NR_io_uring_enter, d->ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+       && errno != EINTR)
+        return -1;
+
+    head = *d->cq_head;
+    tail = __atomic_load_n(d->cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != tail; ++head)
+    {
+        const struct io_uring_cqe *cqe = &d->cqes[head & *d->cq_mask];
+        struct outdir_job         *job = &d->jobs[cqe->user_data / OUTDIR_STEPS];
+        int                       step = cqe->user_data % OUTDIR_STEPS;
+
+        /* (a failure cancels the rest of the chain: keep the cause) */
+        if(!job->error)
+        {
+            if(cqe->res < 0)
+                job->error = -cqe->res;
+            else if(step == 1 && (size_t)cqe->res != job->bytes)
+                job->error = EIO;
+        }
+        --job->pending;
+    }
+    __atomic_store_n(d->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* ring_abandon - give up on a broken ring: whatever was in it is
+ * lost, so goes again the plain way */
+static void ring_abandon(VRP_OutDir *d)
+{
+    unsigned seq;
+
+    for(seq = d->head; seq != d->tail; ++seq)
+    {
+        struct outdir_job *job = &d->jobs[seq % d->depth];
+
+        job->pending = 0;
+        if(!job->error)
+            job->error = EIO;
+    }
+    ring_close(d);
+}
+
+#else
+
+static int ring_setup(VRP_OutDir *d)
+{
+    (void)d;
+    return -1;
+}
+
+static void ring_close(VRP_OutDir *d)
+{
+    d->ring = -1;
+}
+
+static int ring_submit(VRP_OutDir *d, int slot)
+{
+    (void)d;
+    (void)slot;
+    return -1;
+}
+
+static int ring_reap(VRP_OutDir *d, int wait)
+{
+    (void)d;
+    (void)wait;
+    return -1;
+}
+
+static void ring_abandon(VRP_OutDir *d)
+{
+    ring_close(d);
+}
+
+#endif
+
+/* deliver - call done() for each of the oldest jobs that's finished,
+ * in order, retrying the plain way any that failed */
+static void deliver(VRP_OutDir *d)
+{
+    while(d->head != d->tail)
+    {
+        struct outdir_job *job = &d->jobs[d->head % d->depth];
+
+        if(job->pending)
+            break;
+        if(job->error)
+        {
+            job->error = write_file(d->dirfd, job->name, job->tmp, job->iov, job->iovcnt, d->flags);
+            if(!job->error && d->ring >= 0)
+                d->failed |= 2; /* the ring can't, but we can: stop using it */
+        }
+        if(job->error && !(d->failed & 1))
+        {
+            snprintf(d->first_failed, sizeof(d->first_failed), "%s", job->name);
+            d->first_error = job->error;
+        }
+        if(job->error)
+        {
+            d->failed |= 1;
+            ++d->nfailed;
+        }
+        ++d->head;
+        job->done(job->arg, job->name, job->error);
+    }
+}
+
+/* vrp_outdir_open - get ready to write files into the directory at path
+ *
+ * inputs:
+ *   path  - the directory, which must exist
+ *   depth - how many files may be in flight at once (0: none; each is
+ *           written before vrp_outdir_write() returns)
+ *   flags - VRP_OUTDIR_FSYNC: each file's data is flushed to disk before
+ *           it's renamed into place, and the directory at the end
+ *   err   - where to say what went wrong (may be NULL)
+ *
+ * return value:
+ *   the handle, to be finished with vrp_outdir_close(); or NULL (with
+ *   err filled in)
+ */
+VRP_OutDir *vrp_outdir_open(const char *path, int depth, int flags, VRP_Error *err)
+{
+    VRP_OutDir *d;
+
+    if(!(d = calloc(1, sizeof(*d))))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", path);
+        return NULL;
+    }
+    snprintf(d->path, sizeof(d->path), "%s", path);
+    d->flags = flags;
+    d->depth = depth > 0 ? depth : 1;
+    d->ring = -1;
+    if((d->dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "%s", path);
+        free(d);
+        return NULL;
+    }
+    if(!(d->jobs = calloc(d->depth, sizeof(*d->jobs))))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", path);
+        close(d->dirfd);
+        free(d);
+        return NULL;
+    }
+    if(depth > 0 && ring_setup(d) < 0)
+        ring_close(d);
+    return d;
+}
+
+/* vrp_outdir_async - whether files are being written in the background */
+int vrp_outdir_async(const VRP_OutDir *d)
+{
+    return d->ring >= 0;
+}
+
+/* vrp_outdir_write - write a file
+ *
+ * inputs:
+ *   d      - from vrp_outdir_open()
+ *   name   - its name within the directory
+ *   iov    - its contents, in up to four pieces (written with one
+ *            writev()); they must stay put until done() is called
+ *   done   - called with arg, name and 0 or an errno once the file is
+ *            in place or has failed, in the order the files were given
+ *            (perhaps before this returns, perhaps later -- by
+ *            vrp_outdir_write(), vrp_outdir_wait() or vrp_outdir_close())
+ *
+ * return value:
+ *   0, or -1 if the file couldn't even be started (done() isn't called)
+ */
+int vrp_outdir_write(VRP_OutDir *d, const char *name, const struct iovec *iov, int iovcnt,
+                     void (*done)(void *arg, const char *name, int error), void *arg)
+{
+    struct outdir_job *job;
+    int               i, slot;
+
+    if(iovcnt < 1 || iovcnt > OUTDIR_MAX_IOV || strlen(name) >= sizeof(job->name))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if(d->ring >= 0 && (d->failed & 2))
+    {
+        /* (give up on the ring, once what's in it is done) */
+        vrp_outdir_wait(d, 0);
+        ring_close(d);
+    }
+    vrp_outdir_wait(d, d->depth - 1);
+
+    slot = d->tail % d->depth;
+    job = &d->jobs[slot];
+    snprintf(job->name, sizeof(job->name), "%s", name);
+    snprintf(job->tmp, sizeof(job->tmp), "%s.tmp", name);
+    memcpy(job->iov, iov, iovcnt * sizeof(*iov));
+    job->iovcnt = iovcnt;
+    for(job->bytes = i = 0; i < iovcnt; ++i)
+        job->bytes += iov[i].iov_len;
+    job->error = 0;
+    job->pending = 0;
+    job->done = done;
+    job->arg = arg;
+    ++d->tail;
+
+    if(d->ring >= 0 && ring_submit(d, slot) < 0)
+        ring_abandon(d);
+    if(d->ring >= 0)
+        ring_reap(d, 0);
+    else if(!job->error)
+        job->error = write_file(d->dirfd, job->name, job->tmp, job->iov, job->iovcnt, d->flags);
+    deliver(d);
+    return 0;
+}
+
+/* vrp_outdir_wait - wait until no more than pending files are still in
+ * flight (their done()s called) */
+void vrp_outdir_wait(VRP_OutDir *d, int pending)
+{
+    deliver(d);
+    while(d->tail - d->head > (unsigned)pending)
+    {
+        if(ring_reap(d, 1) < 0)
+            ring_abandon(d);
+        deliver(d);
+    }
+}
+
+/* vrp_outdir_close - finish writing everything, and let go of the
+ * directory; returns 0 if every file was written, -1 if not (with err
+ * filled in, for the first file that failed, or the directory's fsync) */
+int vrp_outdir_close(VRP_OutDir *d, VRP_Error *err)
+{
+    int ret = 0;
+
+    vrp_outdir_wait(d, 0);
+    if((d->flags & VRP_OUTDIR_FSYNC) && fsync(d->dirfd) < 0)
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "%s", d->path);
+        ret = -1;
+    }
+    else if(d->failed & 1)
+    {
+        errno = d->first_error;
+        vrp_set_error(err, VRP_E_SYSTEM, "%s: %u file%s couldn't be written, the first %s",
+                      d->path, d->nfailed, d->nfailed == 1 ? "" : "s", d->first_failed);
+        ret = -1;
+    }
+    ring_close(d);
+    close(d->dirfd);
+    free(d->jobs);
+    free(d);
+    return ret;
+}
@@ -0,0 +1,1103 @@
+/*
+ * pack.c -- lossless compression of raw CINE files (see cine-pack),
+ * and the reader backend that lets packed files be used like any other.
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "vrptools.h"
+#include "util.h"
+
+/*
+ * File layout (all little-endian):
+ *
+ *   VRP_PACKHEADER
+ *   prefix      -- the original file up to its first image, verbatim:
+ *                  CINEFILEHEADER, BITMAPINFOHEADER, SETUP, tagged
+ *                  blocks and the (original) image offset table
+ *   records     -- one per image, in order:
+ *                    DWORD  annotation length (bytes before the pixels)
+ *                    BYTE   annotation[length], verbatim
+ *                    DWORD  coded length (0 if the image was missing)
+ *                    BYTE   'K' (keyframe) or 'P' (relative to the
+ *                           image before), then the coded pixels; or
+ *                           'R', then the pixels as they were
+ *   index       -- ImageCount pack offsets of the records
+ *   trailer     -- whatever followed the last image, verbatim
+ *
+ * (Anything in gaps between images is not kept; cine-unpack leaves
+ * those as holes.)
+ *
+ * Images are coded in groups of GroupSize; the first of each group
+ * (and any following a missing image) is coded on its own (a
+ * "keyframe"), the rest relative to the image before, so any image
+ * can be had by decoding at most GroupSize images, and groups can be
+ * decoded in parallel.
+ *
+ * Coding of an image: each of the four CFA planes (every other pixel
+ * of every other row) separately.  Each plane sample is predicted
+ * with the LOCO-I/JPEG-LS median predictor from its left, upper and
+ * upper-left plane neighbours -- within a keyframe on the samples
+ * themselves, otherwise on the difference from the previous image
+ * (so that static areas cost next to nothing, while moving ones still
+ * get spatial prediction).  Residuals are zigzagged to unsigned and
+ * split into a bit-length class (rANS coded, using static frequencies
+ * in one of PACK_NCTX contexts picked by the neighbours' classes)
+ * and the remaining low bits, stored raw.  The classes are coded with
+ * PACK_NSTATES rANS states taking turns along each row (column px
+ * using state px % PACK_NSTATES), all renormalizing 16 bits at a time
+ * into one stream, so that decoding a sample needn't wait on the last
+ * one's state.  Each plane's lengths come first, so the four can be
+ * found without decoding them, and decoded in parallel.
+ *
+ * An image that doesn't come out smaller coded than as it was (noise
+ * compresses badly) is stored as it was instead, as an 'R' record, so
+ * a packed file is never much bigger than the original.  The image
+ * after it can still be coded relative to it.
+ *
+ * Files are written as Version 3.  Versions 1 and 2 (the latter with
+ * 'R' records) coded the classes with a single rANS state, 8 bits at
+ * a time, and are still read.
+ */
+
+#define PACK_NSYM        20  /* classes: bit lengths 0..19 */
+#define PACK_NCTX        8
+#define PACK_SCALE_BITS  12
+#define PACK_SCALE       (1 << PACK_SCALE_BITS)
+#define PACK_NSTATES     4
+#define RANS_L           (1u << 16)
+#define RANS_L_V1        (1u << 23)  /* (Versions 1 and 2) */
+#define PACK_PARALLEL_MIN (1 << 16)  /* samples in a plane worth a thread of its own */
+
+struct _VRP_Pack {
+    void            *map;       /* the whole mmap()ed packed file */
+    VRP_PACKHEADER  *header;
+    VRP_ImageOffset *index;     /* record offsets, per image */
+    pthread_mutex_t lock;       /* for cursors: */
+    VRP_PackCursor  *cursors;   /* vrp_image_pixels()'s, one per thread */
+};
+
+struct _VRP_PackCursor {
+    int      frame;             /* which image cur holds; -1 for none */
+    int      threads;           /* to decode the planes with (<= 0: all CPUs) */
+    size_t   npixels;
+    uint16_t *cur, *prev;
+    void     *out8;             /* 8-bit copy, for 8-bit cines */
+    pthread_t owner;            /* (of the handle's cursors) */
+    struct _VRP_PackCursor *next;
+};
+
+/** helpers **/
+
+struct pack_buf {
+    unsigned char *data;
+    size_t        len, cap;
+};
+
+static int buf_reserve(struct pack_buf *b, size_t more)
+{
+    if(b->len + more > b->cap)
+    {
+        size_t        cap = b->cap ? b->cap : 4096;
+        unsigned char *p;
+
+        while(cap < b->len + more)
+            cap *= 2;
+        if(!(p = realloc(b->data, cap)))
+            return -1;
+        b->data = p;
+        b->cap = cap;
+    }
+    return 0;
+}
+
+static int buf_append(struct pack_buf *b, const void *data, size_t len)
+{
+    if(buf_reserve(b, len) < 0)
+        return -1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static int buf_dword(struct pack_buf *b, VRP_DWORD v)
+{
+    return buf_append(b, &v, sizeof(v));
+}
+
+static int bitlength(uint32_t v)
+{
+    return v ? 32 - __builtin_clz(v) : 0;
+}
+
+static int med(int a, int b, int c)
+{
+    int mx = a > b ? a : b, mn = a > b ? b : a;
+
+    return c >= mx ? mn : c <= mn ? mx : a + b - c;
+}
+
+/* the context for a sample, from the classes of its left and upper
+ * neighbours' residuals */
+static int context(const unsigned char *cls, int pw, int px, int py)
+{
+    int left = px ? cls[py*pw + px - 1] : 0;
+    int up   = py ? cls[(py-1)*pw + px] : left;
+    int c    = (left + up + 1) >> 1;
+
+    return c < PACK_NCTX ? c : PACK_NCTX - 1;
+}
+
+/* scale a histogram to sum to PACK_SCALE, keeping every symbol that
+ * occurs at a frequency of at least 1 */
+static void normalize(const uint32_t *hist, uint16_t *freq)
+{
+    uint64_t total = 0;
+    int      s, sum = 0, biggest = 0;
+
+    for(s = 0; s < PACK_NSYM; ++s)
+        total += hist[s];
+
+    for(s = 0; s < PACK_NSYM; ++s)
+    {
+        freq[s] = 0;
+        if(!hist[s])
+            continue;
+        freq[s] = (uint64_t)hist[s] * PACK_SCALE / total;
+        if(!freq[s])
+            freq[s] = 1;
+        sum += freq[s];
+        if(freq[s] > freq[biggest])
+            biggest = s;
+    }
+
+    /* fix up rounding on the most frequent symbol, which can afford it
+     * (or, if it can't, take from whoever has more than 1) */
+    while(sum > PACK_SCALE)
+    {
+        int take = sum - PACK_SCALE;
+
+        if(freq[biggest] > take)
+        {
+            freq[biggest] -= take;
+            sum -= take;
+        }
+        else
+            for(s = 0; s < PACK_NSYM && sum > PACK_SCALE; ++s)
+                if(freq[s] > 1)
+                {
+                    freq[s]--;
+                    sum--;
+                }
+    }
+    freq[biggest] += PACK_SCALE - sum;
+}
+
+/** encoding **/
+
+struct plane_scratch {
+    uint32_t      *zz;   /* zigzagged residuals */
+    unsigned char *cls;  /* their classes */
+    unsigned char *rans; /* rANS output, written backwards */
+};
+
+/* pack_plane - code one CFA plane (offset ox, oy) of cur, predicted
+ * against prev if that's not NULL, appending it to out */
+static int pack_plane(const uint16_t *cur, const uint16_t *prev, int w, int h,
+                      int ox, int oy, struct plane_scratch *sc, struct pack_buf *out)
+{
+    int           pw = (w - ox + 1) / 2, ph = (h - oy + 1) / 2;
+    size_t        n = (size_t)pw * ph, i, ranslen;
+    uint32_t      hist[PACK_NCTX][PACK_NSYM];
+    uint16_t      freq[PACK_NCTX][PACK_NSYM], cum[PACK_NCTX][PACK_NSYM];
+    unsigned char mask = 0, *ptr;
+    uint64_t      acc = 0;
+    int           nacc = 0, px, py, c, s;
+    uint32_t      x[PACK_NSTATES], bits;
+    size_t        bitstart;
+
+    memset(hist, 0, sizeof(hist));
+
+    /* pass 1: residuals and their classes */
+    for(py = 0; py < ph; ++py)
+    {
+        const uint16_t *row = cur + (size_t)(2*py + oy) * w + ox;
+        const uint16_t *prow = prev ? prev + (size_t)(2*py + oy) * w + ox : NULL;
+
+        for(px = 0; px < pw; ++px)
+        {
+            int d, a, b, cc, pred, r;
+
+            /* (d)ifference from the previous image (or the sample itself),
+             * and the same for the left, upper and upper-left neighbours */
+#define DIFF(p, q) ((int)row[(q)*-2*w + 2*(p)] - (prow ? (int)prow[(q)*-2*w + 2*(p)] : 0))
+            d = DIFF(px, 0);
+            if(py == 0)
+                pred = px ? DIFF(px - 1, 0) : 0;
+            else if(px == 0)
+                pred = DIFF(px, 1);
+            else
+            {
+                a = DIFF(px - 1, 0);
+                b = DIFF(px, 1);
+                cc = DIFF(px - 1, 1);
+                pred = med(a, b, cc);
+            }
+#undef DIFF
+            r = d - pred;
+            sc->zz[py*pw + px] = r >= 0 ? (uint32_t)r << 1 : ((uint32_t)-r << 1) - 1;
+            sc->cls[py*pw + px] = bitlength(sc->zz[py*pw + px]);
+            hist[context(sc->cls, pw, px, py)][sc->cls[py*pw + px]]++;
+        }
+    }
+
+    for(c = 0; c < PACK_NCTX; ++c)
+    {
+        int sum = 0;
+
+        for(s = 0; s < PACK_NSYM; ++s)
+            if(hist[c][s])
+                mask |= 1 << c;
+        normalize(hist[c], freq[c]);
+        for(s = 0; s < PACK_NSYM; ++s)
+        {
+            cum[c][s] = sum;
+            sum += freq[c][s];
+        }
+    }
+
+    /* pass 2: rANS, which has to run backwards (the states' final
+     * values, which the decoder starts from, go in front) */
+    ptr = sc->rans + 2*n + 4*PACK_NSTATES;
+    for(s = 0; s < PACK_NSTATES; ++s)
+        x[s] = RANS_L;
+    for(i = n; i-- > 0; )
+    {
+        uint32_t f, *st;
+
+        px = i % pw;
+        py = i / pw;
+        st = &x[px % PACK_NSTATES];
+        c = context(sc->cls, pw, px, py);
+        s = sc->cls[i];
+        f = freq[c][s];
+        if(*st >= (uint64_t)((RANS_L >> PACK_SCALE_BITS) << 16) * f)
+        {
+            ptr -= 2;
+            ptr[0] = *st & 0xff;
+            ptr[1] = *st >> 8 & 0xff;
+            *st >>= 16;
+        }
+        *st = ((*st / f) << PACK_SCALE_BITS) + (*st % f) + cum[c][s];
+    }
+    ptr -= sizeof(x);
+    memcpy(ptr, x, sizeof(x));
+    ranslen = sc->rans + 2*n + 4*PACK_NSTATES - ptr;
+
+    if(buf_dword(out, ranslen) < 0 || buf_append(out, &mask, 1) < 0)
+        return -1;
+    for(c = 0; c < PACK_NCTX; ++c)
+        if(mask & (1 << c) && buf_append(out, freq[c], sizeof(freq[c])) < 0)
+            return -1;
+    if(buf_append(out, ptr, ranslen) < 0)
+        return -1;
+
+    /* pass 3: the raw low bits, below each class's leading 1 */
+    bitstart = out->len;
+    if(buf_dword(out, 0) < 0 || buf_reserve(out, n * 3 + 8) < 0)
+        return -1;
+    for(i = 0; i < n; ++i)
+    {
+        int k = sc->cls[i];
+
+        if(k < 2)
+            continue;
+        acc |= (uint64_t)(sc->zz[i] & ((1u << (k-1)) - 1)) << nacc;
+        nacc += k - 1;
+        while(nacc >= 8)
+        {
+            out->data[out->len++] = acc & 0xff;
+            acc >>= 8;
+            nacc -= 8;
+        }
+    }
+    if(nacc)
+        out->data[out->len++] = acc & 0xff;
+    bits = out->len - bitstart - 4;
+    memcpy(out->data + bitstart, &bits, 4);
+
+    return 0;
+}
+
+/* vrp_pack_image - code one image (w x h 16-bit samples) into out,
+ * relative to prev unless that's NULL.  Returns 0, or -1 if out of
+ * memory. */
+static int vrp_pack_image(const uint16_t *cur, const uint16_t *prev, int w, int h,
+                          struct pack_buf *out)
+{
+    struct plane_scratch sc;
+    size_t               n = (size_t)((w + 1) / 2) * ((h + 1) / 2);
+    int                  plane, ret = 0;
+
+    sc.zz = vrp_buffer_get(n * sizeof(*sc.zz));
+    sc.cls = vrp_buffer_get(n);
+    sc.rans = vrp_buffer_get(2*n + 4*PACK_NSTATES);
+    if(!sc.zz || !sc.cls || !sc.rans)
+        ret = -1;
+
+    for(plane = 0; plane < 4 && !ret; ++plane)
+        ret = pack_plane(cur, prev, w, h, plane & 1, plane >> 1, &sc, out);
+
+    vrp_buffer_put(sc.zz);
+    vrp_buffer_put(sc.cls);
+    vrp_buffer_put(sc.rans);
+    return ret;
+}
+
+/** decoding **/
+
+/* plane_length - how many bytes of in a coded plane takes up (found
+ * from the lengths it starts with, without decoding it), or -1 if
+ * that's more than there is */
+static long plane_length(const unsigned char *in, size_t len)
+{
+    VRP_DWORD ranslen, bitslen;
+    size_t    n = 5;
+    int       c;
+
+    if(len < n)
+        return -1;
+    memcpy(&ranslen, in, 4);
+    for(c = 0; c < PACK_NCTX; ++c)
+        if(in[4] & (1 << c))
+            n += PACK_NSYM * sizeof(uint16_t);
+    if(n + ranslen + 4 > len)
+        return -1;
+    n += ranslen;
+    memcpy(&bitslen, in + n, 4);
+    n += 4;
+    if(n + bitslen > len)
+        return -1;
+    return n + bitslen;
+}
+
+/* unpack_plane - the inverse of pack_plane() (or, for version < 3, of
+ * what Versions 1 and 2 did), given all plane_length() of its bytes;
+ * returns 0, or -1 if it's corrupt */
+static int unpack_plane(const unsigned char *in, uint16_t *cur,
+                        const uint16_t *prev, int w, int h, int ox, int oy, int version)
+{
+    int                 pw = (w - ox + 1) / 2, ph = (h - oy + 1) / 2;
+    uint16_t            freq[PACK_NCTX][PACK_NSYM], cum[PACK_NCTX][PACK_NSYM];
+    unsigned char       lut[PACK_NCTX][PACK_SCALE];
+    const unsigned char *p = in, *rp, *rend, *bp, *bend;
+    unsigned char       mask, *cls;
+    VRP_DWORD           ranslen, bitslen;
+    uint32_t            x[PACK_NSTATES];
+    uint64_t            acc;
+    int                 bit = 0, c, s, px, py, *d, ret = -1;
+
+    memcpy(&ranslen, p, 4);
+    mask = p[4];
+    p += 5;
+
+    /* (contexts that aren't there decode to an impossible class) */
+    memset(freq, 0, sizeof(freq));
+    for(c = 0; c < PACK_NCTX; ++c)
+    {
+        int sum = 0;
+
+        if(!(mask & (1 << c)))
+        {
+            memset(lut[c], PACK_NSYM, PACK_SCALE);
+            continue;
+        }
+        memcpy(freq[c], p, sizeof(freq[c]));
+        p += sizeof(freq[c]);
+        for(s = 0; s < PACK_NSYM; ++s)
+        {
+            cum[c][s] = sum;
+            if(sum + freq[c][s] > PACK_SCALE)
+                return -1;
+            memset(lut[c] + sum, s, freq[c][s]);
+            sum += freq[c][s];
+        }
+        if(sum != PACK_SCALE)
+            return -1;
+    }
+
+    rp = p;
+    rend = p + ranslen;
+    memcpy(&bitslen, rend, 4);
+    bp = rend + 4;
+    bend = bp + bitslen;
+    if(ranslen < (version < 3 ? 4 : sizeof(x)))
+        return -1;
+    if(version < 3)
+    {
+        memcpy(&x[0], rp, 4);
+        rp += 4;
+    }
+    else
+    {
+        memcpy(x, rp, sizeof(x));
+        rp += sizeof(x);
+    }
+
+    /* the classes and differences (from the previous image, or in a
+     * keyframe the samples themselves) of this row and the one above */
+    if(!(cls = vrp_buffer_get((size_t)2 * pw * (1 + sizeof(*d)))))
+        return -1;
+    d = (int *)(cls + 2 * pw);
+
+    for(py = 0; py < ph; ++py)
+    {
+        uint16_t       *row = cur + (size_t)(2*py + oy) * w + ox;
+        const uint16_t *prow = prev ? prev + (size_t)(2*py + oy) * w + ox : NULL;
+        unsigned char  *ccls = cls + (py & 1) * pw, *ucls = cls + (~py & 1) * pw;
+        int            *cd = d + (py & 1) * pw, *ud = d + (~py & 1) * pw;
+        int            left = 0, a = 0; /* the left neighbour's class and difference */
+
+        /* (on noise, every branch in here would be a coin toss; the
+         * ones left are taken the same way all along a row) */
+        for(px = 0; px < pw; ++px)
+        {
+            uint32_t slot, zz, *st = &x[version < 3 ? 0 : px % PACK_NSTATES];
+            int      k, nbits, renorm, pred, g, mx, mn, base;
+
+            /* the class, in context (see context()) */
+            c = (left + (py ? ucls[px] : left) + 1) >> 1;
+            c = c < PACK_NCTX ? c : PACK_NCTX - 1;
+            slot = *st & (PACK_SCALE - 1);
+            k = lut[c][slot];
+            if(k >= PACK_NSYM)
+                goto done;
+            *st = freq[c][k] * (*st >> PACK_SCALE_BITS) + slot - cum[c][k];
+            if(version >= 3)
+            {
+                renorm = (*st < RANS_L) & (rp + 2 <= rend);
+                *st = *st << (renorm * 16) | ((rp[0] | rp[1] << 8) & -renorm);
+                rp += renorm * 2;
+            }
+            else
+                while(*st < RANS_L_V1 && rp < rend)
+                    *st = *st << 8 | *rp++;
+            ccls[px] = left = k;
+
+            /* its low bits, below the leading 1 (past the end, 0s) */
+            if(bend - bp >= 8)
+                memcpy(&acc, bp, 8);
+            else
+                for(acc = 0, g = 0; g < bend - bp; ++g)
+                    acc |= (uint64_t)bp[g] << 8*g;
+            nbits = k > 1 ? k - 1 : 0;
+            zz = (k ? 1u << nbits : 0) | (uint32_t)(acc >> bit & ((1u << nbits) - 1));
+            bit += nbits;
+            bp += bit >> 3;
+            bit &= 7;
+
+            /* unzigzagged, plus the prediction (see med(): the middle
+             * of a, b and a + b - c is the same thing) */
+            if(py == 0)
+                pred = px ? a : 0;
+            else if(px == 0)
+                pred = ud[0];
+            else
+            {
+                mx = a > ud[px] ? a : ud[px];
+                mn = a > ud[px] ? ud[px] : a;
+                g = a + ud[px] - ud[px-1];
+                pred = g < mn ? mn : g > mx ? mx : g;
+            }
+            base = prow ? prow[2*px] : 0;
+            row[2*px] = base + pred + (int)((zz >> 1) ^ -(zz & 1));
+            cd[px] = a = row[2*px] - base;
+        }
+    }
+    ret = 0;
+
+done:
+    vrp_buffer_put(cls);
+    return ret;
+}
+
+/* the planes of one image, decoded in parallel */
+struct unpack_job {
+    const unsigned char *in[4];
+    uint16_t            *cur;
+    const uint16_t      *prev;
+    int                 w, h, version, failed;
+};
+
+static void unpack_plane_job(int plane, void *arg)
+{
+    struct unpack_job *job = arg;
+
+    if(unpack_plane(job->in[plane], job->cur, job->prev, job->w, job->h,
+                    plane & 1, plane >> 1, job->version) < 0)
+        job->failed = 1;
+}
+
+/** packing a whole file **/
+
+struct pack_job {
+    VRP_Handle      handle;
+    int             first_group, group_size, w, h;
+    struct pack_buf *out;   /* per group in this batch */
+    int             failed;
+};
+
+/* copy (widening, if need be) an image's samples into buf */
+static int load_image(VRP_Handle handle, int offset, uint16_t *buf, size_t npixels)
+{
+    const void *pixels = vrp_image_pixels(handle, offset);
+    size_t     i;
+
+    if(!pixels)
+        return -1;
+    if(handle->imageHeader->biBitCount == 16)
+        memcpy(buf, pixels, npixels * 2);
+    else
+        for(i = 0; i < npixels; ++i)
+            buf[i] = ((const unsigned char *)pixels)[i];
+    return 0;
+}
+
+static void pack_group(int item, void *arg)
+{
+    struct pack_job *job = arg;
+    struct pack_buf *out = &job->out[item];
+    VRP_Handle      handle = job->handle;
+    int             first = (job->first_group + item) * job->group_size;
+    int             j, have_prev = 0;
+    size_t          npixels = (size_t)job->w * job->h, raw = vrp_image_size(handle);
+    uint16_t        *cur, *prev, *t;
+
+    cur = malloc(npixels * 2);
+    prev = malloc(npixels * 2);
+    if(!cur || !prev)
+        job->failed = 1;
+
+    for(j = first; j < first + job->group_size && (unsigned)j < handle->header->ImageCount && !job->failed; ++j)
+    {
+        off_t               pixels = vrp_image_pixel_offset(handle, j);
+        VRP_DWORD           annlen, len;
+        size_t              lenpos;
+        unsigned char       kind;
+
+        /* images missing from a truncated file are recorded as empty */
+        annlen = pixels < 0 ? 0 : pixels - handle->firstImageOffset[j];
+        if(buf_dword(out, annlen) < 0
+           || (annlen && buf_append(out, handle->start + handle->firstImageOffset[j], annlen) < 0))
+        {
+            job->failed = 1;
+            break;
+        }
+        lenpos = out->len;
+        if(buf_dword(out, 0) < 0)
+        {
+            job->failed = 1;
+            break;
+        }
+        if(pixels < 0 || load_image(handle, j, cur, npixels) < 0)
+        {
+            have_prev = 0;
+            continue;
+        }
+        kind = have_prev ? 'P' : 'K';
+        if(buf_append(out, &kind, 1) < 0
+           || vrp_pack_image(cur, have_prev ? prev : NULL, job->w, job->h, out) < 0)
+        {
+            job->failed = 1;
+            break;
+        }
+
+        /* no smaller coded? then as it was */
+        if(out->len - lenpos - 5 >= raw)
+        {
+            kind = 'R';
+            out->len = lenpos + 4;
+            if(buf_append(out, &kind, 1) < 0 || buf_append(out, handle->start + pixels, raw) < 0)
+            {
+                job->failed = 1;
+                break;
+            }
+        }
+        len = out->len - lenpos - 4;
+        memcpy(out->data + lenpos, &len, 4);
+
+        t = prev;
+        prev = cur;
+        cur = t;
+        have_prev = 1;
+    }
+
+    free(cur);
+    free(prev);
+}
+
+/* vrp_pack_cine - write a packed (losslessly compressed) copy of a raw cine
+ *
+ * inputs:
+ *   handle     - handle to opened VRP Cine file (CC_UNINT, 8 or 16 bit)
+ *   outfd      - where to write the packed file (at its current position,
+ *                which is taken to be its start)
+ *   group_size - images per independently decodable group
+ *   threads    - how many threads to compress with (<= 0: all CPUs)
+ *   err        - where to say what went wrong (may be NULL)
+ *
+ * return value:
+ *   0 on success, -1 on failure (with err filled in)
+ */
+int vrp_pack_cine(VRP_Handle handle, int outfd, int group_size, int threads, VRP_Error *err)
+{
+    VRP_PACKHEADER  ph;
+    VRP_ImageOffset *index = NULL, pos;
+    struct pack_job job;
+    unsigned        i, count;
+    int             ngroups, batch, g, b, ret = -1;
+    off_t           prefix = -1, start, last = 0;
+
+    if(handle->pack)
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: already packed", handle->name);
+        return -1;
+    }
+    if(handle->header->Compression != VRP_CC_UNINT || !handle->imageHeader
+       || (handle->imageHeader->biBitCount != 8 && handle->imageHeader->biBitCount != 16))
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: can only pack raw (uninterpolated) 8- or 16-bit cines", handle->name);
+        return -1;
+    }
+    if(!handle->firstImageOffset)
+    {
+        vrp_set_error(err, VRP_E_FORMAT, "%s: no image offsets, nothing to pack", handle->name);
+        return -1;
+    }
+
+    count = handle->header->ImageCount;
+    if(group_size < 1)
+        group_size = 1;
+    if(threads <= 0)
+        threads = vrp_default_threads();
+
+    /* everything before the first image is kept verbatim */
+    for(i = 0; i < count; ++i)
+    {
+        off_t pixels = vrp_image_pixel_offset(handle, i);
+
+        if(pixels < 0)
+            continue;
+        if(prefix < 0 || handle->firstImageOffset[i] < prefix)
+            prefix = handle->firstImageOffset[i];
+        if(pixels + (off_t)vrp_image_size(handle) > last)
+            last = pixels + vrp_image_size(handle);
+    }
+    if(prefix < 0)
+        prefix = handle->header->OffImageOffsets + (off_t)count * sizeof(VRP_ImageOffset);
+    if(prefix > handle->end - handle->start)
+        prefix = handle->end - handle->start;
+
+    memset(&ph, 0, sizeof(ph));
+    memcpy(&ph.Magic, VRP_PACK_MAGIC, 4);
+    ph.Version = 3;
+    ph.PrefixSize = prefix;
+    ph.ImageCount = count;
+    ph.GroupSize = group_size;
+    ph.OriginalSize = handle->st.st_size;
+    ph.TrailerSize = last > prefix ? handle->st.st_size - last : 0;
+
+    if((start = lseek(outfd, 0, SEEK_CUR)) < 0)
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "packed output must be a seekable file");
+        return -1;
+    }
+    if(write_all_fd(outfd, &ph, sizeof(ph)) < 0 || write_all_fd(outfd, handle->start, prefix) < 0)
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "writing packed header");
+        return -1;
+    }
+    pos = sizeof(ph) + prefix;
+
+    if(!(index = calloc(count ? count : 1, sizeof(*index))))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", handle->name);
+        return -1;
+    }
+
+    job.handle = handle;
+    job.group_size = group_size;
+    job.w = handle->imageHeader->biWidth;
+    job.h = handle->imageHeader->biHeight;
+    job.failed = 0;
+    if(!(job.out = calloc(threads, sizeof(*job.out))))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", handle->name);
+        goto done;
+    }
+
+    /* compress a batch of groups (one per thread) at a time, then
+     * write them out in order */
+    ngroups = (count + group_size - 1) / group_size;
+    for(g = 0; g < ngroups; g += batch)
+    {
+        batch = ngroups - g < threads ? ngroups - g : threads;
+        job.first_group = g;
+        for(b = 0; b < batch; ++b)
+            job.out[b].len = 0;
+
+        vrp_parallel_for(batch, threads, pack_group, &job);
+        if(job.failed)
+        {
+            vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory while packing", handle->name);
+            goto done;
+        }
+
+        for(b = 0; b < batch; ++b)
+        {
+            size_t off = 0;
+
+            /* note where each record starts, for the index */
+            for(i = (g + b) * group_size; i < count && i < (unsigned)(g + b + 1) * group_size; ++i)
+            {
+                VRP_DWORD annlen, len;
+
+                index[i] = pos + off;
+                memcpy(&annlen, job.out[b].data + off, 4);
+                off += 4 + annlen;
+                memcpy(&len, job.out[b].data + off, 4);
+                off += 4 + len;
+            }
+            if(write_all_fd(outfd, job.out[b].data, job.out[b].len) < 0)
+            {
+                vrp_set_error(err, VRP_E_SYSTEM, "writing packed images");
+                goto done;
+            }
+            pos += job.out[b].len;
+        }
+    }
+
+    ph.IndexOffset = pos;
+    if(write_all_fd(outfd, index, count * sizeof(*index)) < 0
+       || write_all_fd(outfd, handle->end - ph.TrailerSize, ph.TrailerSize) < 0
+       || pwrite(outfd, &ph, sizeof(ph), start) != sizeof(ph))
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "writing packed index");
+        goto done;
+    }
+    ret = 0;
+
+done:
+    if(job.out)
+        for(b = 0; b < threads; ++b)
+            free(job.out[b].data);
+    free(job.out);
+    free(index);
+    return ret;
+}
+
+/** the reader backend **/
+
+/* vrp_pack_attach - called by vrp_open_fd() on a freshly mapped file.
+ * If it's a packed file, point the handle at the original cine's
+ * headers (kept in the prefix) and remember how to find its images.
+ * Returns 1 if packed, 0 if not, -1 (filling in *err) if packed but
+ * broken. */
+int vrp_pack_attach(VRP_Handle handle, VRP_Error *err)
+{
+    VRP_PACKHEADER *ph = handle->start;
+    struct _VRP_Pack *pack;
+    size_t         size = handle->st.st_size;
+
+    if(size < sizeof(*ph) || memcmp(&ph->Magic, VRP_PACK_MAGIC, 4))
+        return 0;
+
+    if(ph->Version < 1 || ph->Version > 3 || ph->GroupSize < 1
+       || sizeof(*ph) + ph->PrefixSize > size || ph->IndexOffset < 0
+       || (size_t)ph->IndexOffset + ph->ImageCount * sizeof(VRP_ImageOffset) + ph->TrailerSize > size
+       || ph->TrailerSize > ph->OriginalSize
+       || ph->PrefixSize < sizeof(VRP_CINEFILEHEADER))
+    {
+        vrp_set_error(err, VRP_E_FORMAT, "%s: packed file is corrupt or truncated", handle->name);
+        return -1;
+    }
+
+    if(!(pack = calloc(1, sizeof(*pack))))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", handle->name);
+        return -1;
+    }
+    pack->map = handle->start;
+    pack->header = ph;
+    pack->index = handle->start + ph->IndexOffset;
+    pthread_mutex_init(&pack->lock, NULL);
+
+    handle->pack = pack;
+    handle->header = handle->start = handle->start + sizeof(*ph);
+    handle->end = handle->start + ph->PrefixSize;
+
+    return 1;
+}
+
+void vrp_pack_detach(VRP_Handle handle)
+{
+    VRP_PackCursor *c, *next;
+
+    if(!handle->pack)
+        return;
+
+    if(munmap(handle->pack->map, handle->st.st_size))
+        perror("munmap failed");
+    for(c = handle->pack->cursors; c; c = next)
+    {
+        next = c->next;
+        vrp_pack_cursor_free(c);
+    }
+    pthread_mutex_destroy(&handle->pack->lock);
+    free(handle->pack);
+    handle->pack = NULL;
+}
+
+/* find an image's record; returns a pointer to its annotation length */
+static const unsigned char *pack_record(VRP_Handle handle, int offset)
+{
+    struct _VRP_Pack *pack = handle->pack;
+    VRP_DWORD        annlen;
+    VRP_ImageOffset  pos;
+
+    if(offset < 0 || (unsigned)offset >= pack->header->ImageCount)
+        return NULL;
+    pos = pack->index[offset];
+    if(pos < 0 || (size_t)pos + 8 > (size_t)handle->st.st_size)
+        return NULL;
+    memcpy(&annlen, (unsigned char *)pack->map + pos, 4);
+    if((size_t)pos + 8 + annlen > (size_t)handle->st.st_size)
+        return NULL;
+
+    return (unsigned char *)pack->map + pos;
+}
+
+/* the annotation of an image in a packed file (NULL if absent) */
+VRP_ImageAnnotation *vrp_pack_annotation(VRP_Handle handle, int offset)
+{
+    const unsigned char *rec = pack_record(handle, offset);
+    VRP_DWORD           annlen;
+
+    if(!rec)
+        return NULL;
+    memcpy(&annlen, rec, 4);
+    return annlen >= sizeof(VRP_DWORD) ? (VRP_ImageAnnotation *)(rec + 4) : NULL;
+}
+
+VRP_PackCursor *vrp_pack_cursor_new(VRP_Handle handle)
+{
+    VRP_PackCursor *c;
+
+    if(!handle->pack || !handle->imageHeader || !(c = calloc(1, sizeof(*c))))
+        return NULL;
+
+    c->frame = -1;
+    c->threads = 1;
+    c->npixels = (size_t)handle->imageHeader->biWidth * handle->imageHeader->biHeight;
+    c->cur = malloc(c->npixels * 2);
+    c->prev = malloc(c->npixels * 2);
+    if(handle->imageHeader->biBitCount == 8)
+        c->out8 = malloc(c->npixels);
+    if(!c->cur || !c->prev || (handle->imageHeader->biBitCount == 8 && !c->out8))
+    {
+        vrp_pack_cursor_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+void vrp_pack_cursor_free(VRP_PackCursor *c)
+{
+    if(!c)
+        return;
+    free(c->cur);
+    free(c->prev);
+    free(c->out8);
+    free(c);
+}
+
+/* decode image number offset into the cursor's buffer; returns 0 on
+ * success, -2 if the image is missing, -1 if it can't be decoded */
+static int pack_decode_one(VRP_Handle handle, VRP_PackCursor *c, int offset)
+{
+    const unsigned char *rec = pack_record(handle, offset), *p;
+    VRP_DWORD           annlen, len;
+    int                 w = handle->imageHeader->biWidth, h = handle->imageHeader->biHeight;
+    int                 plane, kind;
+    long                n;
+    struct unpack_job   job;
+    uint16_t            *t;
+
+    if(!rec)
+        return -1;
+    memcpy(&annlen, rec, 4);
+    memcpy(&len, rec + 4 + annlen, 4);
+    p = rec + 8 + annlen;
+    if(!len)
+    {
+        c->frame = -1;
+        return -2;
+    }
+    if((size_t)(p - (unsigned char *)handle->pack->map) + len > (size_t)handle->st.st_size
+       || (*p != 'K' && *p != 'P' && *p != 'R'))
+        return -1;
+    kind = *p++;
+    len--;
+    if(kind == 'P' && c->frame != offset - 1)
+        return -1;
+
+    /* decode over the older buffer, predicting from the newer */
+    t = c->prev;
+    c->prev = c->cur;
+    c->cur = t;
+
+    if(kind == 'R')
+    {
+        size_t i;
+
+        if(len != c->npixels * (c->out8 ? 1 : 2))
+        {
+            c->frame = -1;
+            return -1;
+        }
+        if(c->out8)
+            for(i = 0; i < c->npixels; ++i)
+                c->cur[i] = p[i];
+        else
+            memcpy(c->cur, p, len);
+        c->frame = offset;
+        return 0;
+    }
+
+    /* find the planes, then decode them (at once, if they're big
+     * enough to be worth it) */
+    job.cur = c->cur;
+    job.prev = kind == 'K' ? NULL : c->prev;
+    job.w = w;
+    job.h = h;
+    job.version = handle->pack->header->Version;
+    job.failed = 0;
+    for(plane = 0; plane < 4; ++plane)
+    {
+        if((n = plane_length(p, len)) < 0)
+        {
+            c->frame = -1;
+            return -1;
+        }
+        job.in[plane] = p;
+        p += n;
+        len -= n;
+    }
+    vrp_parallel_for(4, c->npixels / 4 >= PACK_PARALLEL_MIN ? c->threads : 1, unpack_plane_job, &job);
+    if(job.failed)
+    {
+        c->frame = -1;
+        return -1;
+    }
+
+    c->frame = offset;
+    return 0;
+}
+
+/* vrp_pack_decode - get the pixels of an image of a packed file, in
+ * the same form they had in the original cine.  Decodes from the
+ * start of the image's group, unless the cursor is already partway
+ * there.  The result is valid until the next call with this cursor. */
+const void *vrp_pack_decode(VRP_Handle handle, VRP_PackCursor *c, int offset)
+{
+    int group, first, j;
+    size_t i;
+
+    if(!handle->pack || !c || offset < 0 || (unsigned)offset >= handle->pack->header->ImageCount)
+        return NULL;
+
+    group = handle->pack->header->GroupSize;
+    first = offset - offset % group;
+
+    if(c->frame != offset)
+    {
+        j = c->frame >= first && c->frame < offset ? c->frame + 1 : first;
+        for(; j <= offset; ++j)
+        {
+            int r = pack_decode_one(handle, c, j);
+
+            /* a missing image only matters if it's the one we want */
+            if(r == -1 || (r == -2 && j == offset))
+                return NULL;
+        }
+    }
+
+    if(!c->out8)
+        return c->cur;
+    for(i = 0; i < c->npixels; ++i)
+        ((unsigned char *)c->out8)[i] = c->cur[i];
+    return c->out8;
+}
+
+/* vrp_image_pixels() for packed files: each thread calling it gets a
+ * cursor of its own, kept with the handle until it's closed (and taken
+ * over by any later thread that happens to get the same id, once the
+ * first has gone), so threads can share a handle without decoding over
+ * each other's images */
+const void *vrp_pack_pixels(VRP_Handle handle, int offset)
+{
+    struct _VRP_Pack *pack = handle->pack;
+    VRP_PackCursor   *c;
+    pthread_t        self = pthread_self();
+
+    pthread_mutex_lock(&pack->lock);
+    for(c = pack->cursors; c && !pthread_equal(c->owner, self); c = c->next)
+        ;
+    if(!c && (c = vrp_pack_cursor_new(handle)))
+    {
+        c->threads = 0;
+        c->owner = self;
+        c->next = pack->cursors;
+        pack->cursors = c;
+    }
+    pthread_mutex_unlock(&pack->lock);
+
+    return c ? vrp_pack_decode(handle, c, offset) : NULL;
+}
+
+/* size of the original (unpacked) file */
+off_t vrp_pack_original_size(VRP_Handle handle)
+{
+    return handle->pack ? handle->pack->header->OriginalSize : handle->st.st_size;
+}
+
+/* images per independently decodable group (1 for unpacked files) */
+int vrp_pack_group_size(VRP_Handle handle)
+{
+    return handle->pack ? (int)handle->pack->header->GroupSize : 1;
+}
+
+/* bytes that followed the last image in the original (and how many) */
+const void *vrp_pack_trailer(VRP_Handle handle, size_t *size)
+{
+    struct _VRP_Pack *pack = handle->pack;
+
+    *size = pack ? pack->header->TrailerSize : 0;
+    if(!pack)
+        return NULL;
+    return (unsigned char *)pack->map + pack->header->IndexOffset
+        + pack->header->ImageCount * sizeof(VRP_ImageOffset);
+}
@@ -0,0 +1,90 @@
+/*
+ * parallel.c -- tiny helper for spreading independent work over threads
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h> /* for sysconf() */
+
+#include "vrptools.h"
+
+#define VRP_MAX_THREADS 256
+
+struct parallel_job {
+    pthread_mutex_t lock;
+    int             next, count;
+    void            (*fn)(int item, void *arg);
+    void            *arg;
+};
+
+static void *parallel_worker(void *p)
+{
+    struct parallel_job *job = p;
+    int item;
+
+    for(;;)
+    {
+        pthread_mutex_lock(&job->lock);
+        item = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if(item >= job->count)
+            break;
+        job->fn(item, job->arg);
+    }
+    return NULL;
+}
+
+/* number of threads to use when the caller asks for "as many as make
+ * sense" (threads <= 0): one per online CPU. */
+int vrp_default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n < 1 ? 1 : n > VRP_MAX_THREADS ? VRP_MAX_THREADS : n;
+}
+
+/* vrp_parallel_for - call fn(item, arg) for every item in 0..count-1,
+ * spread over up to threads threads (<= 0 meaning one per CPU).  Items
+ * are handed out in increasing order, but may complete in any order.
+ * Runs everything in the calling thread if threads is 1 or thread
+ * creation fails. */
+void vrp_parallel_for(int count, int threads, void (*fn)(int item, void *arg), void *arg)
+{
+    struct parallel_job job;
+    pthread_t           tids[VRP_MAX_THREADS];
+    int                 i, started;
+
+    if(threads <= 0)
+        threads = vrp_default_threads();
+    if(threads > VRP_MAX_THREADS)
+        threads = VRP_MAX_THREADS;
+    if(threads > count)
+        threads = count;
+
+    job.next = 0;
+    job.count = count;
+    job.fn = fn;
+    job.arg = arg;
+    pthread_mutex_init(&job.lock, NULL);
+
+    /* the calling thread is one of the workers */
+    for(started = 0; started < threads - 1; ++started)
+        if(pthread_create(&tids[started], NULL, parallel_worker, &job))
+            break;
+
+    parallel_worker(&job);
+
+    for(i = 0; i < started; ++i)
+        pthread_join(tids[i], NULL);
+
+    pthread_mutex_destroy(&job.lock);
+}
@@ -0,0 +1,288 @@
+/*
+ * pool.c -- recycled, aligned buffers for the per-image work of
+ * decoding, demosaicing and encoding
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#define _GNU_SOURCE /* MADV_HUGEPAGE */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "vrptools.h"
+
+/* Every image extracted wants the same few buffers -- JPEG planes, a
+ * widened or decoded copy of its samples, strips and chunks to compress
+ * into -- at the same few sizes, over and over.  vrp_buffer_get() hands
+ * out one at least as big as asked for, 64-byte aligned, and
+ * vrp_buffer_put() takes it back for next time, so that once a run has
+ * seen its first image or two it stops allocating altogether.
+ *
+ * Sizes are rounded up to one of four steps per power of two (so at
+ * most a quarter is wasted), and each such size class has a list of
+ * idle buffers.  Each thread keeps a few of its own, unlocked, which go
+ * back to the shared lists when it exits; the shared lists hold at most
+ * the limit set by vrp_pool_configure() (beyond which buffers are given
+ * back to the system), so peak memory is what's in use plus that.
+ *
+ * Nothing here touches a buffer's memory: big ones are fresh mappings,
+ * whose pages land (on NUMA machines) on the node of whichever thread
+ * first writes them -- the worker using the buffer -- and the
+ * per-thread lists tend to give a buffer back to the thread that last
+ * had it.  With VRP_POOL_HUGEPAGES, mappings of 2MB or more ask for
+ * transparent huge pages, saving TLB misses on whole frames. */
+
+#define POOL_ALIGN        64        /* the buffer header's size, too */
+#define POOL_MIN          4096      /* the smallest size class */
+#define POOL_MMAP         (256 << 10) /* from here up, mmap() rather than malloc */
+#define POOL_HUGE         (2 << 20)
+#define POOL_CLASSES      (1 + 4 * 52)
+#define POOL_THREAD_CACHE 8         /* idle buffers a thread keeps to itself */
+
+struct buffer {
+    struct buffer *next;
+    size_t        size;   /* usable bytes, after the header */
+    size_t        mapped; /* bytes mapped, or 0 if malloc()ed */
+    int           class;
+};
+
+struct thread_cache {
+    struct buffer *idle[POOL_THREAD_CACHE];
+    int           count;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct buffer   *idle[POOL_CLASSES];
+static size_t          pool_limit = (size_t)256 << 20;
+static int             pool_flags;
+static VRP_PoolStats   pool_stats;
+static pthread_key_t   cache_key;
+static pthread_once_t  cache_key_once = PTHREAD_ONCE_INIT;
+static __thread struct thread_cache cache;
+
+/* size_class - which class a request for size bytes falls in; *rounded
+ * is set to the class's size */
+static int size_class(size_t size, size_t *rounded)
+{
+    int    bits, step;
+    size_t n;
+
+    if(size <= POOL_MIN)
+    {
+        *rounded = POOL_MIN;
+        return 0;
+    }
+    n = size - 1;
+    for(bits = 12; bits < 63 && n >> (bits + 1); ++bits)
+        ;
+    step = (n >> (bits - 2)) & 3;
+    *rounded = (size_t)(5 + step) << (bits - 2);
+    return 1 + (bits - 12) * 4 + step;
+}
+
+/* release - give b back to the system (holding pool_lock) */
+static void release(struct buffer *b)
+{
+    pool_stats.held -= b->size;
+    if(b->mapped)
+        munmap(b, b->mapped);
+    else
+        free(b);
+}
+
+/* shelve - put b on its shared idle list, if that leaves the lists
+ * within the limit (holding pool_lock) */
+static void shelve(struct buffer *b)
+{
+    if(pool_stats.idle + b->size > pool_limit)
+    {
+        release(b);
+        return;
+    }
+    b->next = idle[b->class];
+    idle[b->class] = b;
+    pool_stats.idle += b->size;
+}
+
+/* flush_cache - hand a (finished) thread's idle buffers to the shared
+ * lists */
+static void flush_cache(void *p)
+{
+    struct thread_cache *c = p;
+
+    pthread_mutex_lock(&pool_lock);
+    while(c->count)
+        shelve(c->idle[--c->count]);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void make_cache_key(void)
+{
+    pthread_key_create(&cache_key, flush_cache);
+}
+
+/* vrp_buffer_get - a buffer of at least size bytes, 64-byte aligned,
+ * with unspecified contents; NULL if we're out of memory.  Give it back
+ * with vrp_buffer_put() (not free()). */
+void *vrp_buffer_get(size_t size)
+{
+    struct buffer *b = NULL;
+    size_t        rounded, bytes;
+    int           class = size_class(size, &rounded), i;
+
+    __atomic_add_fetch(&pool_stats.gets, 1, __ATOMIC_RELAXED);
+    for(i = cache.count - 1; i >= 0; --i)
+        if(cache.idle[i]->class == class)
+        {
+            b = cache.idle[i];
+            cache.idle[i] = cache.idle[--cache.count];
+            return (char *)b + POOL_ALIGN;
+        }
+
+    pthread_mutex_lock(&pool_lock);
+    if((b = idle[class]))
+    {
+        idle[class] = b->next;
+        pool_stats.idle -= b->size;
+        pthread_mutex_unlock(&pool_lock);
+        return (char *)b + POOL_ALIGN;
+    }
+    ++pool_stats.allocated;
+    pool_stats.held += rounded;
+    if(pool_stats.held > pool_stats.peak)
+        pool_stats.peak = pool_stats.held;
+    pthread_mutex_unlock(&pool_lock);
+
+    bytes = rounded + POOL_ALIGN;
+    if(bytes >= POOL_MMAP)
+    {
+        void *p;
+
+        if((pool_flags & VRP_POOL_HUGEPAGES) && bytes >= POOL_HUGE)
+            bytes = (bytes + POOL_HUGE - 1) & ~((size_t)POOL_HUGE - 1);
+        if((p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED)
+        {
+            b = p;
+            b->mapped = bytes;
+#ifdef MADV_HUGEPAGE
+            if((pool_flags & VRP_POOL_HUGEPAGES) && bytes >= POOL_HUGE)
+                madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+        }
+    }
+    else if(!posix_memalign((void **)&b, POOL_ALIGN, bytes))
+        b->mapped = 0;
+    else
+        b = NULL;
+
+    if(!b)
+    {
+        pthread_mutex_lock(&pool_lock);
+        pool_stats.held -= rounded;
+        pthread_mutex_unlock(&pool_lock);
+        return NULL;
+    }
+    b->size = rounded;
+    b->class = class;
+    return (char *)b + POOL_ALIGN;
+}
+
+/* vrp_buffer_put - take back a buffer from vrp_buffer_get() (NULL is
+ * fine) */
+void vrp_buffer_put(void *buf)
+{
+    struct buffer *b;
+
+    if(!buf)
+        return;
+    b = (struct buffer *)((char *)buf - POOL_ALIGN);
+
+    if(cache.count < POOL_THREAD_CACHE && pool_limit)
+    {
+        /* (registering the thread, so what it keeps goes back when it
+         * exits) */
+        if(!cache.count)
+        {
+            pthread_once(&cache_key_once, make_cache_key);
+            pthread_setspecific(cache_key, &cache);
+        }
+        cache.idle[cache.count++] = b;
+        return;
+    }
+    pthread_mutex_lock(&pool_lock);
+    shelve(b);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* vrp_pool_zalloc, vrp_pool_zfree - zlib's allocator hooks (a
+ * z_stream's zalloc and zfree), so that its state and window come from
+ * the pool as well */
+void *vrp_pool_zalloc(void *opaque, unsigned items, unsigned size)
+{
+    (void)opaque;
+    return vrp_buffer_get((size_t)items * size);
+}
+
+void vrp_pool_zfree(void *opaque, void *p)
+{
+    (void)opaque;
+    vrp_buffer_put(p);
+}
+
+/* vrp_pool_configure - set how many bytes of idle buffers the pool may
+ * hold on to (256MB to start with; 0 keeps nothing, so every buffer is
+ * freshly allocated), and flags (VRP_POOL_HUGEPAGES) for new ones */
+void vrp_pool_configure(size_t limit, int flags)
+{
+    int i;
+
+    pthread_mutex_lock(&pool_lock);
+    pool_limit = limit;
+    pool_flags = flags;
+    for(i = 0; i < POOL_CLASSES && pool_stats.idle > pool_limit; ++i)
+        while(idle[i] && pool_stats.idle > pool_limit)
+        {
+            struct buffer *b = idle[i];
+
+            idle[i] = b->next;
+            pool_stats.idle -= b->size;
+            release(b);
+        }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* vrp_pool_option - parse a --pool argument, "MB[,huge]", and configure
+ * the pool accordingly; returns 0, or -1 if it doesn't make sense */
+int vrp_pool_option(const char *spec)
+{
+    char          *end;
+    unsigned long mb = strtoul(spec, &end, 10);
+    int           flags = 0;
+
+    if(end == spec)
+        return -1;
+    if(*end == ',' && !strcmp(end + 1, "huge"))
+        flags = VRP_POOL_HUGEPAGES;
+    else if(*end)
+        return -1;
+    vrp_pool_configure((size_t)mb << 20, flags);
+    return 0;
+}
+
+/* vrp_pool_stats - a snapshot of the pool's counters */
+void vrp_pool_stats(VRP_PoolStats *stats)
+{
+    pthread_mutex_lock(&pool_lock);
+    *stats = pool_stats;
+    pthread_mutex_unlock(&pool_lock);
+}
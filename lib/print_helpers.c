@@ -16,28 +16,42 @@
 
 #include "vrptools.h"
 
+/* format t as ISO 8601 local time in the zone offset seconds *west*
+ * of UTC (as SETUP's RecordingTimeZone has it), into buf (sz bytes).
+ * Reentrant: the zone comes from offset, not from our environment. */
 void vrp_time_iso8601_s(VRP_TIME64 t, char *buf, int sz, int offset)
 {
-    struct tm *tm;
-    time_t time;
+    struct tm tm;
+    time_t    time;
+    size_t    len;
 
     offset = -offset; /* they treat this opposite to tm_gmtoff */
 
-    time = t.Seconds;
-    /* compute break-out time once, just to get local offset: */
-    tm = localtime(&time);
-    /* adjust to the offset's timezone, removing our own: */
-    time += offset - tm->tm_gmtoff;
-    /* re-compute, still in our own timezone, but adjusted */
-    tm = localtime(&time);
+    /* shift to the offset's zone, then break out as if it were UTC */
+    time = (time_t)t.Seconds + offset;
+    gmtime_r(&time, &tm);
 
-    buf += strftime(buf, sz, "%FT%T", tm);
-    sprintf(buf, "%+03d%02d", offset / 3600, (abs(offset)) % 3600);
+    len = strftime(buf, sz, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + len, sz - len, "%c%02d%02d", offset < 0 ? '-' : '+',
+             abs(offset) / 3600, abs(offset) / 60 % 60);
 }
 
-const char const *vrp_time_iso8601(VRP_TIME64 t, int offset)
+/* vrp_print_open_warnings - say on out what vrp_open*() noticed, in
+ * err->warnings, about handle's file (for the tools: the library
+ * itself leaves printing to them) */
+void vrp_print_open_warnings(FILE *out, VRP_Handle handle, const VRP_Error *err)
 {
-    static char buf[BUFSIZ];
-    vrp_time_iso8601_s(t, buf, BUFSIZ, offset);
-    return buf;
+    if(err->warnings & VRP_WARN_NO_IMAGEHEADER)
+        fprintf(out, "WARNING: %s is too small to contain Image Headers!\n", handle->name);
+    if(err->warnings & VRP_WARN_NO_SETUP)
+        fprintf(out, "WARNING: %s is too small to contain Setup info!\n", handle->name);
+    if(err->warnings & VRP_WARN_NO_BLOCK_ROOM)
+        fprintf(out, "WARNING: It seems we ought to have tagged blocks, but we don't actually have space for them!\n");
+    if(err->warnings & VRP_WARN_NO_BLOCKS)
+        fprintf(out, "INFO: No tagged blocks found.\n");
+    if(err->warnings & VRP_WARN_TRUNCATED)
+        fprintf(out, "WARNING: file appears to be truncated (not all images are present)"
+                " (size %llu, expected at least %llu.)\n", (unsigned long long)handle->st.st_size,
+                (unsigned long long)(handle->header->OffImageOffsets
+                                     + handle->header->ImageCount * vrp_image_size(handle)));
 }
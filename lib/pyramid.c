@@ -0,0 +1,466 @@
+/*
+ * pyramid.c -- preview pyramids: every image of a cine, shrunk to a few
+ * small sizes, in one mappable sidecar file (see cine-index --pyramid)
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "vrptools.h"
+#include "util.h"
+
+/*
+ * File layout:
+ *
+ *   VRP_PYRAMIDHEADER (at 0, its Magic written last of all)
+ *   index       -- at IndexOffset: a byte of VRP_PYRAMID_* flags per image
+ *   levels      -- each at its Level[].Offset (page-aligned): ImageCount
+ *                  images of FrameBytes, 8-bit RGB, top row first
+ *
+ * Level 0 bins each 4x4 block of the raw CFA samples: the red, green
+ * and blue samples in the block are averaged separately (so there's no
+ * demosaicing to do), white balanced, and gamma-encoded (2.2) into 8
+ * bits.  The smaller levels average 4x4 blocks of the level before,
+ * still linear, before their own encoding.  So a preview of any image
+ * is one pointer computation away (vrp_pyramid_frame()).
+ *
+ * Gray cines (or CFAs we don't know) are binned as if every sample
+ * were green, giving R = G = B.
+ */
+
+#define PYRAMID_FACTOR 4  /* from each level to the next */
+#define PYRAMID_CHUNK  16 /* images per work item (packed files decode in runs) */
+#define PYRAMID_ALIGN  4096
+
+struct _VRP_Pyramid {
+    void                    *map;
+    size_t                  size;
+    const VRP_PYRAMIDHEADER *header;
+    const unsigned char     *index;
+};
+
+struct pyramid_job {
+    VRP_Handle        handle;
+    unsigned char     *map;      /* the sidecar being filled */
+    VRP_PYRAMIDHEADER *header;
+    unsigned char     pattern[4];
+    int               count[3];  /* samples of each colour in a level-0 block */
+    unsigned          maxval;
+    unsigned char     *lut[3];   /* linear sample to 8 bits, white balance included */
+    int               failed;
+};
+
+static int64_t align_up(int64_t n)
+{
+    return (n + PYRAMID_ALIGN - 1) / PYRAMID_ALIGN * PYRAMID_ALIGN;
+}
+
+/* bin one image (stored bottom-up) to linear level 0, top row first */
+static void pyramid_bin(struct pyramid_job *job, const void *pixels, uint16_t *lin)
+{
+    const VRP_PYRAMIDLEVEL *l0 = &job->header->Level[0];
+    int                    rows = job->header->Height, cols = job->header->Width;
+    int                    wide = job->handle->imageHeader->biBitCount > 8;
+    int                    ox, oy, k, c, ch;
+    uint32_t               acc[3 * 4096], *a;
+
+    for(oy = 0; oy < (int)l0->Height; ++oy)
+    {
+        /* (in slices of acc, for very wide images) */
+        int x0, w;
+
+        for(x0 = 0; x0 < (int)l0->Width; x0 += 4096)
+        {
+            w = l0->Width - x0 < 4096 ? l0->Width - x0 : 4096;
+            memset(acc, 0, 3 * w * sizeof(*acc));
+            for(k = 0; k < PYRAMID_FACTOR; ++k)
+            {
+                int                 sr = rows - PYRAMID_FACTOR * (oy + 1) + k; /* stored row */
+                const unsigned char *colour = job->pattern + (sr & 1) * 2;
+                size_t              start = (size_t)sr * cols + x0 * PYRAMID_FACTOR;
+
+                if(wide)
+                {
+                    const uint16_t *p = (const uint16_t *)pixels + start;
+
+                    for(ox = 0, a = acc; ox < w; ++ox, a += 3)
+                        for(c = 0; c < PYRAMID_FACTOR; c += 2, p += 2)
+                        {
+                            a[colour[0]] += p[0];
+                            a[colour[1]] += p[1];
+                        }
+                }
+                else
+                {
+                    const uint8_t *p = (const uint8_t *)pixels + start;
+
+                    for(ox = 0, a = acc; ox < w; ++ox, a += 3)
+                        for(c = 0; c < PYRAMID_FACTOR; c += 2, p += 2)
+                        {
+                            a[colour[0]] += p[0];
+                            a[colour[1]] += p[1];
+                        }
+                }
+            }
+
+            for(ox = 0, a = acc; ox < w; ++ox, a += 3)
+                for(ch = 0; ch < 3; ++ch)
+                    lin[3 * ((size_t)oy * l0->Width + x0 + ox) + ch]
+                        = job->count[ch] ? a[ch] / job->count[ch] : a[1] / job->count[1];
+        }
+    }
+}
+
+/* shrink linear level n-1 (w by h) to level n */
+static void pyramid_shrink(const uint16_t *src, int w, const VRP_PYRAMIDLEVEL *l, uint16_t *dst)
+{
+    int      ox, oy, i, j, ch;
+    uint32_t sum[3];
+
+    for(oy = 0; oy < (int)l->Height; ++oy)
+        for(ox = 0; ox < (int)l->Width; ++ox)
+        {
+            sum[0] = sum[1] = sum[2] = 0;
+            for(j = 0; j < PYRAMID_FACTOR; ++j)
+            {
+                const uint16_t *p = src + 3 * ((size_t)(oy * PYRAMID_FACTOR + j) * w + ox * PYRAMID_FACTOR);
+
+                for(i = 0; i < PYRAMID_FACTOR; ++i, p += 3)
+                    for(ch = 0; ch < 3; ++ch)
+                        sum[ch] += p[ch];
+            }
+            for(ch = 0; ch < 3; ++ch)
+                *dst++ = sum[ch] / (PYRAMID_FACTOR * PYRAMID_FACTOR);
+        }
+}
+
+static void pyramid_encode(struct pyramid_job *job, const uint16_t *lin, size_t npixels,
+                           unsigned char *out)
+{
+    size_t i;
+
+    for(i = 0; i < npixels; ++i, lin += 3)
+    {
+        *out++ = job->lut[0][lin[0] < job->maxval ? lin[0] : job->maxval - 1];
+        *out++ = job->lut[1][lin[1] < job->maxval ? lin[1] : job->maxval - 1];
+        *out++ = job->lut[2][lin[2] < job->maxval ? lin[2] : job->maxval - 1];
+    }
+}
+
+/* one work item: a run of PYRAMID_CHUNK images */
+static void pyramid_chunk(int item, void *arg)
+{
+    struct pyramid_job *job = arg;
+    VRP_PYRAMIDHEADER  *h = job->header;
+    VRP_PackCursor     *cursor = NULL;
+    uint16_t           *lin[VRP_PYRAMID_LEVELS] = { NULL };
+    int                i, l, last;
+
+    for(l = 0; l < VRP_PYRAMID_LEVELS; ++l)
+        if(!(lin[l] = malloc(3 * sizeof(uint16_t) * ((size_t)h->Level[l].Width * h->Level[l].Height + 1))))
+            goto failed;
+    if(job->handle->pack && !(cursor = vrp_pack_cursor_new(job->handle)))
+        goto failed;
+
+    last = (item + 1) * PYRAMID_CHUNK;
+    if(last > (int)h->ImageCount)
+        last = h->ImageCount;
+    for(i = item * PYRAMID_CHUNK; i < last; ++i)
+    {
+        const void *pixels = cursor ? vrp_pack_decode(job->handle, cursor, i)
+                                    : vrp_image_pixels(job->handle, i);
+
+        if(!pixels)
+            continue; /* (left out of the index) */
+
+        pyramid_bin(job, pixels, lin[0]);
+        for(l = 1; l < VRP_PYRAMID_LEVELS; ++l)
+            pyramid_shrink(lin[l - 1], h->Level[l - 1].Width, &h->Level[l], lin[l]);
+        for(l = 0; l < VRP_PYRAMID_LEVELS; ++l)
+            pyramid_encode(job, lin[l], (size_t)h->Level[l].Width * h->Level[l].Height,
+                           job->map + h->Level[l].Offset + (size_t)i * h->Level[l].FrameBytes);
+        job->map[h->IndexOffset + i] = VRP_PYRAMID_PRESENT;
+    }
+    goto done;
+
+failed:
+    job->failed = 1;
+done:
+    vrp_pack_cursor_free(cursor);
+    for(l = 0; l < VRP_PYRAMID_LEVELS; ++l)
+        free(lin[l]);
+}
+
+/* vrp_pyramid_build - make the preview pyramid of a cine, in one pass
+ *
+ * inputs:
+ *   handle  - the cine
+ *   path    - the sidecar file to write (made under a temporary name,
+ *             then renamed into place, so it's never seen half done)
+ *   threads - as for vrp_parallel_for()
+ *   err     - where to report what went wrong (may be NULL)
+ *
+ * return value:
+ *   0 on success, -1 on failure
+ */
+int vrp_pyramid_build(VRP_Handle handle, const char *path, int threads, VRP_Error *err)
+{
+    struct pyramid_job job;
+    VRP_PYRAMIDHEADER  header;
+    unsigned char      *map = MAP_FAILED;
+    char               *tmp = NULL;
+    int64_t            size;
+    int                fd = -1, ret = -1, l, ch, chunks;
+    unsigned           v, scale, n;
+
+    if(!handle->imageHeader || !handle->setup)
+    {
+        vrp_set_error(err, VRP_E_FORMAT, "%s: no image header or setup", handle->name);
+        return -1;
+    }
+    if(handle->imageHeader->biBitCount != 8 && handle->imageHeader->biBitCount != 16)
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: can't make previews of %d-bit images",
+                      handle->name, handle->imageHeader->biBitCount);
+        return -1;
+    }
+    if(handle->header->Compression == VRP_CC_JPEG)
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: can't make previews of JPEG-compressed images", handle->name);
+        return -1;
+    }
+
+    memset(&job, 0, sizeof(job));
+    memset(&header, 0, sizeof(header));
+    header.Version = 1;
+    header.ImageCount = handle->header->ImageCount;
+    header.FirstImageNo = handle->header->FirstImageNo;
+    header.Width = handle->imageHeader->biWidth;
+    header.Height = handle->imageHeader->biHeight;
+    header.Levels = VRP_PYRAMID_LEVELS;
+    header.SourceSize = handle->st.st_size;
+    header.SourceMtime = handle->st.st_mtime;
+    header.IndexOffset = sizeof(header);
+
+    size = align_up(header.IndexOffset + header.ImageCount);
+    for(l = 0, scale = PYRAMID_FACTOR; l < VRP_PYRAMID_LEVELS; ++l, scale *= PYRAMID_FACTOR)
+    {
+        VRP_PYRAMIDLEVEL *level = &header.Level[l];
+
+        level->Scale = scale;
+        level->Width = header.Width / scale;
+        level->Height = header.Height / scale;
+        level->FrameBytes = 3 * level->Width * level->Height;
+        level->Offset = size;
+        size = align_up(size + (int64_t)header.ImageCount * level->FrameBytes);
+    }
+
+    /* what to bin into what, and how to encode it */
+    job.handle = handle;
+    job.header = &header;
+    if(vrp_cfa_pattern(handle, job.pattern) < 0)
+        memset(job.pattern, 1, 4);
+    for(n = 0; n < PYRAMID_FACTOR * PYRAMID_FACTOR; ++n)
+        ++job.count[job.pattern[((n / PYRAMID_FACTOR) & 1) * 2 + (n & 1)]];
+    job.maxval = handle->imageHeader->biClrImportant;
+    if(!job.maxval || job.maxval > (1u << handle->imageHeader->biBitCount))
+        job.maxval = 1u << handle->imageHeader->biBitCount;
+    for(ch = 0; ch < 3; ++ch)
+    {
+        float gain = ch == 0 ? handle->setup->WBGain[0].R : ch == 2 ? handle->setup->WBGain[0].B : 1;
+
+        if(!(gain > 0))
+            gain = 1;
+        if(!(job.lut[ch] = malloc(job.maxval)))
+        {
+            vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", handle->name);
+            goto done;
+        }
+        for(v = 0; v < job.maxval; ++v)
+        {
+            double x = gain * v / (job.maxval - 1);
+
+            job.lut[ch][v] = x >= 1 ? 255 : (unsigned char)(255 * pow(x, 1 / 2.2) + 0.5);
+        }
+    }
+
+    if(!(tmp = malloc(strlen(path) + 5)))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", path);
+        goto done;
+    }
+    sprintf(tmp, "%s.tmp", path);
+    if((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0 || ftruncate(fd, size) < 0
+       || (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "%s", tmp);
+        goto done;
+    }
+
+    job.map = map;
+    chunks = (header.ImageCount + PYRAMID_CHUNK - 1) / PYRAMID_CHUNK;
+    vrp_parallel_for(chunks, threads, pyramid_chunk, &job);
+    if(job.failed)
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", path);
+        goto done;
+    }
+
+    memcpy(&header.Magic, VRP_PYRAMID_MAGIC, 4);
+    memcpy(map, &header, sizeof(header));
+    munmap(map, size);
+    map = MAP_FAILED;
+    l = close(fd);
+    fd = -1;
+    if(l < 0)
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "%s", tmp);
+        goto done;
+    }
+    if(rename(tmp, path) < 0)
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "%s", path);
+        goto done;
+    }
+    ret = 0;
+
+done:
+    if(map != MAP_FAILED)
+        munmap(map, size);
+    if(fd >= 0)
+        close(fd);
+    if(ret < 0 && tmp)
+        unlink(tmp);
+    free(tmp);
+    for(ch = 0; ch < 3; ++ch)
+        free(job.lut[ch]);
+    return ret;
+}
+
+/* vrp_pyramid_open - map a pyramid sidecar for reading
+ *
+ * inputs:
+ *   path   - the sidecar
+ *   handle - the cine it should be of, to check it's up to date (may be
+ *            NULL, to take the sidecar's word for it)
+ *   err    - where to report what went wrong (may be NULL)
+ *
+ * return value:
+ *   the pyramid, to be closed with vrp_pyramid_close(), or NULL
+ */
+VRP_Pyramid *vrp_pyramid_open(const char *path, VRP_Handle handle, VRP_Error *err)
+{
+    VRP_Pyramid             *pyramid;
+    const VRP_PYRAMIDHEADER *h;
+    struct stat             st;
+    int                     fd, l;
+    void                    *map;
+
+    if(err)
+        memset(err, 0, sizeof(*err));
+
+    if((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "%s", path);
+        if(fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    if((size_t)st.st_size < sizeof(*h))
+    {
+        close(fd);
+        vrp_set_error(err, VRP_E_FORMAT, "%s: not a preview pyramid", path);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "%s: mmap", path);
+        return NULL;
+    }
+
+    h = map;
+    if(memcmp(&h->Magic, VRP_PYRAMID_MAGIC, 4))
+    {
+        vrp_set_error(err, VRP_E_FORMAT, "%s: not a preview pyramid", path);
+        goto failed;
+    }
+    if(h->Version != 1 || h->Levels != VRP_PYRAMID_LEVELS)
+    {
+        vrp_set_error(err, VRP_E_VERSION, "%s: preview pyramid version %u not supported", path, h->Version);
+        goto failed;
+    }
+    if(h->IndexOffset < (int64_t)sizeof(*h) || h->IndexOffset + h->ImageCount > st.st_size)
+        goto corrupt;
+    for(l = 0; l < VRP_PYRAMID_LEVELS; ++l)
+        if(h->Level[l].Offset < 0 || h->Level[l].FrameBytes != 3 * h->Level[l].Width * h->Level[l].Height
+           || h->Level[l].Offset + (int64_t)h->ImageCount * h->Level[l].FrameBytes > st.st_size)
+            goto corrupt;
+    if(handle && (h->SourceSize != handle->st.st_size || h->SourceMtime != handle->st.st_mtime
+                  || h->ImageCount != handle->header->ImageCount
+                  || h->FirstImageNo != handle->header->FirstImageNo))
+    {
+        vrp_set_error(err, VRP_E_FORMAT, "%s: out of date for %s (rebuild it)", path, handle->name);
+        goto failed;
+    }
+
+    if(!(pyramid = calloc(1, sizeof(*pyramid))))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", path);
+        goto failed;
+    }
+    pyramid->map = map;
+    pyramid->size = st.st_size;
+    pyramid->header = h;
+    pyramid->index = (const unsigned char *)map + h->IndexOffset;
+    return pyramid;
+
+corrupt:
+    vrp_set_error(err, VRP_E_FORMAT, "%s: preview pyramid is corrupt or truncated", path);
+failed:
+    munmap(map, st.st_size);
+    return NULL;
+}
+
+const VRP_PYRAMIDHEADER *vrp_pyramid_header(const VRP_Pyramid *pyramid)
+{
+    return pyramid->header;
+}
+
+/* the preview of image offset at level (0 biggest), 8-bit RGB, top row
+ * first, Level[level].Width by Height; NULL if there isn't one */
+const unsigned char *vrp_pyramid_frame(const VRP_Pyramid *pyramid, int level, int offset)
+{
+    const VRP_PYRAMIDLEVEL *l;
+
+    if(level < 0 || level >= VRP_PYRAMID_LEVELS || offset < 0 || (unsigned)offset >= pyramid->header->ImageCount
+       || !(pyramid->index[offset] & VRP_PYRAMID_PRESENT))
+        return NULL;
+    l = &pyramid->header->Level[level];
+    if(!l->FrameBytes)
+        return NULL;
+    return (const unsigned char *)pyramid->map + l->Offset + (size_t)offset * l->FrameBytes;
+}
+
+void vrp_pyramid_close(VRP_Pyramid *pyramid)
+{
+    if(!pyramid)
+        return;
+    munmap(pyramid->map, pyramid->size);
+    free(pyramid);
+}
@@ -12,125 +12,167 @@
 
 #include <stdio.h> /* for perror() */
 #include <fcntl.h> /* for open() */
-#include <string.h> /* for strlen() */
+#include <string.h> /* for strlen(), memcpy() */
 #include <sys/stat.h> /* for fstat(), struct stat */
 #include <sys/mman.h> /* for mmap() */
 #include <stdlib.h> /* for calloc() */
+#include <unistd.h> /* for close() */
+#include <errno.h>
 
 #include "vrptools.h"
+#include "util.h"
 
-VRP_Handle read_cine_fd(int fd, const char *name)
+/* vrp_open_fd - get a handle on the CINE (or packed) file open on fd
+ *
+ * inputs:
+ *   fd   - open file; stays open for the life of the handle, but is
+ *          not closed by free_cine_handle() (unlike vrp_open()'s)
+ *   name - what to call it in messages
+ *   err  - where to report what went wrong, and any warnings (may be
+ *          NULL, if you don't care)
+ *
+ * return value:
+ *   the new handle, or NULL on failure
+ */
+VRP_Handle vrp_open_fd(int fd, const char *name, VRP_Error *err)
 {
     VRP_Handle  handle;
-    size_t      expected_size;
+    VRP_Error   ignored;
+    void        *map;
+    size_t      expected_size, size;
+    int         packed;
+
+    if(!err)
+        err = &ignored;
+    memset(err, 0, sizeof(*err));
 
     if(!(handle = calloc(sizeof(VRP_File), 1)))
     {
-        perror("calloc");
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", name);
         return NULL;
     }
 
     if(fstat(fd, &handle->st) < 0)
     {
-        perror(name);
+        vrp_set_error(err, VRP_E_SYSTEM, "%s", name);
+        free(handle);
         return NULL;
     }
 
     if((size_t)handle->st.st_size < sizeof(VRP_CINEFILEHEADER))
     {
-        fprintf(stderr, "%s: too small to be a CINE file!\n", name);
-        free_cine_handle(handle);
+        vrp_set_error(err, VRP_E_FORMAT, "%s: too small to be a CINE file!", name);
+        free(handle);
         return NULL;
     }
 
-    if(!(handle->header = mmap(NULL, handle->st.st_size, PROT_READ, MAP_SHARED, fd, 0)))
+    if((map = mmap(NULL, handle->st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
     {
-        perror("mmap");
+        vrp_set_error(err, VRP_E_SYSTEM, "%s: mmap", name);
         free(handle);
         return NULL;
     }
 
+    handle->header = map;
     handle->start = handle->header; /* convenience pointer */
+    handle->end = handle->start + handle->st.st_size;
+    handle->fd = fd;
 
     /* after this point, if we bail, we want to do it in a consistent way: */
 #define BAIL free_cine_handle(handle); return NULL
 
+    if(!(handle->name = strdup(name)))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", name);
+        BAIL;
+    }
+
+    /* a packed file carries the original's headers; from here on we
+     * look at those (and "size" is just theirs) */
+    if((packed = vrp_pack_attach(handle, err)) < 0)
+    {
+        BAIL;
+    }
+    size = handle->end - handle->start;
+
     /* a couple very basic sanity checks before we do anything else: */
 
     /* check magic number */
-    if(htons(handle->header->Type) != ('C' << 8 | 'I')
+    if(memcmp(&handle->header->Type, "CI", 2)
        || handle->header->Headersize != 44)
     {
-        fprintf(stderr, "%s: does not appear to be a CINE file!\n", name);
+        vrp_set_error(err, VRP_E_FORMAT, "%s: does not appear to be a CINE file!", name);
         BAIL;
     }
     if(handle->header->Version != 1)
     {
-        fprintf(stderr, "%s: version number (%d) not supported\n",
-                name, handle->header->Version);
-        /* a little extra error if the Version seems extraordinary. 5 is arbitrary. */
-        if(handle->header->Version > 5)
-            fprintf(stderr, "(Is this really a CINE file?)\n");
-
+        /* a little extra note if the Version seems extraordinary. 5 is arbitrary. */
+        vrp_set_error(err, VRP_E_VERSION, "%s: version number (%d) not supported%s",
+                      name, handle->header->Version,
+                      handle->header->Version > 5 ? " (Is this really a CINE file?)" : "");
         BAIL;
     }
 
-    handle->fd = fd;
-    handle->name = strdup(name);
-
     /* note: doing this as an addition on the left of < rather than
      * subtraction to the right is important -- dealing with unsigned
      * values. */
-    if(handle->header->OffImageHeader + sizeof(VRP_BITMAPINFOHEADER) < (size_t)handle->st.st_size)
+    if(handle->header->OffImageHeader + sizeof(VRP_BITMAPINFOHEADER) < size)
         handle->imageHeader = handle->start + handle->header->OffImageHeader;
     else
-        fprintf(stderr, "WARNING: %s is too small to contain Image Headers!\n", handle->name);
+        err->warnings |= VRP_WARN_NO_IMAGEHEADER;
 
-    if(handle->header->OffSetup + sizeof(VRP_SETUP) < (size_t)handle->st.st_size)
+    if(handle->header->OffSetup + sizeof(VRP_SETUP) < size)
         handle->setup = handle->start + handle->header->OffSetup;
     else
-        fprintf(stderr, "WARNING: %s is too small to contain Setup info!\n", handle->name);
+        err->warnings |= VRP_WARN_NO_SETUP;
 
     if(handle->header->OffImageOffsets > handle->header->OffSetup + sizeof(VRP_SETUP))
     {
-        if(handle->header->OffSetup + sizeof(VRP_SETUP) + sizeof(VRP_TAGGED_BLOCK) < (size_t)handle->st.st_size)
+        if(handle->header->OffSetup + sizeof(VRP_SETUP) + sizeof(VRP_TAGGED_BLOCK) < size)
             handle->firstTaggedBlock = (void*)handle->setup + sizeof(VRP_SETUP);
         else
-            fprintf(stderr, "WARNING: It seems we ought to have tagged blocks, but we don't actually have space for them!\n");
+            err->warnings |= VRP_WARN_NO_BLOCK_ROOM;
     }
     else
-        fprintf(stderr, "INFO: No tagged blocks found.\n");
+        err->warnings |= VRP_WARN_NO_BLOCKS;
 
     expected_size = handle->header->OffImageOffsets + handle->header->ImageCount * vrp_image_size(handle);
 
-    if((size_t)handle->st.st_size < expected_size)
-    {
-        fprintf(stderr, "WARNING: file appears to be truncated (not all images are present)"
-                " (size %llu, expected at least %lu.)\n", handle->st.st_size, expected_size);
-    }
-
-    handle->end = handle->start + handle->st.st_size;
+    /* (compressed images have sizes of their own; nothing to expect) */
+    if(!packed && handle->header->Compression != VRP_CC_JPEG && size < expected_size)
+        err->warnings |= VRP_WARN_TRUNCATED;
 
     /* set it anyway, so we can at least get some images, if we have
      * them.  This could cause the client to have problems, but we
      * should be able to mostly solve it by just providing an API for
      * getting the address of a particular image. */
     handle->firstImageOffset     = handle->start + handle->header->OffImageOffsets;
-    if((void*)handle->firstImageOffset > handle->end)
+    if((void*)(handle->firstImageOffset + 1) > handle->end)
         handle->firstImageOffset = NULL;
     else
-        handle->firstImageAnnotation = handle->start + *(handle->firstImageOffset);
+        handle->firstImageAnnotation = vrp_image_annotation(handle, 0);
 
 
     return handle;
 }
 
-VRP_Handle read_cine(const char *filename)
+/* vrp_open - vrp_open_fd() on a named file ("-" meaning stdin) */
+VRP_Handle vrp_open(const char *filename, VRP_Error *err)
 {
-    int fd;
+    VRP_StatsTimer t;
+    VRP_Handle     handle;
+    int            fd;
 
-    if(!filename) return NULL; /* TODO: error message? */
-    if(strlen(filename) == 0) return NULL; /* TODO: error message? */
+    if(err)
+        memset(err, 0, sizeof(*err));
+    if(!filename || strlen(filename) == 0)
+    {
+        errno = ENOENT;
+        vrp_set_error(err, VRP_E_SYSTEM, "(no file name)");
+        return NULL;
+    }
+
+    VRP_STATS_START(&t);
 
     /* treat "-" as stdin.  TODO: check to see if ./- exists first? */
     if(strlen(filename) == 1 && filename[0] == '-')
@@ -140,23 +182,36 @@ VRP_Handle read_cine(const char *filename)
 
     if(fd < 0)
     {
-        perror(filename);
+        vrp_set_error(err, VRP_E_SYSTEM, "%s", filename);
         return NULL;
     }
 
-    return read_cine_fd(fd, filename);
+    if((handle = vrp_open_fd(fd, filename, err)))
+        handle->ownfd = fd > 0;
+    else if(fd > 0)
+        close(fd);
+
+    VRP_STATS_STOP(&t, VRP_STAGE_OPEN, 0);
+    return handle;
 }
 
 void free_cine_file(VRP_Handle handle)
 {
     if(!handle) return;
 
-    if(handle->header)
+    if(handle->pack)
+        vrp_pack_detach(handle);
+    else if(handle->header)
         if(munmap(handle->header, handle->st.st_size))
             perror("munmap failed");
 
+    if(handle->ownfd)
+        close(handle->fd);
+    handle->ownfd = 0;
+
     /* only name has to be freed, everything else was under the mmap. */
     if(handle->name) free(handle->name);
+    handle->name = NULL;
 
     /* but even mmap-based data should be reset: */
     handle->header               = NULL;
@@ -184,3 +239,161 @@ size_t vrp_image_size(VRP_Handle handle)
 
     return(handle->imageHeader->biSizeImage);
 }
+
+/* the size of the data stored after an annotation: biSizeImage, but
+ * for CC_JPEG cines, whose images are each compressed to a size of
+ * their own, the last DWORD of the annotation */
+static size_t stored_size(VRP_Handle handle, const VRP_ImageAnnotation *annotation)
+{
+    if(handle->header->Compression != VRP_CC_JPEG)
+        return vrp_image_size(handle);
+    if(annotation->AnnotationSize < 8)
+        return 0;
+    return *(const VRP_DWORD *)((const char *)annotation + annotation->AnnotationSize - sizeof(VRP_DWORD));
+}
+
+/* the size of the image at offset as stored (see stored_size()); 0 if
+ * it isn't there */
+size_t vrp_image_stored_size(VRP_Handle handle, int offset)
+{
+    VRP_ImageAnnotation *annotation = vrp_image_annotation(handle, offset);
+
+    return annotation ? stored_size(handle, annotation) : 0;
+}
+
+/* report the file offset of the pixel array for the image at the
+ * given zero-based offset (i.e. just past its annotation), or -1 if
+ * that image isn't (entirely) present in the file. */
+off_t vrp_image_pixel_offset(VRP_Handle handle, int offset)
+{
+    VRP_ImageAnnotation *annotation;
+    off_t               pos, size = handle->end - handle->start;
+
+    /* (packed files have no pixel arrays to point at) */
+    if(handle->pack || !handle->firstImageOffset || offset < 0
+       || (unsigned)offset >= handle->header->ImageCount)
+        return -1;
+    if((void*)(handle->firstImageOffset + offset + 1) > handle->end)
+        return -1;
+
+    pos = handle->firstImageOffset[offset];
+    if(pos < 0 || pos + (off_t)sizeof(VRP_DWORD) > size)
+        return -1;
+
+    annotation = handle->start + pos;
+    if(pos + (off_t)annotation->AnnotationSize > size)
+        return -1;
+    pos += annotation->AnnotationSize;
+    if(pos + (off_t)stored_size(handle, annotation) > size)
+        return -1;
+
+    return pos;
+}
+
+/* a pointer to the pixel array of an image, in the form the cine
+ * stores it (NULL if absent).  Normally that points into the mapped
+ * file; for packed files it's decoded into a buffer belonging to the
+ * handle and the calling thread, and only good until that thread's next
+ * call on the handle. */
+const void *vrp_image_pixels(VRP_Handle handle, int offset)
+{
+    off_t pos;
+
+    if(handle->pack)
+    {
+        VRP_StatsTimer t;
+        const void     *pixels;
+
+        VRP_STATS_START(&t);
+        pixels = vrp_pack_pixels(handle, offset);
+        VRP_STATS_STOP(&t, VRP_STAGE_FETCH, vrp_image_size(handle));
+        return pixels;
+    }
+
+    pos = vrp_image_pixel_offset(handle, offset);
+    return pos < 0 ? NULL : handle->start + pos;
+}
+
+/* the annotation of an image (NULL if absent) */
+VRP_ImageAnnotation *vrp_image_annotation(VRP_Handle handle, int offset)
+{
+    if(handle->pack)
+        return vrp_pack_annotation(handle, offset);
+
+    if(vrp_image_pixel_offset(handle, offset) < 0)
+        return NULL;
+    return handle->start + handle->firstImageOffset[offset];
+}
+
+/* fill in the 2x2 CFA pattern as the pixels are *stored* (i.e. with
+ * row 0 being the bottom of the image), in TIFF/EP terms: 0 = red,
+ * 1 = green, 2 = blue; pattern[0..1] is the first stored row.
+ * Returns 0 on success, -1 for CFA modes we don't understand. */
+int vrp_cfa_pattern(VRP_Handle handle, unsigned char pattern[4])
+{
+    static const unsigned char bayer[4]     = { 0, 1, 1, 2 }; /* gb/rg, seen bottom-up */
+    static const unsigned char bayerflip[4] = { 1, 2, 0, 1 }; /* rg/gb, seen bottom-up */
+
+    if(!handle->setup)
+        return -1;
+
+    switch(handle->setup->CFA & 0xff)
+    {
+    case VRP_CFA_BAYER:     memcpy(pattern, bayer, 4); return 0;
+    case VRP_CFA_BAYERFLIP: memcpy(pattern, bayerflip, 4); return 0;
+    default:                return -1;
+    }
+}
+
+/* whether the images are monochrome: one sample per pixel, with no
+ * CFA to demosaic.  That's a CC_RGB cine of 8 or 16 bits (wider ones
+ * hold interpolated colour), or any other whose SETUP says CFA_NONE. */
+int vrp_is_gray(VRP_Handle handle)
+{
+    if(!handle->imageHeader)
+        return 0;
+    if(handle->header->Compression == VRP_CC_RGB)
+        return handle->imageHeader->biBitCount <= 16;
+    return handle->setup && (handle->setup->CFA & 0xff) == VRP_CFA_NONE;
+}
+
+/* step through the tagged blocks: pass NULL to get the first one;
+ * returns NULL after the last (or at the first one that doesn't fit
+ * between SETUP and the image offsets). */
+VRP_TAGGED_BLOCK *vrp_next_tagged_block(VRP_Handle handle, VRP_TAGGED_BLOCK *block)
+{
+    void *limit;
+
+    if(!handle->firstTaggedBlock)
+        return NULL;
+
+    limit = handle->start + handle->header->OffImageOffsets;
+    if(limit > handle->end)
+        limit = handle->end;
+
+    if(!block)
+        block = handle->firstTaggedBlock;
+    else if(!block->Reserved) /* that was the last one */
+        return NULL;
+    else
+        block = (void*)block + block->BlockSize;
+
+    if((void*)block + sizeof(VRP_TAGGED_BLOCK) > limit
+       || block->BlockSize < sizeof(VRP_TAGGED_BLOCK)
+       || (void*)block + block->BlockSize > limit)
+        return NULL;
+
+    return block;
+}
+
+/* the first tagged block of the given type (NULL if there isn't one) */
+VRP_TAGGED_BLOCK *vrp_find_tagged_block(VRP_Handle handle, int type)
+{
+    VRP_TAGGED_BLOCK *block = NULL;
+
+    while((block = vrp_next_tagged_block(handle, block)))
+        if(block->Type == type)
+            return block;
+
+    return NULL;
+}
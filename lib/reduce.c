@@ -0,0 +1,464 @@
+/*
+ * reduce.c -- per-pixel reductions over a range of images: mean,
+ * median, maximum and minimum (see cine-reduce)
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "vrptools.h"
+#include "util.h"
+
+/*
+ * The samples of an image are cut into tiles of REDUCE_TILE; a work
+ * item is one tile, run through every image of a batch, so each
+ * thread's accumulators stay in its cache while the images stream
+ * past.  Images of raw files are read straight from the mapping (a
+ * batch is the whole range); those of packed files are decoded, a
+ * batch at a time, into half the memory budget.
+ *
+ * Per sample, the state is:
+ *
+ *   mean     - a 64-bit total, topped up once a batch from the work
+ *              item's 32-bit running sums (batches are at most
+ *              REDUCE_MAX_BATCH images, so those can't overflow)
+ *   max, min - the output sample itself
+ *   median   - a copy of the sample from every image (exact: the
+ *              lower median, for an even count)
+ *
+ * When that won't fit in the budget, the image is done in slabs of
+ * tiles that will, one pass over the images per slab.  Only medians
+ * (2 bytes per image per sample) are likely to need more than one.
+ *
+ * 16-bit samples are handled 16 at a time with the compiler's vector
+ * extensions; 8-bit ones one at a time.
+ */
+
+#define REDUCE_TILE      8192    /* samples per work item */
+#define REDUCE_MAX_BATCH 65536   /* images summed in 32 bits before spilling */
+#define REDUCE_COLUMNS   32      /* samples per median selection block */
+
+typedef uint16_t v16u16 __attribute__((vector_size(32)));
+typedef uint32_t v8u32 __attribute__((vector_size(32)));
+
+struct reduce_job {
+    VRP_Handle  handle;
+    int         op, wide, group;
+    int         first, count;          /* the images reduced */
+    size_t      samples, image_size;   /* per image */
+
+    size_t      slab0, slab_len;       /* samples in this pass */
+    int         batch0, batch_len;     /* images in this batch (from first) */
+    const void  **frames;              /* batch_len pixel arrays */
+    char        *decoded;              /* packed files: room for a batch */
+
+    uint64_t    *sums;                 /* mean: slab_len totals */
+    uint16_t    *gather;               /* median: count rows of slab_len */
+    uint16_t    *out;
+    int         failed;                /* a VRP_E_* code */
+};
+
+/* kth_smallest - select in place (Wirth's algorithm); returns a[k] as
+ * it would be if a were sorted */
+static uint16_t kth_smallest(uint16_t *a, int n, int k)
+{
+    int      i, j, l = 0, m = n - 1;
+    uint16_t x, t;
+
+    while(l < m)
+    {
+        x = a[k];
+        i = l;
+        j = m;
+        do
+        {
+            while(a[i] < x)
+                i++;
+            while(x < a[j])
+                j--;
+            if(i <= j)
+            {
+                t = a[i];
+                a[i] = a[j];
+                a[j] = t;
+                i++;
+                j--;
+            }
+        } while(i <= j);
+        if(j < k)
+            l = i;
+        if(k < i)
+            m = j;
+    }
+    return a[k];
+}
+
+/* decode one group's worth of a batch, with a cursor of its own */
+static void reduce_decode(int item, void *arg)
+{
+    struct reduce_job *job = arg;
+    VRP_PackCursor    *cursor;
+    const void        *pixels;
+    int               i = item * job->group, end = i + job->group;
+
+    if(end > job->batch_len)
+        end = job->batch_len;
+    if(!(cursor = vrp_pack_cursor_new(job->handle)))
+    {
+        job->failed = VRP_E_NOMEM;
+        return;
+    }
+    for(; i < end; ++i)
+    {
+        if(!(pixels = vrp_pack_decode(job->handle, cursor, job->first + job->batch0 + i)))
+        {
+            job->failed = VRP_E_RANGE;
+            break;
+        }
+        memcpy(job->decoded + i * job->image_size, pixels, job->image_size);
+        job->frames[i] = job->decoded + i * job->image_size;
+    }
+    vrp_pack_cursor_free(cursor);
+}
+
+/* sum one tile of the batch into the slab's totals */
+static void reduce_mean(struct reduce_job *job, size_t s0, size_t n)
+{
+    v8u32    acc[REDUCE_TILE / 8]; /* each block of 16: its 8 even samples' sums, then its odd */
+    uint32_t tail[16];
+    size_t   k, v = job->wide ? n / 16 * 16 : 0;
+    int      f, e;
+
+    memset(acc, 0, sizeof(acc));
+    memset(tail, 0, sizeof(tail));
+    for(f = 0; f < job->batch_len; ++f)
+    {
+        if(job->wide)
+        {
+            const uint16_t *p = (const uint16_t *)job->frames[f] + s0;
+            v8u32          *a = acc;
+
+            for(k = 0; k < v; k += 16, a += 2)
+            {
+                v16u16 in;
+                v8u32  pairs;
+
+                memcpy(&in, p + k, sizeof(in));
+                pairs = (v8u32)in;
+                a[0] += pairs & 0xffff;
+                a[1] += pairs >> 16;
+            }
+            for(; k < n; ++k)
+                tail[k - v] += p[k];
+        }
+        else
+        {
+            const uint8_t *p = (const uint8_t *)job->frames[f] + s0;
+            uint32_t      *a = (uint32_t *)acc;
+
+            for(k = 0; k < n; ++k)
+                a[k] += p[k];
+        }
+    }
+
+    if(!job->wide)
+    {
+        for(k = 0; k < n; ++k)
+            job->sums[s0 - job->slab0 + k] += ((uint32_t *)acc)[k];
+        return;
+    }
+    for(k = 0; k < v; k += 16)
+        for(e = 0; e < 8; ++e)
+        {
+            job->sums[s0 - job->slab0 + k + 2 * e] += acc[k / 8][e];
+            job->sums[s0 - job->slab0 + k + 2 * e + 1] += acc[k / 8 + 1][e];
+        }
+    for(; k < n; ++k)
+        job->sums[s0 - job->slab0 + k] += tail[k - v];
+}
+
+/* fold one tile of the batch into the running maxima (or minima) */
+static void reduce_extreme(struct reduce_job *job, size_t s0, size_t n)
+{
+    uint16_t *out = job->out + s0;
+    size_t   k, v = job->wide ? n / 16 * 16 : 0;
+    int      f, max = job->op == VRP_REDUCE_MAX;
+
+    for(f = 0; f < job->batch_len; ++f)
+    {
+        if(job->wide)
+        {
+            const uint16_t *p = (const uint16_t *)job->frames[f] + s0;
+
+            for(k = 0; k < v; k += 16)
+            {
+                v16u16 in, m, take;
+
+                memcpy(&in, p + k, sizeof(in));
+                memcpy(&m, out + k, sizeof(m));
+                take = max ? (v16u16)(in > m) : (v16u16)(in < m);
+                m = (in & take) | (m & ~take);
+                memcpy(out + k, &m, sizeof(m));
+            }
+            for(; k < n; ++k)
+                if(max ? p[k] > out[k] : p[k] < out[k])
+                    out[k] = p[k];
+        }
+        else
+        {
+            const uint8_t *p = (const uint8_t *)job->frames[f] + s0;
+
+            for(k = 0; k < n; ++k)
+                if(max ? p[k] > out[k] : p[k] < out[k])
+                    out[k] = p[k];
+        }
+    }
+}
+
+/* copy one tile of the batch into the median's sample store */
+static void reduce_gather(struct reduce_job *job, size_t s0, size_t n)
+{
+    size_t k;
+    int    f;
+
+    for(f = 0; f < job->batch_len; ++f)
+    {
+        uint16_t *g = job->gather + (size_t)(job->batch0 + f) * job->slab_len + (s0 - job->slab0);
+
+        if(job->wide)
+            memcpy(g, (const uint16_t *)job->frames[f] + s0, n * sizeof(*g));
+        else
+        {
+            const uint8_t *p = (const uint8_t *)job->frames[f] + s0;
+
+            for(k = 0; k < n; ++k)
+                g[k] = p[k];
+        }
+    }
+}
+
+/* one tile through the current batch */
+static void reduce_tile(int item, void *arg)
+{
+    struct reduce_job *job = arg;
+    size_t            s0 = job->slab0 + (size_t)item * REDUCE_TILE;
+    size_t            n = job->slab0 + job->slab_len - s0;
+
+    if(n > REDUCE_TILE)
+        n = REDUCE_TILE;
+    switch(job->op)
+    {
+    case VRP_REDUCE_MEAN:   reduce_mean(job, s0, n); break;
+    case VRP_REDUCE_MEDIAN: reduce_gather(job, s0, n); break;
+    default:                reduce_extreme(job, s0, n); break;
+    }
+}
+
+/* one tile's results, once every image has been seen */
+static void reduce_finish(int item, void *arg)
+{
+    struct reduce_job *job = arg;
+    size_t            t0 = (size_t)item * REDUCE_TILE; /* (from slab0) */
+    size_t            n = job->slab_len - t0, k, c;
+    uint16_t          *column;
+    int               f;
+
+    if(n > REDUCE_TILE)
+        n = REDUCE_TILE;
+    if(job->op == VRP_REDUCE_MEAN)
+    {
+        for(k = 0; k < n; ++k)
+            job->out[job->slab0 + t0 + k] = (job->sums[t0 + k] + job->count / 2) / job->count;
+        return;
+    }
+
+    /* median: transpose a few samples' columns at a time, so the
+     * store is read a cache line per image, then select in each */
+    if(!(column = malloc(REDUCE_COLUMNS * job->count * sizeof(*column))))
+    {
+        job->failed = VRP_E_NOMEM;
+        return;
+    }
+    for(k = 0; k < n; k += REDUCE_COLUMNS)
+    {
+        size_t w = n - k < REDUCE_COLUMNS ? n - k : REDUCE_COLUMNS;
+
+        for(f = 0; f < job->count; ++f)
+        {
+            const uint16_t *g = job->gather + (size_t)f * job->slab_len + t0 + k;
+
+            for(c = 0; c < w; ++c)
+                column[c * job->count + f] = g[c];
+        }
+        for(c = 0; c < w; ++c)
+            job->out[job->slab0 + t0 + k + c] = kth_smallest(column + c * job->count, job->count,
+                                                             (job->count - 1) / 2);
+    }
+    free(column);
+}
+
+/* vrp_reduce - reduce a range of images to one, sample by sample
+ *
+ * inputs:
+ *   handle  - handle to an opened cine (raw or packed), 8 or 16 bits
+ *             per sample
+ *   first   - zero-based offset of the first image
+ *   count   - how many images
+ *   op      - VRP_REDUCE_MEAN (rounded), _MEDIAN, _MAX or _MIN
+ *   budget  - bytes of working memory to stay within (roughly; not
+ *             counting out)
+ *   threads - how many to use (0: one per CPU)
+ *   out     - room for one image's samples (width * height), which
+ *             are left in the file's own order and CFA layout (stored
+ *             rows are bottom-up), 16 bits each whatever the source's
+ *             depth
+ *   err     - where to say what went wrong
+ *
+ * return value:
+ *   0 on success, -1 on failure (with err filled in)
+ */
+int vrp_reduce(VRP_Handle handle, int first, int count, int op, size_t budget,
+               int threads, uint16_t *out, VRP_Error *err)
+{
+    struct reduce_job job;
+    size_t            per_sample, state_budget;
+    int               batch, tiles, ret = -1;
+
+    memset(&job, 0, sizeof(job));
+    job.handle = handle;
+    job.op = op;
+    job.first = first;
+    job.count = count;
+    job.out = out;
+
+    if(!handle->imageHeader || (handle->imageHeader->biBitCount != 8 && handle->imageHeader->biBitCount != 16))
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: can only reduce 8- or 16-bit images", handle->name);
+        return -1;
+    }
+    if(handle->header->Compression == VRP_CC_JPEG)
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: can't reduce JPEG-compressed images", handle->name);
+        return -1;
+    }
+    if(op < VRP_REDUCE_MEAN || op > VRP_REDUCE_MIN)
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: no such reduction (%d)", handle->name, op);
+        return -1;
+    }
+    if(count < 1 || first < 0 || first + count > (int)handle->header->ImageCount)
+    {
+        vrp_set_error(err, VRP_E_RANGE, "%s: images %d through %d aren't all there", handle->name,
+                      first, first + count - 1);
+        return -1;
+    }
+
+    job.wide = handle->imageHeader->biBitCount > 8;
+    job.samples = (size_t)handle->imageHeader->biWidth * abs(handle->imageHeader->biHeight);
+    job.image_size = job.samples * (job.wide ? 2 : 1);
+
+    /* packed images are decoded a batch at a time, in half the budget;
+     * raw ones are just pointers */
+    state_budget = budget;
+    batch = count < REDUCE_MAX_BATCH ? count : REDUCE_MAX_BATCH;
+    if(handle->pack)
+    {
+        size_t fit = budget / 2 / job.image_size;
+
+        job.group = vrp_pack_group_size(handle);
+        state_budget = budget / 2;
+        if(fit < 1)
+            fit = 1;
+        if(fit > (size_t)job.group)
+            fit -= fit % job.group; /* (whole groups decode cheapest) */
+        if((size_t)batch > fit)
+            batch = fit;
+        if(!(job.decoded = malloc(batch * job.image_size)))
+        {
+            vrp_set_error(err, VRP_E_NOMEM, "%s: no memory for %d decoded images", handle->name, batch);
+            goto done;
+        }
+    }
+    if(!(job.frames = malloc(batch * sizeof(*job.frames))))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", handle->name);
+        goto done;
+    }
+
+    /* how much of the image each pass can keep state for */
+    per_sample = op == VRP_REDUCE_MEAN ? sizeof(uint64_t)
+        : op == VRP_REDUCE_MEDIAN ? count * sizeof(uint16_t) : 0;
+    job.slab_len = per_sample ? state_budget / per_sample : job.samples;
+    if(job.slab_len < job.samples)
+        job.slab_len -= job.slab_len % REDUCE_TILE;
+    else
+        job.slab_len = job.samples;
+    if(!job.slab_len)
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: a budget of %zu bytes is too small for this (try %zu)",
+                      handle->name, budget, (handle->pack ? 2 : 1) * REDUCE_TILE * per_sample);
+        goto done;
+    }
+    if((op == VRP_REDUCE_MEAN && !(job.sums = malloc(job.slab_len * sizeof(*job.sums))))
+       || (op == VRP_REDUCE_MEDIAN && !(job.gather = malloc(job.slab_len * count * sizeof(*job.gather)))))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", handle->name);
+        goto done;
+    }
+
+    for(job.slab0 = 0; job.slab0 < job.samples; job.slab0 += job.slab_len)
+    {
+        if(job.slab0 + job.slab_len > job.samples)
+            job.slab_len = job.samples - job.slab0;
+        tiles = (job.slab_len + REDUCE_TILE - 1) / REDUCE_TILE;
+        if(job.sums)
+            memset(job.sums, 0, job.slab_len * sizeof(*job.sums));
+        if(op == VRP_REDUCE_MAX || op == VRP_REDUCE_MIN)
+            memset(out + job.slab0, op == VRP_REDUCE_MAX ? 0 : 0xff, job.slab_len * sizeof(*out));
+
+        for(job.batch0 = 0; job.batch0 < count; job.batch0 += batch)
+        {
+            int i;
+
+            job.batch_len = count - job.batch0 < batch ? count - job.batch0 : batch;
+            if(handle->pack)
+                vrp_parallel_for((job.batch_len + job.group - 1) / job.group, threads, reduce_decode, &job);
+            else
+                for(i = 0; i < job.batch_len; ++i)
+                    if(!(job.frames[i] = vrp_image_pixels(handle, first + job.batch0 + i)))
+                        job.failed = VRP_E_RANGE;
+            if(job.failed)
+                break;
+            vrp_parallel_for(tiles, threads, reduce_tile, &job);
+        }
+        if(!job.failed && (op == VRP_REDUCE_MEAN || op == VRP_REDUCE_MEDIAN))
+            vrp_parallel_for(tiles, threads, reduce_finish, &job);
+        if(job.failed)
+        {
+            if(job.failed == VRP_E_RANGE)
+                vrp_set_error(err, VRP_E_RANGE, "%s: images %d through %d aren't all there (truncated?)",
+                              handle->name, first, first + count - 1);
+            else
+                vrp_set_error(err, job.failed, "%s: out of memory", handle->name);
+            goto done;
+        }
+    }
+    ret = 0;
+
+done:
+    free(job.gather);
+    free(job.sums);
+    free(job.frames);
+    free(job.decoded);
+    return ret;
+}
@@ -0,0 +1,446 @@
+/*
+ * session.c -- cines recorded together (the heads of a multi-head
+ * camera, or cameras slaved to a master), grouped into sessions and
+ * matched up image by image
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "vrptools.h"
+#include "util.h"
+
+/* One take on a rig of cameras leaves a cine per head.  Slaves name
+ * their master in SETUP's MasterSerial, so a rig is known by its
+ * master's serial (or, for a camera on its own, its own), and a take by
+ * its trigger time: cines of one rig whose triggers are within the
+ * tolerance of the take's first are its heads.  A camera whose memory
+ * was partitioned (MCCnt) records a take per partition, each with a
+ * trigger of its own, so those become successive sessions of the rig,
+ * numbered in trigger order.
+ *
+ * Heads are matched up by time -- each image's TIME64 from the
+ * Time_only block, or failing that, worked out from the trigger and
+ * frame rate -- against a reference head, the one with the longest
+ * interval between images (so heads running faster are sampled, rather
+ * than the slowest having to be repeated).  A step is a reference image
+ * with an image from every other head within half an interval of it;
+ * reference images some head has no match for are left out.
+ *
+ * vrp_session_run() spreads the work over threads a step at a time,
+ * every head in turn, so each file is read in order and all of them at
+ * the same pace; it asks for each step's images a few steps ahead of
+ * the workers (and tells the kernel not to read ahead on its own), so
+ * the disks are shared evenly among the heads rather than by whichever
+ * file faults most. */
+
+#define SESSION_READAHEAD 2 /* steps advised per worker thread */
+
+/* as a single 32.32 fixed-point number, which is what a TIME64 is */
+static uint64_t time64(VRP_TIME64 t)
+{
+    return (uint64_t)t.Seconds << 32 | t.Fractions;
+}
+
+/* the rig a cine was recorded on: its master's serial, or its own */
+static VRP_UINT rig_serial(VRP_Handle handle)
+{
+    return handle->setup->MasterSerial ? handle->setup->MasterSerial : handle->setup->Serial;
+}
+
+/* head_times - each of handle's images' time, 32.32, or NULL if out of
+ * memory */
+static uint64_t *head_times(VRP_Handle handle)
+{
+    VRP_TAGGED_BLOCK *block = vrp_find_tagged_block(handle, VRP_TB_Time_only);
+    const VRP_TIME64 *times = NULL;
+    uint64_t         trigger = time64(handle->header->TriggerTime), *t;
+    unsigned         i, count = handle->header->ImageCount;
+    int64_t          rate = handle->setup->FrameRate ? handle->setup->FrameRate : 1;
+
+    if(!(t = malloc((count ? count : 1) * sizeof(*t))))
+        return NULL;
+    if(block && block->BlockSize - sizeof(*block) >= count * sizeof(*times))
+        times = (const VRP_TIME64 *)block->Data;
+
+    for(i = 0; i < count; ++i)
+        if(times)
+            t[i] = time64(times[i]);
+        else
+            t[i] = trigger + ((int64_t)(handle->header->FirstImageNo + (int)i) << 32) / rate;
+    return t;
+}
+
+/* head_serial - the serial of the head that recorded a cine, if it
+ * says (just the one head saved), or else of its camera */
+static VRP_UINT head_serial(VRP_Handle handle)
+{
+    const VRP_SETUP *setup = handle->setup;
+
+    if(setup->HeadSerial[0] && setup->HeadSerial[0] != 0xffffffff && setup->HeadSerial[1] == 0xffffffff)
+        return setup->HeadSerial[0];
+    return setup->Serial;
+}
+
+struct head_order {
+    VRP_Handle handle;
+    int        index;
+};
+
+/* compare_heads - the order cines are sorted into sessions in: by rig,
+ * then trigger time, then as they were given */
+static int compare_heads(const void *a, const void *b)
+{
+    const struct head_order *x = a, *y = b;
+    uint64_t                tx = time64(x->handle->header->TriggerTime), ty = time64(y->handle->header->TriggerTime);
+
+    if(rig_serial(x->handle) != rig_serial(y->handle))
+        return rig_serial(x->handle) < rig_serial(y->handle) ? -1 : 1;
+    if(tx != ty)
+        return tx < ty ? -1 : 1;
+    return x->index - y->index;
+}
+
+/* compare_in_session - the order of a session's heads: the master
+ * first, then by serial and head serial (equals stay as they came) */
+static int compare_in_session(VRP_Handle x, VRP_Handle y)
+{
+    const VRP_SETUP *sx = x->setup, *sy = y->setup;
+
+    if(!sx->MasterSerial != !sy->MasterSerial)
+        return sx->MasterSerial ? 1 : -1;
+    if(sx->Serial != sy->Serial)
+        return sx->Serial < sy->Serial ? -1 : 1;
+    if(head_serial(x) != head_serial(y))
+        return head_serial(x) < head_serial(y) ? -1 : 1;
+    return 0;
+}
+
+/* label - what to call a head: its serial, numbered if the session has
+ * more than one of that */
+static void label(VRP_Session *s, int h)
+{
+    VRP_UINT serial = head_serial(s->head[h]);
+    int      i, same = 0;
+
+    for(i = 0; i < h; ++i)
+        if(head_serial(s->head[i]) == serial)
+            ++same;
+    if(same)
+        snprintf(s->label[h], sizeof(s->label[h]), "%u-%d", serial, same + 1);
+    else
+        snprintf(s->label[h], sizeof(s->label[h]), "%u", serial);
+}
+
+/* align - match up s's heads' images (see above); returns 0, or -1 if
+ * out of memory */
+static int align(VRP_Session *s, VRP_Error *err)
+{
+    uint64_t *times[VRP_SESSION_HEADS];
+    unsigned count[VRP_SESSION_HEADS];
+    int      next[VRP_SESSION_HEADS], last[VRP_SESSION_HEADS];
+    int64_t  tolerance, worst = 0;
+    double   longest = -1;
+    int      h, r, ref = 0, ret = -1;
+
+    memset(times, 0, sizeof(times));
+    for(h = 0; h < s->nheads; ++h)
+    {
+        double interval;
+
+        count[h] = s->head[h]->header->ImageCount;
+        if(!(times[h] = head_times(s->head[h])))
+        {
+            vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", s->head[h]->name);
+            goto done;
+        }
+        interval = count[h] > 1 ? (double)(int64_t)(times[h][count[h] - 1] - times[h][0]) / (count[h] - 1) / 4294967296.0
+            : 1.0 / (s->head[h]->setup->FrameRate ? s->head[h]->setup->FrameRate : 1);
+        if(interval > longest * (1 + 1e-6)) /* (the first, of equals) */
+        {
+            longest = interval;
+            ref = h;
+        }
+        next[h] = 0;
+        last[h] = -1;
+    }
+    s->reference = ref;
+    s->interval = longest;
+    tolerance = longest * 4294967296.0 / 2;
+
+    if(!(s->offsets = malloc(((size_t)count[ref] + 1) * s->nheads * sizeof(*s->offsets))))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", s->head[ref]->name);
+        goto done;
+    }
+
+    s->steps = 0;
+    for(r = 0; r < (int)count[ref]; ++r)
+    {
+        uint64_t t = times[ref][r];
+        int64_t  skew = 0;
+        int      *row = s->offsets + (size_t)s->steps * s->nheads;
+
+        for(h = 0; h < s->nheads; ++h)
+        {
+            int     p = next[h];
+            int64_t d;
+
+            if(h == ref)
+            {
+                row[h] = r;
+                continue;
+            }
+            /* the nearest, as times only go forward */
+            while(p + 1 < (int)count[h] && (int64_t)(times[h][p + 1] - t) <= 0)
+                ++p;
+            if(p + 1 < (int)count[h] && (int64_t)(times[h][p + 1] - t) < (int64_t)(t - times[h][p]))
+                ++p;
+            next[h] = p;
+            if(p >= (int)count[h] || p <= last[h])
+                break;
+            d = (int64_t)(times[h][p] - t);
+            if(d < 0)
+                d = -d;
+            if(d > tolerance)
+                break;
+            if(d > skew)
+                skew = d;
+            row[h] = p;
+        }
+        if(h < s->nheads)
+            continue;
+
+        for(h = 0; h < s->nheads; ++h)
+            last[h] = row[h];
+        if(skew > worst)
+            worst = skew;
+        ++s->steps;
+    }
+    s->skew = worst / 4294967296.0;
+    ret = 0;
+
+done:
+    for(h = 0; h < s->nheads; ++h)
+        free(times[h]);
+    return ret;
+}
+
+/* vrp_session_group - sort cines into sessions, and match up their
+ * images
+ *
+ * inputs:
+ *   handles   - the cines (as many as VRP_SESSION_HEADS per session)
+ *   count     - how many
+ *   tolerance - how far apart (seconds) triggers may be and still be
+ *               the same take; <= 0 for VRP_SESSION_TOLERANCE
+ *   sessions  - set to an array of them, in order of rig and trigger
+ *               time, to be freed with vrp_session_free()
+ *   err       - filled in on failure
+ *
+ * return value:
+ *   the number of sessions, or -1 on failure
+ */
+int vrp_session_group(VRP_Handle *handles, int count, double tolerance, VRP_Session **sessions,
+                      VRP_Error *err)
+{
+    struct head_order *order;
+    VRP_Session       *s = NULL;
+    uint64_t          first = 0, limit;
+    int               i, h, n = 0, take = 0;
+
+    if(tolerance <= 0)
+        tolerance = VRP_SESSION_TOLERANCE;
+    limit = tolerance * 4294967296.0;
+
+    *sessions = NULL;
+    if(!(order = malloc((count ? count : 1) * sizeof(*order)))
+       || !(*sessions = calloc(count ? count : 1, sizeof(**sessions))))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "out of memory");
+        free(order);
+        return -1;
+    }
+    for(i = 0; i < count; ++i)
+    {
+        order[i].handle = handles[i];
+        order[i].index = i;
+    }
+    qsort(order, count, sizeof(*order), compare_heads);
+
+    for(i = 0; i < count; ++i)
+    {
+        VRP_Handle handle = order[i].handle;
+        uint64_t   trigger = time64(handle->header->TriggerTime);
+
+        if(!s || rig_serial(handle) != s->serial || trigger - first > limit)
+        {
+            take = s && rig_serial(handle) == s->serial ? take + 1 : 0;
+            s = &(*sessions)[n++];
+            s->serial = rig_serial(handle);
+            s->take = take;
+            s->trigger = handle->header->TriggerTime;
+            first = trigger;
+        }
+        if(s->nheads == VRP_SESSION_HEADS)
+        {
+            vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: more than %d heads in one session",
+                          handle->name, VRP_SESSION_HEADS);
+            goto failed;
+        }
+
+        /* (in order: see compare_in_session()) */
+        for(h = s->nheads; h > 0 && compare_in_session(handle, s->head[h - 1]) < 0; --h)
+            s->head[h] = s->head[h - 1];
+        s->head[h] = handle;
+        ++s->nheads;
+    }
+    free(order);
+    order = NULL;
+
+    for(i = 0; i < n; ++i)
+    {
+        s = &(*sessions)[i];
+        for(h = 0; h < s->nheads; ++h)
+            label(s, h);
+        if(align(s, err) < 0)
+            goto failed;
+    }
+    return n;
+
+failed:
+    free(order);
+    vrp_session_free(*sessions, n);
+    *sessions = NULL;
+    return -1;
+}
+
+/* vrp_session_free - free what vrp_session_group() made (but not the
+ * handles) */
+void vrp_session_free(VRP_Session *sessions, int count)
+{
+    int i;
+
+    if(!sessions)
+        return;
+    for(i = 0; i < count; ++i)
+        free(sessions[i].offsets);
+    free(sessions);
+}
+
+/* vrp_session_time - when a step's image from a head was taken */
+VRP_TIME64 vrp_session_time(const VRP_Session *s, int step, int head)
+{
+    VRP_Handle       handle = s->head[head];
+    VRP_TAGGED_BLOCK *block = vrp_find_tagged_block(handle, VRP_TB_Time_only);
+    int              offset = s->offsets[(size_t)step * s->nheads + head];
+    int64_t          rate = handle->setup->FrameRate ? handle->setup->FrameRate : 1;
+    uint64_t         t;
+    VRP_TIME64       ret;
+
+    if(block && block->BlockSize - sizeof(*block) >= handle->header->ImageCount * sizeof(VRP_TIME64))
+        return ((const VRP_TIME64 *)block->Data)[offset];
+    t = time64(handle->header->TriggerTime) + ((int64_t)(handle->header->FirstImageNo + offset) << 32) / rate;
+    ret.Seconds = t >> 32;
+    ret.Fractions = t & 0xffffffff;
+    return ret;
+}
+
+/* vrp_session_extract - vrp_extract_image() of a step's image from a
+ * head, safe to call from several threads at once */
+int vrp_session_extract(VRP_Session *s, int step, int head, int *rows_out, int *cols_out,
+                        uint16_t **buf, size_t *bufsize, VRP_Error *err)
+{
+    return vrp_extract_image(s->head[head], s->offsets[(size_t)step * s->nheads + head], rows_out, cols_out,
+                             buf, bufsize, err);
+}
+
+
+/** the scheduler **/
+
+struct session_job {
+    VRP_Session     *s;
+    int             whole;    /* a work item per step, not per head */
+    int             per_step; /* work items per step: 1, or nheads */
+    int             window;   /* steps to advise ahead */
+    void            (*fn)(VRP_Session *s, int step, int head, void *arg);
+    void            *arg;
+    pthread_mutex_t lock;
+    int             advised;  /* steps advised so far */
+};
+
+/* advise - ask for the images of steps first..last-1, a head at a time */
+static void advise(VRP_Session *s, int first, int last)
+{
+    int step, h;
+
+    for(step = first; step < last; ++step)
+        for(h = 0; h < s->nheads; ++h)
+        {
+            VRP_Handle handle = s->head[h];
+            off_t      off = vrp_image_pixel_offset(handle, s->offsets[(size_t)step * s->nheads + h]);
+
+            if(off > 0)
+                posix_fadvise(handle->fd, off, vrp_image_stored_size(handle, s->offsets[(size_t)step * s->nheads + h]),
+                              POSIX_FADV_WILLNEED);
+        }
+}
+
+static void session_worker(int item, void *arg)
+{
+    struct session_job *job = arg;
+    int                step = item / job->per_step, first, last;
+
+    pthread_mutex_lock(&job->lock);
+    first = job->advised;
+    last = step + job->window < job->s->steps ? step + job->window : job->s->steps;
+    if(last > first)
+        job->advised = last;
+    pthread_mutex_unlock(&job->lock);
+    if(last > first)
+        advise(job->s, first, last);
+
+    job->fn(job->s, step, job->whole ? -1 : item % job->per_step, job->arg);
+}
+
+/* vrp_session_run - call fn(s, step, head, arg) for every step of s:
+ * once per step with head -1 if whole_steps, else once per step for
+ * each head, head by head; spread over up to threads threads (<= 0
+ * meaning one per CPU) in step order, reading ahead (see above) */
+void vrp_session_run(VRP_Session *s, int threads, int whole_steps,
+                     void (*fn)(VRP_Session *s, int step, int head, void *arg), void *arg)
+{
+    struct session_job job;
+    int                h;
+
+    if(threads <= 0)
+        threads = vrp_default_threads();
+    job.s = s;
+    job.whole = whole_steps;
+    job.per_step = whole_steps ? 1 : s->nheads;
+    job.window = (SESSION_READAHEAD * threads + job.per_step - 1) / job.per_step + 1;
+    job.fn = fn;
+    job.arg = arg;
+    job.advised = 0;
+    pthread_mutex_init(&job.lock, NULL);
+
+    for(h = 0; h < s->nheads; ++h)
+        if(!s->head[h]->pack)
+            madvise(s->head[h]->start, (char *)s->head[h]->end - (char *)s->head[h]->start, MADV_RANDOM);
+
+    vrp_parallel_for(s->steps * job.per_step, threads, session_worker, &job);
+    pthread_mutex_destroy(&job.lock);
+}
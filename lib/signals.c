@@ -0,0 +1,178 @@
+/*
+ * signals.c -- the binary and analog signals recorded alongside the
+ * images by a SAM3 module (the BinSig and AnaSig tagged blocks)
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "vrptools.h"
+#include "util.h"
+
+/*
+ * Both blocks hold a record per saved image, of SamplesPerImage
+ * samples (or, with bit 0 of SigOption set, as many as fit: we work
+ * that out from the block's size), each sample one value per channel:
+ *
+ *   BinSig: BinChannels bits per sample, least significant bit
+ *           first, each image's record padded out to a whole byte --
+ *           so with the usual 8 channels, a byte per sample;
+ *   AnaSig: AnaChannels little-endian 16-bit words per sample
+ *           (signed if AnaOption says the inputs are bipolar).
+ *
+ * Sample s of image i is "row" i * samples + s.  The unpacking below
+ * works on runs of rows of one channel -- a column -- 32 (binary) or
+ * 8 (analog) rows at a time where the layout allows it.
+ */
+
+typedef uint8_t v32u8 __attribute__((vector_size(32)));
+typedef int16_t v8i16 __attribute__((vector_size(16)));
+typedef uint16_t v8u16 __attribute__((vector_size(16)));
+typedef float v8f32 __attribute__((vector_size(32)));
+
+/* vrp_signals_open - find the signal blocks of a cine and check they
+ * hold what SETUP says they should
+ *
+ * inputs:
+ *   handle - handle to opened VRP Cine file
+ *   sig    - filled in (sig->bin and sig->ana are NULL for signals
+ *            that weren't recorded)
+ *   err    - where to say what went wrong (may be NULL)
+ *
+ * return value:
+ *   0 on success (even if there are no signals: see sig->rows), -1
+ *   on failure
+ */
+int vrp_signals_open(VRP_Handle handle, VRP_Signals *sig, VRP_Error *err)
+{
+    const VRP_SETUP  *s = handle->setup;
+    VRP_TAGGED_BLOCK *bin, *ana;
+    size_t           images = handle->header->ImageCount, binlen = 0, analen = 0;
+    int              samples;
+
+    memset(sig, 0, sizeof(*sig));
+    if(!s || !images)
+        return 0;
+
+    bin = s->BinChannels > 0 ? vrp_find_tagged_block(handle, VRP_TB_BinSig) : NULL;
+    ana = s->AnaChannels > 0 ? vrp_find_tagged_block(handle, VRP_TB_AnaSig) : NULL;
+    if(bin)
+        binlen = bin->BlockSize - sizeof(*bin);
+    if(ana)
+        analen = ana->BlockSize - sizeof(*ana);
+
+    samples = s->SamplesPerImage;
+    if(s->SigOption & 1) /* as many as were recorded */
+    {
+        if(ana)
+            samples = analen / images / (2 * s->AnaChannels);
+        else if(bin)
+            samples = binlen / images * 8 / s->BinChannels;
+    }
+    if(samples < 1 || (!bin && !ana))
+        return 0;
+
+    sig->images = images;
+    sig->samples = samples;
+    sig->rows = images * samples;
+    if(bin)
+    {
+        sig->bin_channels = s->BinChannels;
+        sig->bin_stride = ((size_t)samples * s->BinChannels + 7) / 8;
+        sig->bin = (const unsigned char *)bin->Data;
+        if(binlen < images * sig->bin_stride)
+        {
+            vrp_set_error(err, VRP_E_FORMAT, "%s: binary signal block holds %zu bytes, not %zu",
+                          handle->name, binlen, images * sig->bin_stride);
+            return -1;
+        }
+    }
+    if(ana)
+    {
+        sig->ana_channels = s->AnaChannels;
+        sig->bipolar = s->AnaOption == 2;
+        sig->ana = (const unsigned char *)ana->Data;
+        if(analen < sig->rows * 2 * sig->ana_channels)
+        {
+            vrp_set_error(err, VRP_E_FORMAT, "%s: analog signal block holds %zu bytes, not %zu",
+                          handle->name, analen, sig->rows * 2 * sig->ana_channels);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* vrp_signals_binary - unpack count rows, from first, of one binary
+ * channel into out: one byte (0 or 1) per row */
+void vrp_signals_binary(const VRP_Signals *sig, int channel, size_t first, size_t count, uint8_t *out)
+{
+    size_t i = 0, row, bit;
+
+    /* a byte per row: shift the channel's bit down, 32 rows at a time */
+    if(sig->bin_channels == 8)
+        for(; i + 32 <= count; i += 32)
+        {
+            v32u8 v;
+
+            memcpy(&v, sig->bin + first + i, sizeof(v));
+            v = (v >> channel) & 1;
+            memcpy(out + i, &v, sizeof(v));
+        }
+
+    for(; i < count; ++i)
+    {
+        row = first + i;
+        bit = row % sig->samples * sig->bin_channels + channel;
+        out[i] = sig->bin[row / sig->samples * sig->bin_stride + bit / 8] >> (bit % 8) & 1;
+    }
+}
+
+/* vrp_signals_analog - convert count rows, from first, of one analog
+ * channel into out, multiplying each sample by gain (e.g. AnaGain, to
+ * get measurement units) */
+void vrp_signals_analog(const VRP_Signals *sig, int channel, size_t first, size_t count, float gain, float *out)
+{
+    const unsigned char *p = sig->ana + 2 * (first * sig->ana_channels + channel);
+    size_t              i = 0, step = 2 * sig->ana_channels;
+
+    /* a single channel is contiguous: convert 8 at a time */
+    if(sig->ana_channels == 1)
+        for(; i + 8 <= count; i += 8, p += 16)
+        {
+            v8f32 v;
+
+            if(sig->bipolar)
+            {
+                v8i16 in;
+
+                memcpy(&in, p, sizeof(in));
+                v = __builtin_convertvector(in, v8f32);
+            }
+            else
+            {
+                v8u16 in;
+
+                memcpy(&in, p, sizeof(in));
+                v = __builtin_convertvector(in, v8f32);
+            }
+            v *= gain;
+            memcpy(out + i, &v, sizeof(v));
+        }
+
+    for(; i < count; ++i, p += step)
+    {
+        unsigned v = p[0] | p[1] << 8;
+
+        out[i] = gain * (sig->bipolar ? (float)(int16_t)v : (float)v);
+    }
+}
@@ -0,0 +1,393 @@
+/*
+ * stats.c -- per-stage timing, counters and latency histograms
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#define _GNU_SOURCE /* RUSAGE_THREAD */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "vrptools.h"
+
+/* Each thread that records anything gets a slot of its own, so the
+ * counters need no locking; the lock is only taken to hand slots out
+ * and to take them back when a thread exits (so the short-lived
+ * threads of vrp_parallel_for() reuse the same few slots, and "thread
+ * N" in the report means the Nth of however many ran at once).
+ *
+ * When stats are off (vrp_stats_flags == 0), VRP_STATS_START/STOP
+ * cost one test of a global each. */
+
+#define STATS_BUCKETS  40  /* log2(ns): 1ns up to ~9 minutes */
+#define STATS_MAX_SLOTS 512
+
+struct stats_slot {
+    int      in_use, perf_fd;
+    uint64_t count[VRP_STAGES], ns[VRP_STAGES], max_ns[VRP_STAGES], bytes[VRP_STAGES];
+    uint64_t cycles[VRP_STAGES], minflt[VRP_STAGES], majflt[VRP_STAGES];
+    uint32_t hist[VRP_STAGES][STATS_BUCKETS];
+};
+
+static const char *stage_names[VRP_STAGES] = { "open", "fetch", "demosaic", "encode", "write" };
+
+unsigned vrp_stats_flags;
+
+static struct stats_slot *slots[STATS_MAX_SLOTS];
+static int               nslots;
+static pthread_mutex_t   slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t     slot_key;
+static pthread_once_t    slot_key_once = PTHREAD_ONCE_INIT;
+static struct timespec   started;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void release_slot(void *p)
+{
+    struct stats_slot *slot = p;
+
+    pthread_mutex_lock(&slots_lock);
+    if(slot->perf_fd >= 0)
+        close(slot->perf_fd);
+    slot->perf_fd = -1;
+    slot->in_use = 0;
+    pthread_mutex_unlock(&slots_lock);
+}
+
+static void make_slot_key(void)
+{
+    pthread_key_create(&slot_key, release_slot);
+}
+
+/* open a cycle counter for the calling thread (-1 if we can't) */
+static int open_cycle_counter(void)
+{
+#if defined(__linux__) && defined(SYS_perf_event_open)
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+/* the calling thread's slot, or NULL if we're out of them */
+static struct stats_slot *my_slot(void)
+{
+    struct stats_slot *slot;
+    int               i;
+
+    pthread_once(&slot_key_once, make_slot_key);
+    if((slot = pthread_getspecific(slot_key)))
+        return slot;
+
+    pthread_mutex_lock(&slots_lock);
+    for(i = 0; i < nslots && slots[i]->in_use; ++i)
+        ;
+    if(i == nslots && nslots < STATS_MAX_SLOTS && (slots[i] = calloc(1, sizeof(**slots))))
+        nslots++;
+    if(i < nslots)
+    {
+        slot = slots[i];
+        slot->in_use = 1;
+        slot->perf_fd = -1;
+    }
+    pthread_mutex_unlock(&slots_lock);
+
+    if(slot)
+    {
+        if(vrp_stats_flags & VRP_STATS_CYCLES)
+            slot->perf_fd = open_cycle_counter();
+        pthread_setspecific(slot_key, slot);
+    }
+    return slot;
+}
+
+static void thread_faults(long *minflt, long *majflt)
+{
+#ifdef RUSAGE_THREAD
+    struct rusage ru;
+
+    if(!getrusage(RUSAGE_THREAD, &ru))
+    {
+        *minflt = ru.ru_minflt;
+        *majflt = ru.ru_majflt;
+        return;
+    }
+#endif
+    *minflt = *majflt = 0;
+}
+
+static uint64_t read_cycles(struct stats_slot *slot)
+{
+    uint64_t v;
+
+    if(slot->perf_fd < 0 || read(slot->perf_fd, &v, sizeof(v)) != sizeof(v))
+        return 0;
+    return v;
+}
+
+/* vrp_stats_option - turn stats on, per a --stats[=...] argument
+ *
+ * inputs:
+ *   spec - NULL or "" for a text report, or a comma-separated list of:
+ *            json   - report as JSON instead
+ *            faults - count page faults per stage (getrusage per call)
+ *            cycles - count CPU cycles per stage (perf_event, if allowed)
+ *
+ * return value:
+ *   0 on success, -1 for an unknown word (the caller says so)
+ */
+int vrp_stats_option(const char *spec)
+{
+    unsigned flags = VRP_STATS_ON;
+
+    while(spec && *spec)
+    {
+        size_t len = strcspn(spec, ",");
+
+        if(len == 4 && !strncmp(spec, "json", 4))
+            flags |= VRP_STATS_JSON;
+        else if(len == 4 && !strncmp(spec, "text", 4))
+            flags &= ~VRP_STATS_JSON;
+        else if(len == 6 && !strncmp(spec, "faults", 6))
+            flags |= VRP_STATS_FAULTS;
+        else if(len == 6 && !strncmp(spec, "cycles", 6))
+            flags |= VRP_STATS_CYCLES;
+        else
+            return -1;
+        spec += len + (spec[len] == ',');
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    vrp_stats_flags = flags;
+    return 0;
+}
+
+/* vrp_stats_start - note the start of a stage (use VRP_STATS_START) */
+void vrp_stats_start(VRP_StatsTimer *t)
+{
+    struct stats_slot *slot = my_slot();
+
+    if(vrp_stats_flags & VRP_STATS_FAULTS)
+        thread_faults(&t->minflt, &t->majflt);
+    t->cycles = slot ? read_cycles(slot) : 0;
+    t->ns = now_ns();
+}
+
+/* vrp_stats_stop - account for a stage started with vrp_stats_start()
+ * (use VRP_STATS_STOP); bytes is how much data it handled, if any */
+void vrp_stats_stop(VRP_StatsTimer *t, int stage, size_t bytes)
+{
+    struct stats_slot *slot = my_slot();
+    uint64_t          ns = now_ns() - t->ns;
+    int               b;
+
+    if(!slot || stage < 0 || stage >= VRP_STAGES)
+        return;
+
+    for(b = 0; b < STATS_BUCKETS - 1 && (ns >> b) > 1; ++b)
+        ;
+    slot->hist[stage][b]++;
+    slot->count[stage]++;
+    slot->ns[stage] += ns;
+    slot->bytes[stage] += bytes;
+    if(ns > slot->max_ns[stage])
+        slot->max_ns[stage] = ns;
+
+    if(slot->perf_fd >= 0)
+        slot->cycles[stage] += read_cycles(slot) - t->cycles;
+    if(vrp_stats_flags & VRP_STATS_FAULTS)
+    {
+        long minflt, majflt;
+
+        thread_faults(&minflt, &majflt);
+        slot->minflt[stage] += minflt - t->minflt;
+        slot->majflt[stage] += majflt - t->majflt;
+    }
+}
+
+/* upper bound, in microseconds, of the bucket holding quantile q
+ * (but no more than the slowest call actually seen) */
+static double quantile_us(const uint32_t *hist, uint64_t count, uint64_t max_ns, double q)
+{
+    uint64_t seen = 0, want = (uint64_t)(q * count + 0.5);
+    int      b;
+
+    if(want < 1)
+        want = 1;
+    for(b = 0; b < STATS_BUCKETS; ++b)
+        if((seen += hist[b]) >= want)
+            break;
+    if(b < 63 && ((uint64_t)1 << (b + 1)) < max_ns)
+        max_ns = (uint64_t)1 << (b + 1);
+    return max_ns / 1e3;
+}
+
+/* vrp_stats_report - print what's been recorded (if stats are on)
+ *
+ * Per stage (summed over threads): calls, total and mean time, p50,
+ * p90 and p99 (to the histogram's power-of-two resolution), the
+ * slowest call, throughput and, if asked for, faults and cycles; then
+ * calls and time per stage for each thread, and the process's own
+ * resource usage.  Stages nest: e.g. demosaic includes its fetch.
+ * Text or JSON, per vrp_stats_option().  Call with no other threads
+ * still recording.
+ */
+void vrp_stats_report(FILE *out)
+{
+    struct stats_slot total;
+    struct rusage     ru;
+    struct timespec   ts;
+    VRP_PoolStats     pool;
+    double            wall;
+    int               json = vrp_stats_flags & VRP_STATS_JSON;
+    int               i, s, b;
+
+    if(!vrp_stats_flags)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    wall = ts.tv_sec - started.tv_sec + (ts.tv_nsec - started.tv_nsec) / 1e9;
+    getrusage(RUSAGE_SELF, &ru);
+    vrp_pool_stats(&pool);
+
+    memset(&total, 0, sizeof(total));
+    for(i = 0; i < nslots; ++i)
+        for(s = 0; s < VRP_STAGES; ++s)
+        {
+            total.count[s] += slots[i]->count[s];
+            total.ns[s] += slots[i]->ns[s];
+            total.bytes[s] += slots[i]->bytes[s];
+            total.cycles[s] += slots[i]->cycles[s];
+            total.minflt[s] += slots[i]->minflt[s];
+            total.majflt[s] += slots[i]->majflt[s];
+            if(slots[i]->max_ns[s] > total.max_ns[s])
+                total.max_ns[s] = slots[i]->max_ns[s];
+            for(b = 0; b < STATS_BUCKETS; ++b)
+                total.hist[s][b] += slots[i]->hist[s][b];
+        }
+
+    if(json)
+        fprintf(out, "{\"wall_s\": %.6f, \"stages\": {", wall);
+    else
+    {
+        fprintf(out, "stats: %.3fs wall\n", wall);
+        fprintf(out, "%-9s %9s %10s %10s %10s %10s %10s %10s %9s", "stage", "calls", "total-s",
+                "mean-us", "p50-us", "p90-us", "p99-us", "max-us", "MB/s");
+        if(vrp_stats_flags & VRP_STATS_FAULTS)
+            fprintf(out, " %9s %9s", "minflt", "majflt");
+        if(vrp_stats_flags & VRP_STATS_CYCLES)
+            fprintf(out, " %10s", "Mcycles");
+        fprintf(out, "\n");
+    }
+
+    for(s = 0; s < VRP_STAGES; ++s)
+    {
+        uint64_t n = total.count[s];
+        double   secs = total.ns[s] / 1e9;
+        double   mbps = secs > 0 ? total.bytes[s] / 1e6 / secs : 0;
+
+        if(json)
+        {
+            fprintf(out, "%s\"%s\": {\"calls\": %llu, \"total_s\": %.6f, \"mean_us\": %.3f, "
+                    "\"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f, "
+                    "\"bytes\": %llu, \"mb_per_s\": %.3f",
+                    s ? ", " : "", stage_names[s], (unsigned long long)n, secs,
+                    n ? total.ns[s] / 1e3 / n : 0,
+                    n ? quantile_us(total.hist[s], n, total.max_ns[s], 0.5) : 0,
+                    n ? quantile_us(total.hist[s], n, total.max_ns[s], 0.9) : 0,
+                    n ? quantile_us(total.hist[s], n, total.max_ns[s], 0.99) : 0,
+                    total.max_ns[s] / 1e3, (unsigned long long)total.bytes[s], mbps);
+            if(vrp_stats_flags & VRP_STATS_FAULTS)
+                fprintf(out, ", \"minflt\": %llu, \"majflt\": %llu",
+                        (unsigned long long)total.minflt[s], (unsigned long long)total.majflt[s]);
+            if(vrp_stats_flags & VRP_STATS_CYCLES)
+                fprintf(out, ", \"cycles\": %llu", (unsigned long long)total.cycles[s]);
+            fprintf(out, "}");
+            continue;
+        }
+
+        if(!n)
+            continue;
+        fprintf(out, "%-9s %9llu %10.4f %10.1f %10.1f %10.1f %10.1f %10.1f %9.1f", stage_names[s],
+                (unsigned long long)n, secs, total.ns[s] / 1e3 / n,
+                quantile_us(total.hist[s], n, total.max_ns[s], 0.5), quantile_us(total.hist[s], n, total.max_ns[s], 0.9),
+                quantile_us(total.hist[s], n, total.max_ns[s], 0.99), total.max_ns[s] / 1e3, mbps);
+        if(vrp_stats_flags & VRP_STATS_FAULTS)
+            fprintf(out, " %9llu %9llu", (unsigned long long)total.minflt[s],
+                    (unsigned long long)total.majflt[s]);
+        if(vrp_stats_flags & VRP_STATS_CYCLES)
+            fprintf(out, " %10.1f", total.cycles[s] / 1e6);
+        fprintf(out, "\n");
+    }
+
+    /* per thread: calls and seconds in each stage */
+    if(json)
+        fprintf(out, "}, \"threads\": [");
+    for(i = 0; i < nslots; ++i)
+    {
+        if(json)
+            fprintf(out, "%s{", i ? ", " : "");
+        else
+            fprintf(out, "thread %-3d", i);
+        for(s = 0; s < VRP_STAGES; ++s)
+        {
+            if(json)
+                fprintf(out, "%s\"%s\": {\"calls\": %llu, \"total_s\": %.6f}", s ? ", " : "",
+                        stage_names[s], (unsigned long long)slots[i]->count[s], slots[i]->ns[s] / 1e9);
+            else if(slots[i]->count[s])
+                fprintf(out, "  %s %llu/%.3fs", stage_names[s],
+                        (unsigned long long)slots[i]->count[s], slots[i]->ns[s] / 1e9);
+        }
+        fprintf(out, json ? "}" : "\n");
+    }
+
+    if(json)
+        fprintf(out, "], \"rusage\": {\"user_s\": %.6f, \"sys_s\": %.6f, \"maxrss_kb\": %ld, "
+                "\"minflt\": %ld, \"majflt\": %ld, \"nvcsw\": %ld, \"nivcsw\": %ld}, "
+                "\"pool\": {\"buffers\": %zu, \"allocated\": %zu, \"peak_bytes\": %zu, \"idle_bytes\": %zu}}\n",
+                ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+                ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6, ru.ru_maxrss,
+                ru.ru_minflt, ru.ru_majflt, ru.ru_nvcsw, ru.ru_nivcsw,
+                pool.gets, pool.allocated, pool.peak, pool.idle);
+    else
+    {
+        fprintf(out, "process: %.3fs user, %.3fs sys, %ld KB peak RSS, %ld minor / %ld major faults, "
+                "%ld/%ld context switches\n",
+                ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+                ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6, ru.ru_maxrss,
+                ru.ru_minflt, ru.ru_majflt, ru.ru_nvcsw, ru.ru_nivcsw);
+        fprintf(out, "pool: %zu buffers, %zu of them newly allocated; %.1f MB at peak, %.1f MB idle\n",
+                pool.gets, pool.allocated, pool.peak / 1e6, pool.idle / 1e6);
+    }
+}
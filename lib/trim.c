@@ -0,0 +1,179 @@
+/*
+ * trim.c -- write a CINE file holding a subrange of another's images
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vrptools.h"
+#include "util.h"
+
+/* does this kind of tagged block hold one fixed-size entry per saved
+ * image (and so needs trimming along with the images)? */
+static int per_image_block(int type)
+{
+    switch(type)
+    {
+    case VRP_TB_Time_only:
+    case VRP_TB_Exposure_only:
+    case VRP_TB_Range_data:
+    case VRP_TB_BinSig:
+    case VRP_TB_AnaSig:
+        return 1;
+    default: /* (including Image_time, which is per *recorded* image) */
+        return 0;
+    }
+}
+
+/* vrp_trim_cine - write a new cine with count images starting at first
+ *
+ * inputs:
+ *   handle - handle to opened VRP Cine file
+ *   first  - zero-based offset of the first image to keep
+ *   count  - how many images to keep
+ *   outfd  - where to write the new cine (at its current position,
+ *            which needn't be 0; it must be seekable, as the header is
+ *            patched at the end)
+ *   err    - where to say what went wrong (may be NULL)
+ *
+ * The headers and SETUP are copied, with the image counts and offsets
+ * rewritten; per-image tagged blocks (time, exposure, signals, range
+ * data) are cut down to the kept images, other blocks copied as they
+ * are; and the images themselves (annotation and pixels) are copied
+ * with copy_file_range() where the kernel allows, so the cost is
+ * about that of copying the kept images.
+ *
+ * return value:
+ *   0 on success, -1 on failure (with err filled in)
+ */
+int vrp_trim_cine(VRP_Handle handle, int first, int count, int outfd, VRP_Error *err)
+{
+    VRP_CINEFILEHEADER header;
+    VRP_TAGGED_BLOCK   *block = NULL, out;
+    VRP_ImageOffset    *offsets = NULL, pos;
+    size_t             prefix, size = vrp_image_size(handle);
+    off_t              start;
+    unsigned           images = handle->header->ImageCount;
+    int                i, ret = -1;
+
+    if(first < 0 || count < 1 || (unsigned)first + count > images || !handle->firstImageOffset)
+    {
+        vrp_set_error(err, VRP_E_RANGE, "%s: can't keep %d images from offset %d of %u",
+                      handle->name, count, first, images);
+        return -1;
+    }
+    for(i = first; i < first + count; ++i)
+        if(!vrp_image_annotation(handle, i) || (!handle->pack && vrp_image_pixel_offset(handle, i) < 0))
+        {
+            vrp_set_error(err, VRP_E_FORMAT, "%s: image at offset %d is missing or truncated", handle->name, i);
+            return -1;
+        }
+
+    /* (offsets in the new cine count from where it starts) */
+    if((start = lseek(outfd, 0, SEEK_CUR)) < 0)
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "trimmed cine output (must be seekable)");
+        return -1;
+    }
+
+    /* everything up to the tagged blocks (or the image offsets) goes
+     * across as it is, apart from the header */
+    prefix = handle->firstTaggedBlock ? (size_t)((void*)handle->firstTaggedBlock - handle->start)
+                                      : handle->header->OffImageOffsets;
+    header = *handle->header;
+    header.FirstImageNo += first;
+    header.ImageCount = count;
+
+    if(write_all_fd(outfd, &header, sizeof(header)) < 0
+       || write_all_fd(outfd, handle->start + sizeof(header), prefix - sizeof(header)) < 0)
+        goto write_failed;
+    pos = prefix;
+
+    while((block = vrp_next_tagged_block(handle, block)))
+    {
+        size_t len = block->BlockSize - sizeof(*block);
+
+        if(per_image_block(block->Type) && len % images == 0)
+        {
+            size_t stride = len / images;
+
+            out = *block;
+            out.BlockSize = sizeof(out) + stride * count;
+            if(write_all_fd(outfd, &out, sizeof(out)) < 0
+               || write_all_fd(outfd, block->Data + stride * first, stride * count) < 0)
+                goto write_failed;
+            pos += out.BlockSize;
+        }
+        else
+        {
+            if(write_all_fd(outfd, block, block->BlockSize) < 0)
+                goto write_failed;
+            pos += block->BlockSize;
+        }
+    }
+
+    /* the new image offsets, 8-byte aligned; images right after them */
+    if(pos % 8)
+    {
+        static const char pad[8];
+
+        if(write_all_fd(outfd, pad, 8 - pos % 8) < 0)
+            goto write_failed;
+        pos += 8 - pos % 8;
+    }
+    header.OffImageOffsets = pos;
+
+    if(!(offsets = malloc(count * sizeof(*offsets))))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "%s: out of memory", handle->name);
+        return -1;
+    }
+    pos += count * sizeof(*offsets);
+    for(i = 0; i < count; ++i)
+    {
+        offsets[i] = pos;
+        pos += vrp_image_annotation(handle, first + i)->AnnotationSize + vrp_image_stored_size(handle, first + i);
+    }
+    if(write_all_fd(outfd, offsets, count * sizeof(*offsets)) < 0)
+        goto write_failed;
+
+    for(i = first; i < first + count; ++i)
+    {
+        VRP_ImageAnnotation *ann = vrp_image_annotation(handle, i);
+
+        if(handle->pack)
+        {
+            /* packed: nothing to copy from but what we decode */
+            if(write_all_fd(outfd, ann, ann->AnnotationSize) < 0
+               || copy_range_fd(-1, 0, outfd, size, vrp_image_pixels(handle, i)) < 0)
+                goto write_failed;
+        }
+        else if(copy_range_fd(handle->fd, handle->firstImageOffset[i], outfd,
+                              ann->AnnotationSize + vrp_image_stored_size(handle, i), ann) < 0)
+            goto write_failed;
+    }
+
+    /* and now that we know where the offsets went: */
+    if(lseek(outfd, start, SEEK_SET) < 0 || write_all_fd(outfd, &header, sizeof(header)) < 0
+       || lseek(outfd, start + pos, SEEK_SET) < 0)
+        goto write_failed;
+
+    ret = 0;
+    goto done;
+
+write_failed:
+    vrp_set_error(err, VRP_E_SYSTEM, "writing trimmed cine");
+done:
+    free(offsets);
+    return ret;
+}
@@ -5,7 +5,20 @@
  * Licensed according to LICENSE file, one directory up.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* for copy_file_range() */
+#include <sys/sendfile.h>
+#endif
+
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "vrptools.h"
+#include "util.h"
 
 /* see https://en.wikipedia.org/wiki/English_numerals#Ordinal_numbers
  * Note, though, that I'm treating negatives as still ordinal (-1st for "negative first"). */
@@ -19,3 +32,167 @@ char *ordinal_suffix(int number)
             ones == 3 && is_not_ten ? "rd" : /* 3s, except 13s */
             "th"); /* everything else */
 }
+
+/* write_all_fd - write all len bytes of data to fd, carrying on after
+ * short writes and interruptions; returns 0, or -1 (with errno set) */
+int write_all_fd(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    ssize_t    n;
+
+    while(len)
+    {
+        if((n = write(fd, p, len)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* pwrite_all_fd - write all len bytes of data to fd at pos, the same
+ * way; a write of nothing at all (which would otherwise go round for
+ * ever) counts as an error.  Returns 0, or -1 (with errno set). */
+int pwrite_all_fd(int fd, const void *data, size_t len, off_t pos)
+{
+    const char *p = data;
+    ssize_t    n;
+
+    while(len)
+    {
+        if((n = pwrite(fd, p, len, pos)) <= 0)
+        {
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n == 0)
+                errno = EIO;
+            return -1;
+        }
+        p += n;
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+/* kernel_cant - whether a copy_file_range() or sendfile() error (0
+ * for one that stopped short without saying) means the kernel can't
+ * copy these files for us, so the next way should be tried, rather
+ * than the copy having failed (no space, an I/O error, ...) */
+static int kernel_cant(int error)
+{
+    switch(error)
+    {
+    case 0:
+    case EBADF: /* (no infd, or one it won't take) */
+    case EXDEV:
+    case EINVAL:
+    case ENOSYS:
+    case EOPNOTSUPP:
+    case ESPIPE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+#endif
+
+/* copy_range_fd - copy len bytes starting at offset off of infd onto
+ * the current position of outfd, keeping the data in the kernel where
+ * we can: copy_file_range() first (which can even share extents on
+ * some filesystems), then sendfile(), and finally a plain write() from
+ * src, which should be the same bytes already mapped into memory (may
+ * be NULL, in which case we just fail if the kernel can't help).  Only
+ * errors that say the kernel can't do it move on to the next way; any
+ * other is the copy's failure.
+ *
+ * returns 0 on success, -1 (with errno set) on failure.
+ */
+int copy_range_fd(int infd, off_t off, int outfd, size_t len, const void *src)
+{
+    size_t  done = 0;
+    ssize_t n;
+    int     error = 0;
+
+#ifdef __linux__
+    loff_t in_off = off;
+
+    while(done < len)
+    {
+        n = copy_file_range(infd, &in_off, outfd, NULL, len - done, 0);
+        error = n < 0 ? errno : 0;
+        if(n < 0 && error == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        done += n;
+    }
+    if(done == len)
+        return 0;
+    if(!kernel_cant(error))
+    {
+        errno = error;
+        return -1;
+    }
+
+    while(done < len)
+    {
+        off_t sf_off = off + done;
+
+        n = sendfile(outfd, infd, &sf_off, len - done);
+        error = n < 0 ? errno : 0;
+        if(n < 0 && error == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        done += n;
+    }
+    if(done == len)
+        return 0;
+    if(!kernel_cant(error))
+    {
+        errno = error;
+        return -1;
+    }
+#else
+    (void)infd;
+    (void)off;
+#endif
+
+    if(!src)
+    {
+        errno = error ? error : EIO;
+        return -1;
+    }
+    return write_all_fd(outfd, (const char *)src + done, len - done);
+}
+
+/* vrp_set_error - fill in *err (if err isn't NULL) with code and a
+ * printf-style message; for VRP_E_SYSTEM, errno is saved and its
+ * description appended, perror()-style.  Leaves err->warnings be. */
+void vrp_set_error(VRP_Error *err, int code, const char *fmt, ...)
+{
+    int     saved = errno;
+    va_list ap;
+    size_t  len;
+
+    if(!err)
+        return;
+
+    err->code = code;
+    err->sys_errno = code == VRP_E_SYSTEM ? saved : 0;
+
+    va_start(ap, fmt);
+    vsnprintf(err->message, sizeof(err->message), fmt, ap);
+    va_end(ap);
+
+    len = strlen(err->message);
+    if(code == VRP_E_SYSTEM && len < sizeof(err->message))
+        snprintf(err->message + len, sizeof(err->message) - len, ": %s", strerror(saved));
+    errno = saved;
+}
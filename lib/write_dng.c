@@ -0,0 +1,300 @@
+/*
+ * write_dng.c -- write raw (un-demosaiced) CINE frames as DNG files
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2011, 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "vrptools.h"
+#include "util.h"
+
+/* The pixel array of a CC_UNINT frame is already exactly what a DNG
+ * wants for a single uncompressed strip: little-endian samples, one
+ * CFA value per pixel, rows stored bottom-up.  So all we build here is
+ * a small ("II") TIFF header and IFD describing that strip -- with
+ * Orientation telling readers the rows go bottom-to-top -- and then
+ * have the kernel copy the pixels straight across from the cine.
+ * (vrp_dng_header() is the first half of that, for callers that would
+ * rather write the two together themselves.) */
+
+/* TIFF field types */
+#define TIFF_BYTE      1
+#define TIFF_ASCII     2
+#define TIFF_SHORT     3
+#define TIFF_LONG      4
+#define TIFF_RATIONAL  5
+#define TIFF_SRATIONAL 10
+
+#define DNG_MAX_ENTRIES 32
+
+struct dng_builder {
+    unsigned char buf[VRP_DNG_HEADER_MAX];
+    int           nentries;
+    size_t        ifd;    /* where the IFD starts */
+    size_t        extra;  /* where the next out-of-line value goes */
+};
+
+static void put16(unsigned char *p, unsigned v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void put32(unsigned char *p, unsigned long v)
+{
+    put16(p, v & 0xffff);
+    put16(p + 2, (v >> 16) & 0xffff);
+}
+
+/* add an IFD entry; tags must be added in increasing order.  values
+ * are given already encoded (little-endian) in data, len bytes long. */
+static int dng_entry(struct dng_builder *b, unsigned tag, unsigned type,
+                     unsigned long count, const void *data, size_t len)
+{
+    unsigned char *e;
+
+    if(b->nentries >= DNG_MAX_ENTRIES)
+        return -1;
+
+    e = b->buf + b->ifd + 2 + 12 * b->nentries++;
+    put16(e, tag);
+    put16(e + 2, type);
+    put32(e + 4, count);
+    memset(e + 8, 0, 4);
+
+    if(len <= 4)
+        memcpy(e + 8, data, len);
+    else
+    {
+        if(b->extra + len > sizeof(b->buf))
+            return -1;
+        put32(e + 8, b->extra);
+        memcpy(b->buf + b->extra, data, len);
+        b->extra += (len + 1) & ~1; /* keep word alignment */
+    }
+    return 0;
+}
+
+static int dng_short(struct dng_builder *b, unsigned tag, unsigned v)
+{
+    unsigned char d[2];
+
+    put16(d, v);
+    return dng_entry(b, tag, TIFF_SHORT, 1, d, 2);
+}
+
+static int dng_long(struct dng_builder *b, unsigned tag, unsigned long v)
+{
+    unsigned char d[4];
+
+    put32(d, v);
+    return dng_entry(b, tag, TIFF_LONG, 1, d, 4);
+}
+
+static int dng_ascii(struct dng_builder *b, unsigned tag, const char *s)
+{
+    return dng_entry(b, tag, TIFF_ASCII, strlen(s) + 1, s, strlen(s) + 1);
+}
+
+/* vrp_dng_header - the header of a DNG of the image at offset: what
+ * goes before its pixels, which follow it as they are
+ *
+ * inputs:
+ *   handle - handle to opened VRP Cine file (must be CC_UNINT)
+ *   offset - zero-based offset of the image
+ *   buf    - where to put the header
+ *   pixels - set to the image's pixels (vrp_image_pixels()), the
+ *            vrp_image_size() bytes that follow the header
+ *   err    - where to say what went wrong (may be NULL)
+ *
+ * return value:
+ *   the header's length, or -1 on failure (with err filled in)
+ */
+long vrp_dng_header(VRP_Handle handle, int offset, unsigned char buf[VRP_DNG_HEADER_MAX],
+                    const void **pixels, VRP_Error *err)
+{
+    struct dng_builder  b;
+    VRP_SETUP           *s = handle->setup;
+    VRP_BITMAPINFOHEADER *bmi = handle->imageHeader;
+    unsigned char       cfa[4], d[72];
+    char                model[32];
+    size_t              size, hdrlen;
+    unsigned long       white;
+    int                 i, bits;
+
+    if(!s || !bmi)
+    {
+        vrp_set_error(err, VRP_E_FORMAT, "%s: missing SETUP or BITMAPINFOHEADER, can't write DNG", handle->name);
+        return -1;
+    }
+    if(handle->header->Compression != VRP_CC_UNINT)
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: DNG output needs an uninterpolated (raw) cine, not Compression type %d",
+                      handle->name, handle->header->Compression);
+        return -1;
+    }
+    if(vrp_cfa_pattern(handle, cfa) < 0)
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: don't (yet) know the DNG layout of CFA type %d", handle->name, s->CFA);
+        return -1;
+    }
+    bits = bmi->biBitCount;
+    if(bits != 8 && bits != 16)
+    {
+        vrp_set_error(err, VRP_E_UNSUPPORTED, "%s: can't write %d-bit (packed?) pixels as DNG", handle->name, bits);
+        return -1;
+    }
+    if(!(*pixels = vrp_image_pixels(handle, offset)))
+    {
+        vrp_set_error(err, VRP_E_FORMAT, "%s: image at offset %d is missing or truncated", handle->name, offset);
+        return -1;
+    }
+    size = vrp_image_size(handle);
+
+    /* RealBPP is the sensor's depth; fall back on biClrImportant */
+    if(s->RealBPP >= 8 && (int)s->RealBPP <= bits)
+        white = (1UL << s->RealBPP) - 1;
+    else if(bmi->biClrImportant)
+        white = bmi->biClrImportant - 1;
+    else
+        white = (1UL << bits) - 1;
+
+    snprintf(model, sizeof(model), "Phantom v%u", s->CameraVersion);
+
+    memset(&b, 0, sizeof(b));
+    memcpy(b.buf, "II", 2);
+    put16(b.buf + 2, 42);
+    put32(b.buf + 4, 8);
+    b.ifd = 8;
+    b.extra = b.ifd + 2 + 12 * DNG_MAX_ENTRIES + 4;
+
+    /* (StripOffsets is filled in below, once we know the header size) */
+    if(dng_long(&b, 254, 0)                           /* NewSubfileType: main image */
+       || dng_long(&b, 256, bmi->biWidth)              /* ImageWidth */
+       || dng_long(&b, 257, bmi->biHeight)             /* ImageLength */
+       || dng_short(&b, 258, bits)                     /* BitsPerSample */
+       || dng_short(&b, 259, 1)                        /* Compression: none */
+       || dng_short(&b, 262, 32803)                    /* PhotometricInterpretation: CFA */
+       || dng_ascii(&b, 271, "Vision Research")        /* Make */
+       || dng_ascii(&b, 272, model)                    /* Model */
+       || dng_long(&b, 273, 0)                         /* StripOffsets */
+       || dng_short(&b, 274, 4)                        /* Orientation: rows go bottom-up */
+       || dng_short(&b, 277, 1)                        /* SamplesPerPixel */
+       || dng_long(&b, 278, bmi->biHeight)             /* RowsPerStrip: all of them */
+       || dng_long(&b, 279, size)                      /* StripByteCounts */
+       || dng_short(&b, 284, 1))                       /* PlanarConfiguration: chunky */
+        goto full;
+
+    put16(d, 2);
+    put16(d + 2, 2);
+    if(dng_entry(&b, 33421, TIFF_SHORT, 2, d, 4)       /* CFARepeatPatternDim */
+       || dng_entry(&b, 33422, TIFF_BYTE, 4, cfa, 4))  /* CFAPattern */
+        goto full;
+
+    d[0] = 1; d[1] = 4; d[2] = 0; d[3] = 0;
+    if(dng_entry(&b, 50706, TIFF_BYTE, 4, d, 4))       /* DNGVersion */
+        goto full;
+    d[1] = 1;
+    if(dng_entry(&b, 50707, TIFF_BYTE, 4, d, 4)        /* DNGBackwardVersion */
+       || dng_ascii(&b, 50708, model))                 /* UniqueCameraModel */
+        goto full;
+
+    d[0] = 0; d[1] = 1; d[2] = 2;
+    if(dng_entry(&b, 50710, TIFF_BYTE, 3, d, 3)        /* CFAPlaneColor: RGB */
+       || dng_short(&b, 50711, 1)                      /* CFALayout: rectangular */
+       || dng_long(&b, 50717, white))                  /* WhiteLevel */
+        goto full;
+
+    /* The cine doesn't record a colour calibration, so all we can
+     * honestly give is an identity ColorMatrix1 (which DNG requires
+     * for CFA images) under D65. */
+    for(i = 0; i < 9; ++i)
+    {
+        put32(d + 8*i, i % 4 == 0 ? 1 : 0);
+        put32(d + 8*i + 4, 1);
+    }
+    if(dng_entry(&b, 50721, TIFF_SRATIONAL, 9, d, 72)) /* ColorMatrix1 */
+        goto full;
+
+    /* AsShotNeutral is the inverse of the white balance gains */
+    put32(d, s->WBGain[0].R > 0 ? (unsigned long)(1000000 / s->WBGain[0].R + 0.5) : 1000000);
+    put32(d + 4, 1000000);
+    put32(d + 8, 1000000);
+    put32(d + 12, 1000000);
+    put32(d + 16, s->WBGain[0].B > 0 ? (unsigned long)(1000000 / s->WBGain[0].B + 0.5) : 1000000);
+    put32(d + 20, 1000000);
+    if(dng_entry(&b, 50728, TIFF_RATIONAL, 3, d, 24)   /* AsShotNeutral */
+       || dng_short(&b, 50778, 21))                    /* CalibrationIlluminant1: D65 */
+        goto full;
+
+    /* now that the header is complete, point the strip just past it */
+    put16(b.buf + b.ifd, b.nentries);
+    put32(b.buf + b.ifd + 2 + 12 * b.nentries, 0); /* no next IFD */
+    hdrlen = b.extra;
+    for(i = 0; i < b.nentries; ++i)
+    {
+        unsigned char *e = b.buf + b.ifd + 2 + 12*i;
+
+        if(e[0] == (273 & 0xff) && e[1] == (273 >> 8))
+            put32(e + 8, hdrlen);
+    }
+    memcpy(buf, b.buf, hdrlen);
+    return hdrlen;
+
+full:
+    vrp_set_error(err, VRP_E_FORMAT, "%s: DNG header overflowed", handle->name);
+    return -1;
+}
+
+/* vrp_write_dng - write the image at offset as a DNG onto outfd
+ *
+ * inputs:
+ *   handle - handle to opened VRP Cine file (must be CC_UNINT)
+ *   offset - zero-based offset of the image
+ *   outfd  - file descriptor to write to (at its current position)
+ *   err    - where to say what went wrong (may be NULL)
+ *
+ * return value:
+ *   0 on success, -1 on failure (with err filled in)
+ */
+int vrp_write_dng(VRP_Handle handle, int offset, int outfd, VRP_Error *err)
+{
+    unsigned char  header[VRP_DNG_HEADER_MAX];
+    const void     *pixels;
+    off_t          pos;
+    size_t         size = vrp_image_size(handle);
+    long           hdrlen;
+    VRP_StatsTimer t;
+
+    if((hdrlen = vrp_dng_header(handle, offset, header, &pixels, err)) < 0)
+        return -1;
+
+    VRP_STATS_START(&t);
+    if(write_all_fd(outfd, header, hdrlen) < 0)
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "%s: writing DNG header", handle->name);
+        return -1;
+    }
+
+    /* (packed files have nothing for the kernel to copy from, so with
+     * no fd we just write() the decoded image) */
+    pos = vrp_image_pixel_offset(handle, offset);
+    if(copy_range_fd(pos < 0 ? -1 : handle->fd, pos, outfd, size, pixels) < 0)
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "%s: copying pixel data into DNG", handle->name);
+        return -1;
+    }
+    VRP_STATS_STOP(&t, VRP_STAGE_WRITE, hdrlen + size);
+
+    return 0;
+}
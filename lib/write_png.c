@@ -0,0 +1,265 @@
+/*
+ * write_png.c -- 16-bit RGB (or 8/16-bit gray) PNG encoder, compressing
+ * in parallel chunks
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "vrptools.h"
+
+/* A PNG's image data is a single zlib stream, but a zlib stream can be
+ * built out of independently compressed raw-deflate pieces, as long as
+ * each piece but the last ends on a byte boundary (Z_SYNC_FLUSH) --
+ * the trick pigz uses.  So we cut the (filtered) rows into chunks of
+ * about this many bytes, deflate them on separate threads, and stitch
+ * them together with adler32_combine().  Each chunk starts with an
+ * empty dictionary, which costs a little compression at the edges. */
+#define PNG_CHUNK_BYTES (256*1024)
+
+static void put32be(unsigned char *p, unsigned long v)
+{
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+/* write one PNG chunk; returns bytes written or -1 */
+static long png_chunk(FILE *out, const char *type, const unsigned char *data, size_t len)
+{
+    unsigned char buf[4];
+    uLong         crc;
+
+    crc = crc32(0, (const Bytef *)type, 4);
+    if(len)
+        crc = crc32(crc, data, len);
+
+    put32be(buf, len);
+    if(fwrite(buf, 4, 1, out) != 1 || fwrite(type, 4, 1, out) != 1)
+        return -1;
+    if(len && fwrite(data, len, 1, out) != 1)
+        return -1;
+    put32be(buf, crc);
+    if(fwrite(buf, 4, 1, out) != 1)
+        return -1;
+
+    return len + 12;
+}
+
+struct png_job {
+    const unsigned char *pixels;
+    size_t         pixbytes; /* bytes per pixel */
+    int            rows, cols, rows_per_chunk, nchunks, level;
+    unsigned char  **chunk;
+    size_t         *chunklen;
+    uLong          *adler;   /* of each chunk's uncompressed bytes */
+    size_t         *rawlen;
+    int            failed;
+};
+
+static void png_encode_chunk(int chunk, void *arg)
+{
+    struct png_job      *job = arg;
+    int                 first = chunk * job->rows_per_chunk;
+    int                 rows = job->rows - first < job->rows_per_chunk ? job->rows - first : job->rows_per_chunk;
+    size_t              bpp = job->pixbytes, rowbytes = (size_t)job->cols * bpp;
+    size_t              len = rows * (rowbytes + 1);
+    const unsigned char *src = job->pixels + (size_t)first * rowbytes;
+    unsigned char       *raw, *out = NULL, *p;
+    z_stream            zs;
+    size_t              i;
+    int                 r;
+    VRP_StatsTimer      t;
+
+    VRP_STATS_START(&t);
+    if(!(raw = vrp_buffer_get(len)))
+    {
+        job->failed = 1;
+        return;
+    }
+
+    /* filter type 1 ("Sub") on every row: a byte-wise horizontal
+     * predictor, which needs nothing from the row above and so keeps
+     * chunks independent. */
+    for(p = raw, r = 0; r < rows; ++r, src += rowbytes)
+    {
+        *p++ = 1;
+        for(i = 0; i < bpp && i < rowbytes; ++i)
+            *p++ = src[i];
+        for(; i < rowbytes; ++i)
+            *p++ = src[i] - src[i - bpp];
+    }
+
+    job->adler[chunk] = adler32(adler32(0, NULL, 0), raw, len);
+    job->rawlen[chunk] = len;
+
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = vrp_pool_zalloc;
+    zs.zfree = vrp_pool_zfree;
+    if(deflateInit2(&zs, job->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+    {
+        size_t cap = deflateBound(&zs, len) + 16;
+
+        if((out = vrp_buffer_get(cap)))
+        {
+            zs.next_in = raw;
+            zs.avail_in = len;
+            zs.next_out = out;
+            zs.avail_out = cap;
+            if(deflate(&zs, chunk == job->nchunks - 1 ? Z_FINISH : Z_SYNC_FLUSH) < 0
+               || zs.avail_in)
+            {
+                vrp_buffer_put(out);
+                out = NULL;
+            }
+            else
+                job->chunklen[chunk] = cap - zs.avail_out;
+        }
+        deflateEnd(&zs);
+    }
+    vrp_buffer_put(raw);
+
+    if(!out)
+        job->failed = 1;
+    job->chunk[chunk] = out;
+    VRP_STATS_STOP(&t, VRP_STAGE_ENCODE, len);
+}
+
+/* write_png - the work of vrp_write_png() and vrp_write_png_gray():
+ * channels of depth-bit samples per pixel (3 of 16, or 1 of 8 or 16) */
+static long write_png(FILE *out, const void *pixels, int channels, int depth, int rows, int cols,
+                      int maxval, int level, int threads)
+{
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    struct png_job job;
+    unsigned char  buf[16];
+    size_t         rowbytes = (size_t)cols * channels * depth / 8 + 1;
+    uLong          adler;
+    long           n, total = -1;
+    int            i, sbit;
+    VRP_StatsTimer t;
+
+    job.pixels = pixels;
+    job.pixbytes = channels * depth / 8;
+    job.rows = rows;
+    job.cols = cols;
+    job.level = level;
+    job.rows_per_chunk = rowbytes >= PNG_CHUNK_BYTES ? 1 : PNG_CHUNK_BYTES / rowbytes;
+    job.nchunks = (rows + job.rows_per_chunk - 1) / job.rows_per_chunk;
+    job.failed = 0;
+    job.chunk = vrp_buffer_get(job.nchunks * sizeof(*job.chunk));
+    job.chunklen = vrp_buffer_get(job.nchunks * sizeof(*job.chunklen));
+    job.adler = vrp_buffer_get(job.nchunks * sizeof(*job.adler));
+    job.rawlen = vrp_buffer_get(job.nchunks * sizeof(*job.rawlen));
+    if(!job.chunk || !job.chunklen || !job.adler || !job.rawlen)
+        goto done;
+    memset(job.chunk, 0, job.nchunks * sizeof(*job.chunk));
+
+    vrp_parallel_for(job.nchunks, threads, png_encode_chunk, &job);
+    if(job.failed)
+        goto done;
+
+    VRP_STATS_START(&t);
+    if(fwrite(signature, 8, 1, out) != 1)
+        goto done;
+    total = 8;
+
+    put32be(buf, cols);
+    put32be(buf + 4, rows);
+    buf[8] = depth;
+    buf[9] = channels == 3 ? 2 : 0;  /* colour type: RGB or grayscale */
+    buf[10] = 0;  /* deflate */
+    buf[11] = 0;  /* adaptive filtering (per-row filter bytes) */
+    buf[12] = 0;  /* no interlace */
+    if((n = png_chunk(out, "IHDR", buf, 13)) < 0)
+        goto fail;
+    total += n;
+
+    /* significant bits, e.g. 14 for biClrImportant of 16384 */
+    for(sbit = 1; sbit < depth && (1 << sbit) < maxval; ++sbit)
+        ;
+    buf[0] = buf[1] = buf[2] = sbit;
+    if((n = png_chunk(out, "sBIT", buf, channels)) < 0)
+        goto fail;
+    total += n;
+
+    /* zlib header (deflate, 32K window, default level), the pieces,
+     * then the combined adler32, each as an IDAT of its own */
+    buf[0] = 0x78;
+    buf[1] = 0x9c;
+    if((n = png_chunk(out, "IDAT", buf, 2)) < 0)
+        goto fail;
+    total += n;
+
+    adler = adler32(0, NULL, 0);
+    for(i = 0; i < job.nchunks; ++i)
+    {
+        adler = adler32_combine(adler, job.adler[i], job.rawlen[i]);
+        if((n = png_chunk(out, "IDAT", job.chunk[i], job.chunklen[i])) < 0)
+            goto fail;
+        total += n;
+    }
+
+    put32be(buf, adler);
+    if((n = png_chunk(out, "IDAT", buf, 4)) < 0
+       || png_chunk(out, "IEND", NULL, 0) < 0)
+        goto fail;
+    total += n + 12;
+    VRP_STATS_STOP(&t, VRP_STAGE_WRITE, total);
+    goto done;
+
+fail:
+    total = -1;
+done:
+    if(job.chunk)
+        for(i = 0; i < job.nchunks; ++i)
+            vrp_buffer_put(job.chunk[i]);
+    vrp_buffer_put(job.chunk);
+    vrp_buffer_put(job.chunklen);
+    vrp_buffer_put(job.adler);
+    vrp_buffer_put(job.rawlen);
+    return total;
+}
+
+/* vrp_write_png - write a 16-bit RGB PNG
+ *
+ * inputs:
+ *   out     - where to write it
+ *   rgb     - rows*cols*3 samples, big-endian, top row first
+ *             (as from vrp_extract_image())
+ *   maxval  - one more than the largest possible sample value
+ *             (biClrImportant), recorded in an sBIT chunk
+ *   level   - zlib compression level
+ *   threads - how many threads to compress with (<= 0: all CPUs)
+ *
+ * return value:
+ *   number of bytes written, or -1 on failure
+ */
+long vrp_write_png(FILE *out, const uint16_t *rgb, int rows, int cols, int maxval,
+                   int level, int threads)
+{
+    return write_png(out, rgb, 3, 16, rows, cols, maxval, level, threads);
+}
+
+/* vrp_write_png_gray - write a grayscale PNG, of depth (8 or 16) bits
+ * per sample, from rows*cols samples as vrp_extract_gray() gives them;
+ * otherwise as vrp_write_png() */
+long vrp_write_png_gray(FILE *out, const void *gray, int depth, int rows, int cols, int maxval,
+                        int level, int threads)
+{
+    if(depth != 8 && depth != 16)
+        return -1;
+    return write_png(out, gray, 1, depth, rows, cols, maxval, level, threads);
+}
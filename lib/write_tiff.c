@@ -0,0 +1,433 @@
+/*
+ * write_tiff.c -- 16-bit RGB (or 8/16-bit gray) TIFF encoder
+ * (uncompressed, LZW, deflate)
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "vrptools.h"
+
+/* The image is cut into strips of about this many (uncompressed)
+ * bytes; each strip is compressed independently, which is what lets
+ * us spread the work over several threads. */
+#define TIFF_STRIP_BYTES (256*1024)
+
+/* The input is the big-endian RGB48 that vrp_extract_image()
+ * produces for PPM, so we write a big-endian ("MM") TIFF and can use
+ * the samples as they are. */
+
+static void put16be(unsigned char *p, unsigned v)
+{
+    p[0] = (v >> 8) & 0xff;
+    p[1] = v & 0xff;
+}
+
+static void put32be(unsigned char *p, unsigned long v)
+{
+    put16be(p, (v >> 16) & 0xffff);
+    put16be(p + 2, v & 0xffff);
+}
+
+/** LZW, as TIFF does it: MSB-first codes of 9-12 bits, with the
+ * "early change" of code width that libtiff (and everyone since)
+ * expects. **/
+
+#define LZW_CLEAR  256
+#define LZW_EOI    257
+#define LZW_FIRST  258
+#define LZW_MAX    4094 /* emit a Clear when the table gets this full */
+#define LZW_HSIZE  9001 /* prime, a bit over twice the table size */
+
+struct lzw_state {
+    unsigned char *out;
+    size_t        len, cap;
+    uint32_t      bitbuf;
+    int           bitcount;
+    int           width;
+    int32_t       hkey[LZW_HSIZE];  /* (prefix << 8 | byte), or -1 */
+    uint16_t      hcode[LZW_HSIZE];
+};
+
+/* lzw_grow - double the room for output (when it's full) */
+static int lzw_grow(struct lzw_state *z)
+{
+    unsigned char *p;
+
+    if(z->len < z->cap)
+        return 0;
+    if(!(p = vrp_buffer_get(z->cap * 2)))
+        return -1;
+    memcpy(p, z->out, z->len);
+    vrp_buffer_put(z->out);
+    z->out = p;
+    z->cap *= 2;
+    return 0;
+}
+
+static int lzw_emit(struct lzw_state *z, unsigned code)
+{
+    z->bitbuf = z->bitbuf << z->width | code;
+    z->bitcount += z->width;
+    while(z->bitcount >= 8)
+    {
+        if(lzw_grow(z) < 0)
+            return -1;
+        z->bitcount -= 8;
+        z->out[z->len++] = z->bitbuf >> z->bitcount;
+    }
+    return lzw_grow(z);
+}
+
+static void lzw_reset(struct lzw_state *z)
+{
+    memset(z->hkey, 0xff, sizeof(z->hkey));
+    z->width = 9;
+}
+
+/* lzw_compress - compress len bytes of in; returns a pool
+ * buffer (length in *outlen), or NULL on allocation failure. */
+static unsigned char *lzw_compress(const unsigned char *in, size_t len, size_t *outlen)
+{
+    struct lzw_state *z;
+    unsigned char    *out = NULL;
+    unsigned         w, next;
+    size_t           i;
+    int              failed = 0;
+
+    if(!(z = vrp_buffer_get(sizeof(*z))))
+        return NULL;
+    z->cap = len / 2 + 64;
+    z->len = 0;
+    z->bitbuf = 0;
+    z->bitcount = 0;
+    if(!(z->out = vrp_buffer_get(z->cap)))
+    {
+        vrp_buffer_put(z);
+        return NULL;
+    }
+
+    lzw_reset(z);
+    failed |= lzw_emit(z, LZW_CLEAR);
+    next = LZW_FIRST;
+    w = len ? in[0] : 0;
+
+    for(i = 1; i < len && !failed; ++i)
+    {
+        int32_t  key = (int32_t)(w << 8 | in[i]);
+        unsigned h = (unsigned)key % LZW_HSIZE;
+
+        while(z->hkey[h] != -1 && z->hkey[h] != key)
+            h = h ? h - 1 : LZW_HSIZE - 1;
+
+        if(z->hkey[h] == key)
+        {
+            w = z->hcode[h];
+            continue;
+        }
+
+        failed |= lzw_emit(z, w);
+        z->hkey[h] = key;
+        z->hcode[h] = next++;
+        w = in[i];
+
+        if(next == LZW_MAX)
+        {
+            failed |= lzw_emit(z, LZW_CLEAR);
+            lzw_reset(z);
+            next = LZW_FIRST;
+        }
+        else if(next > (1u << z->width) - 1)
+            z->width++;
+    }
+
+    if(len)
+        failed |= lzw_emit(z, w);
+    failed |= lzw_emit(z, LZW_EOI);
+    if(z->bitcount && !failed)
+    {
+        /* pad out the last byte; lzw_emit() always leaves room for it */
+        z->out[z->len++] = z->bitbuf << (8 - z->bitcount);
+    }
+
+    if(!failed)
+    {
+        out = z->out;
+        *outlen = z->len;
+    }
+    else
+        vrp_buffer_put(z->out);
+    vrp_buffer_put(z);
+    return out;
+}
+
+/** the strip-parallel encoder **/
+
+struct tiff_job {
+    const unsigned char *pixels;
+    int            channels, depth;
+    int            rows, cols, rows_per_strip;
+    int            compression, level;
+    unsigned char  **strip;   /* per-strip output */
+    size_t         *striplen;
+    int            failed;
+};
+
+/* horizontal differencing (TIFF Predictor 2) of one row of channels
+ * big-endian samples per pixel, going right to left so we can do it in
+ * place */
+static void tiff_predict_row(unsigned char *row, int cols, int channels, int depth)
+{
+    int i, c = channels;
+
+    if(depth == 8)
+        for(i = c*cols - 1; i >= c; --i)
+            row[i] -= row[i-c];
+    else
+        for(i = c*cols - 1; i >= c; --i)
+        {
+            unsigned v = (row[2*i] << 8 | row[2*i+1]) - (row[2*(i-c)] << 8 | row[2*(i-c)+1]);
+
+            put16be(row + 2*i, v & 0xffff);
+        }
+}
+
+static void tiff_encode_strip(int strip, void *arg)
+{
+    struct tiff_job     *job = arg;
+    int                 first = strip * job->rows_per_strip;
+    int                 rows = job->rows - first < job->rows_per_strip ? job->rows - first : job->rows_per_strip;
+    size_t              rowbytes = (size_t)job->cols * job->channels * job->depth / 8;
+    size_t              len = rows * rowbytes;
+    const unsigned char *src = job->pixels + (size_t)first * rowbytes;
+    unsigned char       *raw, *out = NULL;
+    int                 i;
+    VRP_StatsTimer      t;
+
+    if(job->compression == VRP_TIFF_NONE)
+        return; /* written straight from the source buffer */
+
+    VRP_STATS_START(&t);
+
+    if(!(raw = vrp_buffer_get(len)))
+    {
+        job->failed = 1;
+        return;
+    }
+    memcpy(raw, src, len);
+    for(i = 0; i < rows; ++i)
+        tiff_predict_row(raw + i * rowbytes, job->cols, job->channels, job->depth);
+
+    if(job->compression == VRP_TIFF_LZW)
+        out = lzw_compress(raw, len, &job->striplen[strip]);
+    else
+    {
+        uLong    outlen = compressBound(len);
+        z_stream zs;
+
+        /* (compress2(), but with zlib's memory from the pool) */
+        memset(&zs, 0, sizeof(zs));
+        zs.zalloc = vrp_pool_zalloc;
+        zs.zfree = vrp_pool_zfree;
+        if((out = vrp_buffer_get(outlen)) && deflateInit(&zs, job->level) == Z_OK)
+        {
+            zs.next_in = raw;
+            zs.avail_in = len;
+            zs.next_out = out;
+            zs.avail_out = outlen;
+            if(deflate(&zs, Z_FINISH) == Z_STREAM_END)
+                job->striplen[strip] = zs.total_out;
+            else
+            {
+                vrp_buffer_put(out);
+                out = NULL;
+            }
+            deflateEnd(&zs);
+        }
+        else
+        {
+            vrp_buffer_put(out);
+            out = NULL;
+        }
+    }
+    vrp_buffer_put(raw);
+
+    if(!out)
+        job->failed = 1;
+    job->strip[strip] = out;
+    VRP_STATS_STOP(&t, VRP_STAGE_ENCODE, len);
+}
+
+/* write_tiff - the work of vrp_write_tiff() and vrp_write_tiff_gray():
+ * channels of depth-bit samples per pixel (3 of 16, or 1 of 8 or 16) */
+static long write_tiff(FILE *out, const void *pixels, int channels, int depth, int rows, int cols,
+                       int maxval, int compression, int level, int threads)
+{
+    struct tiff_job job;
+    unsigned char   hdr[256], *e, *offsets, *counts;
+    int             nstrips, nentries = 0, i;
+    size_t          rowbytes = (size_t)cols * channels * depth / 8;
+    size_t          hdrlen, pos;
+    long            total = -1;
+    VRP_StatsTimer  t;
+
+    if(compression != VRP_TIFF_NONE && compression != VRP_TIFF_LZW
+       && compression != VRP_TIFF_DEFLATE)
+        return -1;
+
+    job.pixels = pixels;
+    job.channels = channels;
+    job.depth = depth;
+    job.rows = rows;
+    job.cols = cols;
+    job.rows_per_strip = rowbytes >= TIFF_STRIP_BYTES ? 1 : TIFF_STRIP_BYTES / rowbytes;
+    job.compression = compression;
+    job.level = level;
+    job.failed = 0;
+    nstrips = (rows + job.rows_per_strip - 1) / job.rows_per_strip;
+
+    job.strip = vrp_buffer_get(nstrips * sizeof(*job.strip));
+    job.striplen = vrp_buffer_get(nstrips * sizeof(*job.striplen));
+    offsets = vrp_buffer_get(4 * nstrips);
+    counts = vrp_buffer_get(4 * nstrips);
+    if(!job.strip || !job.striplen || !offsets || !counts)
+        goto done;
+    memset(job.strip, 0, nstrips * sizeof(*job.strip));
+
+    vrp_parallel_for(nstrips, threads, tiff_encode_strip, &job);
+    if(job.failed)
+        goto done;
+
+    if(compression == VRP_TIFF_NONE)
+        for(i = 0; i < nstrips; ++i)
+            job.striplen[i] = (rows - i * job.rows_per_strip < job.rows_per_strip
+                               ? rows - i * job.rows_per_strip : job.rows_per_strip) * rowbytes;
+
+    /* layout: header + IFD + BitsPerSample values (if there's more
+     * than the one, which fits in its entry), then the two strip
+     * arrays, then the strips themselves */
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, "MM", 2);
+    put16be(hdr + 2, 42);
+    put32be(hdr + 4, 8);
+
+#define TIFF_ENTRIES 13
+    hdrlen = 8 + 2 + 12 * TIFF_ENTRIES + 4;
+    put16be(hdr + 8, TIFF_ENTRIES);
+    put16be(hdr + hdrlen, depth);    /* BitsPerSample values */
+    put16be(hdr + hdrlen + 2, depth);
+    put16be(hdr + hdrlen + 4, depth);
+
+#define TIFF_ENTRY(tag, type, count, value) \
+    (e = hdr + 10 + 12 * nentries++, put16be(e, tag), put16be(e + 2, type), \
+     put32be(e + 4, count), \
+     (type) == 3 && (count) == 1 ? put16be(e + 8, value) : put32be(e + 8, value))
+
+    pos = hdrlen + 6;
+    TIFF_ENTRY(256, 4, 1, cols);                         /* ImageWidth */
+    TIFF_ENTRY(257, 4, 1, rows);                         /* ImageLength */
+    if(channels == 3)
+        TIFF_ENTRY(258, 3, 3, hdrlen);                   /* BitsPerSample */
+    else
+        TIFF_ENTRY(258, 3, 1, depth);
+    TIFF_ENTRY(259, 3, 1, compression);                  /* Compression */
+    TIFF_ENTRY(262, 3, 1, channels == 3 ? 2 : 1);        /* Photometric: RGB or BlackIsZero */
+    TIFF_ENTRY(273, 4, nstrips, nstrips > 1 ? pos : 0);  /* StripOffsets */
+    TIFF_ENTRY(277, 3, 1, channels);                     /* SamplesPerPixel */
+    TIFF_ENTRY(278, 4, 1, job.rows_per_strip);           /* RowsPerStrip */
+    TIFF_ENTRY(279, 4, nstrips, nstrips > 1 ? pos + 4*nstrips : 0); /* StripByteCounts */
+    TIFF_ENTRY(281, 3, 1, maxval > 0 && maxval <= (1 << depth) ? maxval - 1 : (1 << depth) - 1); /* MaxSampleValue */
+    TIFF_ENTRY(284, 3, 1, 1);                            /* PlanarConfig: chunky */
+    TIFF_ENTRY(317, 3, 1, compression == VRP_TIFF_NONE ? 1 : 2); /* Predictor */
+    TIFF_ENTRY(339, 3, 1, 1);                            /* SampleFormat: unsigned */
+#undef TIFF_ENTRY
+
+    if(nstrips > 1)
+        pos += 8 * nstrips;
+    for(i = 0; i < nstrips; ++i)
+    {
+        put32be(offsets + 4*i, pos);
+        put32be(counts + 4*i, job.striplen[i]);
+        pos += job.striplen[i];
+    }
+    if(nstrips == 1)
+    {
+        /* single values live right in the IFD entry */
+        memcpy(hdr + 10 + 12*5 + 8, offsets, 4);
+        memcpy(hdr + 10 + 12*8 + 8, counts, 4);
+    }
+
+    VRP_STATS_START(&t);
+    if(fwrite(hdr, hdrlen + 6, 1, out) != 1)
+        goto done;
+    if(nstrips > 1 && (fwrite(offsets, 4, nstrips, out) != (size_t)nstrips
+                       || fwrite(counts, 4, nstrips, out) != (size_t)nstrips))
+        goto done;
+
+    if(compression == VRP_TIFF_NONE)
+    {
+        if(fwrite(pixels, rowbytes, rows, out) != (size_t)rows)
+            goto done;
+    }
+    else
+        for(i = 0; i < nstrips; ++i)
+            if(fwrite(job.strip[i], 1, job.striplen[i], out) != job.striplen[i])
+                goto done;
+
+    total = pos;
+    VRP_STATS_STOP(&t, VRP_STAGE_WRITE, pos);
+
+done:
+    if(job.strip)
+        for(i = 0; i < nstrips; ++i)
+            vrp_buffer_put(job.strip[i]);
+    vrp_buffer_put(job.strip);
+    vrp_buffer_put(job.striplen);
+    vrp_buffer_put(offsets);
+    vrp_buffer_put(counts);
+    return total;
+}
+
+/* vrp_write_tiff - write a 16-bit RGB TIFF
+ *
+ * inputs:
+ *   out         - where to write it
+ *   rgb         - rows*cols*3 samples, big-endian, top row first
+ *                 (as from vrp_extract_image())
+ *   maxval      - one more than the largest possible sample value
+ *                 (biClrImportant), recorded as MaxSampleValue
+ *   compression - VRP_TIFF_NONE, VRP_TIFF_LZW or VRP_TIFF_DEFLATE;
+ *                 the compressed ones also use horizontal prediction
+ *   level       - zlib compression level (deflate only)
+ *   threads     - how many threads to compress strips with (<= 0: all CPUs)
+ *
+ * return value:
+ *   number of bytes written, or -1 on failure
+ */
+long vrp_write_tiff(FILE *out, const uint16_t *rgb, int rows, int cols, int maxval,
+                    int compression, int level, int threads)
+{
+    return write_tiff(out, rgb, 3, 16, rows, cols, maxval, compression, level, threads);
+}
+
+/* vrp_write_tiff_gray - write a grayscale TIFF, of depth (8 or 16)
+ * bits per sample, from rows*cols samples as vrp_extract_gray() gives
+ * them; otherwise as vrp_write_tiff() */
+long vrp_write_tiff_gray(FILE *out, const void *gray, int depth, int rows, int cols, int maxval,
+                         int compression, int level, int threads)
+{
+    if(depth != 8 && depth != 16)
+        return -1;
+    return write_tiff(out, gray, 1, depth, rows, cols, maxval, compression, level, threads);
+}
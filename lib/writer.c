@@ -0,0 +1,428 @@
+/*
+ * writer.c -- write a CINE file a frame at a time
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "vrptools.h"
+#include "util.h"
+
+/* The layout is fixed as soon as the first image arrives:
+ *
+ *   CINEFILEHEADER, BITMAPINFOHEADER, SETUP
+ *   tagged blocks (with room for max_images times/exposures)
+ *   image offsets (room for max_images of them)
+ *   images, starting on a VRP_WRITER_ALIGN boundary
+ *
+ * so images can be streamed out through a buffer as they come, in
+ * large writes that start and (but for the last) end on aligned
+ * offsets.  Everything before the images is only known for sure at
+ * close, so that's when it's written.  If fewer than max_images were
+ * appended, the unused space in the block area is covered by a
+ * filler block of a type no reader knows, so it's skipped. */
+
+#define VRP_WRITER_ALIGN  4096
+#define VRP_WRITER_BUFFER (8*1024*1024)
+#define VRP_TB_Filler     0    /* (not a Vision Research type) */
+
+struct _VRP_Writer {
+    int                  fd;
+    off_t                start;        /* where in fd the cine starts */
+    VRP_CINEFILEHEADER   header;
+    VRP_BITMAPINFOHEADER bmi;
+    VRP_SETUP            setup;
+    unsigned             max_images, count, flags;
+    size_t               image_size;
+
+    char                 *blocks;      /* caller's tagged blocks, ready to write */
+    size_t               blocks_len;
+
+    VRP_ImageOffset      *offsets;
+    VRP_TIME64           *times;
+    VRP_DWORD            *exposures;
+
+    off_t                data;         /* where the images start (0: not yet laid out) */
+    off_t                pos;          /* where the next image goes */
+    char                 *buf;         /* images not yet written, from buf_pos */
+    off_t                buf_pos;
+    size_t               buf_len;
+    int                  failed;
+    VRP_Error            error;        /* why, once it has */
+};
+
+static int flush_buffer(VRP_Writer *w, VRP_Error *err)
+{
+    if(w->buf_len && pwrite_all_fd(w->fd, w->buf, w->buf_len, w->start + w->buf_pos) < 0)
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "writing cine images");
+        return -1;
+    }
+    w->buf_pos += w->buf_len;
+    w->buf_len = 0;
+    return 0;
+}
+
+/* queue len bytes to go at w->pos (always the end of the buffer);
+ * with no data, leave a hole of that size instead */
+static int buffer_bytes(VRP_Writer *w, const void *data, size_t len, VRP_Error *err)
+{
+    const char *p = data;
+
+    if(!data)
+    {
+        if(flush_buffer(w, err) < 0)
+            return -1;
+        w->buf_pos += len;
+        w->pos += len;
+        return 0;
+    }
+    while(len)
+    {
+        size_t n = VRP_WRITER_BUFFER - w->buf_len;
+
+        if(n > len)
+            n = len;
+        memcpy(w->buf + w->buf_len, p, n);
+        w->buf_len += n;
+        w->pos += n;
+        p += n;
+        len -= n;
+        if(w->buf_len == VRP_WRITER_BUFFER && flush_buffer(w, err) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* size of the tagged block area for n images (not counting filler) */
+static size_t blocks_size(VRP_Writer *w, unsigned n)
+{
+    size_t size = w->blocks_len;
+
+    if(w->flags & VRP_WRITER_TIMES)
+        size += sizeof(VRP_TAGGED_BLOCK) + n * sizeof(VRP_TIME64);
+    if(w->flags & VRP_WRITER_EXPOSURES)
+        size += sizeof(VRP_TAGGED_BLOCK) + n * sizeof(VRP_DWORD);
+    return size;
+}
+
+/* vrp_writer_open - start writing a cine onto fd
+ *
+ * inputs:
+ *   fd         - where to write (from its current position; must be
+ *                seekable, as the headers are written last)
+ *   header     - CINEFILEHEADER; FirstImageNo, FirstMovieImage,
+ *                TotalImageCount and TriggerTime are used, the rest
+ *                filled in
+ *   bmi, setup - copied as they are (but see biSizeImage, below)
+ *   max_images - most images that will be appended
+ *   flags      - VRP_WRITER_TIMES and/or VRP_WRITER_EXPOSURES, to
+ *                write those tagged blocks from vrp_writer_append()'s
+ *                arguments
+ *   err        - where to say what went wrong (may be NULL)
+ *
+ * The size of each pixel array is taken from bmi->biSizeImage, or
+ * worked out from the dimensions and bit count if that's zero.
+ *
+ * return value:
+ *   the new writer, or NULL on failure (with err filled in)
+ */
+VRP_Writer *vrp_writer_open(int fd, const VRP_CINEFILEHEADER *header,
+                            const VRP_BITMAPINFOHEADER *bmi, const VRP_SETUP *setup,
+                            unsigned max_images, unsigned flags, VRP_Error *err)
+{
+    VRP_Writer *w;
+
+    if(!max_images)
+    {
+        vrp_set_error(err, VRP_E_RANGE, "vrp_writer_open: need room for at least one image");
+        return NULL;
+    }
+    if(!(w = calloc(1, sizeof(*w))))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "vrp_writer_open: out of memory");
+        return NULL;
+    }
+
+    w->fd = fd;
+    w->header = *header;
+    w->bmi = *bmi;
+    w->setup = *setup;
+    w->max_images = max_images;
+    w->flags = flags;
+
+    if(!w->bmi.biSizeImage)
+        w->bmi.biSizeImage = (size_t)w->bmi.biWidth * abs(w->bmi.biHeight) * w->bmi.biBitCount / 8;
+    w->image_size = w->bmi.biSizeImage;
+
+    if((w->start = lseek(fd, 0, SEEK_CUR)) < 0)
+    {
+        vrp_set_error(err, VRP_E_SYSTEM, "vrp_writer_open: output must be seekable");
+        goto fail;
+    }
+    if(!(w->offsets = malloc(max_images * sizeof(*w->offsets)))
+       || ((flags & VRP_WRITER_TIMES) && !(w->times = malloc(max_images * sizeof(*w->times))))
+       || ((flags & VRP_WRITER_EXPOSURES) && !(w->exposures = malloc(max_images * sizeof(*w->exposures)))))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "vrp_writer_open: out of memory");
+        goto fail;
+    }
+    if(posix_memalign((void **)&w->buf, VRP_WRITER_ALIGN, VRP_WRITER_BUFFER))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "vrp_writer_open: can't allocate write buffer");
+        w->buf = NULL;
+        goto fail;
+    }
+
+    return w;
+
+fail:
+    free(w->offsets);
+    free(w->times);
+    free(w->exposures);
+    free(w);
+    return NULL;
+}
+
+/* vrp_writer_add_block - add a tagged block to be written with the headers
+ *
+ * inputs:
+ *   w          - writer, with no images appended yet
+ *   type       - the block's Type
+ *   data, len  - its contents (copied)
+ *   err        - where to say what went wrong (may be NULL)
+ *
+ * return value:
+ *   0 on success, -1 on failure (with err filled in)
+ */
+int vrp_writer_add_block(VRP_Writer *w, int type, const void *data, size_t len, VRP_Error *err)
+{
+    VRP_TAGGED_BLOCK block;
+    char             *p;
+
+    if(w->data)
+    {
+        vrp_set_error(err, VRP_E_RANGE, "vrp_writer_add_block: too late, images already written");
+        return -1;
+    }
+    if(!(p = realloc(w->blocks, w->blocks_len + sizeof(block) + len)))
+    {
+        vrp_set_error(err, VRP_E_NOMEM, "vrp_writer_add_block: out of memory");
+        return -1;
+    }
+    w->blocks = p;
+
+    block.BlockSize = sizeof(block) + len;
+    block.Type = type;
+    block.Reserved = 1;
+    memcpy(w->blocks + w->blocks_len, &block, sizeof(block));
+    memcpy(w->blocks + w->blocks_len + sizeof(block), data, len);
+    w->blocks_len += sizeof(block) + len;
+    return 0;
+}
+
+/* vrp_writer_append - add the next image
+ *
+ * inputs:
+ *   w          - writer
+ *   annotation - the image's annotation, or NULL for a minimal one
+ *   pixels     - biSizeImage bytes of pixel data, or NULL to leave
+ *                them unwritten (a hole in the file, reading as zeros)
+ *   time       - when it was taken (if opened with VRP_WRITER_TIMES)
+ *   exposure   - its exposure (if opened with VRP_WRITER_EXPOSURES)
+ *   err        - where to say what went wrong (may be NULL)
+ *
+ * Once a write has failed, so does every later append, with the same
+ * error.
+ *
+ * return value:
+ *   0 on success, -1 on failure (with err filled in)
+ */
+int vrp_writer_append(VRP_Writer *w, const VRP_ImageAnnotation *annotation,
+                      const void *pixels, VRP_TIME64 time, VRP_DWORD exposure, VRP_Error *err)
+{
+    VRP_DWORD minimal[2];
+
+    if(w->failed)
+    {
+        if(err)
+            *err = w->error;
+        return -1;
+    }
+    if(w->count >= w->max_images)
+    {
+        vrp_set_error(err, VRP_E_RANGE, "vrp_writer_append: only room for %u images", w->max_images);
+        return -1;
+    }
+
+    if(!w->data)
+    {
+        off_t pos = sizeof(w->header) + sizeof(w->bmi) + sizeof(w->setup);
+
+        pos += blocks_size(w, w->max_images);
+        pos = (pos + 7) & ~7;
+        w->header.OffImageOffsets = pos;
+        pos += w->max_images * sizeof(*w->offsets);
+        w->data = w->pos = w->buf_pos = (pos + VRP_WRITER_ALIGN - 1) & ~(off_t)(VRP_WRITER_ALIGN - 1);
+    }
+
+    if(!annotation)
+    {
+        minimal[0] = sizeof(minimal);
+        minimal[1] = w->image_size;
+        annotation = (const VRP_ImageAnnotation *)minimal;
+    }
+
+    w->offsets[w->count] = w->pos;
+    if(w->times)
+        w->times[w->count] = time;
+    if(w->exposures)
+        w->exposures[w->count] = exposure;
+
+    if(buffer_bytes(w, annotation, annotation->AnnotationSize, &w->error) < 0
+       || buffer_bytes(w, pixels, w->image_size, &w->error) < 0)
+    {
+        w->failed = 1;
+        if(err)
+            *err = w->error;
+        return -1;
+    }
+    w->count++;
+    return 0;
+}
+
+/* append a tagged block's header and data at p; returns the block */
+static VRP_TAGGED_BLOCK *put_block(char *p, int type, const void *data, size_t len)
+{
+    VRP_TAGGED_BLOCK *block = (VRP_TAGGED_BLOCK *)p;
+
+    block->BlockSize = sizeof(*block) + len;
+    block->Type = type;
+    block->Reserved = 1;
+    if(data)
+        memcpy(block->Data, data, len);
+    return block;
+}
+
+/* vrp_writer_close - finish the file and free the writer
+ *
+ * Writes out any buffered images, then the headers, the tagged
+ * blocks and the image offsets, and leaves fd positioned at the end
+ * of the cine.  The fd itself is left open.
+ *
+ * return value:
+ *   0 on success, -1 if anything along the way failed (with err, if
+ *   not NULL, filled in -- for an earlier failed append, with its
+ *   error again)
+ */
+int vrp_writer_close(VRP_Writer *w, VRP_Error *err)
+{
+    VRP_TAGGED_BLOCK *last = NULL;
+    struct stat      st;
+    off_t            pos, end;
+    size_t           len;
+    int              ret = -1;
+
+    if(w->failed)
+    {
+        if(err)
+            *err = w->error;
+        goto done;
+    }
+    if(!w->data)
+    {
+        vrp_set_error(err, VRP_E_RANGE, "vrp_writer_close: no images were written");
+        goto done;
+    }
+    if(flush_buffer(w, err) < 0)
+        goto done;
+    end = w->pos;
+
+    w->header.Type = 'C' | ('I' << 8);
+    w->header.Headersize = sizeof(w->header);
+    w->header.ImageCount = w->count;
+    if(w->header.TotalImageCount < w->count)
+        w->header.TotalImageCount = w->count;
+    w->header.OffImageHeader = sizeof(w->header);
+    w->header.OffSetup = sizeof(w->header) + sizeof(w->bmi);
+
+    if(pwrite_all_fd(w->fd, &w->header, sizeof(w->header), w->start) < 0
+       || pwrite_all_fd(w->fd, &w->bmi, sizeof(w->bmi), w->start + w->header.OffImageHeader) < 0
+       || pwrite_all_fd(w->fd, &w->setup, sizeof(w->setup), w->start + w->header.OffSetup) < 0)
+        goto write_failed;
+
+    /* the tagged blocks, assembled in memory (with any space we
+     * reserved but didn't need covered by a filler block), the last
+     * of them marked as such */
+    pos = w->header.OffSetup + sizeof(w->setup);
+    if((len = w->header.OffImageOffsets - pos))
+    {
+        char *area, *p;
+
+        if(!(area = p = calloc(1, len)))
+        {
+            vrp_set_error(err, VRP_E_NOMEM, "vrp_writer_close: out of memory");
+            goto done;
+        }
+        memcpy(area, w->blocks, w->blocks_len);
+        for(; p < area + w->blocks_len; p += last->BlockSize)
+            last = (VRP_TAGGED_BLOCK *)p;
+        if(w->times)
+        {
+            last = put_block(p, VRP_TB_Time_only, w->times, w->count * sizeof(*w->times));
+            p += last->BlockSize;
+        }
+        if(w->exposures)
+        {
+            last = put_block(p, VRP_TB_Exposure_only, w->exposures, w->count * sizeof(*w->exposures));
+            p += last->BlockSize;
+        }
+        if(area + len - p >= (ssize_t)sizeof(VRP_TAGGED_BLOCK))
+            last = put_block(p, VRP_TB_Filler, NULL, area + len - p - sizeof(VRP_TAGGED_BLOCK));
+        if(last)
+            last->Reserved = 0;
+
+        if(pwrite_all_fd(w->fd, area, len, w->start + pos) < 0)
+        {
+            free(area);
+            goto write_failed;
+        }
+        free(area);
+    }
+
+    /* (if the last pixels were left as a hole, the file may not
+     * reach its end yet) */
+    if(fstat(w->fd, &st) < 0
+       || (S_ISREG(st.st_mode) && st.st_size < w->start + end && ftruncate(w->fd, w->start + end) < 0))
+        goto write_failed;
+
+    if(pwrite_all_fd(w->fd, w->offsets, w->count * sizeof(*w->offsets),
+                  w->start + w->header.OffImageOffsets) < 0
+       || lseek(w->fd, w->start + end, SEEK_SET) < 0)
+        goto write_failed;
+
+    ret = 0;
+    goto done;
+
+write_failed:
+    vrp_set_error(err, VRP_E_SYSTEM, "writing cine");
+done:
+    free(w->blocks);
+    free(w->offsets);
+    free(w->times);
+    free(w->exposures);
+    free(w->buf);
+    free(w);
+    return ret;
+}
@@ -1,3 +1,11 @@
 /* util.h - header for some random little utility functions */
 
+#include <sys/types.h>
+
 char *ordinal_suffix(int number);
+int write_all_fd(int fd, const void *data, size_t len);
+int pwrite_all_fd(int fd, const void *data, size_t len, off_t pos);
+int copy_range_fd(int infd, off_t off, int outfd, size_t len, const void *src);
+
+struct _VRP_Error;
+void vrp_set_error(struct _VRP_Error *err, int code, const char *fmt, ...);
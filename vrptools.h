@@ -10,9 +10,18 @@
  * reference.
  */
 
+#ifndef VRPTOOLS_H
+#define VRPTOOLS_H
+
+#include <stdio.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /** Base data types -- note: Intel little-endian **/
 typedef char          VRP_BYTE;   /* BYTE in docs */
 typedef u_char        VRP_CHAR;   /* CHAR in docs */
@@ -371,10 +380,84 @@ typedef struct _VRP_ImageData {
 
 /* compressed files are proprietary.  Unless that changes, we won't be supporting them here. */
 
-/* New structure for this project: */
+/* Packed (losslessly compressed) cines, as written by cine-pack; see lib/pack.c */
+typedef struct _VRP_PACKHEADER {
+    VRP_DWORD       Magic;        /* VRP_PACK_MAGIC */
+#define VRP_PACK_MAGIC "CIPK"
+    VRP_DWORD       Version;      /* 3 (1 and 2 are older codings, still read) */
+    VRP_DWORD       PrefixSize;   /* bytes of original file (before first image) following this */
+    VRP_DWORD       ImageCount;   /* images (records) in the file */
+    VRP_DWORD       GroupSize;    /* images per independently decodable group */
+    VRP_DWORD       TrailerSize;  /* bytes after the last image, kept after the index */
+    int64_t         IndexOffset;  /* offset of the record index */
+    int64_t         OriginalSize; /* size of the original cine */
+} VRP_PACKHEADER;
+
+/* Preview pyramids, as written by cine-index --pyramid; see lib/pyramid.c */
+#define VRP_PYRAMID_LEVELS  3   /* at 1/4, 1/16 and 1/64 of the width and height */
+#define VRP_PYRAMID_PRESENT 1   /* index flag: the image was there to be shrunk */
+typedef struct _VRP_PYRAMIDLEVEL {
+    VRP_DWORD       Scale;        /* the source's width and height over this level's */
+    VRP_DWORD       Width;        /* (may be 0, for small sources) */
+    VRP_DWORD       Height;
+    VRP_DWORD       FrameBytes;   /* Width * Height * 3 */
+    int64_t         Offset;       /* of image 0; image i is at Offset + i * FrameBytes */
+} VRP_PYRAMIDLEVEL;
+
+typedef struct _VRP_PYRAMIDHEADER {
+    VRP_DWORD       Magic;        /* VRP_PYRAMID_MAGIC */
+#define VRP_PYRAMID_MAGIC "CIPY"
+    VRP_DWORD       Version;      /* currently 1 */
+    VRP_DWORD       ImageCount;   /* as the source's */
+    VRP_INT         FirstImageNo;
+    VRP_DWORD       Width;        /* of the source's images */
+    VRP_DWORD       Height;
+    VRP_DWORD       Levels;       /* VRP_PYRAMID_LEVELS */
+    VRP_DWORD       Reserved;
+    int64_t         SourceSize;   /* size and modification time of the source, */
+    int64_t         SourceMtime;  /* to tell when it's changed since */
+    int64_t         IndexOffset;  /* ImageCount bytes of VRP_PYRAMID_* flags */
+    VRP_PYRAMIDLEVEL Level[VRP_PYRAMID_LEVELS];
+} VRP_PYRAMIDHEADER;
+
+typedef struct _VRP_PackCursor VRP_PackCursor; /* decoding state; opaque */
+
+/* Errors, as reported by the vrp_open*() and vrp_extract_image() API:
+ * code says what went wrong (VRP_OK if nothing did), message says it
+ * in words ("file: what"), and warnings collects the VRP_WARN_* bits
+ * for problems that didn't stop us. */
+enum VRP_ERROR_CODE {
+    VRP_OK = 0,
+    VRP_E_SYSTEM,        /* a system call failed; sys_errno says why */
+    VRP_E_NOMEM,         /* out of memory */
+    VRP_E_FORMAT,        /* not a CINE file (or a corrupt one) */
+    VRP_E_VERSION,       /* a CINE version we don't support */
+    VRP_E_UNSUPPORTED,   /* a compression, CFA or depth we can't handle (yet) */
+    VRP_E_RANGE          /* no such image, or it's truncated */
+};
+#define VRP_WARN_NO_IMAGEHEADER 0x01 /* too small for a BITMAPINFOHEADER */
+#define VRP_WARN_NO_SETUP       0x02 /* too small for SETUP */
+#define VRP_WARN_NO_BLOCK_ROOM  0x04 /* tagged blocks promised, but no room for them */
+#define VRP_WARN_NO_BLOCKS      0x08 /* (just so you know) no tagged blocks */
+#define VRP_WARN_TRUNCATED      0x10 /* not all images are present */
+typedef struct _VRP_Error {
+    int      code;
+    int      sys_errno;
+    unsigned warnings;
+    char     message[256];
+} VRP_Error;
+
+/* New structure for this project.  Everything the library knows about
+ * an open file lives here, so separate handles can be used from
+ * separate threads freely, and a single handle can be shared by
+ * threads too: vrp_image_pixels() on packed files decodes into a
+ * cursor per thread (kept until the handle is closed -- threads that
+ * come and go can use their own cursors, and vrp_pack_decode(),
+ * instead). */
 typedef struct _VRP_File {
     char *name;
     int fd;
+    int ownfd;      /* whether fd is ours to close (i.e. vrp_open() opened it) */
     struct stat st;
 
     VRP_CINEFILEHEADER   *header;
@@ -385,14 +468,295 @@ typedef struct _VRP_File {
     /* we probably don't really need this: */
     VRP_ImageAnnotation  *firstImageAnnotation;
     void                 *start, *end; /* convenience pointers */
+    struct _VRP_Pack     *pack;     /* non-NULL for packed files; see lib/pack.c */
 } VRP_File;
 
 typedef VRP_File *VRP_Handle;
 
-VRP_Handle read_cine_fd(int fd, const char *name);
-VRP_Handle read_cine(const char *filename);
+VRP_Handle vrp_open_fd(int fd, const char *name, VRP_Error *err);
+VRP_Handle vrp_open(const char *filename, VRP_Error *err);
 void free_cine_file(VRP_Handle handle); /* doesn't free handle, just its contents */
 void free_cine_handle(VRP_Handle handle); /* calls free_cine_file, then frees handle */
 size_t vrp_image_size(VRP_Handle handle);
+size_t vrp_image_stored_size(VRP_Handle handle, int offset); /* (differs for CC_JPEG) */
 void vrp_time_iso8601_s(VRP_TIME64 t, char *buf, int sz, int offset);
-const char const *vrp_time_iso8601(VRP_TIME64 t, int offset);
+void vrp_print_open_warnings(FILE *out, VRP_Handle handle, const VRP_Error *err);
+off_t vrp_image_pixel_offset(VRP_Handle handle, int offset);
+const void *vrp_image_pixels(VRP_Handle handle, int offset);
+VRP_ImageAnnotation *vrp_image_annotation(VRP_Handle handle, int offset);
+int vrp_cfa_pattern(VRP_Handle handle, unsigned char pattern[4]);
+int vrp_is_gray(VRP_Handle handle);
+VRP_TAGGED_BLOCK *vrp_next_tagged_block(VRP_Handle handle, VRP_TAGGED_BLOCK *block);
+VRP_TAGGED_BLOCK *vrp_find_tagged_block(VRP_Handle handle, int type);
+
+/* stats.c -- optional per-stage instrumentation (see --stats): */
+enum VRP_STAGE {
+    VRP_STAGE_OPEN,      /* vrp_open(): open, map and check headers */
+    VRP_STAGE_FETCH,     /* vrp_image_pixels() (decoding, for packed files) */
+    VRP_STAGE_DEMOSAIC,  /* vrp_extract_image() */
+    VRP_STAGE_ENCODE,    /* compressing a strip/chunk of TIFF or PNG */
+    VRP_STAGE_WRITE,     /* writing output files */
+    VRP_STAGES
+};
+#define VRP_STATS_ON     1
+#define VRP_STATS_JSON   2
+#define VRP_STATS_FAULTS 4
+#define VRP_STATS_CYCLES 8
+typedef struct _VRP_StatsTimer {
+    uint64_t ns, cycles;
+    long     minflt, majflt;
+} VRP_StatsTimer;
+extern unsigned vrp_stats_flags; /* 0: off */
+#define VRP_STATS_START(t) do { if(vrp_stats_flags) vrp_stats_start(t); } while(0)
+#define VRP_STATS_STOP(t, stage, bytes) do { if(vrp_stats_flags) vrp_stats_stop(t, stage, bytes); } while(0)
+int vrp_stats_option(const char *spec);
+void vrp_stats_start(VRP_StatsTimer *t);
+void vrp_stats_stop(VRP_StatsTimer *t, int stage, size_t bytes);
+void vrp_stats_report(FILE *out);
+
+/* write_dng.c: */
+#define VRP_DNG_HEADER_MAX 1024 /* (plenty for what we put in one) */
+long vrp_dng_header(VRP_Handle handle, int offset, unsigned char buf[VRP_DNG_HEADER_MAX],
+                    const void **pixels, VRP_Error *err);
+int vrp_write_dng(VRP_Handle handle, int offset, int outfd, VRP_Error *err);
+
+/* extract.c: */
+int vrp_extract_image(VRP_Handle handle, int offset, int *rows_out, int *cols_out,
+                      uint16_t **buf, size_t *bufsize, VRP_Error *err);
+int vrp_extract_image_mt(VRP_Handle handle, int offset, int threads, int *rows_out, int *cols_out,
+                         uint16_t **buf, size_t *bufsize, VRP_Error *err);
+int vrp_extract_gray(VRP_Handle handle, int offset, int threads, int *rows_out, int *cols_out,
+                     void **buf, size_t *bufsize, VRP_Error *err);
+#define VRP_YUV420     420 /* chroma subsampling, for vrp_extract_yuv() */
+#define VRP_YUV422     422
+#define VRP_YUV_BT709  709 /* colour matrices */
+#define VRP_YUV_BT2020 2020
+int vrp_extract_yuv(VRP_Handle handle, int offset, int chroma, int bits, int matrix, int threads,
+                    int *rows_out, int *cols_out, void **buf, size_t *bufsize, VRP_Error *err);
+
+/* parallel.c: */
+int vrp_default_threads(void);
+void vrp_parallel_for(int count, int threads, void (*fn)(int item, void *arg), void *arg);
+
+/* pool.c -- recycled 64-byte-aligned scratch buffers (see --pool): */
+#define VRP_POOL_HUGEPAGES 1
+typedef struct _VRP_PoolStats {
+    size_t gets;      /* buffers handed out */
+    size_t allocated; /* of which newly allocated */
+    size_t held;      /* bytes allocated, in use or idle */
+    size_t idle;      /* bytes idle in the shared lists */
+    size_t peak;      /* most bytes ever held */
+} VRP_PoolStats;
+void *vrp_buffer_get(size_t size);
+void vrp_buffer_put(void *buf);
+void *vrp_pool_zalloc(void *opaque, unsigned items, unsigned size);
+void vrp_pool_zfree(void *opaque, void *p);
+void vrp_pool_configure(size_t limit, int flags);
+int vrp_pool_option(const char *spec);
+void vrp_pool_stats(VRP_PoolStats *stats);
+
+/* write_tiff.c, write_png.c -- encoders for demosaiced (RGB48, big-endian) images,
+ * and for gray ones from vrp_extract_gray(): */
+#define VRP_TIFF_NONE    1 /* values are the TIFF Compression tag's */
+#define VRP_TIFF_LZW     5
+#define VRP_TIFF_DEFLATE 8
+long vrp_write_tiff(FILE *out, const uint16_t *rgb, int rows, int cols, int maxval,
+                    int compression, int level, int threads);
+long vrp_write_png(FILE *out, const uint16_t *rgb, int rows, int cols, int maxval,
+                   int level, int threads);
+long vrp_write_tiff_gray(FILE *out, const void *gray, int depth, int rows, int cols, int maxval,
+                         int compression, int level, int threads);
+long vrp_write_png_gray(FILE *out, const void *gray, int depth, int rows, int cols, int maxval,
+                        int level, int threads);
+
+/* trim.c: */
+int vrp_trim_cine(VRP_Handle handle, int first, int count, int outfd, VRP_Error *err);
+
+/* writer.c: */
+typedef struct _VRP_Writer VRP_Writer; /* opaque */
+#define VRP_WRITER_TIMES     1 /* write a Time_only tagged block */
+#define VRP_WRITER_EXPOSURES 2 /* write an Exposure_only tagged block */
+VRP_Writer *vrp_writer_open(int fd, const VRP_CINEFILEHEADER *header,
+                            const VRP_BITMAPINFOHEADER *bmi, const VRP_SETUP *setup,
+                            unsigned max_images, unsigned flags, VRP_Error *err);
+int vrp_writer_add_block(VRP_Writer *w, int type, const void *data, size_t len, VRP_Error *err);
+int vrp_writer_append(VRP_Writer *w, const VRP_ImageAnnotation *annotation,
+                      const void *pixels, VRP_TIME64 time, VRP_DWORD exposure, VRP_Error *err);
+int vrp_writer_close(VRP_Writer *w, VRP_Error *err);
+
+/* pack.c: */
+int vrp_pack_cine(VRP_Handle handle, int outfd, int group_size, int threads, VRP_Error *err);
+int vrp_pack_attach(VRP_Handle handle, VRP_Error *err); /* for vrp_open_fd() */
+void vrp_pack_detach(VRP_Handle handle); /* for free_cine_file() */
+VRP_ImageAnnotation *vrp_pack_annotation(VRP_Handle handle, int offset);
+const void *vrp_pack_pixels(VRP_Handle handle, int offset);
+VRP_PackCursor *vrp_pack_cursor_new(VRP_Handle handle);
+void vrp_pack_cursor_free(VRP_PackCursor *cursor);
+const void *vrp_pack_decode(VRP_Handle handle, VRP_PackCursor *cursor, int offset);
+off_t vrp_pack_original_size(VRP_Handle handle);
+int vrp_pack_group_size(VRP_Handle handle);
+const void *vrp_pack_trailer(VRP_Handle handle, size_t *size);
+
+/* pyramid.c: */
+typedef struct _VRP_Pyramid VRP_Pyramid; /* opaque */
+int vrp_pyramid_build(VRP_Handle handle, const char *path, int threads, VRP_Error *err);
+VRP_Pyramid *vrp_pyramid_open(const char *path, VRP_Handle handle, VRP_Error *err);
+const VRP_PYRAMIDHEADER *vrp_pyramid_header(const VRP_Pyramid *pyramid);
+const unsigned char *vrp_pyramid_frame(const VRP_Pyramid *pyramid, int level, int offset);
+void vrp_pyramid_close(VRP_Pyramid *pyramid);
+
+/* jpeg.c -- decoding the images of CC_JPEG cines: */
+typedef struct _VRP_JpegInfo {
+    int width, height;
+    int components;   /* 1 to 4; sequential images of 3 are decoded as RGB */
+    int precision;    /* bits per sample */
+    int lossless;
+} VRP_JpegInfo;
+int vrp_jpeg_info(const void *data, size_t len, VRP_JpegInfo *info, VRP_Error *err);
+int vrp_jpeg_decode(const void *data, size_t len, uint16_t *out, int threads, VRP_Error *err);
+
+/* npy.c: */
+#define VRP_NPY_HEADER_MAX 256
+int vrp_npy_header(unsigned char *buf, size_t size, const char *descr, const size_t *shape, int ndim);
+
+/* signals.c -- the BinSig and AnaSig blocks, as rows of samples: */
+typedef struct _VRP_Signals {
+    int                 images, samples; /* samples per image */
+    size_t              rows;            /* images * samples */
+    int                 bin_channels, ana_channels;
+    int                 bipolar;         /* analog samples are signed */
+    size_t              bin_stride;      /* bytes per image of binary samples */
+    const unsigned char *bin, *ana;      /* the blocks' data, or NULL */
+} VRP_Signals;
+int vrp_signals_open(VRP_Handle handle, VRP_Signals *sig, VRP_Error *err);
+void vrp_signals_binary(const VRP_Signals *sig, int channel, size_t first, size_t count, uint8_t *out);
+void vrp_signals_analog(const VRP_Signals *sig, int channel, size_t first, size_t count, float gain, float *out);
+
+/* arrow.c: */
+#define VRP_ARROW_INT32   0
+#define VRP_ARROW_UINT8   1
+#define VRP_ARROW_FLOAT32 2
+#define VRP_ARROW_FLOAT64 3
+typedef struct _VRP_ArrowWriter VRP_ArrowWriter; /* opaque */
+VRP_ArrowWriter *vrp_arrow_open(FILE *out, int ncolumns, const char *const *names, const int *types);
+int vrp_arrow_write(VRP_ArrowWriter *w, size_t rows, const void *const *columns);
+int vrp_arrow_close(VRP_ArrowWriter *w);
+
+/* manifest.c -- what cine-extract has written (see there): */
+#define VRP_MANIFEST_NAME "cine-extract.manifest"
+typedef struct _VRP_ManifestEntry {
+    char          file[64];
+    int           offset;
+    char          source[96];
+    char          format[32];
+    long long     bytes;
+    unsigned long crc;
+    size_t        line;     /* (to tell which came last) */
+} VRP_ManifestEntry;
+typedef struct _VRP_ManifestPlan {
+    char          source[96];
+    char          format[32];
+    int           shard, shards;   /* 1 to shards */
+    int           assigned, total; /* images */
+} VRP_ManifestPlan;
+typedef struct _VRP_Manifest {
+    char              path[4096];
+    VRP_ManifestEntry *entries;  /* sorted by file, one each */
+    size_t            count;
+    VRP_ManifestPlan  *plans;    /* one per source and format */
+    size_t            nplans;
+    FILE              *out;      /* appending, once opened */
+} VRP_Manifest;
+int vrp_manifest_read(VRP_Manifest *m, const char *path, VRP_Error *err);
+void vrp_manifest_sort(VRP_Manifest *m);
+int vrp_manifest_write(const VRP_Manifest *m, const char *path, VRP_Error *err);
+int vrp_manifest_open(VRP_Manifest *m, const char *path, VRP_Error *err);
+int vrp_manifest_close(VRP_Manifest *m, VRP_Error *err);
+int vrp_manifest_add(VRP_Manifest *m, const VRP_ManifestEntry *e, VRP_Error *err);
+int vrp_manifest_plan(VRP_Manifest *m, const VRP_ManifestPlan *p, VRP_Error *err);
+const VRP_ManifestEntry *vrp_manifest_find(const VRP_Manifest *m, const char *file);
+int vrp_file_crc(const char *path, unsigned long *crc);
+int vrp_manifest_present(const VRP_ManifestEntry *e, const char *dir, int verify);
+
+/* outdir.c -- whole files written into a directory, in the background
+ * where the kernel has io_uring: */
+#define VRP_OUTDIR_FSYNC 1 /* each file flushed before it's renamed into place */
+typedef struct _VRP_OutDir VRP_OutDir; /* opaque */
+struct iovec;
+VRP_OutDir *vrp_outdir_open(const char *path, int depth, int flags, VRP_Error *err);
+int vrp_outdir_async(const VRP_OutDir *d);
+int vrp_outdir_write(VRP_OutDir *d, const char *name, const struct iovec *iov, int iovcnt,
+                     void (*done)(void *arg, const char *name, int error), void *arg);
+void vrp_outdir_wait(VRP_OutDir *d, int pending);
+int vrp_outdir_close(VRP_OutDir *d, VRP_Error *err);
+
+/* cache.c -- what the daemons make from frames, kept in memory (LRU,
+ * bounded by size) and made ahead by background threads: */
+#define VRP_CACHE_AHEAD 64 /* most keys queued for prefetching at once */
+typedef struct _VRP_Cache VRP_Cache; /* opaque */
+typedef struct _VRP_CacheEntry {
+    const void *key;          /* the cache's copy */
+    int        fd;            /* memfd holding the result, or -1... */
+    void       *data;         /* ...and its mapping, or malloc()ed memory */
+    size_t     size;
+    int        width, height; /* for the producer's use */
+    char       error[256];    /* why it couldn't be made */
+    /* the cache's: */
+    int        state, refs, cached;
+    struct _VRP_CacheEntry *older, *newer, *chain;
+} VRP_CacheEntry;
+typedef struct _VRP_CacheStats {
+    size_t        entries, bytes, limit;
+    unsigned long hits, misses, waits, prefetched, evictions;
+} VRP_CacheStats;
+VRP_Cache *vrp_cache_new(size_t key_size, size_t limit,
+                         int (*produce)(VRP_CacheEntry *e, void *arg),
+                         int (*warm)(const void *key, void *arg), void *arg);
+int vrp_cache_alloc(VRP_CacheEntry *e, size_t size);
+VRP_CacheEntry *vrp_cache_get(VRP_Cache *c, const void *key, int prefetching, char error[256]);
+void vrp_cache_release(VRP_Cache *c, VRP_CacheEntry *e);
+void vrp_cache_stats(VRP_Cache *c, VRP_CacheStats *stats);
+void vrp_cache_prefetch(VRP_Cache *c, const void *keys, int count);
+int vrp_cache_start(VRP_Cache *c, int threads);
+
+/* session.c -- cines recorded together (the heads of a multi-head
+ * camera, or cameras slaved to a master), grouped and matched up by
+ * time: */
+#define VRP_SESSION_HEADS     16
+#define VRP_SESSION_TOLERANCE 0.5 /* seconds between triggers of one take */
+typedef struct _VRP_Session {
+    VRP_UINT   serial;    /* the rig's: its master's, or the camera's */
+    int        take;      /* 0, 1, ...: the rig's sessions in trigger order
+                           * (e.g. the partitions of a multi-cine, MCCnt) */
+    VRP_TIME64 trigger;   /* the first head's */
+    int        nheads;
+    VRP_Handle head[VRP_SESSION_HEADS]; /* the master first */
+    char       label[VRP_SESSION_HEADS][24]; /* head serials, made unique */
+    int        reference; /* the head others are matched to: the slowest */
+    double     interval;  /* seconds between its images */
+    int        steps;     /* images matched across all heads */
+    int        *offsets;  /* steps x nheads: each head's image at each step */
+    double     skew;      /* the worst mismatch in time among them, seconds */
+} VRP_Session;
+int vrp_session_group(VRP_Handle *handles, int count, double tolerance, VRP_Session **sessions,
+                      VRP_Error *err);
+void vrp_session_free(VRP_Session *sessions, int count);
+VRP_TIME64 vrp_session_time(const VRP_Session *s, int step, int head);
+int vrp_session_extract(VRP_Session *s, int step, int head, int *rows_out, int *cols_out,
+                        uint16_t **buf, size_t *bufsize, VRP_Error *err);
+void vrp_session_run(VRP_Session *s, int threads, int whole_steps,
+                     void (*fn)(VRP_Session *s, int step, int head, void *arg), void *arg);
+
+/* reduce.c: */
+#define VRP_REDUCE_MEAN   0
+#define VRP_REDUCE_MEDIAN 1
+#define VRP_REDUCE_MAX    2
+#define VRP_REDUCE_MIN    3
+int vrp_reduce(VRP_Handle handle, int first, int count, int op, size_t budget,
+               int threads, uint16_t *out, VRP_Error *err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VRPTOOLS_H */
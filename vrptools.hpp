@@ -0,0 +1,389 @@
+/*
+ * vrptools.hpp -- header-only C++ (17 or later) interface to vrptools
+ *
+ * part of vrptools -- https://github.com/lindes/vrptools
+ *
+ * Copyright 2013 by David Lindes.  All rights reserved.
+ *
+ * Available under terms in the LICENSE file that should accompany
+ * this file.  Please consider that file to be included herein by
+ * reference.
+ */
+
+#ifndef VRPTOOLS_HPP
+#define VRPTOOLS_HPP
+
+/* A thin layer over the C library (link with lib/libvrp.a as usual):
+ *
+ *   vrp::CineFile cine("myfile.cine");       // RAII; throws vrp::Error
+ *   for (vrp::FrameView f : cine.frames())   // random-access range
+ *       use(f.number(), f.pixels<uint16_t>()); // span into the mmap
+ *
+ *   cine.dispatch([&](auto cfa, auto sample) { // CFA and depth as
+ *       ...                                    // compile-time types
+ *   });
+ *
+ * Frame views of raw files point straight into the mapped file, so
+ * they cost nothing and stay valid as long as the CineFile.  For packed
+ * files the pixels are decoded into a cursor of the fetching thread's,
+ * so a view is only good until that thread fetches the next frame from
+ * that file. */
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+#include "vrptools.h"
+
+namespace vrp {
+
+#if defined(__cpp_lib_span)
+template <class T> using span = std::span<T>;
+#else
+/* just enough of std::span for C++17 */
+template <class T> class span {
+public:
+    using element_type = T;
+    using iterator = T *;
+
+    constexpr span() noexcept : data_(nullptr), size_(0) {}
+    constexpr span(T *data, std::size_t size) noexcept : data_(data), size_(size) {}
+    template <class U, class = std::enable_if_t<std::is_convertible_v<U (*)[], T (*)[]>>>
+    constexpr span(const span<U> &other) noexcept : data_(other.data()), size_(other.size()) {}
+    template <class C, class = decltype(std::declval<C &>().data())>
+    constexpr span(C &c) : data_(c.data()), size_(c.size()) {}
+
+    constexpr T *data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr std::size_t size_bytes() const noexcept { return size_ * sizeof(T); }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr T &operator[](std::size_t i) const { return data_[i]; }
+    constexpr iterator begin() const noexcept { return data_; }
+    constexpr iterator end() const noexcept { return data_ + size_; }
+    constexpr span subspan(std::size_t offset, std::size_t count) const { return span(data_ + offset, count); }
+
+private:
+    T           *data_;
+    std::size_t size_;
+};
+#endif
+
+/* failures from the C library, with its VRP_ERROR_CODE */
+class Error : public std::runtime_error {
+public:
+    explicit Error(const VRP_Error &err) : std::runtime_error(err.message), code_(err.code) {}
+    Error(int code, const std::string &message) : std::runtime_error(message), code_(code) {}
+    int code() const noexcept { return code_; }
+
+private:
+    int code_;
+};
+
+/* one image of a cine: where it is, and views of its data */
+class FrameView {
+public:
+    FrameView(VRP_Handle handle, int offset, const void *pixels, const VRP_ImageAnnotation *annotation)
+        : handle_(handle), offset_(offset), pixels_(pixels), annotation_(annotation) {}
+
+    int offset() const noexcept { return offset_; }                 /* 0-based, in the file */
+    int number() const noexcept { return handle_->header->FirstImageNo + offset_; } /* camera's */
+    int width() const noexcept { return handle_->imageHeader->biWidth; }
+    int height() const noexcept { return handle_->imageHeader->biHeight; }
+    bool present() const noexcept { return pixels_ != nullptr; }
+
+    /* the samples, bottom row first, as stored; Sample must match the
+     * file's depth (uint8_t or uint16_t) */
+    template <class Sample> span<const Sample> pixels() const
+    {
+        static_assert(std::is_same_v<Sample, uint8_t> || std::is_same_v<Sample, uint16_t>,
+                      "samples are 8 or 16 bits");
+        if (!pixels_)
+            return {};
+        if (handle_->imageHeader->biBitCount != 8 * sizeof(Sample))
+            throw Error(VRP_E_UNSUPPORTED, std::string(handle_->name) + ": frame isn't "
+                        + std::to_string(8 * sizeof(Sample)) + "-bit");
+        return span<const Sample>(static_cast<const Sample *>(pixels_),
+                                  vrp_image_size(handle_) / sizeof(Sample));
+    }
+
+    /* one stored row (row 0 being the bottom of the picture) */
+    template <class Sample> span<const Sample> row(int r) const
+    {
+        return pixels<Sample>().subspan(static_cast<std::size_t>(r) * width(), width());
+    }
+
+    /* the annotation's contents (between AnnotationSize and the
+     * trailing image size), empty if there isn't one */
+    span<const std::byte> annotation() const noexcept
+    {
+        if (!annotation_ || annotation_->AnnotationSize < 2 * sizeof(VRP_DWORD))
+            return {};
+        return span<const std::byte>(reinterpret_cast<const std::byte *>(annotation_->Annotation),
+                                     annotation_->AnnotationSize - 2 * sizeof(VRP_DWORD));
+    }
+
+private:
+    VRP_Handle                handle_;
+    int                       offset_;
+    const void                *pixels_;
+    const VRP_ImageAnnotation *annotation_;
+};
+
+class CineFile;
+
+/* all the frames of a cine, as a random-access range of FrameViews
+ * (each made as it's dereferenced) */
+class FrameRange {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = FrameView;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = FrameView;
+
+        iterator() = default;
+        iterator(VRP_Handle handle, int offset) : handle_(handle), offset_(offset) {}
+
+        FrameView operator*() const
+        {
+            return FrameView(handle_, offset_, vrp_image_pixels(handle_, offset_),
+                             vrp_image_annotation(handle_, offset_));
+        }
+        FrameView operator[](difference_type n) const { return *(*this + n); }
+
+        iterator &operator++() { ++offset_; return *this; }
+        iterator operator++(int) { iterator i = *this; ++offset_; return i; }
+        iterator &operator--() { --offset_; return *this; }
+        iterator operator--(int) { iterator i = *this; --offset_; return i; }
+        iterator &operator+=(difference_type n) { offset_ += n; return *this; }
+        iterator &operator-=(difference_type n) { offset_ -= n; return *this; }
+        friend iterator operator+(iterator i, difference_type n) { return i += n; }
+        friend iterator operator+(difference_type n, iterator i) { return i += n; }
+        friend iterator operator-(iterator i, difference_type n) { return i -= n; }
+        friend difference_type operator-(const iterator &a, const iterator &b) { return a.offset_ - b.offset_; }
+        friend bool operator==(const iterator &a, const iterator &b) { return a.offset_ == b.offset_; }
+        friend bool operator!=(const iterator &a, const iterator &b) { return a.offset_ != b.offset_; }
+        friend bool operator<(const iterator &a, const iterator &b) { return a.offset_ < b.offset_; }
+        friend bool operator>(const iterator &a, const iterator &b) { return a.offset_ > b.offset_; }
+        friend bool operator<=(const iterator &a, const iterator &b) { return a.offset_ <= b.offset_; }
+        friend bool operator>=(const iterator &a, const iterator &b) { return a.offset_ >= b.offset_; }
+
+    private:
+        VRP_Handle handle_ = nullptr;
+        int        offset_ = 0;
+    };
+
+    FrameRange(VRP_Handle handle, int first, int last) : handle_(handle), first_(first), last_(last) {}
+
+    iterator begin() const { return iterator(handle_, first_); }
+    iterator end() const { return iterator(handle_, last_); }
+    std::size_t size() const { return last_ - first_; }
+    FrameView operator[](std::size_t i) const { return begin()[i]; }
+
+private:
+    VRP_Handle handle_;
+    int        first_, last_;
+};
+
+/* compile-time CFA layouts, as stored (see vrp_cfa_pattern()): the
+ * colour (0 red, 1 green, 2 blue) of each cell of the 2x2 tile, bottom
+ * row first */
+template <unsigned CFA> struct CfaPattern;
+template <> struct CfaPattern<VRP_CFA_BAYER> {
+    static constexpr unsigned char colour[4] = { 0, 1, 1, 2 };
+};
+template <> struct CfaPattern<VRP_CFA_BAYERFLIP> {
+    static constexpr unsigned char colour[4] = { 1, 2, 0, 1 };
+};
+
+template <unsigned CFA> using Cfa = std::integral_constant<unsigned, CFA>;
+
+class CineFile {
+public:
+    explicit CineFile(const std::string &filename)
+    {
+        VRP_Error err;
+
+        if (!(handle_ = vrp_open(filename.c_str(), &err)))
+            throw Error(err);
+        warnings_ = err.warnings;
+    }
+    ~CineFile() { free_cine_handle(handle_); }
+
+    CineFile(const CineFile &) = delete;
+    CineFile &operator=(const CineFile &) = delete;
+    CineFile(CineFile &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)),
+                                          warnings_(other.warnings_) {}
+    CineFile &operator=(CineFile &&other) noexcept
+    {
+        std::swap(handle_, other.handle_);
+        std::swap(warnings_, other.warnings_);
+        return *this;
+    }
+
+    VRP_Handle handle() const noexcept { return handle_; }  /* for the C API */
+    unsigned warnings() const noexcept { return warnings_; } /* VRP_WARN_* */
+
+    const VRP_CINEFILEHEADER &header() const noexcept { return *handle_->header; }
+    const VRP_BITMAPINFOHEADER &bitmap() const { return *require(handle_->imageHeader, "BITMAPINFOHEADER"); }
+    const VRP_SETUP &setup() const { return *require(handle_->setup, "SETUP"); }
+
+    std::size_t size() const noexcept { return handle_->header->ImageCount; }
+    int first_number() const noexcept { return handle_->header->FirstImageNo; }
+    int width() const { return bitmap().biWidth; }
+    int height() const { return bitmap().biHeight; }
+    int bits() const { return bitmap().biBitCount; }  /* as stored: 8 or 16 */
+    unsigned cfa() const { return setup().CFA & 0xff; }
+    std::size_t image_bytes() const noexcept { return vrp_image_size(handle_); }
+
+    FrameView frame(int offset) const
+    {
+        if (offset < 0 || static_cast<std::size_t>(offset) >= size())
+            throw Error(VRP_E_RANGE, std::string(handle_->name) + ": no image at offset "
+                        + std::to_string(offset));
+        return *FrameRange::iterator(handle_, offset);
+    }
+    FrameView operator[](int offset) const { return frame(offset); }
+    FrameView frame_number(int number) const { return frame(number - first_number()); }
+
+    FrameRange frames() const { return FrameRange(handle_, 0, static_cast<int>(size())); }
+    FrameRange frames(int first_offset, int last_offset) const /* [first, last) */
+    {
+        return FrameRange(handle_, first_offset, last_offset);
+    }
+
+    /* call fn(Cfa<...>{}, Sample{}) with this file's CFA layout and
+     * sample type as compile-time types, so the kernel it runs is
+     * specialised for them; throws for layouts we don't know */
+    template <class Fn> decltype(auto) dispatch(Fn &&fn) const
+    {
+        unsigned c = cfa();
+
+        if (bits() == 16)
+        {
+            if (c == VRP_CFA_BAYER) return fn(Cfa<VRP_CFA_BAYER>{}, uint16_t{});
+            if (c == VRP_CFA_BAYERFLIP) return fn(Cfa<VRP_CFA_BAYERFLIP>{}, uint16_t{});
+        }
+        else if (bits() == 8)
+        {
+            if (c == VRP_CFA_BAYER) return fn(Cfa<VRP_CFA_BAYER>{}, uint8_t{});
+            if (c == VRP_CFA_BAYERFLIP) return fn(Cfa<VRP_CFA_BAYERFLIP>{}, uint8_t{});
+        }
+        throw Error(VRP_E_UNSUPPORTED, std::string(handle_->name) + ": no kernels for CFA "
+                    + std::to_string(c) + " at " + std::to_string(bits()) + " bits");
+    }
+
+private:
+    template <class T> T *require(T *p, const char *what) const
+    {
+        if (!p)
+            throw Error(VRP_E_FORMAT, std::string(handle_->name) + ": no " + what);
+        return p;
+    }
+
+    VRP_Handle handle_ = nullptr;
+    unsigned   warnings_ = 0;
+};
+
+/** kernels **/
+
+/* the simple statistics of a frame's (or any) samples */
+struct SampleStats {
+    unsigned min = 0, max = 0;
+    double   mean = 0;
+};
+
+template <class Sample> SampleStats sample_stats(span<const Sample> samples)
+{
+    SampleStats s;
+    uint64_t    sum = 0;
+    unsigned    lo = ~0u, hi = 0;
+
+    for (Sample v : samples)
+    {
+        sum += v;
+        lo = v < lo ? v : lo;
+        hi = v > hi ? v : hi;
+    }
+    if (!samples.empty())
+    {
+        s.min = lo;
+        s.max = hi;
+        s.mean = static_cast<double>(sum) / samples.size();
+    }
+    return s;
+}
+
+/* demosaic a frame into rgb (width*height*3 samples, native byte
+ * order, top row first), the same way vrp_extract_image() does:
+ * each 2x2 tile's red and blue go to all four of its pixels, green
+ * pixels keep their own green and the others take the green beside
+ * them; red and blue are scaled by the white balance gains, clipped
+ * below maxval.  CFA and Sample are compile-time, e.g. from
+ * CineFile::dispatch(). */
+template <unsigned CFA, class Sample>
+void demosaic_rgb48(Cfa<CFA>, const FrameView &frame, span<uint16_t> rgb,
+                    unsigned maxval, float wb_r = 1, float wb_b = 1)
+{
+    constexpr const unsigned char *colour = CfaPattern<CFA>::colour;
+    constexpr int                 r_at = colour[0] == 0 ? 0 : colour[1] == 0 ? 1 : colour[2] == 0 ? 2 : 3;
+    constexpr int                 b_at = colour[0] == 2 ? 0 : colour[1] == 2 ? 1 : colour[2] == 2 ? 2 : 3;
+    const int                     w = frame.width(), h = frame.height();
+    span<const Sample>            px = frame.pixels<Sample>();
+
+    if (px.empty() || rgb.size() < static_cast<std::size_t>(w) * h * 3)
+        throw Error(VRP_E_RANGE, "demosaic_rgb48: missing frame or short output buffer");
+
+    for (int row = 0; row + 1 < h; row += 2)
+        for (int col = 0; col + 1 < w; col += 2)
+        {
+            const Sample *tile[2] = { &px[static_cast<std::size_t>(row) * w + col],
+                                      &px[static_cast<std::size_t>(row + 1) * w + col] };
+            auto         at = [&](int cell) -> unsigned { return tile[cell >> 1][cell & 1]; };
+            unsigned     r = static_cast<uint16_t>(wb_r * at(r_at));
+            unsigned     b = static_cast<uint16_t>(wb_b * at(b_at));
+
+            r = r >= maxval ? maxval - 1 : r;
+            b = b >= maxval ? maxval - 1 : b;
+            for (int cell = 0; cell < 4; ++cell)
+            {
+                /* green: its own, or the other one in the same row */
+                unsigned  g = colour[cell] == 1 ? at(cell) : at(cell ^ 1);
+                int       y = row + (cell >> 1), x = col + (cell & 1);
+                uint16_t *out = &rgb[(static_cast<std::size_t>(h - 1 - y) * w + x) * 3];
+
+                out[0] = r;
+                out[1] = g;
+                out[2] = b;
+            }
+        }
+}
+
+/* convenience: demosaic any frame of a known-layout file */
+inline std::vector<uint16_t> demosaic_rgb48(const CineFile &cine, const FrameView &frame)
+{
+    std::vector<uint16_t> rgb(static_cast<std::size_t>(cine.width()) * cine.height() * 3);
+    const VRP_SETUP       &s = cine.setup();
+    unsigned              maxval = cine.bitmap().biClrImportant ? cine.bitmap().biClrImportant
+                                                                : 1u << cine.bits();
+
+    cine.dispatch([&](auto cfa, auto sample) {
+        demosaic_rgb48<decltype(cfa)::value, decltype(sample)>(cfa, frame, span<uint16_t>(rgb),
+                                                               maxval, s.WBGain[0].R, s.WBGain[0].B);
+    });
+    return rgb;
+}
+
+} /* namespace vrp */
+
+#endif /* VRPTOOLS_HPP */